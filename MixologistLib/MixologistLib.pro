@@ -73,7 +73,18 @@ HEADERS += ft/ftcontroller.h \
            ft/fttemplist.h \
            ft/ftofflmlist.h \
            ft/ftfilecreator.h \
+           ft/ftchunkmap.h \
+           ft/ftresumejournal.h \
+           ft/ftpiecemanifest.h \
+           ft/ftratecontroller.h \
+           ft/ftdownloadscheduler.h \
            ft/ftfileprovider.h \
+           ft/ftfilehandlecache.h \
+           ft/ftreadahead.h \
+           ft/ftblockcache.h \
+           ft/ftuploadscheduler.h \
+           ft/ftdiskio.h \
+           ft/ftfileindex.h \
            ft/ftfilewatcher.h \
            ft/ftfilemethod.h \
            ft/ftserver.h \
@@ -95,6 +106,7 @@ HEADERS += ft/ftcontroller.h \
            pqi/pqissllistener.h \
            pqi/pqissludp.h \
            pqi/pqistreamer.h \
+           pqi/pqipacketpool.h \
            interface/files.h \
            interface/iface.h \
            interface/init.h \
@@ -136,6 +148,7 @@ HEADERS += ft/ftcontroller.h \
            tcponudp/udpsorter.h \
            upnp/upnphandler.h \
            upnp/upnputil.h \
+           util/clock.h \
            util/debug.h \
            util/dir.h \
            util/net.h \
@@ -159,7 +172,18 @@ SOURCES = \
 				ft/fttemplist.cc \
 				ft/ftofflmlist.cc \
 				ft/ftfilecreator.cc \
+				ft/ftchunkmap.cc \
+				ft/ftresumejournal.cc \
+				ft/ftpiecemanifest.cc \
+				ft/ftratecontroller.cc \
+				ft/ftdownloadscheduler.cc \
 				ft/ftfileprovider.cc \
+				ft/ftfilehandlecache.cc \
+				ft/ftreadahead.cc \
+				ft/ftblockcache.cc \
+				ft/ftuploadscheduler.cc \
+				ft/ftdiskio.cc \
+				ft/ftfileindex.cc \
 				ft/ftfilewatcher.cc \
 				ft/ftborrower.cc \
                                 upnp/upnputil.cc \
@@ -180,6 +204,7 @@ SOURCES = \
                                 pqi/ownConnectivityManager.cc \
                                 pqi/friendsConnectivityManager.cc \
 				pqi/pqistreamer.cc \
+				pqi/pqipacketpool.cc \
 				pqi/pqiloopback.cc \
 				pqi/pqinetwork.cc \
 				serialiser/mixologyitems.cc \
@@ -200,6 +225,7 @@ SOURCES = \
 				tcponudp/udpsorter.cc \
 				tcponudp/tou_net.cc \
 				tcponudp/udplayer.cc \
+				util/clock.cc \
 				util/debug.cc \
 				util/dir.cc \
 				util/net.cc \
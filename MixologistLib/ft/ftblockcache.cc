@@ -0,0 +1,210 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#include <ft/ftblockcache.h>
+#include <ft/ftfilewatcher.h>
+#include <interface/settings.h>
+
+#include <QDir>
+#include <QList>
+
+#include <string.h>
+
+ftBlockCache *blockCache = NULL;
+
+//The megabytes of memory used for the cache, unless overridden by the "Transfers/BlockCacheMemory" setting
+#define DEFAULT_BLOCK_CACHE_MEMORY 64
+//The share of the cache's memory that the protected segment may use, in percent
+#define PROTECTED_SEGMENT_PERCENT 80
+//The most recently invalidated files remembered, past which they are all forgotten and everything being read at the time is discarded
+#define MAX_REMEMBERED_INVALIDATIONS 1024
+
+ftBlockCache::ftBlockCache()
+    :mUseCounter(0), mCachedBytes(0), mProtectedBytes(0), mGeneration(0), mOldestGeneration(0), mHits(0), mMisses(0) {
+    QSettings settings(*mainSettings, QSettings::IniFormat);
+    int megabytes = settings.value("Transfers/BlockCacheMemory", DEFAULT_BLOCK_CACHE_MEMORY).toInt();
+    if (megabytes < 1) megabytes = 1;
+    mMaxCachedBytes = (uint64_t)megabytes * 1024 * 1024;
+
+    /* These are direct connections so that the blocks are dropped before any further reads of the changed file. */
+    connect(fileWatcher, SIGNAL(oldHashInvalidated(QString,qlonglong,uint)), this, SLOT(oldHashInvalidated(QString,qlonglong,uint)), Qt::DirectConnection);
+    connect(fileWatcher, SIGNAL(fileRemoved(QString)), this, SLOT(invalidatePath(QString)), Qt::DirectConnection);
+}
+
+uint32_t ftBlockCache::read(const QString &hash, uint64_t offset, uint32_t size, void *data) {
+    QMutexLocker stack(&blockCacheMutex);
+
+    uint32_t copied = 0;
+    while (copied < size) {
+        uint64_t position = offset + copied;
+        uint64_t start = position - (position % FT_BLOCK_SIZE);
+
+        QHash<blockKey, cachedBlock>::iterator it = mBlocks.find(blockKey(hash, start));
+        if (it == mBlocks.end()) {
+            mMisses++;
+            break;
+        }
+        mHits++;
+
+        uint32_t available = it->data.size() - (position - start);
+        if (available > size - copied) available = size - copied;
+        memcpy((char *)data + copied, it->data.constData() + (position - start), available);
+        copied += available;
+
+        /* Only a block that has been read before it was needed moves into the protected segment. */
+        if (it->isProtected) mProtected.remove(it->lastUsed);
+        else mProbation.remove(it->lastUsed);
+        if (it->prefetched) it->prefetched = false;
+        else if (!it->isProtected) {
+            it->isProtected = true;
+            mProtectedBytes += it->data.size();
+        }
+        it->lastUsed = mUseCounter++;
+        if (it->isProtected) mProtected[it->lastUsed] = it.key();
+        else mProbation[it->lastUsed] = it.key();
+
+        /* A short block is the end of the file. */
+        if (it->data.size() < FT_BLOCK_SIZE) break;
+    }
+
+    locked_evictExcess();
+    return copied;
+}
+
+bool ftBlockCache::contains(const QString &hash, uint64_t blockStart) const {
+    QMutexLocker stack(&blockCacheMutex);
+    return mBlocks.contains(blockKey(hash, blockStart));
+}
+
+uint64_t ftBlockCache::generation() const {
+    QMutexLocker stack(&blockCacheMutex);
+    return mGeneration;
+}
+
+void ftBlockCache::insertBlock(const QString &hash, const QString &path, uint64_t blockStart, const QByteArray &data,
+                               uint64_t generation, bool prefetched) {
+    QMutexLocker stack(&blockCacheMutex);
+    QString file = QDir::toNativeSeparators(path);
+
+    if (generation < mOldestGeneration) return;
+    if (mInvalidatedAt.value(file, 0) > generation) return;
+    if (mInvalidatedAt.value(hash, 0) > generation) return;
+
+    blockKey key(hash, blockStart);
+    if (mBlocks.contains(key)) return;
+
+    cachedBlock block;
+    block.data = data;
+    block.path = file;
+    block.isProtected = false;
+    block.prefetched = prefetched;
+    block.lastUsed = mUseCounter++;
+    mBlocks[key] = block;
+    mProbation[block.lastUsed] = key;
+    mCachedBytes += data.size();
+
+    locked_evictExcess();
+}
+
+void ftBlockCache::invalidatePath(QString path) {
+    QMutexLocker stack(&blockCacheMutex);
+    QString file = QDir::toNativeSeparators(path);
+
+    if (mInvalidatedAt.count() >= MAX_REMEMBERED_INVALIDATIONS) {
+        mInvalidatedAt.clear();
+        mOldestGeneration = mGeneration + 1;
+    }
+    mInvalidatedAt[file] = ++mGeneration;
+
+    QList<blockKey> toRemove;
+    QHash<blockKey, cachedBlock>::const_iterator it;
+    for (it = mBlocks.constBegin(); it != mBlocks.constEnd(); it++) {
+        if (it->path == file) toRemove.append(it.key());
+    }
+    foreach (blockKey key, toRemove) {
+        locked_removeBlock(key);
+    }
+}
+
+void ftBlockCache::invalidateHash(QString hash) {
+    QMutexLocker stack(&blockCacheMutex);
+
+    if (mInvalidatedAt.count() >= MAX_REMEMBERED_INVALIDATIONS) {
+        mInvalidatedAt.clear();
+        mOldestGeneration = mGeneration + 1;
+    }
+    mInvalidatedAt[hash] = ++mGeneration;
+
+    QList<blockKey> toRemove;
+    QHash<blockKey, cachedBlock>::const_iterator it;
+    for (it = mBlocks.constBegin(); it != mBlocks.constEnd(); it++) {
+        if (it.key().first == hash) toRemove.append(it.key());
+    }
+    foreach (blockKey key, toRemove) {
+        locked_removeBlock(key);
+    }
+}
+
+void ftBlockCache::oldHashInvalidated(QString path, qlonglong /*size*/, unsigned int /*modified*/) {
+    invalidatePath(path);
+}
+
+void ftBlockCache::getStats(uint64_t &hits, uint64_t &misses, uint64_t &cachedBytes) const {
+    QMutexLocker stack(&blockCacheMutex);
+    hits = mHits;
+    misses = mMisses;
+    cachedBytes = mCachedBytes;
+}
+
+void ftBlockCache::locked_removeBlock(const blockKey &key) {
+    QHash<blockKey, cachedBlock>::iterator it = mBlocks.find(key);
+    if (it == mBlocks.end()) return;
+
+    if (it->isProtected) {
+        mProtected.remove(it->lastUsed);
+        mProtectedBytes -= it->data.size();
+    } else {
+        mProbation.remove(it->lastUsed);
+    }
+    mCachedBytes -= it->data.size();
+    mBlocks.erase(it);
+}
+
+void ftBlockCache::locked_evictExcess() {
+    uint64_t maxProtectedBytes = mMaxCachedBytes / 100 * PROTECTED_SEGMENT_PERCENT;
+    while (mProtectedBytes > maxProtectedBytes && !mProtected.isEmpty()) {
+        blockKey key = mProtected.begin().value();
+        mProtected.erase(mProtected.begin());
+        cachedBlock &block = mBlocks[key];
+        block.isProtected = false;
+        mProtectedBytes -= block.data.size();
+        block.lastUsed = mUseCounter++;
+        mProbation[block.lastUsed] = key;
+    }
+
+    while (mCachedBytes > mMaxCachedBytes) {
+        blockKey key;
+        if (!mProbation.isEmpty()) key = mProbation.begin().value();
+        else if (!mProtected.isEmpty()) key = mProtected.begin().value();
+        else break;
+        locked_removeBlock(key);
+    }
+}
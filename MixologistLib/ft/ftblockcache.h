@@ -0,0 +1,139 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#ifndef FT_BLOCK_CACHE_HEADER
+#define FT_BLOCK_CACHE_HEADER
+
+#include <QObject>
+#include <QMutex>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QString>
+#include <QByteArray>
+#include <stdint.h>
+
+//The size of each cached block, which are aligned to multiples of this size in the file
+#define FT_BLOCK_SIZE (256 * 1024)
+
+/*
+ * A process-wide cache of blocks of the files being uploaded, keyed by file hash and block index,
+ * so that when several friends are downloading the same file, only the first of them has to wait for the disk.
+ *
+ * Blocks are added both by ftReadAhead as it reads ahead of sequential uploads,
+ * and by ftFileProvider when a block that was missed is for a file that more than one friend is downloading.
+ *
+ * The cache is limited to the number of megabytes set by "Transfers/BlockCacheMemory".
+ * Eviction is a segmented LRU, which takes into account how often blocks are used as well as how recently:
+ * new blocks go into a probationary segment, and only move into the protected segment when they are read again,
+ * so a single friend streaming through a large file can't push out the blocks that are being shared by several friends.
+ * A block that was read ahead for a friend doesn't count as read again when that friend reads it, as that is the read it was fetched for.
+ * Eviction takes from the least recently used end of the probationary segment first,
+ * and when the protected segment outgrows its share of the memory, its least recently used blocks are moved back to probation.
+ *
+ * Blocks for a file are discarded when the file changes or is removed. As blocks are read from disk without holding the cache's mutex,
+ * the reader takes the value of generation() before it starts, and insertBlock discards the block if the file has been invalidated since.
+ */
+
+class ftBlockCache;
+extern ftBlockCache *blockCache;
+
+class ftBlockCache : public QObject {
+    Q_OBJECT
+
+public:
+    ftBlockCache();
+
+    /* Copies as much of the size bytes starting at offset in the file with hash as are cached into data,
+       stopping at the first block that isn't cached.
+       Returns the number of bytes copied, which is 0 if the start of the range isn't cached. */
+    uint32_t read(const QString &hash, uint64_t offset, uint32_t size, void *data);
+
+    /* True if the block starting at blockStart of the file with hash is cached. */
+    bool contains(const QString &hash, uint64_t blockStart) const;
+
+    /* Returns a value to be passed to insertBlock for blocks about to be read from disk. */
+    uint64_t generation() const;
+
+    /* Adds the block starting at blockStart of the file with hash, read from path, unless the file has been invalidated since generation.
+       prefetched should be true if the block was read ahead of a friend that is expected to read it. */
+    void insertBlock(const QString &hash, const QString &path, uint64_t blockStart, const QByteArray &data, uint64_t generation, bool prefetched);
+
+    /* Fills in the number of block lookups that were answered from the cache and that had to go to disk, and the bytes cached. */
+    void getStats(uint64_t &hits, uint64_t &misses, uint64_t &cachedBytes) const;
+
+public slots:
+    /* Discards every block read from the file at path.
+       Connected to ftFileWatcher's signals for files changing or being removed. */
+    void invalidatePath(QString path);
+
+    /* Discards every block of the file with hash. */
+    void invalidateHash(QString hash);
+
+private slots:
+    /* Connected to ftFileWatcher's oldHashInvalidated signal. */
+    void oldHashInvalidated(QString path, qlonglong size, unsigned int modified);
+
+private:
+    typedef QPair<QString, uint64_t> blockKey;
+
+    struct cachedBlock {
+        QByteArray data;
+        /* The path with native directory separators that the block was read from. */
+        QString path;
+        /* True if the block is in the protected segment, otherwise it is on probation. */
+        bool isProtected;
+        /* True if the block was read ahead and hasn't been read since. */
+        bool prefetched;
+        /* This block's key in its segment's LRU. */
+        uint64_t lastUsed;
+    };
+
+    /* Removes the block from the cache. */
+    void locked_removeBlock(const blockKey &key);
+
+    /* Demotes excess protected blocks and then discards probationary blocks until the cache is within its memory limit. */
+    void locked_evictExcess();
+
+    mutable QMutex blockCacheMutex;
+
+    QHash<blockKey, cachedBlock> mBlocks;
+
+    /* The keys of the blocks in each segment, ordered from least to most recently used. */
+    QMap<uint64_t, blockKey> mProbation;
+    QMap<uint64_t, blockKey> mProtected;
+    uint64_t mUseCounter;
+
+    uint64_t mCachedBytes;
+    uint64_t mProtectedBytes;
+    uint64_t mMaxCachedBytes;
+
+    /* Incremented whenever a file is invalidated. mInvalidatedAt holds the generation at which each recently invalidated path or hash was,
+       and anything invalidated before mOldestGeneration has been forgotten, so blocks read before then are always discarded. */
+    uint64_t mGeneration;
+    uint64_t mOldestGeneration;
+    QHash<QString, uint64_t> mInvalidatedAt;
+
+    uint64_t mHits;
+    uint64_t mMisses;
+};
+
+#endif //FT_BLOCK_CACHE_HEADER
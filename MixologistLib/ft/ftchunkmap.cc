@@ -0,0 +1,335 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#include <ft/ftchunkmap.h>
+
+/**********************************************************************************
+ * ftRangeSet
+ **********************************************************************************/
+
+void ftRangeSet::add(uint64_t start, uint64_t end) {
+    if (start >= end) return;
+
+    /* Begin from the last range starting at or before start, as it may touch or overlap the new range. */
+    std::map<uint64_t, uint64_t>::iterator it = mRanges.upper_bound(start);
+    if (it != mRanges.begin()) {
+        std::map<uint64_t, uint64_t>::iterator previous = it;
+        --previous;
+        if (previous->second >= start) it = previous;
+    }
+
+    /* Swallow every range that touches or overlaps the new one. */
+    while (it != mRanges.end() && it->first <= end) {
+        if (it->first < start) start = it->first;
+        if (it->second > end) end = it->second;
+        mTotal -= it->second - it->first;
+        mRanges.erase(it++);
+    }
+
+    mRanges[start] = end;
+    mTotal += end - start;
+}
+
+void ftRangeSet::remove(uint64_t start, uint64_t end) {
+    if (start >= end) return;
+
+    std::map<uint64_t, uint64_t>::iterator it = mRanges.upper_bound(start);
+    if (it != mRanges.begin()) {
+        std::map<uint64_t, uint64_t>::iterator previous = it;
+        --previous;
+        if (previous->second > start) it = previous;
+    }
+
+    while (it != mRanges.end() && it->first < end) {
+        uint64_t currentStart = it->first;
+        uint64_t currentEnd = it->second;
+        mTotal -= currentEnd - currentStart;
+        mRanges.erase(it++);
+
+        /* Put back whatever parts of the range lie outside of what is being removed. */
+        if (currentStart < start) {
+            mRanges[currentStart] = start;
+            mTotal += start - currentStart;
+        }
+        if (currentEnd > end) {
+            mRanges[end] = currentEnd;
+            mTotal += currentEnd - end;
+        }
+    }
+}
+
+bool ftRangeSet::contains(uint64_t start, uint64_t end) const {
+    if (start >= end) return true;
+
+    std::map<uint64_t, uint64_t>::const_iterator it = mRanges.upper_bound(start);
+    if (it == mRanges.begin()) return false;
+    --it;
+
+    /* Since ranges are always merged, the whole span must be in this single range. */
+    return it->second >= end;
+}
+
+bool ftRangeSet::intersects(uint64_t start, uint64_t end) const {
+    if (start >= end) return false;
+
+    std::map<uint64_t, uint64_t>::const_iterator it = mRanges.lower_bound(start);
+    if (it != mRanges.end() && it->first < end) return true;
+    if (it == mRanges.begin()) return false;
+    --it;
+    return it->second > start;
+}
+
+bool ftRangeSet::first(uint64_t &start, uint64_t &end) const {
+    if (mRanges.empty()) return false;
+    start = mRanges.begin()->first;
+    end = mRanges.begin()->second;
+    return true;
+}
+
+uint64_t ftRangeSet::contiguousFromStart() const {
+    if (mRanges.empty() || mRanges.begin()->first != 0) return 0;
+    return mRanges.begin()->second;
+}
+
+uint64_t ftRangeSet::contiguousFrom(uint64_t position) const {
+    std::map<uint64_t, uint64_t>::const_iterator it = mRanges.upper_bound(position);
+    if (it == mRanges.begin()) return position;
+    --it;
+    if (it->second <= position) return position;
+    return it->second;
+}
+
+/**********************************************************************************
+ * ftChunkMap
+ **********************************************************************************/
+
+void ftChunkMap::reset(uint64_t fileSize, const ftRangeSet &alreadyHave) {
+    mRequested.clear();
+    mExpiry.clear();
+    mFriendChunks.clear();
+
+    mUnrequested.clear();
+    mUnrequested.add(0, fileSize);
+
+    std::map<uint64_t, uint64_t>::const_iterator it;
+    for (it = alreadyHave.ranges().begin(); it != alreadyHave.ranges().end(); it++) {
+        mUnrequested.remove(it->first, it->second);
+    }
+}
+
+bool ftChunkMap::allocate(unsigned int friend_id, time_t now, time_t maxAge, uint64_t &startingByte, uint32_t &lengthInBytes,
+                          unsigned int &previousOwner) {
+    previousOwner = 0;
+
+    /* The oldest outstanding request is always at the front, so there is only ever one candidate to check for a timeout. */
+    if (!mExpiry.empty() && mExpiry.begin()->first + maxAge < now) {
+        std::map<uint64_t, requestedChunk>::iterator oldest = mRequested.find(mExpiry.begin()->second);
+        requestedChunk chunk = oldest->second;
+        startingByte = oldest->first;
+        lengthInBytes = chunk.end - startingByte;
+        previousOwner = chunk.friend_requested_from;
+
+        /* Whoever we are now re-requesting this from is the one we are now waiting on. */
+        eraseChunk(oldest);
+        chunk.requestTime = now;
+        chunk.friend_requested_from = friend_id;
+        chunk.racer = 0;
+        insertChunk(startingByte, chunk);
+        return true;
+    }
+
+    uint64_t unrequestedStart, unrequestedEnd;
+    if (lengthInBytes == 0 || !mUnrequested.first(unrequestedStart, unrequestedEnd)) {
+        lengthInBytes = 0;
+        return false;
+    }
+
+    if (unrequestedEnd - unrequestedStart < lengthInBytes) lengthInBytes = unrequestedEnd - unrequestedStart;
+
+    startingByte = unrequestedStart;
+    mUnrequested.remove(startingByte, startingByte + lengthInBytes);
+    insertChunk(startingByte, requestedChunk(startingByte + lengthInBytes, now, friend_id));
+    return true;
+}
+
+bool ftChunkMap::allocateRace(unsigned int friend_id, time_t now, time_t minAge, uint64_t &startingByte, uint32_t &lengthInBytes,
+                              unsigned int &previousOwner) {
+    std::set<std::pair<time_t, uint64_t> >::iterator it;
+    for (it = mExpiry.begin(); it != mExpiry.end(); it++) {
+        /* As mExpiry is in order of age, once one is too young, all the rest are too. */
+        if (it->first + minAge > now) return false;
+
+        requestedChunk &chunk = mRequested[it->second];
+        if (chunk.friend_requested_from == friend_id || chunk.racer != 0) continue;
+
+        chunk.racer = friend_id;
+        previousOwner = chunk.friend_requested_from;
+        startingByte = it->second;
+        lengthInBytes = chunk.end - startingByte;
+        return true;
+    }
+    return false;
+}
+
+/* Received data may line up with our requests in any number of ways, for example if a request was re-requested as a different size.
+   Rather than handle each case, every request the received data overlaps is removed,
+   and whatever parts of it that stick out before or after the received data are put back as requests of their own. */
+void ftChunkMap::received(uint64_t startingByte, uint32_t lengthInBytes) {
+    uint64_t receivedEnd = startingByte + lengthInBytes;
+
+    mUnrequested.remove(startingByte, receivedEnd);
+
+    std::map<uint64_t, requestedChunk>::iterator it = mRequested.upper_bound(startingByte);
+    if (it != mRequested.begin()) {
+        std::map<uint64_t, requestedChunk>::iterator previous = it;
+        --previous;
+        if (previous->second.end > startingByte) it = previous;
+    }
+
+    while (it != mRequested.end() && it->first < receivedEnd) {
+        uint64_t currentStart = it->first;
+        requestedChunk current = it->second;
+        eraseChunk(it++);
+
+        if (currentStart < startingByte) {
+            requestedChunk before = current;
+            before.end = startingByte;
+            insertChunk(currentStart, before);
+        }
+        if (current.end > receivedEnd) {
+            insertChunk(receivedEnd, current);
+        }
+    }
+}
+
+void ftChunkMap::release(uint64_t startingByte, uint32_t lengthInBytes) {
+    received(startingByte, lengthInBytes);
+    mUnrequested.add(startingByte, startingByte + lengthInBytes);
+}
+
+void ftChunkMap::invalidateFriend(unsigned int friend_id) {
+    std::map<unsigned int, std::set<uint64_t> >::iterator friendChunks = mFriendChunks.find(friend_id);
+    if (friendChunks == mFriendChunks.end()) return;
+
+    /* Take a copy as eraseChunk modifies the index we'd otherwise be iterating over. */
+    std::set<uint64_t> toInvalidate;
+    toInvalidate.swap(friendChunks->second);
+    mFriendChunks.erase(friendChunks);
+
+    for (std::set<uint64_t>::iterator it = toInvalidate.begin(); it != toInvalidate.end(); it++) {
+        std::map<uint64_t, requestedChunk>::iterator chunk = mRequested.find(*it);
+        if (chunk == mRequested.end()) continue;
+
+        /* If another friend is racing for this chunk, it simply becomes theirs. */
+        if (chunk->second.racer != 0) {
+            requestedChunk raced = chunk->second;
+            mExpiry.erase(std::make_pair(raced.requestTime, chunk->first));
+            raced.friend_requested_from = raced.racer;
+            raced.racer = 0;
+            insertChunk(chunk->first, raced);
+            continue;
+        }
+
+        mUnrequested.add(chunk->first, chunk->second.end);
+        mExpiry.erase(std::make_pair(chunk->second.requestTime, chunk->first));
+        mRequested.erase(chunk);
+    }
+
+    /* Races are rare and only happen at the very end of a download, so simply scan for any this friend was in. */
+    std::map<uint64_t, requestedChunk>::iterator it;
+    for (it = mRequested.begin(); it != mRequested.end(); it++) {
+        if (it->second.racer == friend_id) it->second.racer = 0;
+    }
+}
+
+void ftChunkMap::invalidateFriendRange(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes) {
+    uint64_t rangeEnd = startingByte + lengthInBytes;
+
+    std::map<uint64_t, requestedChunk>::iterator it = mRequested.upper_bound(startingByte);
+    if (it != mRequested.begin()) {
+        std::map<uint64_t, requestedChunk>::iterator previous = it;
+        --previous;
+        if (previous->second.end > startingByte) it = previous;
+    }
+
+    /* As in received(), every overlapped request is taken out, with the parts outside of the range put back untouched,
+       and the part inside the range put back with friend_id's claim on it dropped. */
+    while (it != mRequested.end() && it->first < rangeEnd) {
+        uint64_t currentStart = it->first;
+        requestedChunk current = it->second;
+        std::map<uint64_t, requestedChunk>::iterator next = it;
+        ++next;
+
+        if (current.friend_requested_from != friend_id && current.racer != friend_id) {
+            it = next;
+            continue;
+        }
+        eraseChunk(it);
+        it = next;
+
+        uint64_t insideStart = (currentStart < startingByte) ? startingByte : currentStart;
+        uint64_t insideEnd = (current.end > rangeEnd) ? rangeEnd : current.end;
+
+        if (currentStart < insideStart) {
+            requestedChunk before = current;
+            before.end = insideStart;
+            insertChunk(currentStart, before);
+        }
+        if (current.end > insideEnd) {
+            insertChunk(insideEnd, current);
+        }
+
+        requestedChunk inside = current;
+        inside.end = insideEnd;
+        if (inside.racer == friend_id) {
+            inside.racer = 0;
+            insertChunk(insideStart, inside);
+        } else if (inside.racer != 0) {
+            inside.friend_requested_from = inside.racer;
+            inside.racer = 0;
+            insertChunk(insideStart, inside);
+        } else {
+            mUnrequested.add(insideStart, insideEnd);
+        }
+    }
+}
+
+bool ftChunkMap::wasRequested(uint64_t startingByte, uint32_t lengthInBytes) const {
+    return !mUnrequested.contains(startingByte, startingByte + lengthInBytes);
+}
+
+void ftChunkMap::insertChunk(uint64_t start, const requestedChunk &chunk) {
+    mRequested[start] = chunk;
+    mExpiry.insert(std::make_pair(chunk.requestTime, start));
+    mFriendChunks[chunk.friend_requested_from].insert(start);
+}
+
+void ftChunkMap::eraseChunk(std::map<uint64_t, requestedChunk>::iterator chunk) {
+    mExpiry.erase(std::make_pair(chunk->second.requestTime, chunk->first));
+
+    std::map<unsigned int, std::set<uint64_t> >::iterator friendChunks = mFriendChunks.find(chunk->second.friend_requested_from);
+    if (friendChunks != mFriendChunks.end()) {
+        friendChunks->second.erase(chunk->first);
+        if (friendChunks->second.empty()) mFriendChunks.erase(friendChunks);
+    }
+
+    mRequested.erase(chunk);
+}
@@ -0,0 +1,171 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#ifndef FT_CHUNK_MAP_HEADER
+#define FT_CHUNK_MAP_HEADER
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A set of non-overlapping byte ranges within a file, each stored as [start, end).
+ * Ranges that touch or overlap are merged as they are added, so the set is always in its most compact form.
+ * Operations are O(log n) in the number of disjoint ranges, plus the number of ranges they actually touch.
+ */
+class ftRangeSet {
+public:
+    ftRangeSet() :mTotal(0) {}
+
+    /* Adds [start, end) to the set. */
+    void add(uint64_t start, uint64_t end);
+
+    /* Removes [start, end) from the set, splitting any range that straddles it. */
+    void remove(uint64_t start, uint64_t end);
+
+    /* Returns true if every byte of [start, end) is in the set. */
+    bool contains(uint64_t start, uint64_t end) const;
+
+    /* Returns true if any byte of [start, end) is in the set. */
+    bool intersects(uint64_t start, uint64_t end) const;
+
+    /* Sets start and end to the lowest range in the set, returns false if the set is empty. */
+    bool first(uint64_t &start, uint64_t &end) const;
+
+    /* Returns the end of the range that begins at 0, or 0 if the set does not include the first byte. */
+    uint64_t contiguousFromStart() const;
+
+    /* Returns the end of the range that contains position, or position itself if it is not in the set. */
+    uint64_t contiguousFrom(uint64_t position) const;
+
+    bool isEmpty() const {return mRanges.empty();}
+
+    /* Total number of bytes in the set. */
+    uint64_t totalSize() const {return mTotal;}
+
+    void clear() {mRanges.clear(); mTotal = 0;}
+
+    /* Direct read-only access to the underlying ranges, keyed by start with the end as the value. */
+    const std::map<uint64_t, uint64_t> &ranges() const {return mRanges;}
+
+private:
+    std::map<uint64_t, uint64_t> mRanges;
+    uint64_t mTotal;
+};
+
+/*
+ * Tracks which parts of a file being downloaded are still to be requested, and which have been requested and are outstanding.
+ *
+ * Outstanding requests are kept in a map ordered by starting byte, so that received data can find the requests it overlaps in O(log n).
+ * Alongside that is a set ordered by request time, so the oldest request is always at the front and timeouts are found in O(log n),
+ * and a per-friend index, so that invalidating one friend's requests only touches that friend's requests.
+ */
+class ftChunkMap {
+public:
+    /* Starts out empty, with nothing to request until reset() is called. */
+    ftChunkMap() {}
+
+    /* Drops all outstanding requests, and marks everything in the file that is not in alreadyHave as unrequested. */
+    void reset(uint64_t fileSize, const ftRangeSet &alreadyHave);
+
+    /* Hands out a chunk to be requested from friend_id.
+       If the oldest outstanding request is older than maxAge, it is re-stamped, reassigned to friend_id and returned,
+       with previousOwner set to the friend it was taken from.
+       Otherwise, up to lengthInBytes of the lowest unrequested part of the file is returned, with previousOwner set to 0.
+       Returns false if there is nothing available to hand out. */
+    bool allocate(unsigned int friend_id, time_t now, time_t maxAge, uint64_t &startingByte, uint32_t &lengthInBytes,
+                  unsigned int &previousOwner);
+
+    /* For the end of a download, when nothing is left unrequested.
+       Finds the oldest outstanding request that is from a friend other than friend_id, is at least minAge old,
+       and is not already being raced, and returns it to also be requested from friend_id.
+       Whichever friend answers first fills it in, and the other's copy is discarded on arrival.
+       previousOwner is set to the friend it was originally requested from.
+       Returns false if there is no such request. */
+    bool allocateRace(unsigned int friend_id, time_t now, time_t minAge, uint64_t &startingByte, uint32_t &lengthInBytes,
+                      unsigned int &previousOwner);
+
+    /* Removes the given set of bytes from both the outstanding requests and the unrequested parts of the file. */
+    void received(uint64_t startingByte, uint32_t lengthInBytes);
+
+    /* Makes the given set of bytes available for allocation again, dropping any outstanding requests for them. */
+    void release(uint64_t startingByte, uint32_t lengthInBytes);
+
+    /* Makes all chunks that are outstanding from that friend available for allocation again. */
+    void invalidateFriend(unsigned int friend_id);
+
+    /* As invalidateFriend, but only for that friend's requests within the given set of bytes.
+       Used when a friend tells us they can't answer a request, so it can be handed to someone else. */
+    void invalidateFriendRange(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes);
+
+    /* Returns true if at least some part of the given range has been requested at some point. */
+    bool wasRequested(uint64_t startingByte, uint32_t lengthInBytes) const;
+
+    /* Returns true if there are outstanding requests. */
+    bool hasOutstandingRequests() const {return !mRequested.empty();}
+
+    /* Returns true if there is some part of the file that has yet to be handed out. */
+    bool hasUnrequested() const {return !mUnrequested.isEmpty();}
+
+    /* Returns the number of bytes that have yet to be handed out. */
+    uint64_t unrequestedSize() const {return mUnrequested.totalSize();}
+
+private:
+    class requestedChunk {
+    public:
+        requestedChunk() {}
+
+        requestedChunk(uint64_t end, time_t now, unsigned int friend_id)
+            :end(end), requestTime(now), friend_requested_from(friend_id), racer(0) {}
+
+        /* First byte after the chunk. */
+        uint64_t end;
+        time_t requestTime;
+
+        /* The friend that we requested send us this chunk.
+           Useful for invalidating chunks when we get disconnected. */
+        unsigned int friend_requested_from;
+
+        /* A second friend this chunk has also been requested from to race the first, or 0 if none. */
+        unsigned int racer;
+    };
+
+    /* Adds a chunk to mRequested and both of the indexes. */
+    void insertChunk(uint64_t start, const requestedChunk &chunk);
+
+    /* Removes a chunk from mRequested and both of the indexes. */
+    void eraseChunk(std::map<uint64_t, requestedChunk>::iterator chunk);
+
+    /* Parts of the file that have never been requested, or whose requests were invalidated. */
+    ftRangeSet mUnrequested;
+
+    /* Outstanding requests keyed by their starting byte. */
+    std::map<uint64_t, requestedChunk> mRequested;
+
+    /* The starting bytes of outstanding requests ordered by when they were requested. */
+    std::set<std::pair<time_t, uint64_t> > mExpiry;
+
+    /* The starting bytes of outstanding requests for each friend. */
+    std::map<unsigned int, std::set<uint64_t> > mFriendChunks;
+};
+
+#endif // FT_CHUNK_MAP_HEADER
@@ -0,0 +1,304 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+/*
+ * Microbenchmark for ftChunkMap.
+ *
+ * Replays the same request/receive trace of a download against the QMap-based tracker ftFileCreator used before ftChunkMap,
+ * and against ftChunkMap itself, and prints how long each took.
+ *
+ * The trace models a large file being downloaded from several friends at once, each keeping a window of requests outstanding.
+ * Each request is answered in MAX_FT_CHUNK sized pieces as ftServer sends them, and every so often a friend disconnects.
+ *
+ * Like the other *_test.cc programs this is not part of the library build. It only needs the STL:
+ *   g++ -O2 -I. ft/ftchunkmap_test.cc ft/ftchunkmap.cc -o ftchunkmap_test
+ *   ./ftchunkmap_test [file size in MB] [friends] [requests outstanding per friend]
+ */
+
+#include <ft/ftchunkmap.h>
+
+#include <deque>
+#include <iostream>
+#include <map>
+#include <vector>
+#include <cstdlib>
+#include <sys/time.h>
+
+/* As in ftFileCreator. */
+#define CHUNK_MAX_AGE 20
+
+/* As in ftServer, the size of each piece of a chunk as it arrives. */
+#define MAX_FT_CHUNK 8192
+
+/* Roughly how many events pass in each second of the trace. */
+#define EVENTS_PER_SECOND 2000
+
+/* One in this many events is a friend disconnecting. */
+#define DISCONNECT_ODDS 50000
+
+/* The outstanding request tracking from ftFileCreator before ftChunkMap, with the QMap replaced by a std::map.
+   QMap::keys() is reproduced by copying the keys into a vector, as every pass over the requests did. */
+class oldChunkTracker {
+public:
+    oldChunkTracker(uint64_t fileSize) :fullFileSize(fileSize), firstUnrequestedByte(0) {}
+
+    bool allocate(unsigned int friend_id, time_t currentTime, uint64_t &startingByte, uint32_t &lengthInBytes) {
+        std::vector<uint64_t> keys = requestedKeys();
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (mRequestedChunks[keys[i]].requestTime + CHUNK_MAX_AGE < currentTime) {
+                mRequestedChunks[keys[i]].requestTime = currentTime;
+                lengthInBytes = mRequestedChunks[keys[i]].lengthInBytes;
+                startingByte = mRequestedChunks[keys[i]].startingByte;
+                return true;
+            }
+        }
+
+        if (fullFileSize - firstUnrequestedByte < lengthInBytes) lengthInBytes = fullFileSize - firstUnrequestedByte;
+        if (lengthInBytes == 0) return false;
+
+        startingByte = firstUnrequestedByte;
+        firstUnrequestedByte += lengthInBytes;
+        mRequestedChunks[startingByte] = requestedChunk(startingByte, lengthInBytes, currentTime, friend_id);
+        return true;
+    }
+
+    void received(uint64_t receivedStartingByte, uint32_t receivedSize) {
+        std::vector<uint64_t> keys = requestedKeys();
+        for (size_t i = 0; i < keys.size(); i++) {
+            uint64_t currentStartingByte = keys[i];
+            uint64_t firstByteAfterReceived = receivedStartingByte + receivedSize;
+            if (firstByteAfterReceived <= currentStartingByte) return;
+
+            uint64_t firstByteAfterCurrent = currentStartingByte + mRequestedChunks[currentStartingByte].lengthInBytes;
+            if (receivedStartingByte >= firstByteAfterCurrent) continue;
+
+            if (receivedStartingByte <= currentStartingByte && firstByteAfterReceived >= firstByteAfterCurrent) {
+                mRequestedChunks.erase(currentStartingByte);
+                continue;
+            }
+
+            if (currentStartingByte < receivedStartingByte && firstByteAfterCurrent > firstByteAfterReceived) {
+                mRequestedChunks[currentStartingByte].lengthInBytes = receivedStartingByte - currentStartingByte;
+                mRequestedChunks[firstByteAfterReceived] = requestedChunk(firstByteAfterReceived,
+                                                                          firstByteAfterCurrent - firstByteAfterReceived,
+                                                                          mRequestedChunks[currentStartingByte].requestTime,
+                                                                          mRequestedChunks[currentStartingByte].friend_requested_from);
+                return;
+            }
+
+            if (firstByteAfterCurrent > firstByteAfterReceived) {
+                mRequestedChunks[currentStartingByte].startingByte = firstByteAfterReceived;
+                mRequestedChunks[currentStartingByte].lengthInBytes = firstByteAfterCurrent - firstByteAfterReceived;
+                mRequestedChunks[firstByteAfterReceived] = mRequestedChunks[currentStartingByte];
+                mRequestedChunks.erase(currentStartingByte);
+                return;
+            }
+
+            if (currentStartingByte < receivedStartingByte) {
+                mRequestedChunks[currentStartingByte].lengthInBytes = receivedStartingByte - currentStartingByte;
+                continue;
+            }
+        }
+    }
+
+    void invalidateFriend(unsigned int friend_id) {
+        std::vector<uint64_t> keys = requestedKeys();
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (mRequestedChunks[keys[i]].friend_requested_from == friend_id) mRequestedChunks.erase(keys[i]);
+        }
+    }
+
+private:
+    std::vector<uint64_t> requestedKeys() const {
+        std::vector<uint64_t> keys;
+        std::map<uint64_t, requestedChunk>::const_iterator it;
+        for (it = mRequestedChunks.begin(); it != mRequestedChunks.end(); it++) keys.push_back(it->first);
+        return keys;
+    }
+
+    class requestedChunk {
+    public:
+        requestedChunk() {}
+        requestedChunk(uint64_t istartingByte, uint64_t size, time_t now, unsigned int friend_id)
+            :startingByte(istartingByte), lengthInBytes(size), requestTime(now), friend_requested_from(friend_id) {}
+        uint64_t startingByte;
+        uint64_t lengthInBytes;
+        time_t requestTime;
+        unsigned int friend_requested_from;
+    };
+
+    uint64_t fullFileSize;
+    uint64_t firstUnrequestedByte;
+    std::map<uint64_t, requestedChunk> mRequestedChunks;
+};
+
+/* ftChunkMap behind the same interface as oldChunkTracker. */
+class newChunkTracker {
+public:
+    newChunkTracker(uint64_t fileSize) {
+        mChunkMap.reset(fileSize, ftRangeSet());
+    }
+
+    bool allocate(unsigned int friend_id, time_t currentTime, uint64_t &startingByte, uint32_t &lengthInBytes) {
+        unsigned int previousOwner;
+        return mChunkMap.allocate(friend_id, currentTime, CHUNK_MAX_AGE, startingByte, lengthInBytes, previousOwner);
+    }
+
+    void received(uint64_t startingByte, uint32_t lengthInBytes) {
+        mChunkMap.received(startingByte, lengthInBytes);
+    }
+
+    void invalidateFriend(unsigned int friend_id) {
+        mChunkMap.invalidateFriend(friend_id);
+    }
+
+private:
+    ftChunkMap mChunkMap;
+};
+
+class traceEvent {
+public:
+    enum eventType {ALLOCATE, RECEIVE, DISCONNECT};
+
+    traceEvent(eventType type, unsigned int friend_id, uint32_t length, time_t time)
+        :type(type), friend_id(friend_id), length(length), time(time) {}
+
+    eventType type;
+    unsigned int friend_id;
+    /* For ALLOCATE, the size of chunk asked for. */
+    uint32_t length;
+    time_t time;
+};
+
+/* A fixed linear congruential generator, so that the same trace is produced on every platform. */
+static uint32_t traceSeed = 12345;
+static uint32_t nextRandom() {
+    traceSeed = traceSeed * 1103515245 + 12345;
+    return (traceSeed >> 8) & 0xFFFFFF;
+}
+
+/* Each friend asks for chunks of a size that depends on how fast they are, between 64KB and 1MB.
+   Whenever a friend's window has room a new chunk is asked for, and otherwise its oldest request is answered. */
+static std::vector<traceEvent> makeTrace(uint64_t fileSize, unsigned int friends, unsigned int window) {
+    std::vector<traceEvent> trace;
+    std::vector<uint32_t> chunkSize(friends + 1);
+    std::vector<unsigned int> outstanding(friends + 1, 0);
+    for (unsigned int i = 1; i <= friends; i++) chunkSize[i] = (64 * 1024) << (nextRandom() % 5);
+
+    uint64_t requested = 0;
+    time_t now = 1000;
+    while (requested < fileSize) {
+        if (trace.size() % EVENTS_PER_SECOND == 0) now++;
+
+        unsigned int friend_id = 1 + nextRandom() % friends;
+        if (nextRandom() % DISCONNECT_ODDS == 0) {
+            trace.push_back(traceEvent(traceEvent::DISCONNECT, friend_id, 0, now));
+            outstanding[friend_id] = 0;
+        } else if (outstanding[friend_id] < window) {
+            trace.push_back(traceEvent(traceEvent::ALLOCATE, friend_id, chunkSize[friend_id], now));
+            outstanding[friend_id]++;
+            requested += chunkSize[friend_id];
+        } else {
+            trace.push_back(traceEvent(traceEvent::RECEIVE, friend_id, 0, now));
+            outstanding[friend_id]--;
+        }
+    }
+    return trace;
+}
+
+static double secondsSince(const struct timeval &start) {
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+/* Replays trace against tracker, keeping track of what each friend was handed so that RECEIVE events answer that friend's oldest request.
+   Returns the number of seconds taken. */
+template <class tracker>
+static double replay(tracker &chunks, const std::vector<traceEvent> &trace, unsigned int friends, uint64_t &bytesReceived) {
+    std::vector<std::deque<std::pair<uint64_t, uint32_t> > > requests(friends + 1);
+    bytesReceived = 0;
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    for (size_t i = 0; i < trace.size(); i++) {
+        const traceEvent &event = trace[i];
+        std::deque<std::pair<uint64_t, uint32_t> > &friendRequests = requests[event.friend_id];
+
+        if (event.type == traceEvent::ALLOCATE) {
+            uint64_t startingByte;
+            uint32_t lengthInBytes = event.length;
+            if (chunks.allocate(event.friend_id, event.time, startingByte, lengthInBytes) && lengthInBytes > 0) {
+                friendRequests.push_back(std::make_pair(startingByte, lengthInBytes));
+            }
+        } else if (event.type == traceEvent::RECEIVE) {
+            if (friendRequests.empty()) continue;
+            uint64_t startingByte = friendRequests.front().first;
+            uint32_t remaining = friendRequests.front().second;
+            friendRequests.pop_front();
+            while (remaining > 0) {
+                uint32_t piece = remaining < MAX_FT_CHUNK ? remaining : MAX_FT_CHUNK;
+                chunks.received(startingByte, piece);
+                startingByte += piece;
+                remaining -= piece;
+                bytesReceived += piece;
+            }
+        } else {
+            friendRequests.clear();
+            chunks.invalidateFriend(event.friend_id);
+        }
+    }
+
+    return secondsSince(start);
+}
+
+int main(int argc, char **argv) {
+    uint64_t fileSize = (uint64_t)(argc > 1 ? atoi(argv[1]) : 4096) * 1024 * 1024;
+    unsigned int friends = argc > 2 ? atoi(argv[2]) : 8;
+    unsigned int window = argc > 3 ? atoi(argv[3]) : 64;
+
+    if (fileSize == 0 || friends == 0 || window == 0) {
+        std::cerr << "Usage: " << argv[0] << " [file size in MB] [friends] [requests outstanding per friend]" << std::endl;
+        return 1;
+    }
+
+    std::vector<traceEvent> trace = makeTrace(fileSize, friends, window);
+    std::cout << "File size: " << fileSize / (1024 * 1024) << "MB"
+              << " Friends: " << friends
+              << " Window: " << window
+              << " Events: " << trace.size() << std::endl;
+
+    uint64_t oldBytes;
+    oldChunkTracker oldTracker(fileSize);
+    double oldSeconds = replay(oldTracker, trace, friends, oldBytes);
+    std::cout << "QMap tracker:  " << oldSeconds << "s for " << oldBytes / (1024 * 1024) << "MB received" << std::endl;
+
+    uint64_t newBytes;
+    newChunkTracker newTracker(fileSize);
+    double newSeconds = replay(newTracker, trace, friends, newBytes);
+    std::cout << "ftChunkMap:    " << newSeconds << "s for " << newBytes / (1024 * 1024) << "MB received" << std::endl;
+
+    if (newSeconds > 0) std::cout << "Speedup:       " << oldSeconds / newSeconds << "x" << std::endl;
+
+    return 0;
+}
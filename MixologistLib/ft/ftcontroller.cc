@@ -28,6 +28,7 @@
 #include <ft/ftdatademultiplex.h>
 #include <ft/ftserver.h>
 #include <ft/ftborrower.h>
+#include <ft/ftpiecemanifest.h>
 
 #include <server/librarymixer-library.h>
 
@@ -37,6 +38,7 @@
 
 #include <util/dir.h>
 #include <util/debug.h>
+#include <util/clock.h>
 
 #include <pqi/friendsConnectivityManager.h>
 #include <pqi/pqinotify.h>
@@ -59,7 +61,7 @@ void ftController::friendConnected(unsigned int friend_id) {
 
     /* add online to all downloads */
     foreach (ftTransferModule* currentFile, mDownloads.values()) {
-        currentFile->friendConnected(friend_id);
+        if (currentFile->friendConnected(friend_id)) scheduleTick(currentFile);
     }
 }
 
@@ -81,39 +83,111 @@ void ftController::run() {
     exec();
 }
 
-#define MAX_CONCURRENT_DOWNLOADS_IN_GROUP 2
 void ftController::runThread() {
     if (!mInitialLoadDone) loadSavedTransfers();
 
-    /* Check on our downloadGroups and see if any transfers need to be activated or finished. */
+    /* Check on the downloadGroups that have changed and see if any need to be finished, then start whichever files the scheduler has room for. */
     if (mFtActive) {
         QMutexLocker stack(&ctrlMutex);
         int waiting_to_download, downloading, completed, total;
-        foreach (int key, mDownloadGroups.keys()) {
+        QSet<int> groupsToCheck = mGroupsToCheck;
+        mGroupsToCheck.clear();
+        foreach (int key, groupsToCheck) {
+            if (!mDownloadGroups.contains(key)) continue;
             mDownloadGroups[key].getStatus(&waiting_to_download, &downloading, &completed, &total);
 
-            if (downloading < MAX_CONCURRENT_DOWNLOADS_IN_GROUP && waiting_to_download > 0) {
-                mDownloadGroups[key].startOneTransfer();
-            }
-
             if (completed == total && !mDownloadGroups[key].downloadFinished) {
                 finishGroup(key);
             }
         }
+
+        foreach (ftTransferModule* started, mScheduler.startTransfers(monotonicMicroseconds())) {
+            scheduleTick(started);
+        }
     }
 
-    /* Tick the active transferModules, i.e. send the requests for downloads */
+    /* Tick the transferModules that need it, i.e. send the requests for downloads */
     if (mFtActive) {
         QMutexLocker stack(&ctrlMutex);
-        foreach (ftTransferModule* transfer, mDownloads.values()){
+        time_t now = time(NULL);
+
+        while (!mWakeups.isEmpty() && mWakeups.begin().key() <= now) {
+            ftTransferModule* transfer = mWakeups.begin().value();
+            mWakeups.erase(mWakeups.begin());
+            mWakeupTimes.remove(transfer);
+            mReadyDownloads.insert(transfer);
+        }
+
+        QSet<ftTransferModule*> readyDownloads = mReadyDownloads;
+        mReadyDownloads.clear();
+        foreach (ftTransferModule* transfer, readyDownloads) {
             if (transfer->transferStatus() == ftTransferModule::FILE_DOWNLOADING) {
                 transfer->tick();
             }
+
+            if (transfer->transferStatus() == ftTransferModule::FILE_COMPLETE) {
+                mScheduler.removeFile(transfer);
+                checkGroupsContaining(transfer);
+                continue;
+            }
+            if (transfer->transferStatus() != ftTransferModule::FILE_DOWNLOADING) continue;
+
+            /* If it has no online sources it sleeps until one comes online, which will put it back on the ready list. */
+            time_t nextDue = transfer->nextTickDue(now);
+            if (nextDue == 0) continue;
+            if (nextDue <= now) {
+                mReadyDownloads.insert(transfer);
+            } else {
+                mWakeups.insert(nextDue, transfer);
+                mWakeupTimes[transfer] = nextDue;
+            }
         }
         offLMList->tick();
     }
 }
 
+void ftController::scheduleTick(ftTransferModule *file) {
+    if (mWakeupTimes.contains(file)) {
+        mWakeups.remove(mWakeupTimes[file], file);
+        mWakeupTimes.remove(file);
+    }
+    mReadyDownloads.insert(file);
+}
+
+void ftController::unscheduleTick(ftTransferModule *file) {
+    if (mWakeupTimes.contains(file)) {
+        mWakeups.remove(mWakeupTimes[file], file);
+        mWakeupTimes.remove(file);
+    }
+    mReadyDownloads.remove(file);
+}
+
+void ftController::checkGroupsContaining(ftTransferModule *file) {
+    QMap<int, downloadGroup>::const_iterator it;
+    for (it = mDownloadGroups.begin(); it != mDownloadGroups.end(); it++) {
+        if (!it.value().downloadFinished && it.value().filesInGroup.contains(file)) mGroupsToCheck.insert(it.key());
+    }
+}
+
+void ftController::updateScheduling(ftTransferModule *file) {
+    bool runnable = false;
+    int priority = 0;
+    unsigned int friend_id = 0;
+    int order = 0;
+    QMap<int, downloadGroup>::const_iterator it;
+    for (it = mDownloadGroups.begin(); it != mDownloadGroups.end(); it++) {
+        if (it.value().downloadFinished || it.value().paused || !it.value().filesInGroup.contains(file)) continue;
+        /* The file takes its place in the queue from the oldest group, but is moved up by any group with a higher priority. */
+        if (!runnable) order = it.key();
+        if (!runnable || it.value().priority > priority) {
+            priority = it.value().priority;
+            friend_id = it.value().friend_id;
+        }
+        runnable = true;
+    }
+    if (mScheduler.updateFile(file, runnable, priority, friend_id, order)) unscheduleTick(file);
+}
+
 void ftController::loadSavedTransfers() {
     QMutexLocker stack(&ctrlMutex);
     QSettings saved(*savedTransfers, QSettings::IniFormat);
@@ -128,6 +202,8 @@ void ftController::loadSavedTransfers() {
         unsigned int source_type = saved.value("source_type").toInt();
         QString source_id = saved.value("source_id").toString();
         downloadGroup::DownloadType download_type = (downloadGroup::DownloadType) saved.value("download_type").toInt();
+        int priority = saved.value("priority", 0).toInt();
+        bool paused = saved.value("paused", false).toBool();
 
         saved.beginGroup("Files");
 
@@ -145,7 +221,7 @@ void ftController::loadSavedTransfers() {
 
         saved.endGroup(); //key
 
-        internalDownloadFiles(friend_id, title, paths, hashes, filesizes, key.toInt(), download_type, source_type, source_id);
+        internalDownloadFiles(friend_id, title, paths, hashes, filesizes, key.toInt(), download_type, source_type, source_id, priority, paused);
     }
     saved.endGroup(); //Transfers
 
@@ -337,6 +413,14 @@ bool ftController::inActiveDownloadGroup(ftTransferModule *file) const {
     return false;
 }
 
+bool ftController::inOnlyNormalDownloadGroups(ftTransferModule *file) const {
+    foreach (downloadGroup group, mDownloadGroups.values()) {
+        if (group.downloadType != downloadGroup::DOWNLOAD_NORMAL &&
+            group.filesInGroup.contains(file)) return false;
+    }
+    return true;
+}
+
 void ftController::activate() {
     mFtActive = true;
 }
@@ -375,7 +459,8 @@ bool ftController::downloadBorrowedFiles(unsigned int friend_id, uint32_t source
 }
 
 bool ftController::internalDownloadFiles(unsigned int friend_id, const QString &title, const QStringList &paths, const QStringList &hashes, const QList<qlonglong> &filesizes,
-                                         int specificKey, downloadGroup::DownloadType download_type, unsigned int source_type, const QString &source_id) {
+                                         int specificKey, downloadGroup::DownloadType download_type, unsigned int source_type, const QString &source_id,
+                                         int priority, bool paused) {
     /* Basic check for well-formed request. */
     if (paths.size() != hashes.size() || paths.size() != filesizes.size() || paths.size() < 1 ||
         title.isEmpty() ||
@@ -389,9 +474,14 @@ bool ftController::internalDownloadFiles(unsigned int friend_id, const QString &
     newGroup.downloadType = download_type;
     newGroup.source_type = source_type;
     newGroup.source_id = source_id;
+    newGroup.priority = priority;
+    newGroup.paused = paused;
+    /* Files already being downloaded for another group, whose place in the queue must be worked out from all of their groups. */
+    QSet<ftTransferModule*> sharedFiles;
     /* Now we must construct an ftTransferModule for each of the files.
        Note that the order is preserved between newGroup.filenames and newGroup.files. */
     for (int i = 0; i < paths.size(); i++) {
+        if (mDownloads.contains(hashes[i])) sharedFiles.insert(mDownloads[hashes[i]]);
         ftTransferModule* file = internalRequestFile(friend_id, hashes[i], filesizes[i]);
         /* If one of the file requests has failed, abort the whole thing and clear already created file requests. */
         if (file == NULL) goto failureDeleteAllNewModules;
@@ -409,14 +499,24 @@ bool ftController::internalDownloadFiles(unsigned int friend_id, const QString &
 
     if (mDownloadGroups.contains(newKey)) goto failureDeleteAllNewModules;
     mDownloadGroups.insert(newKey, newGroup);
+    mGroupsToCheck.insert(newKey);
     addGroupToSavedTransfers(newKey, newGroup);
 
+    /* New files are only in this group, so there's no need to look through all of the others to queue them. */
+    foreach (ftTransferModule* file, newGroup.filesInGroup) {
+        if (sharedFiles.contains(file)) updateScheduling(file);
+        else mScheduler.updateFile(file, !paused, priority, friend_id, newKey);
+    }
+
     return true;
 
     failureDeleteAllNewModules:
     log(LOG_WARNING, FTCONTROLLERZONE, "Error initializing download of " + title);
     foreach (ftTransferModule* currentFile, newGroup.filesInGroup) {
+        if (sharedFiles.contains(currentFile)) continue;
         mDownloads.remove(currentFile->mFileCreator->getHash());
+        mScheduler.removeFile(currentFile);
+        unscheduleTick(currentFile);
         delete currentFile;
     }
     return false;
@@ -425,7 +525,12 @@ bool ftController::internalDownloadFiles(unsigned int friend_id, const QString &
 ftTransferModule* ftController::internalRequestFile(unsigned int friend_id, const QString &hash, uint64_t size) {
     if (hash.isEmpty()) return false;
 
-    if (mDownloads.contains(hash)) return mDownloads[hash];
+    /* If we're already downloading this file, whoever we are requesting it from now is simply another source for it. */
+    if (mDownloads.contains(hash)) {
+        mDownloads[hash]->addFileSource(friend_id);
+        scheduleTick(mDownloads[hash]);
+        return mDownloads[hash];
+    }
 
     log(LOG_DEBUG_ALERT, FTCONTROLLERZONE, "Beginning download for " + hash);
 
@@ -441,8 +546,13 @@ void ftController::cancelDownloadGroup(int groupId) {
     foreach(ftTransferModule* file, mDownloadGroups[groupId].filesInGroup) {
         internalCancelFile(groupId, file);
     }
+    /* Anything left is still wanted by another group, and may now be scheduled differently. */
+    QList<ftTransferModule*> remainingFiles = mDownloadGroups[groupId].filesInGroup;
     mDownloadGroups.remove(groupId);
     removeGroupFromSavedTransfers(groupId);
+    foreach(ftTransferModule* file, remainingFiles) {
+        updateScheduling(file);
+    }
 }
 
 void ftController::cancelFile(int groupId, const QString &hash) {
@@ -453,6 +563,8 @@ void ftController::cancelFile(int groupId, const QString &hash) {
         mDownloadGroups.remove(groupId);
         removeGroupFromSavedTransfers(groupId);
     } else {
+        /* With the file gone, the group may now be able to start another or be complete. */
+        mGroupsToCheck.insert(groupId);
         QSettings saved(*savedTransfers, QSettings::IniFormat);
         saved.remove("Transfers/" + QString::number(groupId) + "/Files/" + hash);
     }
@@ -471,14 +583,34 @@ void ftController::internalCancelFile(int groupId, ftTransferModule *file) {
         mDownloadGroups[groupId].filesInGroup.removeAt(index);
         mDownloadGroups[groupId].filenames.removeAt(index);
 
+        mScheduler.removeFile(file);
+        unscheduleTick(file);
         delete file;
     }
 }
 
-bool ftController::controlFile(int orig_item_id, QString hash, uint32_t flags) {
-    (void) orig_item_id;
+bool ftController::controlFile(int groupId, QString hash, uint32_t flags) {
     (void) hash;
-    (void) flags;
+    QMutexLocker stack(&ctrlMutex);
+    if (!mDownloadGroups.contains(groupId)) return false;
+
+    if (flags & FILE_CTRL_PAUSE) mDownloadGroups[groupId].paused = true;
+    else if (flags & FILE_CTRL_START) mDownloadGroups[groupId].paused = false;
+
+    if (flags & FILE_CTRL_MOVE_TO_TOP) {
+        int highestPriority = 0;
+        foreach (int key, mDownloadGroups.keys()) {
+            if (key != groupId && mDownloadGroups[key].priority > highestPriority) highestPriority = mDownloadGroups[key].priority;
+        }
+        mDownloadGroups[groupId].priority = highestPriority + 1;
+    }
+
+    if (mDownloadGroups[groupId].downloadFinished) return true;
+
+    foreach (ftTransferModule* file, mDownloadGroups[groupId].filesInGroup) {
+        updateScheduling(file);
+    }
+    addGroupToSavedTransfers(groupId, mDownloadGroups[groupId]);
     return true;
 }
 
@@ -492,6 +624,8 @@ void ftController::clearCompletedFiles() {
             foreach (ftTransferModule* file, mDownloadGroups[key].filesInGroup) {
                 if (!inMultipleDownloadGroups(file)) {
                     mDownloads.remove(file->mFileCreator->getHash());
+                    mScheduler.removeFile(file);
+                    unscheduleTick(file);
                     delete file;
                 }
             }
@@ -581,6 +715,8 @@ void ftController::addGroupToSavedTransfers(int groupKey, const downloadGroup &g
     saved.setValue("download_type", group.downloadType);
     saved.setValue("source_type", group.source_type);
     saved.setValue("source_id", group.source_id);
+    saved.setValue("priority", group.priority);
+    saved.setValue("paused", group.paused);
 
     saved.beginGroup("Files");
     for (int i = 0; i < group.filesInGroup.count(); i++) {
@@ -650,20 +786,71 @@ QString ftController::getPartialsDirectory() const {
     return mPartialsPath;
 }
 
-bool ftController::handleReceiveData(unsigned int librarymixer_id, const QString &hash, uint64_t offset, uint32_t chunksize, void *data) {
+bool ftController::handleReceiveData(unsigned int librarymixer_id, const QString &hash, uint64_t offset, uint32_t chunksize,
+                                     const QByteArray &dataBuffer, const void *data) {
     QMutexLocker stack(&ctrlMutex);
     QMap<QString, ftTransferModule*>::const_iterator it;
     it = mDownloads.find(hash);
     if (it != mDownloads.end()) {
-        it.value()->recvFileData(librarymixer_id, offset, chunksize, data);
+        it.value()->recvFileData(librarymixer_id, offset, chunksize, dataBuffer, data);
+        scheduleTick(it.value());
         return true;
     } else {
         /* If it's not for any of our files, see if it might be for ftOffLMList's Xmls. */
-        return offLMList->handleReceiveData(librarymixer_id, hash, offset, chunksize, data);
+        return offLMList->handleReceiveData(librarymixer_id, hash, offset, chunksize, dataBuffer, data);
+    }
+    return false;
+}
+
+bool ftController::handleDataUnavailable(unsigned int librarymixer_id, const QString &hash, uint64_t offset, uint32_t chunksize, uint32_t reason) {
+    QMutexLocker stack(&ctrlMutex);
+    QMap<QString, ftTransferModule*>::const_iterator it;
+    it = mDownloads.find(hash);
+    if (it != mDownloads.end()) {
+        return it.value()->recvFileUnavailable(librarymixer_id, offset, chunksize, reason);
+    }
+    return false;
+}
+
+bool ftController::handleReceiveManifest(unsigned int librarymixer_id, const QString &hash, uint32_t totalPieces, uint32_t firstPiece,
+                                         const QByteArray &root, const QByteArray &pieceHashes) {
+    QMutexLocker stack(&ctrlMutex);
+    QMap<QString, ftTransferModule*>::const_iterator it;
+    it = mDownloads.find(hash);
+    if (it != mDownloads.end()) {
+        return it.value()->recvFileManifest(librarymixer_id, totalPieces, firstPiece, root, pieceHashes);
     }
     return false;
 }
 
+bool ftController::getPartialManifest(const QString &hash, uint64_t size, ftPieceManifest &manifest) {
+    QMutexLocker stack(&ctrlMutex);
+    QMap<QString, ftTransferModule*>::const_iterator it;
+    it = mDownloads.find(hash);
+    if (it == mDownloads.end()) return false;
+
+    ftTransferModule *file = it.value();
+    if (file->mFileCreator->getFileSize() != size) return false;
+    if (!inOnlyNormalDownloadGroups(file)) return false;
+
+    return file->mFileCreator->getManifest(manifest);
+}
+
+ftFileProvider *ftController::getPartialFile(const QString &hash, uint64_t size) {
+    QMutexLocker stack(&ctrlMutex);
+    QMap<QString, ftTransferModule*>::const_iterator it;
+    it = mDownloads.find(hash);
+    if (it == mDownloads.end()) return NULL;
+
+    ftTransferModule *file = it.value();
+    if (file->mFileCreator->getFileSize() != size) return NULL;
+    if (!inOnlyNormalDownloadGroups(file)) return NULL;
+
+    /* The file creator waits for this disk job before it is deleted, so it stays valid after ctrlMutex is released. */
+    file->mFileCreator->beginDiskJob();
+    return file->mFileCreator;
+}
+
 /***************************************************************/
 /********************** downloadGroup **************************/
 /***************************************************************/
@@ -688,12 +875,3 @@ void downloadGroup::getStatus(int *waiting_to_download, int *downloading, int *c
         }
     }
 }
-
-void downloadGroup::startOneTransfer() {
-    for (int i = 0; i < filesInGroup.count(); i++) {
-        if (filesInGroup[i]->transferStatus() == ftTransferModule::FILE_WAITING) {
-            filesInGroup[i]->transferStatus(ftTransferModule::FILE_DOWNLOADING);
-            return;
-        }
-    }
-}
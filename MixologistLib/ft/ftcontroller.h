@@ -24,14 +24,19 @@
 #define FT_CONTROLLER_HEADER
 
 #include "interface/files.h"
+#include "ft/ftdownloadscheduler.h"
 
 #include <QThread>
 #include <QMutex>
 #include <QMap>
+#include <QSet>
+#include <QHash>
 #include <QString>
 #include <QDir>
 
 class ftTransferModule;
+class ftFileProvider;
+class ftPieceManifest;
 
 class ftController;
 extern ftController *fileDownloadController;
@@ -51,7 +56,7 @@ struct downloadGroup {
         DOWNLOAD_RETURN = 2
     };
 
-    downloadGroup() :downloadFinished(false) {}
+    downloadGroup() :downloadFinished(false), priority(0), paused(false) {}
 
     /* These fields are "" and 0 for non-borrow downloads.
        For borrows, they are information supplied by the sender we will pass back on transfer completion so he knows which item we just borrowed. */
@@ -65,20 +70,31 @@ struct downloadGroup {
 
     bool downloadFinished;
 
+    /* Groups with a higher priority have their files started first, which the user controls by moving a group to the top.
+       A paused group has none of its files downloading until it is started again. */
+    int priority;
+    bool paused;
+
     /* The path of the final resting place of the files. */
     QString finalDestination;
 
     /* Fills in appropriate statistics about this group's current situation. */
     void getStatus(int *waiting_to_download, int *downloading, int *completed, int *total) const;
-
-    /* Starts a transfer on a file that is waiting to download. */
-    void startOneTransfer();
 };
 
 /*
 This class is the master file downloads controller, and its loop steps through the downloads sending requests for
 further data, and handles items that have finished download.
 
+Rather than stepping through every download on each run of its loop, which becomes slow with many queued downloads,
+it only touches the downloads and downloadGroups that need attention.
+Transfer modules are put on a ready list to be ticked when they start, receive data or have a source come online,
+and after each tick are either kept on the ready list, put to sleep until a set time, or left to sleep until another of those events.
+downloadGroups are only checked for completion when one of their files changes status.
+
+Which files are downloading at any time is decided across all downloadGroups by the ftDownloadScheduler,
+which is told whenever a file is added, completes, is removed or has one of its downloadGroups paused, started or reprioritized.
+
 On receiving requested ata ftDataDemultiplex calls ftController's handleReceiveData to handle it.
 
 Downloads belong to downloadGroups, which contain information about a batch of file(s) being downloaded.
@@ -129,9 +145,11 @@ public:
        to see if this was the last file that was holding up its completion and it should be completed.*/
     void cancelFile(int groupId, const QString &hash);
 
-    /* Enables pausing and starting of transfers
-       TEMPORARILY DISABLED */
-    bool controlFile(int orig_item_id, QString hash, uint32_t flags);
+    /* Pauses, starts or moves to the top of the queue the downloadGroup groupId according to flags,
+       which are FILE_CTRL_PAUSE, FILE_CTRL_START and FILE_CTRL_MOVE_TO_TOP.
+       The control applies to the whole downloadGroup, as scheduling is done by group, so hash is not used.
+       Returns false if there is no such group. */
+    bool controlFile(int groupId, QString hash, uint32_t flags);
 
     /* Clears out mCompleted */
     void clearCompletedFiles();
@@ -153,7 +171,28 @@ public:
     QString getPartialsDirectory() const;
 
     /* Called from ftDataDemultiplex when we receive new data to pass it to the appropriate transferModule. */
-    bool handleReceiveData(unsigned int librarymixer_id, const QString &hash, uint64_t offset, uint32_t chunksize, void *data);
+    bool handleReceiveData(unsigned int librarymixer_id, const QString &hash, uint64_t offset, uint32_t chunksize,
+                           const QByteArray &dataBuffer, const void *data);
+
+    /* Called from ftDataDemultiplex when a friend tells us they can't answer one of our requests, to pass it to the appropriate transferModule.
+       reason is one of the FileUnavailable reasons. */
+    bool handleDataUnavailable(unsigned int librarymixer_id, const QString &hash, uint64_t offset, uint32_t chunksize, uint32_t reason);
+
+    /* Called from ftDataDemultiplex when a friend requests a file we don't have a complete copy of,
+       so that we can relay whatever we've already downloaded of it.
+       Only files from normal downloads are relayed, never those being borrowed or returned.
+       Returns the download's ftFileCreator with a disk job begun on it, so that it can be read from without ctrlMutex,
+       or NULL if we aren't downloading that file. The caller must call endDiskJob on it once done reading. */
+    ftFileProvider *getPartialFile(const QString &hash, uint64_t size);
+
+    /* Called from ftDataDemultiplex when we receive a page of a piece manifest to pass it to the appropriate transferModule. */
+    bool handleReceiveManifest(unsigned int librarymixer_id, const QString &hash, uint32_t totalPieces, uint32_t firstPiece,
+                               const QByteArray &root, const QByteArray &pieceHashes);
+
+    /* Called from ftDataDemultiplex when a friend requests the piece manifest of a file we don't have a complete copy of.
+       Fills in manifest and returns true if we are downloading that file with the same restrictions as getPartialFile, and have a complete manifest for it that we can vouch for.
+       A manifest received from a friend is not passed on until the file has matched its hash, so that a bad one doesn't spread. */
+    bool getPartialManifest(const QString &hash, uint64_t size, ftPieceManifest &manifest);
 
 private slots:
     /* Connected to a timer, analagous to run() in a normal thread. */
@@ -184,12 +223,14 @@ private:
     /* Does the actual work in creating a new download of a batch of files and saving it to saved transfers.
        If a specificKey other than -1, that key will be assigned to the group or else it will fail if unavailable.
        Setting a specificKey is used for restoring saved transfers on startup (retaining the same key is needed to keep the save in sync).
+       priority and paused are only set other than 0 and false when restoring saved transfers.
        Not mutex protected so we can call from inside internal mutexes. */
     virtual bool internalDownloadFiles(unsigned int friend_id, const QString &title, const QStringList &paths, const QStringList &hashes, const QList<qlonglong> &filesizes,
-                                       int specificKey, downloadGroup::DownloadType download_type, unsigned int source_type, const QString &source_id);
+                                       int specificKey, downloadGroup::DownloadType download_type, unsigned int source_type, const QString &source_id,
+                                       int priority = 0, bool paused = false);
 
     /* Requests the file.
-       If a file is already being downloaded, returns it.
+       If a file is already being downloaded, adds friend_id as a source for it and returns it.
        Otherwise, creates a new ftTransferModule and adds it to mDownloads.
        No mutex protection. */
     ftTransferModule* internalRequestFile(unsigned int friend_id, const QString &hash, uint64_t size);
@@ -198,6 +239,18 @@ private:
        No mutex protection because both of the cancel functions are mutex protected. */
     void internalCancelFile(int groupId, ftTransferModule* file);
 
+    /* Puts file on the ready list to be ticked on the next run of runThread. */
+    void scheduleTick(ftTransferModule* file);
+
+    /* Takes file off of the ready list and out of the wakeups, for when it is about to be deleted. */
+    void unscheduleTick(ftTransferModule* file);
+
+    /* Marks every downloadGroup containing file to be checked on the next run of runThread. */
+    void checkGroupsContaining(ftTransferModule* file);
+
+    /* Tells the scheduler the current state of the downloadGroups containing file, for after one of them changes. */
+    void updateScheduling(ftTransferModule* file);
+
     /* Returns true if more than one downloadGroup contains the given file.
        This information is useful for finishGroup(), so we know whether to leave the transferModule in mDownloads and the file behind.
        As it is called from within finishGroup(), it has no mutex protection for itself. */
@@ -206,6 +259,9 @@ private:
     /* Returns true if it is any non-completed downloadGroup. */
     bool inActiveDownloadGroup(ftTransferModule* file) const;
 
+    /* Returns true if every downloadGroup containing the given file is a normal download, so its contents may be relayed to other friends. */
+    bool inOnlyNormalDownloadGroups(ftTransferModule* file) const;
+
     /* Called by FileDownloads() to fill in info on information from file.
        Not mutex protected, as FileDownloads() is protected. */
     void fileDetails(ftTransferModule* file, downloadFileInfo &info);
@@ -257,6 +313,20 @@ private:
     QMap<QString, ftTransferModule*> mDownloads;
     QMap<int, downloadGroup> mDownloadGroups;
 
+    /* The transfer modules to tick on the next run of runThread. */
+    QSet<ftTransferModule*> mReadyDownloads;
+
+    /* Transfer modules that are asleep until a set time, ordered by the time they are due to be put back on the ready list,
+       along with the reverse lookup so that they can be found when they need to be moved early. */
+    QMultiMap<time_t, ftTransferModule*> mWakeups;
+    QHash<ftTransferModule*, time_t> mWakeupTimes;
+
+    /* The keys of downloadGroups that need to be checked for completion on the next run of runThread. */
+    QSet<int> mGroupsToCheck;
+
+    /* Decides which files are downloading. */
+    ftDownloadScheduler mScheduler;
+
     //The path completed files are moved to
     QString mDownloadPath;
     //The path that incoming files are temporarily stored in
@@ -29,6 +29,7 @@
  */
 
 #include <QString>
+#include <QByteArray>
 #include <inttypes.h>
 
 /*************** SEND INTERFACE *******************/
@@ -42,8 +43,22 @@ public:
     /* Client Send */
     virtual bool sendDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) = 0;
 
-    /* Server Send */
-    virtual bool sendData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, void *data) = 0;
+    /* Server Send, where data holds exactly the chunk to send.
+       The packets sent point into data rather than copying it, so it must not be modified afterwards. */
+    virtual bool sendData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, const QByteArray &data) = 0;
+
+    /* Tells the requester that a range can't be served, with reason one of the FileUnavailable reasons. */
+    virtual bool sendDataUnavailable(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, uint32_t reason) = 0;
+
+    /* Client Send of a request for a page of a file's piece manifest */
+    virtual bool sendManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece) = 0;
+
+    /* Server Send of a page of a file's piece manifest */
+    virtual bool sendManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t totalPieces, uint32_t firstPiece,
+                              const QByteArray &root, const QByteArray &pieceHashes) = 0;
+
+    /* The rate in kB/s at which data has recently been written to the connection to the friend. */
+    virtual float getSentRate(unsigned int librarymixer_id) = 0;
 
 };
 
@@ -59,10 +74,16 @@ public:
     }
 
     /* Client Recv */
-    virtual bool recvData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, void *data) = 0;
+    /* data points into dataBuffer, which keeps it alive for as long as it is needed. */
+    virtual bool recvData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize,
+                          const QByteArray &dataBuffer, const void *data) = 0;
+    virtual bool recvDataUnavailable(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, uint32_t reason) = 0;
+    virtual bool recvManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t totalPieces, uint32_t firstPiece,
+                              const QByteArray &root, const QByteArray &pieceHashes) = 0;
 
     /* Server Recv */
     virtual bool recvDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) = 0;
+    virtual bool recvManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece) = 0;
 
 };
 
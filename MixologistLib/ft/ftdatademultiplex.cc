@@ -28,25 +28,145 @@
 #include "ft/ftfileprovider.h"
 #include "ft/ftfilemethod.h"
 #include "ft/ftserver.h"
+#include "ft/ftfilewatcher.h"
+#include "ft/ftpiecemanifest.h"
+#include "ft/ftblockcache.h"
+#include "ft/ftuploadscheduler.h"
+#include "ft/ftdiskio.h"
+#include "ft/ftfileindex.h"
 #include "util/debug.h"
+#include "util/clock.h"
 
-#include <QTimer>
+#include <QFileInfo>
+#include <QSet>
 
-/* For Thread Behaviour */
-const uint32_t DMULTIPLEX_MIN   = 10; /* 1ms sleep */
-const uint32_t DMULTIPLEX_MAX   = 1000; /* 1 sec sleep */
-const double   DMULTIPLEX_RELAX = 0.5; /* ??? */
+
+/* How often the request latency histogram is logged. */
+const uint64_t DMULTIPLEX_LATENCY_LOG_PERIOD = 60 * 1000000; /* 60 secs */
 
 const uint32_t FT_DATA      = 0x0001;
 const uint32_t FT_DATA_REQ  = 0x0002;
+const uint32_t FT_DATA_UNAVAILABLE = 0x0003;
+const uint32_t FT_MANIFEST_REQ = 0x0004;
+const uint32_t FT_MANIFEST = 0x0005;
+
+/* Number of piece hashes sent in each page of a manifest. */
+const uint32_t FT_MANIFEST_PAGE_PIECES = 512;
+
+/* The most reads for uploads that may be queued with the ftDiskIO at once for each device.
+   Past this, requests for files on that device are held back in the order the upload scheduler released them until one of its reads finishes,
+   while requests for files on other devices are still served. */
+const int FT_MAX_QUEUED_UPLOAD_READS = 16;
+
+/* The most read for a single request, matching the largest our own ftTransferModule ever asks for.
+   Only this much of a larger request is answered, rather than allocating whatever a friend asks for. */
+const uint32_t FT_MAX_UPLOAD_READ = 16 * 1024 * 1024;
+
+/* The most queued searches handled each period. */
+const size_t FT_SEARCH_BATCH = 64;
+
+/* How long in seconds a request for a file we don't have is remembered, so that the friend's retries of it are answered without searching the fileIndex.
+   Misses are forgotten as soon as any file is added to the fileIndex.
+   Files we are downloading are always checked for before misses, so a miss never hides a download started since. */
+const time_t FT_RECENT_MISS_TIME = 30;
+
+/* The most recent misses remembered, past which they are all forgotten. */
+const int FT_MAX_RECENT_MISSES = 4096;
+
+/* How long in seconds after asking for a file to be hashed again for its piece manifest before it may be asked for again,
+   in case hashing failed or produced a manifest for a different hash because the file had changed. */
+const time_t FT_MANIFEST_HASH_RETRY_TIME = 60 * 60;
+
+/* Reads the data for a request on the ftDiskIO worker for the device the file is on, and sends it.
+   The provider is either one of our file serves, or if partial is set, a file we're still downloading. */
+class ftUploadReadJob: public ftDiskJob {
+public:
+    ftUploadReadJob(ftDataDemultiplex *demultiplex, ftFileProvider *provider, bool partial, const QString &device,
+                    unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize)
+        :demultiplex(demultiplex), provider(provider), partial(partial), device(device), librarymixer_id(librarymixer_id),
+         hash(hash), size(size), offset(offset), chunksize(chunksize) {}
+
+    virtual void run() {
+        uint32_t requestedChunksize = chunksize;
+        if (chunksize > FT_MAX_UPLOAD_READ) chunksize = FT_MAX_UPLOAD_READ;
+
+        /* The data is read straight into the buffer the outgoing packets will point into. */
+        QByteArray data;
+        data.resize(chunksize);
+
+        if (offset >= size) {
+            /* A request past the end of the file is the requester's mistake, and says nothing about whether we still have the file. */
+            provider->endDiskJob();
+            ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset, requestedChunksize, FileUnavailable::RANGE_NOT_YET_AVAILABLE);
+        } else if ((uint32_t)data.size() != chunksize) {
+            log(LOG_DEBUG_ALERT, FTDATADEMULTIPLEXZONE, "ftDataDemultiplex::sendRequestedData allocation failed for a chunksize of " + QString::number(chunksize));
+            provider->endDiskJob();
+        } else if (provider->getFileData(offset, chunksize, data.data(), librarymixer_id)) {
+            provider->endDiskJob();
+            log(LOG_DEBUG_ALL, FTDATADEMULTIPLEXZONE,
+                QString("ftDataDemultiplex::sendRequestedData") +
+                " hash: " + hash +
+                " offset: " + QString::number(offset) +
+                " chunksize: " + QString::number(chunksize));
+            data.resize(chunksize);
+            ftserver->sendData(librarymixer_id, hash, size, offset, data);
+
+            /* If less could be read than was asked for, tell them so for the rest, rather than leaving them waiting on it.
+               The rest of a request only cut short by FT_MAX_UPLOAD_READ is available though,
+               and saying otherwise would have them back off from us, so that is left for them to ask for again. */
+            uint64_t requestedEnd = qMin(offset + qMin(requestedChunksize, FT_MAX_UPLOAD_READ), size);
+            if (offset + chunksize < requestedEnd) {
+                ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset + chunksize, requestedEnd - (offset + chunksize),
+                                              FileUnavailable::RANGE_NOT_YET_AVAILABLE);
+            }
+        } else if (partial) {
+            provider->endDiskJob();
+            ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset, requestedChunksize, FileUnavailable::RANGE_NOT_YET_AVAILABLE);
+        } else {
+            QString path = provider->getPath();
+            provider->endDiskJob();
+
+            /* Only if the file is really gone or has changed size do we give up on it.
+               Anything else, such as a disk that is briefly unavailable, may well succeed when they ask again. */
+            QFileInfo info(path);
+            if (!info.exists() || (uint64_t)info.size() != size) {
+                log(LOG_WARNING, FTDATADEMULTIPLEXZONE, "File has changed or been removed " + path);
+                ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset, requestedChunksize, FileUnavailable::FILE_CHANGED);
+                /* The provider may be being deleted under the demultiplexer's mutex waiting for this job,
+                   so the file serve is deactivated through a queued call rather than by taking the mutex here. */
+                QMetaObject::invokeMethod(demultiplex, "fileNoLongerAvailable", Qt::QueuedConnection,
+                                          Q_ARG(QString, hash), Q_ARG(qulonglong, size));
+            } else {
+                log(LOG_WARNING, FTDATADEMULTIPLEXZONE, "Unable to read file " + path);
+                ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset, requestedChunksize, FileUnavailable::RANGE_NOT_YET_AVAILABLE);
+            }
+        }
+        demultiplex->uploadReadFinished(device);
+    }
 
-ftRequest::ftRequest(uint32_t type, unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunk, void *data)
+private:
+    ftDataDemultiplex *demultiplex;
+    ftFileProvider *provider;
+    bool partial;
+    QString device;
+    unsigned int librarymixer_id;
+    QString hash;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t chunksize;
+};
+
+ftRequest::ftRequest(uint32_t type, unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunk, const void *data)
     :mType(type), mLibraryMixerId(librarymixer_id), mHash(hash), mSize(size),
-     mOffset(offset), mChunk(chunk), mData(data) {
+     mOffset(offset), mChunk(chunk), mData(data), mReason(0), mQueuedAt(monotonicMicroseconds()) {
     return;
 }
 
-ftDataDemultiplex::ftDataDemultiplex(ftController *controller) :mController(controller) {}
+ftDataDemultiplex::ftDataDemultiplex(ftController *controller)
+    :mController(controller), mStopping(false), mLastLatencyLog(0) {
+    mUploadScheduler = new ftUploadScheduler();
+    for (int i = 0; i < LATENCY_BUCKETS; i++) mLatencyBuckets[i] = 0;
+}
 
 void ftDataDemultiplex::addFileMethod(ftFileMethod *fileMethod) {
     QMutexLocker stack(&dataMtx);
@@ -54,29 +174,82 @@ void ftDataDemultiplex::addFileMethod(ftFileMethod *fileMethod) {
 }
 
 void ftDataDemultiplex::run() {
-    QTimer::singleShot(1000, this, SLOT(runThread()));
-    exec();
-}
-
-void ftDataDemultiplex::runThread() {
-    bool doneWork = false;
-    while (workQueued() && doWork()) {
-        doneWork = true;
-    }
-    time_t now = time(NULL);
-    if (doneWork) {
-        mLastWork = now;
-        mLastSleep = (uint32_t) (DMULTIPLEX_MIN + (mLastSleep - DMULTIPLEX_MIN) / 2.0);
-    } else {
-        uint32_t deltaT = now - mLastWork;
-        double frac = deltaT / DMULTIPLEX_RELAX;
-
-        mLastSleep += (uint32_t)((DMULTIPLEX_MAX - DMULTIPLEX_MIN) * (frac + 0.05));
-        if (mLastSleep > DMULTIPLEX_MAX) {
-            mLastSleep = DMULTIPLEX_MAX;
+    /* Rather than polling on a timer, which left a request received while idle waiting up to a second,
+       the thread sleeps until one of the recv functions wakes it. */
+    while (true) {
+        {
+            QMutexLocker stack(&dataMtx);
+            while (mRequestQueue.empty() && !locked_canServeUploads() && mSearchQueue.empty() && !mStopping) {
+                workAvailable.wait(&dataMtx);
+            }
+            if (mStopping) return;
         }
+        while (workQueued() && doWork()) {}
+    }
+}
+
+void ftDataDemultiplex::stop() {
+    {
+        QMutexLocker stack(&dataMtx);
+        mStopping = true;
+        workAvailable.wakeAll();
+    }
+    wait();
+}
+
+void ftDataDemultiplex::locked_workAdded() {
+    workAvailable.wakeOne();
+}
+
+bool ftDataDemultiplex::locked_canServeUploads() const {
+    return mUploadScheduler->hasRequests();
+}
+
+void ftDataDemultiplex::uploadReadFinished(const QString &device) {
+    QMutexLocker stack(&dataMtx);
+    if (--mQueuedUploadReads[device] <= 0) mQueuedUploadReads.remove(device);
+
+    /* Now there's room, the longest held request for this device is handled again. */
+    QHash<QString, std::list<ftRequest> >::iterator held = mHeldUploads.find(device);
+    if (held != mHeldUploads.end()) {
+        mRequestQueue.push_back(held.value().front());
+        held.value().pop_front();
+        if (held.value().empty()) mHeldUploads.erase(held);
     }
-    QTimer::singleShot(mLastSleep, this, SLOT(runThread()));
+
+    locked_workAdded();
+}
+
+bool ftDataDemultiplex::locked_holdUploadIfBusy(const QString &device, unsigned int librarymixer_id, QString hash, uint64_t size,
+                                                uint64_t offset, uint32_t chunksize) {
+    if (mQueuedUploadReads.value(device, 0) < FT_MAX_QUEUED_UPLOAD_READS) {
+        mQueuedUploadReads[device]++;
+        return false;
+    }
+    mHeldUploads[device].push_back(ftRequest(FT_DATA_REQ, librarymixer_id, hash, size, offset, chunksize, NULL));
+    return true;
+}
+
+void ftDataDemultiplex::recordLatency(const ftRequest &request) {
+    uint64_t now = monotonicMicroseconds();
+    uint64_t waited = now - request.mQueuedAt;
+
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && waited >= ((uint64_t)2 << bucket)) bucket++;
+    mLatencyBuckets[bucket]++;
+
+    if (mLastLatencyLog == 0) mLastLatencyLog = now;
+    if (now - mLastLatencyLog < DMULTIPLEX_LATENCY_LOG_PERIOD) return;
+    mLastLatencyLog = now;
+
+    QString histogram;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (mLatencyBuckets[i] == 0) continue;
+        if (i < LATENCY_BUCKETS - 1) histogram += " <" + QString::number((uint64_t)2 << i) + "us:";
+        else histogram += " longer:";
+        histogram += QString::number(mLatencyBuckets[i]);
+    }
+    log(LOG_DEBUG_BASIC, FTDATADEMULTIPLEXZONE, "ftDataDemultiplex request latency histogram" + histogram);
 }
 
 void ftDataDemultiplex::FileUploads(QList<uploadFileInfo> &uploads) {
@@ -100,10 +273,14 @@ void ftDataDemultiplex::FileUploads(QList<uploadFileInfo> &uploads) {
 /*************** RECV INTERFACE (provides ftDataRecv) ****************/
 
 /* Client Recv */
-bool ftDataDemultiplex::recvData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, void *data) {
+bool ftDataDemultiplex::recvData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize,
+                                 const QByteArray &dataBuffer, const void *data) {
     /* Store in Queue */
     QMutexLocker stack(&dataMtx);
-    mRequestQueue.push_back(ftRequest(FT_DATA, librarymixer_id, hash, size, offset, chunksize, data));
+    ftRequest request(FT_DATA, librarymixer_id, hash, size, offset, chunksize, data);
+    request.mDataBuffer = dataBuffer;
+    mRequestQueue.push_back(request);
+    locked_workAdded();
 
     return true;
 }
@@ -112,12 +289,50 @@ bool ftDataDemultiplex::recvData(unsigned int librarymixer_id, QString hash, uin
 bool ftDataDemultiplex::recvDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) {
     /* Store in Queue */
     QMutexLocker stack(&dataMtx);
-    mRequestQueue.push_back(ftRequest(FT_DATA_REQ, librarymixer_id, hash, size, offset, chunksize, NULL));
+    mUploadScheduler->addRequest(ftRequest(FT_DATA_REQ, librarymixer_id, hash, size, offset, chunksize, NULL));
+    locked_workAdded();
+
+    return true;
+}
+
+/* Client Recv */
+bool ftDataDemultiplex::recvDataUnavailable(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, uint32_t reason) {
+    /* Store in Queue */
+    QMutexLocker stack(&dataMtx);
+    ftRequest request(FT_DATA_UNAVAILABLE, librarymixer_id, hash, size, offset, chunksize, NULL);
+    request.mReason = reason;
+    mRequestQueue.push_back(request);
+    locked_workAdded();
+
+    return true;
+}
+
+/* Client Recv */
+bool ftDataDemultiplex::recvManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t totalPieces, uint32_t firstPiece,
+                                     const QByteArray &root, const QByteArray &pieceHashes) {
+    /* Store in Queue */
+    QMutexLocker stack(&dataMtx);
+    ftRequest request(FT_MANIFEST, librarymixer_id, hash, size, firstPiece, totalPieces, NULL);
+    request.mManifestRoot = root;
+    request.mManifestPieceHashes = pieceHashes;
+    mRequestQueue.push_back(request);
+    locked_workAdded();
+
+    return true;
+}
+
+/* Server Recv */
+bool ftDataDemultiplex::recvManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece) {
+    /* Store in Queue */
+    QMutexLocker stack(&dataMtx);
+    mRequestQueue.push_back(ftRequest(FT_MANIFEST_REQ, librarymixer_id, hash, size, firstPiece, 0, NULL));
+    locked_workAdded();
 
     return true;
 }
 
 void ftDataDemultiplex::fileNoLongerAvailable(QString hash, qulonglong size) {
+    blockCache->invalidateHash(hash);
     QMutexLocker stack(&dataMtx);
     deactivateFileServe(hash, size);
 }
@@ -129,6 +344,10 @@ bool ftDataDemultiplex::workQueued() {
         return true;
     }
 
+    if (locked_canServeUploads()) {
+        return true;
+    }
+
     if (mSearchQueue.size() > 0) {
         return true;
     }
@@ -139,7 +358,7 @@ bool ftDataDemultiplex::workQueued() {
 bool ftDataDemultiplex::doWork() {
     bool doRequests = true;
 
-    /* Handle all the current requests. */
+    /* Handle all the current incoming data and other requests, which are quick to handle. */
     while (doRequests) {
         ftRequest req;
         {
@@ -153,14 +372,29 @@ bool ftDataDemultiplex::doWork() {
             req = mRequestQueue.front();
             mRequestQueue.pop_front();
         }
+        recordLatency(req);
 
         switch (req.mType) {
             case FT_DATA:
-                handleIncomingData(req.mLibraryMixerId, req.mHash, req.mOffset, req.mChunk, req.mData);
+                handleIncomingData(req.mLibraryMixerId, req.mHash, req.mOffset, req.mChunk, req.mDataBuffer, req.mData);
                 break;
 
+            /* Requests for data are only in this queue once they've been released from mHeldUploads. */
             case FT_DATA_REQ:
-                handleOutgoingDataRequest(req.mLibraryMixerId, req.mHash, req.mSize,  req.mOffset, req.mChunk);
+                handleOutgoingDataRequest(req.mLibraryMixerId, req.mHash, req.mSize, req.mOffset, req.mChunk);
+                break;
+
+            case FT_DATA_UNAVAILABLE:
+                mController->handleDataUnavailable(req.mLibraryMixerId, req.mHash, req.mOffset, req.mChunk, req.mReason);
+                break;
+
+            case FT_MANIFEST_REQ:
+                handleManifestRequest(req.mLibraryMixerId, req.mHash, req.mSize, req.mOffset);
+                break;
+
+            case FT_MANIFEST:
+                mController->handleReceiveManifest(req.mLibraryMixerId, req.mHash, req.mChunk, req.mOffset,
+                                                   req.mManifestRoot, req.mManifestPieceHashes);
                 break;
 
             default:
@@ -168,132 +402,352 @@ bool ftDataDemultiplex::doWork() {
         }
     }
 
-    /* Only handle one search per period, we treat these as lower priority. */
-    ftRequest req;
+    /* Answer about one request for data for each friend being served, in the order the upload scheduler decides,
+       so that searches for newly requested files are interleaved with serving uploads rather than waiting for every upload to be served. */
+    int uploadsToServe;
     {
         QMutexLocker stack(&dataMtx);
-
-        if (mSearchQueue.size() == 0) {
-            return true;
+        uploadsToServe = qMax(1, mUploadScheduler->activeFriends());
+    }
+    for (int i = 0; i < uploadsToServe; i++) {
+        ftRequest req;
+        {
+            QMutexLocker stack(&dataMtx);
+            if (!mUploadScheduler->nextRequest(req)) break;
         }
+        recordLatency(req);
+        handleOutgoingDataRequest(req.mLibraryMixerId, req.mHash, req.mSize,  req.mOffset, req.mChunk);
+    }
 
-        req = mSearchQueue.front();
-        mSearchQueue.pop_front();
+    /* Searches are lower priority, so only a batch is handled per period,
+       with all of the requests in the batch for the same file answered by a single search. */
+    std::list<ftRequest> searches;
+    {
+        QMutexLocker stack(&dataMtx);
+        while (!mSearchQueue.empty() && searches.size() < FT_SEARCH_BATCH) {
+            searches.push_back(mSearchQueue.front());
+            mSearchQueue.pop_front();
+        }
     }
 
-    handleSearchRequest(req.mLibraryMixerId, req.mHash, req.mSize, req.mOffset, req.mChunk);
+    handleSearchRequests(searches);
 
     return true;
 }
 
 
-bool ftDataDemultiplex::handleIncomingData(unsigned int librarymixer_id, QString hash, uint64_t offset, uint32_t chunksize, void *data) {
-    return mController->handleReceiveData(librarymixer_id, hash, offset, chunksize, data);
+bool ftDataDemultiplex::handleIncomingData(unsigned int librarymixer_id, QString hash, uint64_t offset, uint32_t chunksize,
+                                           const QByteArray &dataBuffer, const void *data) {
+    return mController->handleReceiveData(librarymixer_id, hash, offset, chunksize, dataBuffer, data);
 }
 
 void ftDataDemultiplex::handleOutgoingDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) {
-    QMutexLocker stack(&dataMtx);
+    {
+        QMutexLocker stack(&dataMtx);
 
-    /* Once multi-source is implemented, we should scan the files we're downloading here to see if
-       we're downloading the thing that is being requested and can respond with what we have. */
+        /* If the data being requested is something we've already got a file provider for, and this friend is allowed to request it. */
+        if (activeFileServes.contains(hash) &&
+            activeFileServes[hash]->getFileSize() == size &&
+            activeFileServes[hash]->isPermittedRequestor(librarymixer_id)) {
+            sendRequestedData(activeFileServes[hash], librarymixer_id, hash, size, offset, chunksize);
+            return;
+        }
+    }
 
-    /* If the data being requested is something we've already got a file provider for, and this friend is allowed to request it. */
-    if (activeFileServes.contains(hash) &&
-        activeFileServes[hash]->getFileSize() == size &&
-        activeFileServes[hash]->isPermittedRequestor(librarymixer_id)) {
-        sendRequestedData(activeFileServes[hash], librarymixer_id, hash, size, offset, chunksize);
+    /* Taken before looking, so that a file added while we look isn't remembered as missing. */
+    uint64_t indexGeneration = fileIndex->generation();
+    bool indexPopulated = fileIndex->populated();
+
+    /* If it's something we're downloading ourselves, respond with what we have of it.
+       Done outside of our mutex, as this locks the ftController.
+       This comes before checking for a recent miss, as we may have started downloading the file since. */
+    if (sendPartialData(librarymixer_id, hash, size, offset, chunksize)) return;
+
+    bool recentMiss;
+    {
+        QMutexLocker stack(&dataMtx);
+        recentMiss = locked_isRecentMiss(hash, size, indexGeneration);
+    }
+    if (recentMiss) {
+        ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset, chunksize, FileUnavailable::FILE_NOT_FOUND);
         return;
     }
 
-    /* Not present in our available files. We'll do a search for it in our file list when we have a chance. */
-    mSearchQueue.push_back(ftRequest(FT_DATA_REQ, librarymixer_id, hash, size, offset, chunksize, NULL));
+    /* Not present in our available files. We'll do a search for it in our file list when we have a chance, unless it isn't shared at all. */
+    {
+        QMutexLocker stack(&dataMtx);
+        if (fileIndex->contains(hash, size)) {
+            mSearchQueue.push_back(ftRequest(FT_DATA_REQ, librarymixer_id, hash, size, offset, chunksize, NULL));
+            return;
+        }
+        if (indexPopulated) locked_recordMiss(hash, size, indexGeneration);
+    }
 
-    return;
+    /* Telling them saves them re-requesting it from us until their requests time out.
+       Until everything we share has been loaded into the index, the file may just not be in it yet,
+       so they are only told to try again shortly rather than that we don't have it. */
+    ftserver->sendDataUnavailable(librarymixer_id, hash, size, offset, chunksize,
+                                  indexPopulated ? FileUnavailable::FILE_NOT_FOUND : FileUnavailable::RANGE_NOT_YET_AVAILABLE);
+}
+
+bool ftDataDemultiplex::sendPartialData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) {
+    ftFileProvider *partialFile = mController->getPartialFile(hash, size);
+    if (partialFile == NULL) return false;
+
+    /* As with file serves, the read is left to the disk worker rather than holding up the demultiplexer.
+       The disk job already begun on it by the ftController is ended by the ftUploadReadJob. */
+    QString device = diskIO->deviceOf(partialFile->getPath());
+    bool held;
+    {
+        QMutexLocker stack(&dataMtx);
+        held = locked_holdUploadIfBusy(device, librarymixer_id, hash, size, offset, chunksize);
+    }
+    if (held) {
+        partialFile->endDiskJob();
+        return true;
+    }
+    diskIO->submit(partialFile->getPath(), new ftUploadReadJob(this, partialFile, true, device, librarymixer_id, hash, size, offset, chunksize));
+    return true;
 }
 
 bool ftDataDemultiplex::sendRequestedData(ftFileProvider *provider, unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) {
-    void *data = malloc(chunksize);
+    /* The read is left to the disk worker, so that a slow disk doesn't hold up serving files from other disks. */
+    QString device = diskIO->deviceOf(provider->getPath());
+    if (locked_holdUploadIfBusy(device, librarymixer_id, hash, size, offset, chunksize)) return true;
+    provider->beginDiskJob();
+    diskIO->submit(provider->getPath(), new ftUploadReadJob(this, provider, false, device, librarymixer_id, hash, size, offset, chunksize));
+    return true;
+}
 
-    if (data == NULL) {
-        log(LOG_DEBUG_ALERT, FTDATADEMULTIPLEXZONE, "ftDataDemultiplex::sendRequestedData malloc failed for a chunksize of " + QString::number(chunksize));
-        return false;
+void ftDataDemultiplex::handleManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece) {
+    QString path;
+    bool internalFile = false;
+    bool serving = false;
+    {
+        QMutexLocker stack(&dataMtx);
+        if (activeFileServes.contains(hash) &&
+            activeFileServes[hash]->getFileSize() == size &&
+            activeFileServes[hash]->isPermittedRequestor(librarymixer_id)) {
+            path = activeFileServes[hash]->getPath();
+            internalFile = activeFileServes[hash]->isInternalMixologistFile();
+            serving = true;
+        }
     }
 
-    if (provider->getFileData(offset, chunksize, data, librarymixer_id)) {
-        log(LOG_DEBUG_ALL, FTDATADEMULTIPLEXZONE,
-            QString("ftDataDemultiplex::sendRequestedData") +
-            " hash: " + hash +
-            " offset: " + QString::number(offset) +
-            " chunksize: " + QString::number(chunksize));
-        ftserver->sendData(librarymixer_id, hash, size, offset, chunksize, data);
-        return true;
-    } else {
-        log(LOG_WARNING, FTDATADEMULTIPLEXZONE, "Unable to read file " + provider->getPath());
-        deactivateFileServe(hash, size);
-        return false;
+    if (serving) {
+        sendCachedManifest(librarymixer_id, hash, size, firstPiece, path, internalFile);
+        return;
+    }
+
+    uint64_t indexGeneration = fileIndex->generation();
+    bool indexPopulated = fileIndex->populated();
+
+    /* If it's something we're downloading ourselves, we can pass on its manifest once we can vouch for it. */
+    ftPieceManifest manifest;
+    if (mController->getPartialManifest(hash, size, manifest)) {
+        sendManifestPage(librarymixer_id, hash, manifest, firstPiece);
+        return;
+    }
+
+    QMutexLocker stack(&dataMtx);
+    if (locked_isRecentMiss(hash, size, indexGeneration)) return;
+    if (!fileIndex->contains(hash, size)) {
+        if (indexPopulated) locked_recordMiss(hash, size, indexGeneration);
+        return;
     }
+    mSearchQueue.push_back(ftRequest(FT_MANIFEST_REQ, librarymixer_id, hash, size, firstPiece, 0, NULL));
+}
+
+void ftDataDemultiplex::sendCachedManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece, QString path, bool internalFile) {
+    ftPieceManifest manifest;
+    if (manifest.load(hash, size)) {
+        {
+            QMutexLocker stack(&dataMtx);
+            mManifestHashJobs.remove(hash);
+        }
+        sendManifestPage(librarymixer_id, hash, manifest, firstPiece);
+        return;
+    }
+
+    /* Files hashed before piece manifests existed have none cached, so have the file hashed again to create one.
+       The requester will ask again later. */
+    if (internalFile) return;
+    {
+        QMutexLocker stack(&dataMtx);
+        time_t now = time(NULL);
+        if (mManifestHashJobs.contains(hash) && now - mManifestHashJobs[hash] < FT_MANIFEST_HASH_RETRY_TIME) return;
+        mManifestHashJobs[hash] = now;
+    }
+    log(LOG_DEBUG_ALERT, FTDATADEMULTIPLEXZONE, "ftDataDemultiplex::sendCachedManifest() no piece manifest cached, rehashing " + path);
+    fileWatcher->addHashJob(path);
+}
+
+void ftDataDemultiplex::sendManifestPage(unsigned int librarymixer_id, QString hash, const ftPieceManifest &manifest, uint32_t firstPiece) {
+    if (firstPiece >= manifest.pieceCount()) return;
+
+    ftserver->sendManifest(librarymixer_id, hash, manifest.fileSize(), manifest.pieceCount(), firstPiece,
+                           manifest.root(), manifest.pieceHashes(firstPiece, FT_MANIFEST_PAGE_PIECES));
 }
 
 void ftDataDemultiplex::clearUploads() {
-    QMutexLocker stack(&dataMtx);
-    foreach (ftFileProvider* provider, activeFileServes.values()) {
+    QList<ftFileProvider*> oldActiveFileServes;
+    QList<ftFileProvider*> oldDeadFileServes;
+    {
+        QMutexLocker stack(&dataMtx);
+        oldActiveFileServes = activeFileServes.values();
+        oldDeadFileServes = deadFileServes;
+        activeFileServes.clear();
+        deadFileServes.clear();
+    }
+
+    /* Deleting a provider waits for its queued reads, which each take dataMtx when they finish,
+       so the providers are only deleted once it has been released. */
+    foreach (ftFileProvider* provider, oldActiveFileServes) {
         delete provider;
     }
-    foreach (ftFileProvider* provider, deadFileServes) {
+    foreach (ftFileProvider* provider, oldDeadFileServes) {
         delete provider;
     }
-    activeFileServes.clear();
-    deadFileServes.clear();
 }
 
-bool ftDataDemultiplex::handleSearchRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize) {
+void ftDataDemultiplex::handleSearchRequests(std::list<ftRequest> &requests) {
+    while (!requests.empty()) {
+        QList<ftRequest> sameFile;
+        sameFile.append(requests.front());
+        requests.pop_front();
+
+        std::list<ftRequest>::iterator it = requests.begin();
+        while (it != requests.end()) {
+            if (it->mHash == sameFile.first().mHash && it->mSize == sameFile.first().mSize) {
+                sameFile.append(*it);
+                it = requests.erase(it);
+            } else it++;
+        }
+
+        handleSearchRequest(sameFile);
+    }
+}
+
+bool ftDataDemultiplex::handleSearchRequest(const QList<ftRequest> &requests) {
+    QString hash = requests.first().mHash;
+    uint64_t size = requests.first().mSize;
+
+    /* Only the methods the index says may have the file are asked, so requests for files we don't have are answered without any searching. */
+    QList<ftFileMethod*> candidates = fileIndex->findMethods(hash, size);
+    if (candidates.isEmpty()) {
+        foreach (const ftRequest &request, requests) {
+            sendFileNotFound(request);
+        }
+        return false;
+    }
+
+    /* Whether a friend may have the file depends on who they are, so the methods are asked once for each friend waiting on it. */
+    QSet<unsigned int> searchedFriends;
+    bool found = false;
+    foreach (const ftRequest &request, requests) {
+        unsigned int librarymixer_id = request.mLibraryMixerId;
+        if (!searchedFriends.contains(librarymixer_id)) {
+            searchedFriends.insert(librarymixer_id);
+            if (searchForFriend(candidates, hash, size, librarymixer_id)) found = true;
+        }
+
+        QString path;
+        bool internalFile;
+        bool permitted;
+        {
+            QMutexLocker stack(&dataMtx);
+            permitted = activeFileServes.contains(hash) && activeFileServes[hash]->isPermittedRequestor(librarymixer_id);
+            if (permitted) {
+                if (request.mType != FT_MANIFEST_REQ) {
+                    sendRequestedData(activeFileServes[hash], librarymixer_id, hash, size, request.mOffset, request.mChunk);
+                    continue;
+                }
+                path = activeFileServes[hash]->getPath();
+                internalFile = activeFileServes[hash]->isInternalMixologistFile();
+            }
+        }
+
+        if (!permitted) {
+            sendFileNotFound(request);
+            continue;
+        }
+
+        /* Manifest requests take dataMtx themselves, so are answered only once it has been released. */
+        sendCachedManifest(librarymixer_id, hash, size, request.mOffset, path, internalFile);
+    }
+
+    return found;
+}
+
+void ftDataDemultiplex::sendFileNotFound(const ftRequest &request) {
+    /* Manifest requests are simply retried from another source, so only data requests are answered. */
+    if (request.mType != FT_DATA_REQ) return;
+    /* As in handleOutgoingDataRequest, until the index is populated the file may yet turn up, so they only back off briefly. */
+    ftserver->sendDataUnavailable(request.mLibraryMixerId, request.mHash, request.mSize, request.mOffset, request.mChunk,
+                                  fileIndex->populated() ? FileUnavailable::FILE_NOT_FOUND : FileUnavailable::RANGE_NOT_YET_AVAILABLE);
+}
+
+bool ftDataDemultiplex::searchForFriend(const QList<ftFileMethod*> &candidates, QString hash, uint64_t size, unsigned int librarymixer_id) {
     QString path;
     uint32_t hintflags = (FILE_HINTS_TEMP |
                           FILE_HINTS_ITEM |
                           FILE_HINTS_OFF_LM);
 
+    /* Those methods that may have the file are still asked in order, as they decide whether this friend may have the file. */
+    QMutexLocker stack(&dataMtx);
     ftFileMethod::searchResult result = ftFileMethod::SEARCH_RESULT_NOT_FOUND;
-    {
-        QMutexLocker stack(&dataMtx);
-        foreach (ftFileMethod* fileMethod, mFileMethods) {
-            result = fileMethod->search(hash, size, hintflags, librarymixer_id, path);
-            if (result != ftFileMethod::SEARCH_RESULT_NOT_FOUND) break;
+    foreach (ftFileMethod* fileMethod, mFileMethods) {
+        if (!candidates.contains(fileMethod)) continue;
+        result = fileMethod->search(hash, size, hintflags, librarymixer_id, path);
+        if (result != ftFileMethod::SEARCH_RESULT_NOT_FOUND) break;
+    }
+    if (result == ftFileMethod::SEARCH_RESULT_NOT_FOUND) return false;
+
+    /* If we already have a file serve that previously rejected this friend for security failure.
+       We now know that this friend is authorized by a search provider to access this file. */
+    if (activeFileServes.contains(hash)) {
+        if (ftFileMethod::SEARCH_RESULT_FOUND_SHARED_FILE_LIMITED == result) {
+            activeFileServes[hash]->addPermittedRequestor(librarymixer_id);
+        } else {
+            activeFileServes[hash]->allowAllRequestors();
         }
+        return true;
     }
 
-    if (result != ftFileMethod::SEARCH_RESULT_NOT_FOUND) {
-        QMutexLocker stack(&dataMtx);
+    /* Otherwise, we are creating a new file serve. */
+    ftFileProvider *provider = new ftFileProvider(path, size, hash);
+    if (!provider->checkFileValid()) {
+        delete provider;
+        return false;
+    }
 
-        /* If we already have a file serve that previously rejected this friend for security failure.
-           We now know that this friend is authorized by a search provider to access this file. */
-        if (activeFileServes.contains(hash)) {
-            if (ftFileMethod::SEARCH_RESULT_FOUND_SHARED_FILE_LIMITED == result) {
-                activeFileServes[hash]->addPermittedRequestor(librarymixer_id);
-            } else {
-                activeFileServes[hash]->allowAllRequestors();
-            }
-            return true;
-        }
+    if (ftFileMethod::SEARCH_RESULT_FOUND_INTERNAL_FILE == result)
+        provider->setInternalMixologistFile(true);
+    else if (ftFileMethod::SEARCH_RESULT_FOUND_SHARED_FILE_LIMITED == result)
+        provider->addPermittedRequestor(librarymixer_id);
 
-        /* Otherwise, we are creating a new file serve. */
-        else {
-            ftFileProvider *provider = new ftFileProvider(path, size, hash);
-            if (provider->checkFileValid()) {
-                if (ftFileMethod::SEARCH_RESULT_FOUND_INTERNAL_FILE == result)
-                    provider->setInternalMixologistFile(true);
-                else if (ftFileMethod::SEARCH_RESULT_FOUND_SHARED_FILE_LIMITED == result)
-                    provider->addPermittedRequestor(librarymixer_id);
-
-                activeFileServes[hash] = provider;
-
-                /* Now that we have created a file serve, we also handle their data request. */
-                sendRequestedData(provider, librarymixer_id, hash, size, offset, chunksize);
-                return true;
-            } else delete provider;
-        }
+    activeFileServes[hash] = provider;
+    return true;
+}
+
+bool ftDataDemultiplex::locked_isRecentMiss(const QString &hash, uint64_t size, uint64_t indexGeneration) {
+    QHash<QString, recentMiss>::iterator it = mRecentMisses.find(hash + ":" + QString::number(size));
+    if (it == mRecentMisses.end()) return false;
+
+    if (it.value().indexGeneration != indexGeneration || time(NULL) - it.value().missedAt >= FT_RECENT_MISS_TIME) {
+        mRecentMisses.erase(it);
+        return false;
     }
+    return true;
+}
 
-    return false;
+void ftDataDemultiplex::locked_recordMiss(const QString &hash, uint64_t size, uint64_t indexGeneration) {
+    if (mRecentMisses.count() >= FT_MAX_RECENT_MISSES) mRecentMisses.clear();
+
+    recentMiss miss;
+    miss.indexGeneration = indexGeneration;
+    miss.missedAt = time(NULL);
+    mRecentMisses[hash + ":" + QString::number(size)] = miss;
 }
 
 void ftDataDemultiplex::deactivateFileServe(QString hash, uint64_t size) {
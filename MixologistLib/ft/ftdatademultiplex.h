@@ -37,6 +37,8 @@ class ftController;
 class ftFileProvider;
 class ftFileCreator;
 class ftFileMethod;
+class ftPieceManifest;
+class ftUploadScheduler;
 
 #include <string>
 #include <list>
@@ -48,15 +50,17 @@ class ftFileMethod;
 
 #include <QThread>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QHash>
+#include <QByteArray>
 
 class ftRequest {
 public:
 
-    ftRequest(uint32_t type, unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunk, void *data);
+    ftRequest(uint32_t type, unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunk, const void *data);
 
     ftRequest()
-        :mType(0), mSize(0), mOffset(0), mChunk(0), mData(NULL) {
+        :mType(0), mSize(0), mOffset(0), mChunk(0), mData(NULL), mReason(0), mQueuedAt(0) {
         return;
     }
 
@@ -66,7 +70,19 @@ public:
     uint64_t mSize;
     uint64_t mOffset;
     uint32_t mChunk;
-    void *mData;
+    /* For received data, the data, which points into mDataBuffer. */
+    const void *mData;
+    QByteArray mDataBuffer;
+
+    /* For FileUnavailable responses, the reason given. */
+    uint32_t mReason;
+
+    /* When the request was received, from monotonicMicroseconds(), for measuring how long it waited to be handled. */
+    uint64_t mQueuedAt;
+
+    /* For piece manifest requests and pages, mOffset is used for the first piece, and for pages mChunk is the total number of pieces. */
+    QByteArray mManifestRoot;
+    QByteArray mManifestPieceHashes;
 };
 
 class ftDataDemultiplex: public QThread, public ftDataRecv {
@@ -78,8 +94,12 @@ public:
 
     void addFileMethod(ftFileMethod* fileMethod);
 
+    /* Handles requests as they are queued, waiting on workAvailable whenever there are none. */
     void run();
 
+    /* Asks the thread to finish, and waits for it. */
+    void stop();
+
     /* data interface */
     /* get Details of File Transfers */
     void FileUploads(QList<uploadFileInfo> &uploads);
@@ -90,15 +110,23 @@ public:
     /*************** RECV INTERFACE (provides ftDataRecv) ****************/
 
     /* Client receive of a piece of data */
-    virtual bool recvData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, void *data);
+    virtual bool recvData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize,
+                          const QByteArray &dataBuffer, const void *data);
 
     /* Server receive of a request for data */
     virtual bool recvDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize);
 
-public slots:
-    /* Connected to a timer, analagous to run() in a normal thread. */
-    void runThread();
+    /* Client receive of notice that a request of ours can't be answered */
+    virtual bool recvDataUnavailable(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, uint32_t reason);
+
+    /* Client receive of a page of a piece manifest */
+    virtual bool recvManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t totalPieces, uint32_t firstPiece,
+                              const QByteArray &root, const QByteArray &pieceHashes);
+
+    /* Server receive of a request for a page of a piece manifest */
+    virtual bool recvManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece);
 
+public slots:
     /* Should be called whenever any of the file providing classes knows that a given file that was previously available
        is no longer available, so that ftDataDemultiplex can clear out any cached information about the file.
        While it is nice to call this when a file is removed to keep things clean, it is important to call this when a file
@@ -106,23 +134,80 @@ public slots:
     void fileNoLongerAvailable(QString hash, qulonglong size);
 
 private:
+    /* Called by a read queued by sendRequestedData or sendPartialData once it is finished,
+       to allow another to be queued for the device it was on. */
+    void uploadReadFinished(const QString &device);
+    friend class ftUploadReadJob;
+
     bool workQueued();
     bool doWork();
 
+    /* Must be called from within mutex after adding to any of the queues, to wake the thread if it is waiting for work. */
+    void locked_workAdded();
+
+    /* Returns true if there are requests for data waiting in the upload scheduler.
+       Must be called from within mutex. */
+    bool locked_canServeUploads() const;
+
+    /* Adds how long the request waited between being received and being handled to the latency histogram,
+       and periodically logs the histogram. */
+    void recordLatency(const ftRequest &request);
+
     /* Handling Job Queues */
     /* Passes incoming data to the appropriate transfer module, or returns false if this data is for a file we're not downloading. */
-    bool handleIncomingData(unsigned int librarymixer_id, QString hash, uint64_t offset, uint32_t chunksize, void *data);
+    bool handleIncomingData(unsigned int librarymixer_id, QString hash, uint64_t offset, uint32_t chunksize, const QByteArray &dataBuffer, const void *data);
 
-    /* Either responds to the data request by sending the requested data via locked_handleServerRequest,
+    /* Either responds to the data request by sending the requested data from an existing file serve or a file we're downloading,
        or adds it to mSearchQueue for further processing */
     void handleOutgoingDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize);
 
-    /* Uses mFileMethods to find the file specified, and if the file is found, adds it to activeFileServes. */
-    bool handleSearchRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize);
+    /* Attempts to answer the data request from a file we're currently downloading.
+       Returns false if we aren't downloading that file. */
+    bool sendPartialData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize);
+
+    /* Responds to the request for a page of a piece manifest from an existing file serve or a file we're downloading,
+       or adds it to mSearchQueue for further processing */
+    void handleManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece);
+
+    /* Handles a batch of requests taken from mSearchQueue, grouping together the requests for each file so that each file is only looked up once. */
+    void handleSearchRequests(std::list<ftRequest> &requests);
+
+    /* Finds the file that all of the requests are for, adding it to activeFileServes if it is found,
+       and answers each request from a friend that may have it, telling the others that we don't have it.
+       The requests may be either for data or for a piece manifest.
+       Returns true if the file was found for any of the friends. */
+    bool handleSearchRequest(const QList<ftRequest> &requests);
+
+    /* Uses those of mFileMethods in candidates to find whether the file may be sent to the friend,
+       and if so, adds it to activeFileServes or permits the friend to request it from the existing file serve.
+       Returns false if the friend may not have the file. */
+    bool searchForFriend(const QList<ftFileMethod*> &candidates, QString hash, uint64_t size, unsigned int librarymixer_id);
+
+    /* Tells the friend that made a data request that we don't have the file for them,
+       or while the fileIndex isn't yet populated, only that they should try again shortly. */
+    void sendFileNotFound(const ftRequest &request);
 
-    /* Sends the requested file data */
+    /* Sends the requested page of the piece manifest for a file we're serving from the manifest cache.
+       If it isn't cached, has the file hashed again to create it, and sends nothing this time. */
+    void sendCachedManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece, QString path, bool internalFile);
+
+    /* Sends the page of manifest starting at firstPiece. */
+    void sendManifestPage(unsigned int librarymixer_id, QString hash, const ftPieceManifest &manifest, uint32_t firstPiece);
+
+    /* Queues the requested file data to be read on the ftDiskIO and then sent,
+       or if the device the file is on is already busy with reads, holds the request in mHeldUploads.
+       Must be called from within mutex. */
     bool sendRequestedData(ftFileProvider *provider, unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize);
 
+    /* Returns true if a request for this file was recently found to be for a file we don't have,
+       and no file has been added to the fileIndex since, going by indexGeneration.
+       Must be called from within mutex. */
+    bool locked_isRecentMiss(const QString &hash, uint64_t size, uint64_t indexGeneration);
+
+    /* Remembers that a request for this file was for a file we don't have, as of indexGeneration.
+       Must be called from within mutex. */
+    void locked_recordMiss(const QString &hash, uint64_t size, uint64_t indexGeneration);
+
     /* Moves an ftFileProvider from activeFileServes to deadFileServes. */
     void deactivateFileServe(QString hash, uint64_t filesize);
 
@@ -133,20 +218,56 @@ private:
     /* List of files that had previously been uploaded. Kept around so GUI can display information on them until user clears it. */
     QList<ftFileProvider *> deadFileServes;
 
-    /* This queue is filled by the ftserver, and contains both incoming data as well as incoming requests for data. */
+    /* This queue is filled by the ftserver, and contains incoming data and everything else other than requests for data,
+       apart from requests for data released from mHeldUploads. */
     std::list<ftRequest> mRequestQueue;
 
+    /* Incoming requests for data, which are queued separately for each friend and answered fairly between them. */
+    ftUploadScheduler *mUploadScheduler;
+
+    /* If the device has room for another read, counts it as queued and returns false.
+       Otherwise adds the request to mHeldUploads and returns true.
+       Must be called from within mutex. */
+    bool locked_holdUploadIfBusy(const QString &device, unsigned int librarymixer_id, QString hash, uint64_t size,
+                                 uint64_t offset, uint32_t chunksize);
+
+    /* The number of reads queued by sendRequestedData and sendPartialData that have yet to finish, keyed by device. */
+    QHash<QString, int> mQueuedUploadReads;
+
+    /* Requests for data held back because the device their file is on already had as many reads queued as allowed, keyed by device.
+       As each read finishes, the oldest request for its device is moved to mRequestQueue to be handled again. */
+    QHash<QString, std::list<ftRequest> > mHeldUploads;
+
     /* When there is an incoming request for data, and we aren't able to service it with an existing upload or download,
        this is a queue of searches to be run against our file list. */
     std::list<ftRequest> mSearchQueue;
 
+    /* Requests for files we don't have, keyed by the file's hash and size, so that retries of them can be answered without searching again.
+       Each is only valid while the fileIndex is at the generation it was recorded at. */
+    struct recentMiss {
+        uint64_t indexGeneration;
+        time_t missedAt;
+    };
+    QHash<QString, recentMiss> mRecentMisses;
+
+    /* Hashes of files we've asked the file watcher to hash again because they had no cached piece manifest, with when we asked.
+       Each is removed once its manifest is found cached, and otherwise only asked for again after FT_MANIFEST_HASH_RETRY_TIME,
+       so that if hashing doesn't produce a manifest for that hash, we don't keep rehashing it. */
+    QHash<QString, time_t> mManifestHashJobs;
+
     /* Interface for sending search requests. */
     QList<ftFileMethod*> mFileMethods;
     ftController *mController;
 
     /* Threading related variables. */
-    uint32_t mLastSleep; /* ms */
-    time_t mLastWork;  /* secs */
+    QWaitCondition workAvailable;
+    bool mStopping;
+
+    /* The number of requests that waited for each range of time to be handled.
+       Bucket i counts waits of less than 2^(i + 1) microseconds, and the last bucket counts everything longer. */
+    enum {LATENCY_BUCKETS = 24};
+    uint64_t mLatencyBuckets[LATENCY_BUCKETS];
+    uint64_t mLastLatencyLog;
 
     friend class ftServer;
 };
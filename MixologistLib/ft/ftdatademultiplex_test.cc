@@ -0,0 +1,284 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+/*
+ * Harness for the request latency of the ftDataDemultiplex thread.
+ *
+ * Replays the same trace of incoming requests against two models of the thread, and prints a histogram of how long each
+ * request waited between being queued and being handled, in the same power-of-two buckets ftDataDemultiplex::recordLatency logs.
+ *
+ * Timer:   The thread as it was before it was woken on new work, sleeping between 10ms and 1s between passes,
+ *          with the sleep halved towards the minimum after a pass that did work, and growing the longer it has been idle.
+ * Wakeup:  The thread as it is now, waiting on a condition variable that is signalled as each request is queued.
+ *
+ * The trace is bursts of requests, as a friend's pipelined requests arrive, separated by idle gaps.
+ * Each request is handled with a short busy loop standing in for doWork.
+ *
+ * Like the other *_test.cc programs this is not part of the library build. It only needs pthreads:
+ *   g++ -O2 -I. ft/ftdatademultiplex_test.cc util/clock.cc -lpthread -o ftdatademultiplex_test
+ *   ./ftdatademultiplex_test [seconds of trace] [average idle gap in ms]
+ */
+
+#include <util/clock.h>
+
+#include <deque>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* As in ftDataDemultiplex before it was woken on new work. */
+const uint32_t DMULTIPLEX_MIN   = 10; /* 10ms sleep */
+const uint32_t DMULTIPLEX_MAX   = 1000; /* 1 sec sleep */
+const double   DMULTIPLEX_RELAX = 0.5;
+
+/* As in ftDataDemultiplex. */
+const int LATENCY_BUCKETS = 24;
+
+/* Time spent handling each request. */
+const uint64_t WORK_MICROSECONDS = 20;
+
+/* Requests in each burst, and the average gap between requests within a burst. */
+const int BURST_MIN_REQUESTS = 4;
+const int BURST_MAX_REQUESTS = 64;
+const uint64_t BURST_GAP_MICROSECONDS = 2000;
+
+/* A small deterministic generator, so that both models replay exactly the same trace. */
+class traceRandom {
+public:
+    traceRandom(uint32_t seed) :mState(seed) {}
+    uint32_t next() {
+        mState = mState * 1103515245 + 12345;
+        return (mState >> 8) & 0xffffff;
+    }
+    /* Roughly exponentially distributed with the given mean. */
+    uint64_t exponential(uint64_t mean) {
+        double uniform = (next() + 1) / (double) 0x1000001;
+        return (uint64_t)(-log(uniform) * mean);
+    }
+private:
+    uint32_t mState;
+};
+
+/* Builds the trace, as offsets in microseconds from its start at which each request arrives. */
+static std::vector<uint64_t> buildTrace(uint64_t duration, uint64_t idleGap) {
+    std::vector<uint64_t> trace;
+    traceRandom random(17);
+    uint64_t now = 0;
+    while (true) {
+        now += random.exponential(idleGap);
+        int requests = BURST_MIN_REQUESTS + random.next() % (BURST_MAX_REQUESTS - BURST_MIN_REQUESTS + 1);
+        for (int i = 0; i < requests; i++) {
+            if (now >= duration) return trace;
+            trace.push_back(now);
+            now += random.exponential(BURST_GAP_MICROSECONDS);
+        }
+    }
+}
+
+static void sleepMicroseconds(uint64_t microseconds) {
+    struct timespec duration;
+    duration.tv_sec = microseconds / 1000000;
+    duration.tv_nsec = (microseconds % 1000000) * 1000;
+    nanosleep(&duration, NULL);
+}
+
+static void busyWork() {
+    uint64_t until = monotonicMicroseconds() + WORK_MICROSECONDS;
+    while (monotonicMicroseconds() < until) {}
+}
+
+/* The queue between the thread replaying the trace and the thread handling it. */
+struct requestQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t workAvailable;
+    std::deque<uint64_t> queuedAt;
+    bool finished;
+    bool useWakeup;
+
+    uint64_t buckets[LATENCY_BUCKETS];
+    std::vector<uint64_t> latencies;
+    uint64_t wakeups;
+};
+
+static void recordLatency(requestQueue *queue, uint64_t waited) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && waited >= ((uint64_t)2 << bucket)) bucket++;
+    queue->buckets[bucket]++;
+    queue->latencies.push_back(waited);
+}
+
+/* Handles everything queued, returning whether there was anything. */
+static bool drainQueue(requestQueue *queue) {
+    bool doneWork = false;
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->queuedAt.empty()) {
+        uint64_t queuedAt = queue->queuedAt.front();
+        queue->queuedAt.pop_front();
+        recordLatency(queue, monotonicMicroseconds() - queuedAt);
+        pthread_mutex_unlock(&queue->mutex);
+        busyWork();
+        doneWork = true;
+        pthread_mutex_lock(&queue->mutex);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return doneWork;
+}
+
+/* ftDataDemultiplex::runThread before it was woken on new work. */
+static void runTimer(requestQueue *queue) {
+    uint32_t lastSleep = DMULTIPLEX_MIN;
+    time_t lastWork = time(NULL);
+    while (true) {
+        sleepMicroseconds(lastSleep * 1000);
+        queue->wakeups++;
+
+        bool doneWork = drainQueue(queue);
+
+        pthread_mutex_lock(&queue->mutex);
+        bool finished = queue->finished && queue->queuedAt.empty();
+        pthread_mutex_unlock(&queue->mutex);
+        if (finished) return;
+
+        time_t now = time(NULL);
+        if (doneWork) {
+            lastWork = now;
+            lastSleep = (uint32_t) (DMULTIPLEX_MIN + (lastSleep - DMULTIPLEX_MIN) / 2.0);
+        } else {
+            uint32_t deltaT = now - lastWork;
+            double frac = deltaT / DMULTIPLEX_RELAX;
+
+            lastSleep += (uint32_t)((DMULTIPLEX_MAX - DMULTIPLEX_MIN) * (frac + 0.05));
+            if (lastSleep > DMULTIPLEX_MAX) {
+                lastSleep = DMULTIPLEX_MAX;
+            }
+        }
+    }
+}
+
+/* ftDataDemultiplex::run now. */
+static void runWakeup(requestQueue *queue) {
+    while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->queuedAt.empty() && !queue->finished) {
+            pthread_cond_wait(&queue->workAvailable, &queue->mutex);
+        }
+        bool finished = queue->finished && queue->queuedAt.empty();
+        pthread_mutex_unlock(&queue->mutex);
+        if (finished) return;
+
+        queue->wakeups++;
+        drainQueue(queue);
+    }
+}
+
+static void *handlerThread(void *argument) {
+    requestQueue *queue = (requestQueue *) argument;
+    if (queue->useWakeup) runWakeup(queue);
+    else runTimer(queue);
+    return NULL;
+}
+
+/* Replays the trace against one model, filling in its histogram. */
+static void runModel(requestQueue &queue, bool useWakeup, const std::vector<uint64_t> &trace) {
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.workAvailable, NULL);
+    queue.finished = false;
+    queue.useWakeup = useWakeup;
+    queue.wakeups = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) queue.buckets[i] = 0;
+
+    pthread_t handler;
+    pthread_create(&handler, NULL, handlerThread, &queue);
+
+    uint64_t start = monotonicMicroseconds();
+    for (size_t i = 0; i < trace.size(); i++) {
+        uint64_t now = monotonicMicroseconds();
+        if (start + trace[i] > now) sleepMicroseconds(start + trace[i] - now);
+
+        pthread_mutex_lock(&queue.mutex);
+        queue.queuedAt.push_back(monotonicMicroseconds());
+        pthread_cond_signal(&queue.workAvailable);
+        pthread_mutex_unlock(&queue.mutex);
+    }
+
+    pthread_mutex_lock(&queue.mutex);
+    queue.finished = true;
+    pthread_cond_signal(&queue.workAvailable);
+    pthread_mutex_unlock(&queue.mutex);
+    pthread_join(handler, NULL);
+
+    pthread_cond_destroy(&queue.workAvailable);
+    pthread_mutex_destroy(&queue.mutex);
+}
+
+static uint64_t percentile(std::vector<uint64_t> latencies, double fraction) {
+    if (latencies.empty()) return 0;
+    std::sort(latencies.begin(), latencies.end());
+    size_t index = (size_t)(fraction * (latencies.size() - 1));
+    return latencies[index];
+}
+
+int main(int argc, char **argv) {
+    uint64_t duration = (argc > 1 ? atoi(argv[1]) : 20) * (uint64_t)1000000;
+    uint64_t idleGap = (argc > 2 ? atoi(argv[2]) : 500) * (uint64_t)1000;
+
+    if (duration == 0) {
+        std::cerr << "Usage: " << argv[0] << " [seconds of trace] [average idle gap in ms]" << std::endl;
+        return 1;
+    }
+
+    std::vector<uint64_t> trace = buildTrace(duration, idleGap);
+    std::cout << trace.size() << " requests over " << duration / 1000000 << "s, bursts separated by " << idleGap / 1000 << "ms on average"
+              << std::endl << std::endl;
+
+    requestQueue timer;
+    runModel(timer, false, trace);
+    requestQueue wakeup;
+    runModel(wakeup, true, trace);
+
+    std::cout << std::setw(12) << "waited" << std::setw(12) << "Timer" << std::setw(12) << "Wakeup" << std::endl;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (timer.buckets[i] == 0 && wakeup.buckets[i] == 0) continue;
+        std::ostringstream label;
+        if (i < LATENCY_BUCKETS - 1) label << "<" << ((uint64_t)2 << i) << "us";
+        else label << "longer";
+        std::cout << std::setw(12) << label.str() << std::setw(12) << timer.buckets[i] << std::setw(12) << wakeup.buckets[i] << std::endl;
+    }
+
+    std::cout << std::endl;
+    std::cout << std::setw(12) << "median" << std::setw(10) << percentile(timer.latencies, 0.5) << "us"
+              << std::setw(10) << percentile(wakeup.latencies, 0.5) << "us" << std::endl;
+    std::cout << std::setw(12) << "99th" << std::setw(10) << percentile(timer.latencies, 0.99) << "us"
+              << std::setw(10) << percentile(wakeup.latencies, 0.99) << "us" << std::endl;
+    std::cout << std::setw(12) << "max" << std::setw(10) << percentile(timer.latencies, 1) << "us"
+              << std::setw(10) << percentile(wakeup.latencies, 1) << "us" << std::endl;
+    std::cout << std::setw(12) << "wakeups" << std::setw(12) << timer.wakeups << std::setw(12) << wakeup.wakeups << std::endl;
+
+    return 0;
+}
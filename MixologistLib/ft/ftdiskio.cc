@@ -0,0 +1,120 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#include <ft/ftdiskio.h>
+#include <util/dir.h>
+
+ftDiskIO *diskIO = NULL;
+
+//The most paths whose devices are remembered, past which they are all forgotten and looked up again as needed
+#define MAX_REMEMBERED_DEVICES 4096
+
+ftDiskIO::ftDiskIO() :mStopped(false) {}
+
+ftDiskIO::~ftDiskIO() {
+    stop();
+}
+
+void ftDiskIO::submit(const QString &path, ftDiskJob *job) {
+    QString device = deviceOf(path);
+
+    {
+        QMutexLocker stack(&diskIOMutex);
+        if (!mStopped) {
+            ftDiskWorker *worker = mWorkers.value(device, NULL);
+            if (worker == NULL) {
+                worker = new ftDiskWorker();
+                mWorkers[device] = worker;
+                worker->start();
+            }
+            worker->addJob(job);
+            return;
+        }
+    }
+
+    /* Once stopped, there is nothing left to run the job on, so it is run straight away. */
+    job->run();
+    delete job;
+}
+
+QString ftDiskIO::deviceOf(const QString &path) {
+    {
+        QMutexLocker stack(&diskIOMutex);
+        if (mDevices.contains(path)) return mDevices[path];
+    }
+
+    /* Looking up the device may itself have to wait for a slow disk, so is done without holding the mutex. */
+    QString device = DirUtil::deviceOf(path);
+
+    QMutexLocker stack(&diskIOMutex);
+    if (mDevices.count() >= MAX_REMEMBERED_DEVICES) mDevices.clear();
+    mDevices[path] = device;
+    return device;
+}
+
+void ftDiskIO::stop() {
+    QList<ftDiskWorker*> workers;
+    {
+        QMutexLocker stack(&diskIOMutex);
+        mStopped = true;
+        workers = mWorkers.values();
+        mWorkers.clear();
+    }
+
+    foreach (ftDiskWorker *worker, workers) {
+        worker->stop();
+        delete worker;
+    }
+}
+
+ftDiskWorker::ftDiskWorker() :mStopping(false) {}
+
+void ftDiskWorker::run() {
+    while (true) {
+        ftDiskJob *job;
+        {
+            QMutexLocker stack(&workerMutex);
+            while (mJobs.isEmpty() && !mStopping) {
+                jobsQueued.wait(&workerMutex);
+            }
+            if (mJobs.isEmpty()) return;
+            job = mJobs.takeFirst();
+        }
+
+        job->run();
+        delete job;
+    }
+}
+
+void ftDiskWorker::addJob(ftDiskJob *job) {
+    QMutexLocker stack(&workerMutex);
+    mJobs.append(job);
+    jobsQueued.wakeOne();
+}
+
+void ftDiskWorker::stop() {
+    {
+        QMutexLocker stack(&workerMutex);
+        mStopping = true;
+        jobsQueued.wakeAll();
+    }
+    wait();
+}
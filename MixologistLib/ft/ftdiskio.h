@@ -0,0 +1,108 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#ifndef FT_DISK_IO_HEADER
+#define FT_DISK_IO_HEADER
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+/*
+ * Reading and writing file data for transfers is done on worker threads rather than on the threads handling the transfers,
+ * so that one slow or sleeping disk only holds up the transfers that use it.
+ *
+ * There is one worker, with its own queue, for each physical device that files are being transferred to or from,
+ * which is created the first time a job is submitted for a file on that device.
+ * Each worker runs its jobs one at a time in the order they were submitted,
+ * so jobs for the same file are run in order, and a disk is never asked to seek between several jobs at once.
+ *
+ * A job is an ftDiskJob, whose run does both the disk access and whatever should happen once it is complete,
+ * and is deleted once it has run.
+ * Anything a job refers to must stay valid until it has run, which ftFileProvider and ftFileCreator
+ * ensure by waiting for their outstanding jobs before closing their files or being deleted.
+ */
+
+class ftDiskJob {
+public:
+    virtual ~ftDiskJob() {}
+
+    /* Called on the worker thread for the job's device. */
+    virtual void run() = 0;
+};
+
+class ftDiskWorker;
+
+class ftDiskIO;
+extern ftDiskIO *diskIO;
+
+class ftDiskIO {
+public:
+    ftDiskIO();
+    ~ftDiskIO();
+
+    /* Queues job to be run by the worker for the device the file at path is on. Takes ownership of job. */
+    void submit(const QString &path, ftDiskJob *job);
+
+    /* Returns the device the file at path is on, as given by DirUtil::deviceOf, remembering it for later jobs. */
+    QString deviceOf(const QString &path);
+
+    /* Runs any jobs still queued, then stops all of the workers and waits for them. */
+    void stop();
+
+private:
+    mutable QMutex diskIOMutex;
+
+    /* One worker for each device, keyed by DirUtil::deviceOf. */
+    QHash<QString, ftDiskWorker*> mWorkers;
+
+    /* The devices of files that jobs have been submitted for, keyed by path. */
+    QHash<QString, QString> mDevices;
+
+    bool mStopped;
+};
+
+class ftDiskWorker : public QThread {
+    Q_OBJECT
+
+public:
+    ftDiskWorker();
+
+    void run();
+
+    /* Adds job to the back of this worker's queue. */
+    void addJob(ftDiskJob *job);
+
+    /* Asks the thread to finish once its queue is empty, and waits for it. */
+    void stop();
+
+private:
+    mutable QMutex workerMutex;
+    QWaitCondition jobsQueued;
+
+    QList<ftDiskJob*> mJobs;
+    bool mStopping;
+};
+
+#endif //FT_DISK_IO_HEADER
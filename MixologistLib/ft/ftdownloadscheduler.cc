@@ -0,0 +1,187 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <ft/ftdownloadscheduler.h>
+#include <ft/fttransfermodule.h>
+#include <interface/settings.h>
+#include <util/debug.h>
+
+//The overall limit on files downloading at once, unless overridden by the "Transfers/MaxActiveDownloads" setting
+const int FT_DS_DEFAULT_MAX_ACTIVE = 8;
+
+//The number of files each friend may have downloading at once, before any extra allowed for files about to finish
+const int FT_DS_FRIEND_BASE_ACTIVE = 2;
+//The most files each friend may have downloading at once
+const int FT_DS_FRIEND_MAX_ACTIVE = 6;
+//A file that will finish within this many seconds at its current rate counts as about to finish
+const double FT_DS_FINISHING_SECONDS = 5;
+
+//How many waiting files to look at on each run, so that a long queue for friends that are all at their limits isn't walked every time
+const int FT_DS_MAX_SCAN = 64;
+
+//How long each disk measurement period lasts
+const uint64_t FT_DS_DISK_PERIOD = 5 * 1000000; //5 seconds
+//The fraction of the time spent writing above which the disk is considered unable to keep up with more files
+const double FT_DS_DISK_BUSY = 0.8;
+//The fraction of the time spent writing below which the disk can take on another file
+const double FT_DS_DISK_IDLE = 0.5;
+
+QMutex ftDownloadScheduler::diskMutex;
+uint64_t ftDownloadScheduler::diskBytesWritten = 0;
+uint64_t ftDownloadScheduler::diskBusyMicroseconds = 0;
+
+bool ftScheduleKey::operator<(const ftScheduleKey &other) const {
+    if (priority != other.priority) return priority > other.priority;
+    if (remaining != other.remaining) return remaining < other.remaining;
+    if (order != other.order) return order < other.order;
+    return sequence < other.sequence;
+}
+
+ftDownloadScheduler::ftDownloadScheduler()
+    :mNextSequence(0), mDiskPeriodStart(0) {
+    QSettings settings(*mainSettings, QSettings::IniFormat);
+    mMaxActive = settings.value("Transfers/MaxActiveDownloads", FT_DS_DEFAULT_MAX_ACTIVE).toInt();
+    if (mMaxActive < 1) mMaxActive = 1;
+    mDiskLimit = mMaxActive;
+}
+
+void ftDownloadScheduler::recordDiskWrite(uint64_t bytes, uint64_t microseconds) {
+    QMutexLocker stack(&diskMutex);
+    diskBytesWritten += bytes;
+    diskBusyMicroseconds += microseconds;
+}
+
+bool ftDownloadScheduler::updateFile(ftTransferModule *file, bool runnable, int priority, unsigned int friend_id, int order) {
+    if (mQueuedKeys.contains(file)) mQueue.remove(mQueuedKeys.take(file));
+
+    if (file->transferStatus() == ftTransferModule::FILE_COMPLETE) {
+        mActive.remove(file);
+        return false;
+    }
+
+    if (mActive.contains(file)) {
+        if (runnable) {
+            mActive[file] = friend_id;
+            return false;
+        }
+        mActive.remove(file);
+        file->transferStatus(ftTransferModule::FILE_WAITING);
+        return true;
+    }
+
+    if (!runnable) return false;
+
+    ftScheduleKey key;
+    key.priority = priority;
+    key.remaining = file->mFileCreator->getFileSize() - file->mFileCreator->amountReceived();
+    key.order = order;
+    key.sequence = mNextSequence++;
+
+    queuedFile queued;
+    queued.file = file;
+    queued.friend_id = friend_id;
+
+    mQueue.insert(key, queued);
+    mQueuedKeys[file] = key;
+    return false;
+}
+
+void ftDownloadScheduler::removeFile(ftTransferModule *file) {
+    if (mQueuedKeys.contains(file)) mQueue.remove(mQueuedKeys.take(file));
+    mActive.remove(file);
+}
+
+QList<ftTransferModule*> ftDownloadScheduler::startTransfers(uint64_t now) {
+    updateDiskLimit(now);
+
+    /* Count up each friend's active files, and how many of those are about to finish. */
+    QHash<unsigned int, int> friendActive;
+    QHash<unsigned int, int> friendFinishing;
+    QHash<ftTransferModule*, unsigned int>::iterator it = mActive.begin();
+    while (it != mActive.end()) {
+        ftTransferModule *file = it.key();
+        if (file->transferStatus() == ftTransferModule::FILE_COMPLETE) {
+            it = mActive.erase(it);
+            continue;
+        }
+        friendActive[it.value()]++;
+
+        double rate = file->currentRate();
+        uint64_t remaining = file->mFileCreator->getFileSize() - file->mFileCreator->amountReceived();
+        if (rate > 0 && remaining < rate * FT_DS_FINISHING_SECONDS) friendFinishing[it.value()]++;
+        it++;
+    }
+
+    QList<ftTransferModule*> started;
+    int limit = qMin(mMaxActive, mDiskLimit);
+    int scanned = 0;
+    QMap<ftScheduleKey, queuedFile>::iterator queued = mQueue.begin();
+    while (queued != mQueue.end() && mActive.count() < limit && scanned < FT_DS_MAX_SCAN) {
+        scanned++;
+        unsigned int friend_id = queued.value().friend_id;
+        int friendLimit = qMin(FT_DS_FRIEND_BASE_ACTIVE + friendFinishing.value(friend_id), FT_DS_FRIEND_MAX_ACTIVE);
+        if (friendActive.value(friend_id) >= friendLimit) {
+            queued++;
+            continue;
+        }
+
+        ftTransferModule *file = queued.value().file;
+        file->transferStatus(ftTransferModule::FILE_DOWNLOADING);
+        mActive[file] = friend_id;
+        friendActive[friend_id]++;
+        mQueuedKeys.remove(file);
+        queued = mQueue.erase(queued);
+        started.append(file);
+    }
+    return started;
+}
+
+void ftDownloadScheduler::updateDiskLimit(uint64_t now) {
+    if (now < mDiskPeriodStart + FT_DS_DISK_PERIOD) return;
+
+    uint64_t written;
+    uint64_t busy;
+    {
+        QMutexLocker stack(&diskMutex);
+        written = diskBytesWritten;
+        busy = diskBusyMicroseconds;
+        diskBytesWritten = 0;
+        diskBusyMicroseconds = 0;
+    }
+
+    double elapsed = now - mDiskPeriodStart;
+    mDiskPeriodStart = now;
+    double busyFraction = busy / elapsed;
+
+    if (busyFraction > FT_DS_DISK_BUSY) {
+        /* Hold at one fewer than are active now, so that nothing new starts until the disk catches up. */
+        int lowered = qMax(mActive.count() - 1, 1);
+        if (lowered < mDiskLimit) {
+            mDiskLimit = lowered;
+            log(LOG_DEBUG_ALERT, FTCONTROLLERZONE,
+                "Disk busy writing " + QString::number((int)(busyFraction * 100)) + "% of the time at " +
+                QString::number((int)(written / (elapsed / 1000000) / 1024)) + " KB/s, limiting active downloads to " + QString::number(mDiskLimit));
+        }
+    } else if (busyFraction < FT_DS_DISK_IDLE && mDiskLimit < mMaxActive) {
+        mDiskLimit++;
+    }
+}
@@ -0,0 +1,115 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef FT_DOWNLOAD_SCHEDULER_HEADER
+#define FT_DOWNLOAD_SCHEDULER_HEADER
+
+#include <QMap>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <stdint.h>
+
+class ftTransferModule;
+
+/*
+ * The ftDownloadScheduler decides which of the files waiting to download should be downloading at any moment,
+ * across all downloadGroups and all friends. It is owned by the ftController, and only called under its mutex,
+ * except for recordDiskWrite, which is called by the ftFileCreators.
+ *
+ * Waiting files are kept in a queue ordered by:
+ * (1) The priority of their downloadGroup, highest first, which the user raises by moving a group to the top.
+ * (2) How much of the file remains to download, smallest first, so that small files don't sit behind large ones,
+ *     which cuts the average time until each file is complete.
+ * (3) The order the downloadGroups were created in, oldest first.
+ * Files in paused downloadGroups are not queued at all.
+ *
+ * How many files may be downloading at once is limited in three ways:
+ * Overall, by the "Transfers/MaxActiveDownloads" setting, lowered further while the disk is too busy writing to keep up.
+ * Per friend, to FT_DS_FRIEND_BASE_ACTIVE files, plus one more for each of that friend's active files that is about to finish
+ * at its measured rate, so that the next file is already started by the time the last one's tail trickles in.
+ * Files are started from the front of the queue, skipping over any whose friend is at their limit.
+ */
+
+/* The position of a waiting file in the queue. */
+struct ftScheduleKey {
+    int priority;
+    uint64_t remaining;
+    int order;
+    /* Unique to each entry, so that files that are otherwise equal keep separate places in the queue. */
+    uint64_t sequence;
+
+    bool operator<(const ftScheduleKey &other) const;
+};
+
+class ftDownloadScheduler {
+public:
+    ftDownloadScheduler();
+
+    /* Called by the ftFileCreators after each write of downloaded data to disk, with how long it took. */
+    static void recordDiskWrite(uint64_t bytes, uint64_t microseconds);
+
+    /* Adds file to the queue, or moves it to its new place in the queue, after it is added to a downloadGroup or one of its downloadGroups changes.
+       runnable is false if every downloadGroup containing file is paused or finished, and the other arguments come from the highest priority one that isn't.
+       If file was downloading and is no longer runnable, it is stopped and set back to waiting, and true is returned so that the caller can stop ticking it. */
+    bool updateFile(ftTransferModule *file, bool runnable, int priority, unsigned int friend_id, int order);
+
+    /* Forgets about file, for when it completes or is about to be deleted. */
+    void removeFile(ftTransferModule *file);
+
+    /* Starts as many files from the front of the queue as the limits allow, and returns them so that the caller can start ticking them.
+       now is in microseconds from monotonicMicroseconds(). */
+    QList<ftTransferModule*> startTransfers(uint64_t now);
+
+private:
+    /* Called by startTransfers, once the latest measurement period is up,
+       lowers the overall limit if the disk has been too busy writing, or raises it back again if it has not. */
+    void updateDiskLimit(uint64_t now);
+
+    struct queuedFile {
+        ftTransferModule *file;
+        unsigned int friend_id;
+    };
+
+    /* The waiting files in the order they should be started, along with the reverse lookup so that they can be found to move or remove. */
+    QMap<ftScheduleKey, queuedFile> mQueue;
+    QHash<ftTransferModule*, ftScheduleKey> mQueuedKeys;
+
+    /* The files that have been started, and the friend each was started for. */
+    QHash<ftTransferModule*, unsigned int> mActive;
+
+    uint64_t mNextSequence;
+
+    /* The configured overall limit on active files, and the current limit after the disk is taken into account. */
+    int mMaxActive;
+    int mDiskLimit;
+
+    /* When the current disk measurement period started. */
+    uint64_t mDiskPeriodStart;
+
+    /* The disk writes since the last measurement, shared between all ftFileCreators. */
+    static QMutex diskMutex;
+    static uint64_t diskBytesWritten;
+    static uint64_t diskBusyMicroseconds;
+};
+
+#endif //FT_DOWNLOAD_SCHEDULER_HEADER
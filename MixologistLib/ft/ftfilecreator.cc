@@ -21,8 +21,12 @@
  ****************************************************************/
 
 #include <ft/ftfilecreator.h>
+#include <ft/ftdownloadscheduler.h>
+#include <ft/ftfilehandlecache.h>
+#include <ft/ftdiskio.h>
 #include <util/dir.h>
 #include <util/debug.h>
+#include <util/clock.h>
 #include <time.h>
 
 #include <QFileInfo>
@@ -36,8 +40,60 @@
    (it's really bad for transfer rates when the duplicative requests pile up). */
 #define CHUNK_MAX_AGE 20
 
+/* This is the minimum age a chunk must reach before it is raced by another friend that has run out of anything else to request.
+   This keeps the end of a download from turning into every friend requesting every remaining chunk. */
+#define CHUNK_RACE_AGE 3
+
+/* How often in seconds to sync progress to the resume journal while a download is active.
+   Syncing forces the data to disk, so this batches many writes into each sync.
+   Anything received since the last sync that is lost in a crash is simply requested again. */
+#define PROGRESS_SYNC_INTERVAL 5
+
+/* How many completed pieces to verify against the manifest each tick.
+   Whatever is left when the last of the file arrives is verified all at once before the file is declared complete. */
+#define VERIFY_PIECES_PER_TICK 16
+
+/* After this many pieces in a row fail verification, a manifest from a friend is assumed to be bad and another is requested from someone else. */
+#define MAX_CONSECUTIVE_VERIFICATION_FAILURES 4
+
+/* Writes a chunk of received data on the ftDiskIO worker for the device the file is on. */
+class ftFileWriteJob: public ftDiskJob {
+public:
+    ftFileWriteJob(ftFileCreator *creator, unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, const QByteArray &dataBuffer, const void *data)
+        :creator(creator), friend_id(friend_id), startingByte(startingByte), lengthInBytes(lengthInBytes), dataBuffer(dataBuffer), data(data) {}
+
+    virtual void run() {
+        creator->writeQueuedData(friend_id, startingByte, lengthInBytes, data);
+    }
+
+private:
+    ftFileCreator *creator;
+    unsigned int friend_id;
+    uint64_t startingByte;
+    uint32_t lengthInBytes;
+    /* Keeps the data alive until it has been written. */
+    QByteArray dataBuffer;
+    const void *data;
+};
+
+/* Verifies completed pieces against the manifest, and the complete file against its hash, on the ftDiskIO worker for the device the file is on. */
+class ftPieceVerifyJob: public ftDiskJob {
+public:
+    ftPieceVerifyJob(ftFileCreator *creator, uint32_t limit)
+        :creator(creator), limit(limit) {}
+
+    virtual void run() {
+        creator->verifyQueuedPieces(limit);
+    }
+
+private:
+    ftFileCreator *creator;
+    uint32_t limit;
+};
+
 ftFileCreator::ftFileCreator(QString path, uint64_t size, QString hash)
-    :ftFileProvider(path, size, hash), fileWriteAccessor(NULL) {
+    :ftFileProvider(path, size, hash), fileWriteAccessor(NULL), mJournal(path + ".journal", size), lastProgressSync(0),
+     mManifest(size), manifestTrusted(false), manifestSource(0), fileVerified(false), verifyQueued(false), consecutiveVerificationFailures(0) {
 
     log(LOG_DEBUG_BASIC, FTFILECREATORZONE,
         QString("ftFileCreator() ") +
@@ -45,11 +101,15 @@ ftFileCreator::ftFileCreator(QString path, uint64_t size, QString hash)
         " size: " + QString::number(size) +
         " hash: " + hash);
 
-    /* The amount of the file on disk when initializing is the amount that has been received. */
-    bytesSaved = QFileInfo(path).size();
+    loadProgress();
+    mChunkMap.reset(size, mSaved);
+
+    /* The journal is only removed once the file has matched its hash, so a complete file without one has already been checked. */
+    fileVerified = mSaved.totalSize() == fullFileSize && !QFile::exists(mJournal.path());
 
-    /* During initialization, we haven't yet requested anything beyond the amount received. */
-    firstUnrequestedByte = bytesSaved;
+    /* Only manifests we can vouch for are cached, so if there is one from an earlier run, everything saved so far is verified again against it as we go. */
+    manifestTrusted = mManifest.load(hash, size);
+    queueSavedPieces();
 
     /* Handle the specical case of a 0 byte file, where addFileData will never be called. */
     if (size == 0) {
@@ -60,33 +120,41 @@ ftFileCreator::ftFileCreator(QString path, uint64_t size, QString hash)
 }
 
 ftFileCreator::~ftFileCreator() {
-    foreach (uint64_t currentChunk, mReceivedChunks.keys()) {
-        free(mReceivedChunks[currentChunk].data);
-    }
+    QMutexLocker stack(&ftcMutex);
+    locked_waitForDiskJobs();
+    syncProgress();
+    if (fileWriteAccessor) fileWriteAccessor->deleteLater();
 }
 
 void ftFileCreator::tick() {
     QMutexLocker stack(&ftcMutex);
 
-    /* Write all received chunks to disk that are ready to be written. */
-    foreach (uint64_t currentReceivedStartingByte, mReceivedChunks.keys()) {
-        /* The bytesSaved will be incremented by writeFileData if we succesfully write a chunk.
-           Therefore, it's possible to start from the beginning and keep writing chunks.
-           Because keys is returned in order by a map, we stop as soon as we hit a chunk that isn't where we're ready to write. */
-        if (currentReceivedStartingByte <= bytesSaved) {
-            /* If we are unsuccessful in writing to the file, for example for a full disk, we do not remove the data so we can try again. */
-            if (writeFileData(currentReceivedStartingByte,
-                              mReceivedChunks[currentReceivedStartingByte].lengthInBytes,
-                              mReceivedChunks[currentReceivedStartingByte].data)) {
-                free(mReceivedChunks[currentReceivedStartingByte].data);
-                mReceivedChunks.remove(currentReceivedStartingByte);
-            } else break;
-        } else break;
+    if (mJournal.hasPending() && time(NULL) - lastProgressSync >= PROGRESS_SYNC_INTERVAL) syncProgress();
+
+    /* Reading the pieces back is left to the disk worker, so that it doesn't hold up whoever called tick. */
+    bool piecesToVerify = mManifest.isComplete() && !mUnverifiedPieces.empty();
+    bool fileToVerify = !fileVerified && mSaved.totalSize() == fullFileSize;
+    if (!verifyQueued && (piecesToVerify || fileToVerify)) {
+        verifyQueued = true;
+        QString pathToRead = path;
+        pendingDiskJobs++;
+        stack.unlock();
+        diskIO->submit(pathToRead, new ftPieceVerifyJob(this, VERIFY_PIECES_PER_TICK));
     }
 }
 
+void ftFileCreator::verifyQueuedPieces(uint32_t limit) {
+    QMutexLocker stack(&ftcMutex);
+    verifyPieces(limit, stack);
+    if (!fileVerified && mSaved.totalSize() == fullFileSize) verifyWholeFile(stack);
+    verifyQueued = false;
+    locked_endDiskJob();
+}
+
 void ftFileCreator::closeFile() {
     QMutexLocker stack(&ftcMutex);
+    locked_waitForDiskJobs();
+    syncProgress();
     if (fileWriteAccessor) {
         fileWriteAccessor->close();
         fileWriteAccessor->deleteLater();
@@ -96,115 +164,372 @@ void ftFileCreator::closeFile() {
 
 bool ftFileCreator::finished() const {
     QMutexLocker stack(&ftcMutex);
-    return bytesSaved == fullFileSize;
+    return fileVerified;
 }
 
 uint64_t ftFileCreator::amountReceived() const {
     QMutexLocker stack(&ftcMutex);
-    return bytesSaved;
+    return mSaved.totalSize();
 }
 
-bool ftFileCreator::addFileData(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, void *data) {
+uint64_t ftFileCreator::amountUnrequested() const {
     QMutexLocker stack(&ftcMutex);
+    return mChunkMap.unrequestedSize();
+}
 
-    if (fileWriteAccessor == NULL){
-        log(LOG_DEBUG_ALERT, FTFILECREATORZONE, "ftFileCreator::addFileData() preparing to write to " + path);
-        fileWriteAccessor= new QFile(path);
-        if (!fileWriteAccessor->open(QIODevice::ReadWrite)) {
-            free(data);
-            return false;
-        }
-    }
+bool ftFileCreator::addFileData(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, const QByteArray &dataBuffer, const void *data) {
+    QMutexLocker stack(&ftcMutex);
 
-    if (mRequestedChunks.isEmpty()) {
+    if (!mChunkMap.hasOutstandingRequests()) {
         log(LOG_WARNING, FTFILECREATORZONE,
             "Received a file chunk at " + QString::number(startingByte) +
             " when we have no outstanding requests for " + path);
-        free(data);
         return false;
     }
 
-    /* Guard against any strange behavior, and make sure data isn't after the latest point in the file we're accepting.
-       (The opposite where we receive data already written could just be retransmission, and unnecessary data is dropped by writeFileData().) */
-    if (startingByte >= firstUnrequestedByte) {
+    /* Guard against any strange behavior, and make sure data isn't past the end of the file or entirely made up of parts we never requested. */
+    if (startingByte >= fullFileSize || !mChunkMap.wasRequested(startingByte, lengthInBytes)) {
         log(LOG_WARNING, FTFILECREATORZONE,
             "Received a file chunk at " + QString::number(startingByte) +
             " containing data we never requested for " + path);
-        free(data);
         return false;
     }
-    if (startingByte + lengthInBytes > firstUnrequestedByte) {
-        lengthInBytes = firstUnrequestedByte - startingByte;
-        log(LOG_WARNING, FTFILECREATORZONE, "Received a file chunk greater than extends past what we requested, adjusting chunk size");
+    if (startingByte + lengthInBytes > fullFileSize) {
+        lengthInBytes = fullFileSize - startingByte;
+        log(LOG_WARNING, FTFILECREATORZONE, "Received a file chunk that extends past the end of the file, adjusting chunk size");
     }
 
-    /* Add the data to our received list, and remove from requested list.
-       This way if we are missing a few bytes at the beginning, we can simply re-request those few bytes while knowing we have the rest cached. */
-    if (mReceivedChunks.contains(startingByte)) {
-        log(LOG_WARNING, FTFILECREATORZONE, "Ignoring duplicative data at " + QString::number(startingByte) + " for " + path);
-        free(data);
+    /* Receiving data already written could just be retransmission of a request that timed out. */
+    if (mSaved.contains(startingByte, startingByte + lengthInBytes)) {
+        log(LOG_WARNING, FTFILECREATORZONE,
+            "Discarding data already written at " + QString::number(startingByte) +
+            " with length " + QString::number(lengthInBytes) +
+            " for " + path);
+        mChunkMap.received(startingByte, lengthInBytes);
         return true;
     }
-    mReceivedChunks[startingByte] = receivedChunk(startingByte, lengthInBytes, data, friend_id);
-    removeFromRequestedChunks(startingByte, lengthInBytes);
+
+    /* The write is left to the disk worker, so that a slow disk doesn't hold up the handling of other transfers. */
+    QString pathToWrite = path;
+    pendingDiskJobs++;
+    stack.unlock();
+    diskIO->submit(pathToWrite, new ftFileWriteJob(this, friend_id, startingByte, lengthInBytes, dataBuffer, data));
 
     return true;
 }
 
-bool ftFileCreator::writeFileData(uint64_t startingByte, uint32_t lengthInBytes, void *data) {
-    if (startingByte + lengthInBytes <= bytesSaved) {
-        log(LOG_WARNING, FTFILECREATORZONE,
-            "Discarding data already written at " + QString::number(startingByte) +
-            " with length " + QString::number(lengthInBytes) +
-            " for " + path);
-        return true;
+void ftFileCreator::writeQueuedData(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, const void *data) {
+    QMutexLocker stack(&ftcMutex);
+
+    /* Another copy of the same data may have been written while this was queued. */
+    if (mSaved.contains(startingByte, startingByte + lengthInBytes)) {
+        mChunkMap.received(startingByte, lengthInBytes);
+        locked_endDiskJob();
+        return;
     }
 
-    uint64_t byteToWriteFrom;
-    uint64_t bytesToWrite;
-    uint64_t offsetInData;
-    if (startingByte < bytesSaved) {
-        log(LOG_WARNING, FTFILECREATORZONE,
-            "Partially discarding data already written at " + QString::number(startingByte) +
-            " with length " + QString::number(lengthInBytes) +
-            " for " + path);
-        byteToWriteFrom = bytesSaved;
-        bytesToWrite = lengthInBytes - (bytesSaved - startingByte);
-        offsetInData = lengthInBytes - bytesToWrite;
-    } else {
-        byteToWriteFrom = startingByte;
-        bytesToWrite = lengthInBytes;
-        offsetInData = 0;
+    if (!openForWriting()) {
+        mChunkMap.release(startingByte, lengthInBytes);
+        locked_endDiskJob();
+        return;
     }
 
-    fileWriteAccessor->seek(byteToWriteFrom);
-    if (fileWriteAccessor->write(&(((char *)data)[offsetInData]), bytesToWrite) == -1) {
-        log(LOG_ERROR, FTFILECREATORZONE, "Error while attempting to write to file " + path);
-        return false;
+    /* If we are unsuccessful in writing to the file, for example for a full disk, the data is handed back to be requested again. */
+    stack.unlock();
+    bool written = writeFileData(startingByte, lengthInBytes, data);
+    stack.relock();
+
+    if (written) recordWritten(friend_id, startingByte, lengthInBytes, stack);
+    else mChunkMap.release(startingByte, lengthInBytes);
+    locked_endDiskJob();
+}
+
+void ftFileCreator::recordWritten(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, QMutexLocker &stack) {
+    mChunkMap.received(startingByte, lengthInBytes);
+    mSaved.add(startingByte, startingByte + lengthInBytes);
+    mJournal.recordCompleted(startingByte, startingByte + lengthInBytes);
+
+    /* Remember who sent each part of each piece, so that if the piece fails verification we know who to blame. */
+    uint32_t lastPiece = ftPieceManifest::pieceAt(startingByte + lengthInBytes - 1);
+    for (uint32_t piece = ftPieceManifest::pieceAt(startingByte); piece <= lastPiece; piece++) {
+        mPieceSources[piece].insert(friend_id);
     }
+    queueCompletedPieces(startingByte, startingByte + lengthInBytes);
 
-    /* Update how much has been completed, and no longer needs to be requested. */
-    bytesSaved += bytesToWrite;
+    /* On the final finish of the file, it is important that it is written to disk,
+       otherwise when the file is moved in ftController, it may be truncated.
+       The journal is kept until the file has matched its hash, so that a crash before then leaves the check still to be done. */
+    if (mSaved.totalSize() == fullFileSize) {
+        /* Any piece that fails its final verification means the file isn't complete after all. */
+        verifyPieces(mUnverifiedPieces.size(), stack);
+        if (mSaved.totalSize() != fullFileSize) return;
 
-    /* Normally it's fine that the QFile is buffered, as it presumably improves performance.
-       However, on the final finish of the file, it is important that it is written to disk,
-       otherwise when the file is moved in ftController, it may be truncated. */
-    if (bytesSaved == fullFileSize) {
-        if (!fileWriteAccessor->flush()) {
+        if (!DirUtil::syncFile(*fileWriteAccessor)) {
             log(LOG_ERROR, FTFILECREATORZONE, "Error while attempting to write to file " + path);
+            return;
+        }
+        syncProgress();
+        fileWriteAccessor->close();
+        verifyWholeFile(stack);
+    }
+}
+
+bool ftFileCreator::openForWriting() {
+    if (fileWriteAccessor != NULL && fileWriteAccessor->isOpen()) return true;
+
+    log(LOG_DEBUG_ALERT, FTFILECREATORZONE, "ftFileCreator::openForWriting() preparing to write to " + path);
+    if (fileWriteAccessor == NULL) fileWriteAccessor = new QFile(path);
+
+    /* Writes go straight to their place in the file, so there is no benefit to buffering them in QFile. */
+    if (!fileWriteAccessor->open(QIODevice::ReadWrite | QIODevice::Unbuffered)) return false;
+
+    /* The journal must exist before the file grows to its full size,
+       otherwise a crash could leave a full size file with nothing to say it isn't complete. */
+    if ((uint64_t)fileWriteAccessor->size() != fullFileSize) {
+        if (!mJournal.rewrite(mSaved)) {
+            fileWriteAccessor->close();
             return false;
-        } else {
+        }
+
+        /* On most filesystems this creates a sparse file, so no space is actually used until it is written to. */
+        if (!fileWriteAccessor->resize(fullFileSize)) {
+            log(LOG_ERROR, FTFILECREATORZONE, "Unable to preallocate " + path);
             fileWriteAccessor->close();
+            return false;
         }
     }
 
     return true;
 }
 
+bool ftFileCreator::writeFileData(uint64_t startingByte, uint32_t lengthInBytes, const void *data) {
+    uint64_t writeStart = monotonicMicroseconds();
+    if (!DirUtil::writeFileAt(*fileWriteAccessor, startingByte, lengthInBytes, data)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Error while attempting to write to file " + fileWriteAccessor->fileName());
+        return false;
+    }
+
+    /* The download scheduler holds off starting more downloads while the disk can't keep up with these. */
+    ftDownloadScheduler::recordDiskWrite(lengthInBytes, monotonicMicroseconds() - writeStart);
+    return true;
+}
+
+void ftFileCreator::loadProgress() {
+    mSaved.clear();
+
+    if (mJournal.load(mSaved)) {
+        /* The journal only describes the preallocated file it was written alongside. */
+        if ((uint64_t)QFileInfo(path).size() != fullFileSize) mSaved.clear();
+
+        /* Rewrite the journal straight away, so anything torn at its end is cleared out before we append to it. */
+        mJournal.rewrite(mSaved);
+        return;
+    }
+
+    /* Partial files without a journal were always written in order, so whatever is on disk is a contiguous prefix.
+       If there is a journal but it couldn't be used, we don't know what was saved, so it is only safe to start over. */
+    if (QFile::exists(mJournal.path())) {
+        log(LOG_WARNING, FTFILECREATORZONE, "Unusable resume journal for " + path + ", restarting download");
+        /* Replace it with an empty one, as anything appended to the unusable journal would be lost on the next load too. */
+        mJournal.rewrite(mSaved);
+        return;
+    }
+    uint64_t onDisk = QFileInfo(path).size();
+    if (onDisk > fullFileSize) onDisk = fullFileSize;
+    mSaved.add(0, onDisk);
+}
+
+void ftFileCreator::syncProgress() {
+    if (!mJournal.hasPending()) return;
+
+    uint64_t syncStart = monotonicMicroseconds();
+    /* If appending fails, for example because the journal was removed out from under us, fall back on writing a fresh one. */
+    if (!mJournal.sync(fileWriteAccessor)) mJournal.rewrite(mSaved, fileWriteAccessor);
+    else if (mJournal.needsCompaction()) mJournal.rewrite(mSaved, fileWriteAccessor);
+    ftDownloadScheduler::recordDiskWrite(0, monotonicMicroseconds() - syncStart);
+
+    lastProgressSync = time(NULL);
+}
+
+void ftFileCreator::queueCompletedPieces(uint64_t start, uint64_t end) {
+    if (start >= end) return;
+
+    uint32_t lastPiece = ftPieceManifest::pieceAt(end - 1);
+    for (uint32_t piece = ftPieceManifest::pieceAt(start); piece <= lastPiece; piece++) {
+        if (mSaved.contains(mManifest.pieceStart(piece), mManifest.pieceEnd(piece))) mUnverifiedPieces.insert(piece);
+    }
+}
+
+void ftFileCreator::queueSavedPieces() {
+    std::map<uint64_t, uint64_t>::const_iterator it;
+    for (it = mSaved.ranges().begin(); it != mSaved.ranges().end(); it++) {
+        queueCompletedPieces(it->first, it->second);
+    }
+}
+
+void ftFileCreator::verifyPieces(uint32_t limit, QMutexLocker &stack) {
+    if (!mManifest.isComplete()) return;
+
+    uint32_t verified = 0;
+    while (!mUnverifiedPieces.empty() && verified < limit) {
+        uint32_t piece = *mUnverifiedPieces.begin();
+        verified++;
+
+        /* The piece is read without the mutex so that reading it doesn't block the rest of the transfer.
+           If we can't read it now, leave it to be tried again later. */
+        QByteArray data;
+        stack.unlock();
+        bool read = readPiece(piece, data);
+        stack.relock();
+        if (!read) return;
+        mUnverifiedPieces.erase(piece);
+
+        if (mManifest.verifyPiece(piece, data)) {
+            consecutiveVerificationFailures = 0;
+            mPieceSources.erase(piece);
+            continue;
+        }
+
+        uint64_t pieceStart = mManifest.pieceStart(piece);
+        uint64_t pieceEnd = mManifest.pieceEnd(piece);
+        log(LOG_WARNING, FTFILECREATORZONE,
+            "Piece " + QString::number(piece) + " of " + path + " failed verification, requesting it again");
+
+        mSaved.remove(pieceStart, pieceEnd);
+        mChunkMap.release(pieceStart, pieceEnd - pieceStart);
+
+        /* The journal only records additions, so it must be rewritten to forget the piece. */
+        mJournal.rewrite(mSaved, fileWriteAccessor);
+
+        /* Any of the friends that sent part of the piece could have sent the bad data. */
+        std::map<uint32_t, std::set<unsigned int> >::iterator sources = mPieceSources.find(piece);
+        if (sources != mPieceSources.end()) {
+            std::set<unsigned int>::const_iterator source;
+            for (source = sources->second.begin(); source != sources->second.end(); source++) {
+                mFailedSources.append(*source);
+            }
+            mPieceSources.erase(sources);
+        }
+
+        /* A manifest we hashed ourselves is never in doubt, so the failures are left to be blamed on the sources alone.
+           A manifest from a friend is dropped, and everything saved is checked again against the next one, which is requested from someone else. */
+        if (++consecutiveVerificationFailures >= MAX_CONSECUTIVE_VERIFICATION_FAILURES && !manifestTrusted) {
+            log(LOG_WARNING, FTFILECREATORZONE,
+                "Too many pieces of " + path + " failed verification, requesting another piece manifest than that from " + QString::number(manifestSource));
+            mSuspectManifestSources.insert(manifestSource);
+            mManifest.clear();
+            consecutiveVerificationFailures = 0;
+            mUnverifiedPieces.clear();
+            queueSavedPieces();
+            return;
+        }
+    }
+}
+
+void ftFileCreator::verifyWholeFile(QMutexLocker &stack) {
+    if (fileVerified) return;
+
+    /* The file is read without the mutex so that hashing it doesn't block the rest of the transfer. */
+    QString pathToHash = path;
+    QString fileHash;
+    QByteArray pieceHashes;
+    stack.unlock();
+    bool read = DirUtil::getFileHash(pathToHash, fileHash, FT_PIECE_SIZE, pieceHashes);
+    stack.relock();
+    if (!read || fileVerified || mSaved.totalSize() != fullFileSize) return;
+
+    if (fileHash == hash) {
+        log(LOG_DEBUG_ALERT, FTFILECREATORZONE, "ftFileCreator::verifyWholeFile() " + path + " matches its hash");
+        fileVerified = true;
+        mJournal.remove();
+        mPieceSources.clear();
+
+        /* Now that the file is known to be good, the piece hashes of it that we computed can be cached and passed on to friends. */
+        if (mManifest.setPieceHashes(pieceHashes)) {
+            manifestTrusted = true;
+            mManifest.save(hash);
+        }
+        return;
+    }
+
+    log(LOG_ERROR, FTFILECREATORZONE, path + " does not match its hash, restarting download");
+    if (!manifestTrusted && mManifest.isComplete()) mSuspectManifestSources.insert(manifestSource);
+    if (!manifestTrusted) mManifest.clear();
+    mUnverifiedPieces.clear();
+    mPieceSources.clear();
+    mSaved.clear();
+    mChunkMap.reset(fullFileSize, mSaved);
+    mJournal.rewrite(mSaved);
+}
+
+bool ftFileCreator::readPiece(uint32_t piece, QByteArray &data) {
+    uint64_t pieceStart = mManifest.pieceStart(piece);
+    uint64_t pieceLength = mManifest.pieceEnd(piece) - pieceStart;
+
+    if (fileWriteAccessor != NULL && fileWriteAccessor->isOpen()) {
+        if (!fileWriteAccessor->seek(pieceStart)) return false;
+        data = fileWriteAccessor->read(pieceLength);
+    } else {
+        QFile fileToRead(path);
+        if (!fileToRead.open(QIODevice::ReadOnly) || !fileToRead.seek(pieceStart)) return false;
+        data = fileToRead.read(pieceLength);
+    }
+
+    return (uint64_t)data.size() == pieceLength;
+}
+
+bool ftFileCreator::needsManifest() const {
+    QMutexLocker stack(&ftcMutex);
+    return !mManifest.isComplete() && mSaved.totalSize() != fullFileSize;
+}
+
+bool ftFileCreator::manifestSuspectFrom(unsigned int friend_id) const {
+    QMutexLocker stack(&ftcMutex);
+    return mSuspectManifestSources.count(friend_id) > 0;
+}
+
+QList<unsigned int> ftFileCreator::takeFailedSources() {
+    QMutexLocker stack(&ftcMutex);
+    QList<unsigned int> failedSources = mFailedSources;
+    mFailedSources.clear();
+    return failedSources;
+}
+
+uint32_t ftFileCreator::nextManifestPiece() const {
+    QMutexLocker stack(&ftcMutex);
+    return mManifest.receivedPieces();
+}
+
+bool ftFileCreator::addManifestPage(unsigned int friend_id, uint32_t totalPieces, uint32_t firstPiece, const QByteArray &root, const QByteArray &pieceHashes) {
+    QMutexLocker stack(&ftcMutex);
+
+    if (mManifest.isComplete() || mSuspectManifestSources.count(friend_id) > 0) return false;
+
+    bool added = mManifest.addPieceHashes(totalPieces, firstPiece, root, pieceHashes);
+    if (added) manifestSource = friend_id;
+
+    if (mManifest.isComplete()) {
+        log(LOG_DEBUG_ALERT, FTFILECREATORZONE, "ftFileCreator::addManifestPage() received complete piece manifest for " + path);
+    }
+
+    return added;
+}
+
+bool ftFileCreator::getManifest(ftPieceManifest &manifest) const {
+    QMutexLocker stack(&ftcMutex);
+    if (!mManifest.isComplete() || !manifestTrusted) return false;
+    manifest = mManifest;
+    return true;
+}
+
 bool ftFileCreator::moveFileToDirectory(QString newPath) {
     bool ok;
     QMutexLocker stack(&ftcMutex);
+    locked_waitForDiskJobs();
+    syncProgress();
     if (fileWriteAccessor) fileWriteAccessor->close();
+    /* Some platforms won't move a file that is still open for reading. */
+    fileHandleCache->invalidate(path);
 
     QFileInfo fileToMove(path);
     QString fullNewPath = newPath + QDir::separator() + fileToMove.fileName();
@@ -216,7 +541,11 @@ bool ftFileCreator::moveFileToDirectory(QString newPath) {
             fileWriteAccessor->deleteLater();
             fileWriteAccessor = NULL;
         }
+        /* Rather than move the old journal, just write out a fresh one at the new location. */
+        mJournal.remove();
         path = fullNewPath;
+        mJournal.setPath(path + ".journal");
+        if (!fileVerified) mJournal.rewrite(mSaved);
         return true;
     } else {
         log(LOG_DEBUG_ALERT, FTFILEPROVIDERZONE, "ftFileProvider::moveFile() failed");
@@ -226,173 +555,69 @@ bool ftFileCreator::moveFileToDirectory(QString newPath) {
 
 bool ftFileCreator::deleteFileFromDisk() {
     closeFile();
+    QMutexLocker stack(&ftcMutex);
+    mJournal.remove();
+    fileHandleCache->invalidate(path);
     QFile fileToDelete(path);
     return fileToDelete.remove();
 }
 
-bool ftFileCreator::allocateRemainingChunk(unsigned int friend_id, uint64_t &startingByte, uint32_t &lengthInBytes) {
+bool ftFileCreator::allocateRemainingChunk(unsigned int friend_id, uint64_t &startingByte, uint32_t &lengthInBytes, unsigned int &previousOwner) {
     QMutexLocker stack(&ftcMutex);
 
-    if (bytesSaved == fullFileSize) return false;
-
-    time_t currentTime = time(NULL);
+    previousOwner = 0;
 
-    /* Check for timed out chunks we can hand out again. */
-    foreach (uint64_t currentChunk, mRequestedChunks.keys()) {
-        if (mRequestedChunks[currentChunk].requestTime + CHUNK_MAX_AGE < currentTime) {
-            mRequestedChunks[currentChunk].requestTime = currentTime;
-            lengthInBytes = mRequestedChunks[currentChunk].lengthInBytes;
-            startingByte = mRequestedChunks[currentChunk].startingByte;
+    if (mSaved.totalSize() == fullFileSize) return false;
 
-            log(LOG_DEBUG_ALERT, FTFILECREATORZONE,
-                "ftFileCreator::allocateRemainingChunk() re-requesting timed out chunk request at " + QString::number(mRequestedChunks[currentChunk].startingByte) +
-                " with length " + QString::number(lengthInBytes) +
-                " for " + path);
+    time_t currentTime = time(NULL);
 
+    /* Once everything has been requested, rather than sit idle, a friend can race another friend for their oldest outstanding chunk.
+       If nothing is available, we return true with a lengthInBytes of 0 to signal there is nothing to request right now. */
+    uint32_t desiredLength = lengthInBytes;
+    if (!mChunkMap.allocate(friend_id, currentTime, CHUNK_MAX_AGE, startingByte, lengthInBytes, previousOwner)) {
+        lengthInBytes = desiredLength;
+        if (!mChunkMap.allocateRace(friend_id, currentTime, CHUNK_RACE_AGE, startingByte, lengthInBytes, previousOwner)) {
+            lengthInBytes = 0;
             return true;
         }
+        log(LOG_DEBUG_ALERT, FTFILECREATORZONE,
+            "ftFileCreator::allocateRemainingChunk() racing for chunk at " + QString::number(startingByte) +
+            " with length " + QString::number(lengthInBytes) +
+            " for " + path);
+        return true;
     }
 
-    /* Never allocate a chunk larger than remaining amont to be transferred */
-    if (fullFileSize - firstUnrequestedByte < lengthInBytes) lengthInBytes = fullFileSize - firstUnrequestedByte;
-
-    if (lengthInBytes == 0) return true;
-
-    startingByte = firstUnrequestedByte;
-    firstUnrequestedByte += lengthInBytes;
-
     log(LOG_DEBUG_BASIC, FTFILECREATORZONE,
-        QString("ftFileCreator::allocateRemainingChunk() adding new chunk") +
-        " bytesSaved: " + QString::number(bytesSaved) +
-        " firstUnrequestedByte: " + QString::number(firstUnrequestedByte) +
+        QString("ftFileCreator::allocateRemainingChunk() allocated chunk") +
+        " amountReceived: " + QString::number(mSaved.totalSize()) +
+        " startingByte: " + QString::number(startingByte) +
+        " lengthInBytes: " + QString::number(lengthInBytes) +
         " fullFileSize: " + QString::number(fullFileSize));
-    mRequestedChunks[startingByte] = requestedChunk(startingByte, lengthInBytes, currentTime, friend_id);
 
     return true;
 }
 
-/* Chart of all possible cases and the proper response. Assume that we have an original request that is 10 bytes from 10-20.
-   The word start is used inclusive, the word ending is used non-inclusive.
-   SIZE MATCH
-   9-19  move up old start to 20
-   10-20 remove
-   11-21 move down old end to 11
-
-   SMALLER SIZE
-   9-17  move up old start to 18
-   10-18 move up old start to 19
-   11-19 move down old end to 11, create new starting from 19
-   12-20 move down old end to 12
-   13-21 move down old end to 13
-
-   LARGER SIZE
-   8-19  move up old start to 20
-   9-20  remove
-   10-21 remove
-   11-22 move down old end to 11
-
-   In light of the chart, the rule is easy to see.
-   If the totality of the request is encompassed, remove the old request.
-   If the totality of the response is encompassed with room to spare, split the old request.
-   Otherwise, if the ending isn't encompassed, move up the start, and if the start isn't encompassed, move down the end. */
-void ftFileCreator::removeFromRequestedChunks(uint64_t receivedStartingByte, uint32_t receivedSize) {
-    foreach (uint64_t currentStartingByte, mRequestedChunks.keys()) {
-        /* If we've already passed the end of the chunk in iterating through our requests, then we're done. */
-        uint64_t firstByteAfterReceived = receivedStartingByte + receivedSize;
-        if (firstByteAfterReceived <= currentStartingByte) return;
-
-        /* If we haven't reached the beginning of the chunk yet, keep iterating. */
-        uint64_t firstByteAfterCurrent = currentStartingByte + mRequestedChunks[currentStartingByte].lengthInBytes;
-        if (receivedStartingByte >= firstByteAfterCurrent) continue;
-
-        /* If the old request is completely contained by the new chunk, remove it. */
-        if (receivedStartingByte <= currentStartingByte &&
-            firstByteAfterReceived >= firstByteAfterCurrent) {
-            mRequestedChunks.remove(currentStartingByte);
-            continue;
-        }
-
-        /* If the old request completely contains the new chunk with room to spare on both ends, split it. */
-        if (currentStartingByte < receivedStartingByte &&
-            firstByteAfterCurrent > firstByteAfterReceived) {
-            mRequestedChunks[currentStartingByte].lengthInBytes = receivedStartingByte - currentStartingByte;
-
-            mRequestedChunks[receivedStartingByte + receivedSize] = requestedChunk(firstByteAfterReceived,
-                                                                                   firstByteAfterCurrent - firstByteAfterReceived,
-                                                                                   mRequestedChunks[currentStartingByte].requestTime,
-                                                                                   mRequestedChunks[currentStartingByte].friend_requested_from);
-
-            return;
-        }
-
-        /* If the old request extends farther than the received data, just move up the old start point.
-           Note we already know the old request won't also start earlier. */
-        if (firstByteAfterCurrent > firstByteAfterReceived) {
-            mRequestedChunks[currentStartingByte].startingByte = firstByteAfterReceived;
-            mRequestedChunks[currentStartingByte].lengthInBytes = firstByteAfterCurrent - firstByteAfterReceived;
-            mRequestedChunks[firstByteAfterReceived] = mRequestedChunks[currentStartingByte];
-            mRequestedChunks.remove(currentStartingByte);
-            return;
-        }
-
-        /* If the old request starts earlier than the received data, just move down the old end point.
-           Note we already know the old request won't also extend farther. */
-        if (currentStartingByte < receivedStartingByte) {
-            mRequestedChunks[currentStartingByte].lengthInBytes = receivedStartingByte - currentStartingByte;
-            continue;
-        }
-    }
+void ftFileCreator::invalidateChunksRequestedFrom(unsigned int friend_id) {
+    QMutexLocker stack(&ftcMutex);
+    mChunkMap.invalidateFriend(friend_id);
 }
 
-void ftFileCreator::invalidateChunksRequestedFrom(unsigned int friend_id) {
+void ftFileCreator::invalidateChunkRequestedFrom(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes) {
     QMutexLocker stack(&ftcMutex);
-    foreach (uint64_t currentChunk, mRequestedChunks.keys()) {
-        if (mRequestedChunks[currentChunk].friend_requested_from == friend_id) {
-            mRequestedChunks.remove(currentChunk);
-        }
-    }
-    /* We also clear out received but unsaved data, which is generally out-of-order data,
-       as we will likely not receiving the remaining data we need to write this our-of-order data to disk anytime soon. */
-    foreach (uint64_t currentChunk, mReceivedChunks.keys()) {
-        if (mReceivedChunks[currentChunk].friend_received_from == friend_id) {
-            free(mReceivedChunks[currentChunk].data);
-            mReceivedChunks.remove(currentChunk);
-        }
-    }
+    mChunkMap.invalidateFriendRange(friend_id, startingByte, lengthInBytes);
 }
 
-#ifdef false
-bool    ftFileCreator::getFileData(uint64_t startingByte, uint32_t &lengthInBytes, void *data) {
+bool ftFileCreator::getFileData(uint64_t offset, uint32_t &chunk_size, void *data, unsigned int librarymixer_id) {
     {
         QMutexLocker stack(&ftcMutex);
-        /* If we don't have the data */
-        if (startingByte + lengthInBytes > bytesSaved) return false;
-    }
-
-    return ftFileProvider::getFileData(startingByte, lengthInBytes, data);
-}
-
 
-bool ftFileCreator::locked_printChunkMap() {
-    std::cerr << "ftFileCreator::locked_printChunkMap()";
-    std::cerr << " this: " << this;
-    std::cerr << std::endl;
-
-    /* check start point */
-    std::cerr << "Size: " << fullFileSize << " Start: " << bytesSaved << " End: " << firstUnrequestedByte;
-    std::cerr << std::endl;
-    std::cerr << "\tOutstanding Chunks (in the middle)";
-    std::cerr << std::endl;
-
-    QMap<uint64_t, requestedChunk>::iterator it;
-
-    time_t ts = time(NULL);
-    for (it = mRequestedChunks.begin(); it != mRequestedChunks.end(); it++) {
-        std::cerr << "\tChunk [" << it->second.startingByte << "] size: ";
-        std::cerr << it->second.lengthInBytes;
-        std::cerr << "  Age: " << ts - it->second.ts;
-        std::cerr << std::endl;
+        /* Saved data is only removed from mSaved when it fails verification, in which case it is corrupt either way,
+           so once we've checked it's there, it's safe to read after releasing the mutex.
+           The requester verifies what we send against the manifest itself. */
+        uint64_t availableEnd = mSaved.contiguousFrom(offset);
+        if (availableEnd <= offset) return false;
+        if (offset + chunk_size > availableEnd) chunk_size = availableEnd - offset;
     }
-    return true;
+
+    return ftFileProvider::getFileData(offset, chunk_size, data, librarymixer_id);
 }
-#endif
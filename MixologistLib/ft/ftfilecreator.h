@@ -25,7 +25,12 @@
 #define FT_FILE_CREATOR_HEADER
 
 #include <ft/ftfileprovider.h>
-#include <QMap>
+#include <ft/ftchunkmap.h>
+#include <ft/ftresumejournal.h>
+#include <ft/ftpiecemanifest.h>
+
+#include <set>
+#include <map>
 
 /*
  * Corresponds to a single file that is being written to, and by extending ftFileProvider,
@@ -41,33 +46,43 @@ public:
 
     ~ftFileCreator();
 
-    /* Called from ftTransferModule to save any received data to disk. */
+    /* Called from ftTransferModule to periodically make what has been received durable in the resume journal,
+       and to queue pieces that have been completed to be verified against the piece manifest on the ftDiskIO worker,
+       as well as a file that is complete but has yet to be checked against its hash. */
     void tick();
 
     /* Closes the file handle to the file if this is a ftFileCreator that holds the file open, otherwise does nothing. */
     virtual void closeFile();
 
-    /* Returns if this file is completed. */
+    /* Returns if this file is completed and matches its hash. */
     bool finished() const;
 
     /* Returns the amount of the file received so far. */
     uint64_t amountReceived() const;
 
+    /* Returns the amount of the file that has yet to be requested from anyone. */
+    uint64_t amountUnrequested() const;
+
     /* Called from ftTransferModule to find out the next chunk of the file to request.
        lengthInBytes is the requested size of the chunk, but it may be altered if a different sized chunk is allocated.
        Checks to see if there are any old requests that need to be re-requested, and if so returns one of those.
-       Otherwise, returns the next section of the file that is needed, and adds it to mRequestedChunks.
+       Otherwise, returns the next section of the file that is needed, and marks it as requested.
+       If the whole file has already been requested, may instead return another friend's slow outstanding chunk to race for.
+       If the chunk returned was already outstanding from another friend, previousOwner is set to that friend, otherwise to 0.
        Returns false only if the file is already complete.
        If there are no chunks left to request, will return a lengthInBytes of 0, but still be true. */
-    bool allocateRemainingChunk(unsigned int friend_id, uint64_t &startingByte, uint32_t &lengthInBytes);
+    bool allocateRemainingChunk(unsigned int friend_id, uint64_t &startingByte, uint32_t &lengthInBytes, unsigned int &previousOwner);
 
     /* Makes all chunks that we are currently waiting for from that friend available for allocation again.
        Useful when we get disconnected from a friend, and hence know they won't be responding. */
     void invalidateChunksRequestedFrom(unsigned int friend_id);
 
     /* Called from ftTransferModule to write newly received file data.
-       Should always assume it frees the data (though technically sometimes it stores it for a little while internally). */
-    bool addFileData(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, void *data);
+       The data is written directly to its place in the file, regardless of whether earlier parts of the file have arrived yet.
+       The write itself is queued with the ftDiskIO, so the data only counts as received once it has been written.
+       data points into dataBuffer, which the queued write keeps a reference to until it is done.
+       Returns false if the data was discarded rather than queued. */
+    bool addFileData(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, const QByteArray &dataBuffer, const void *data);
 
     /* Moves the old file to new location and updates internal variables. */
     bool moveFileToDirectory(QString newPath);
@@ -75,78 +90,153 @@ public:
     /* Closes any open file handle and deletes the file from disk. Useful when cancelling a download. */
     bool deleteFileFromDisk();
 
+    /* Called from ftTransferModule when a friend tells us they can't answer a request we made of them,
+       so that range can be requested from someone else. */
+    void invalidateChunkRequestedFrom(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes);
+
+    /* Returns true if we don't yet have a piece manifest for this file and should request one. */
+    bool needsManifest() const;
+
+    /* Returns true if a manifest from that friend was dropped as suspect, so that it isn't requested from them again. */
+    bool manifestSuspectFrom(unsigned int friend_id) const;
+
+    /* Returns the friends that sent data for pieces that have failed verification since the last call, once for each failed piece,
+       so that the ftTransferModule can back off from them. */
+    QList<unsigned int> takeFailedSources();
+
+    /* Returns the first piece of the next page of the piece manifest to request. */
+    uint32_t nextManifestPiece() const;
+
+    /* Called from ftTransferModule with a page of the piece manifest received from a friend.
+       Once the manifest is complete, all pieces are verified against it as they are completed.
+       A manifest from a friend is only held in memory, and is neither cached nor passed on until the finished file matches its hash.
+       Returns true if the page was added, or false if it was rejected, including when it came from a friend whose manifest was suspect. */
+    bool addManifestPage(unsigned int friend_id, uint32_t totalPieces, uint32_t firstPiece, const QByteArray &root, const QByteArray &pieceHashes);
+
+    /* Fills in manifest and returns true if we have a complete piece manifest for this file that we can vouch for,
+       which is one we hashed ourselves rather than one received from a friend for a file that has yet to match its hash. */
+    bool getManifest(ftPieceManifest &manifest) const;
+
     /* Overloaded from FileProvider
        This is to be able to send parts of a file that the user is currently downloading.
-       Not currently used, as multi-source downloading is not working yet. */
-    //virtual bool getFileData(uint64_t startingByte, uint32_t &lengthInBytes, void *data);
+       Only serves data that has already been saved, shortening chunk_size if only the start of the request is available.
+       Returns false if the byte at offset has not been saved yet. */
+    virtual bool getFileData(uint64_t offset, uint32_t &chunk_size, void *data, unsigned int librarymixer_id);
+
+protected:
+    /* Overloaded from FileProvider
+       What lies ahead of a request may not be saved yet, and pieces that fail verification are rewritten,
+       so nothing is read ahead or cached, though requests may still be answered from blocks cached from a complete copy elsewhere. */
+    virtual bool blocksCacheable() const {return false;}
+
 private:
-    /* Removes the given set of bytes from the requested chunks. */
-    void removeFromRequestedChunks(uint64_t receivedStartingByte, uint32_t lengthInBytes);
+    /* Called on the ftDiskIO worker to write data queued by addFileData, and then record it as received. */
+    void writeQueuedData(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, const void *data);
+    friend class ftFileWriteJob;
+
+    /* Called on the ftDiskIO worker to verify up to limit pieces for a verification queued by tick,
+       and then the whole file if it is complete but yet to be checked against its hash. */
+    void verifyQueuedPieces(uint32_t limit);
+    friend class ftPieceVerifyJob;
+
+    /* Records data that has been written as received from friend_id, and if that completes the file, verifies it and commits it to disk.
+       Must be called on the ftDiskIO worker from within mutex, held by stack. */
+    void recordWritten(unsigned int friend_id, uint64_t startingByte, uint32_t lengthInBytes, QMutexLocker &stack);
 
-    /* Used internally to write file data when we have data ready to be written.
-       fileWriteAccessor must already be initialized.
+    /* Opens fileWriteAccessor and preallocates the file to its full size if it is not already open.
        Must be called from within mutex.
-       Returns false on file write failure, where data must not be destroyed so it can be tried again. */
-    bool writeFileData(uint64_t startingByte, uint32_t lengthInBytes, void *data);
+       Returns false if the file could not be opened. */
+    bool openForWriting();
+
+    /* Used internally to write file data directly to its final position in the file.
+       fileWriteAccessor must already be open.
+       Called from a disk job without the mutex, which is safe because fileWriteAccessor is only closed or replaced
+       either once no disk jobs are outstanding, or by a disk job, and the jobs for a file are run one at a time.
+       Returns false on file write failure. */
+    bool writeFileData(uint64_t startingByte, uint32_t lengthInBytes, const void *data);
+
+    /* Loads mSaved from the resume journal, or if there is none, from the file on disk assuming it is a contiguous partial file.
+       Must be called from within mutex. */
+    void loadProgress();
+
+    /* Makes everything written so far durable in the resume journal, compacting it if it has grown large.
+       Must be called from within mutex. */
+    void syncProgress();
+
+    /* Adds any pieces overlapping [start, end) that have now been completely saved to mUnverifiedPieces.
+       Must be called from within mutex. */
+    void queueCompletedPieces(uint64_t start, uint64_t end);
+
+    /* Adds every piece that has been completely saved to mUnverifiedPieces, for when there is a new manifest to check them against.
+       Must be called from within mutex. */
+    void queueSavedPieces();
+
+    /* Verifies up to limit pieces from mUnverifiedPieces against the manifest, if we have one.
+       Pieces that fail are removed from mSaved to be requested again, and the friends that sent them are added to mFailedSources.
+       If too many fail in a row and the manifest came from a friend, it is dropped as suspect so that another can be requested from someone else.
+       Must be called on the ftDiskIO worker from within mutex, held by stack, which is released while each piece is read. */
+    void verifyPieces(uint32_t limit, QMutexLocker &stack);
+
+    /* Hashes the complete file and compares it against the hash we are downloading.
+       If it matches, the file is finished, and the piece hashes computed alongside replace the manifest and are cached.
+       Otherwise, the download starts over, along with any manifest from a friend, as there is no way to tell which part is bad.
+       Must be called on the ftDiskIO worker from within mutex, held by stack, which is released while the file is read. */
+    void verifyWholeFile(QMutexLocker &stack);
+
+    /* Reads the given piece from disk into data, returning false on failure.
+       Called from a disk job without the mutex, which is safe for the same reasons as writeFileData. */
+    bool readPiece(uint32_t piece, QByteArray &data);
 
     /* QFile object that we use for writing to file.
        The ftFileProvider simply reads using a temporary file object, since it has no need to hold the file open.
        Initialized only when needed, NULL if this creator has not been used to write data yet. */
     QFile *fileWriteAccessor;
 
-    /* Amount of the file received so far. */
-    uint64_t bytesSaved;
-
-    /* First byte in the file that is unrequested.
-       Alternatively, can be seen as number of bytes of the file that have been requested for so far. */
-    uint64_t firstUnrequestedByte;
-
-    /* This map tracks all of the parts of the file that have been requested so far.
-       When there are no outstanding requests, it will be empty.
-       Keyed by startingBytes in the file, and since this is a map, it will be in order. */
-    class requestedChunk {
-    public:
-        /* Default constructor supplied only so QMap works. */
-        requestedChunk() {}
-
-        requestedChunk(uint64_t istartingByte, uint64_t size, time_t now, unsigned int friend_id)
-            :startingByte(istartingByte), lengthInBytes(size), requestTime(now), friend_requested_from(friend_id) {}
-
-        ~requestedChunk() {}
-
-        uint64_t startingByte;
-        uint64_t lengthInBytes;
-        time_t requestTime;
-
-        /* The friend that we requested send us this chunk.
-           Useful for invalidating chunks when we get disconnected. */
-        unsigned int friend_requested_from;
-    };
-    QMap<uint64_t, requestedChunk> mRequestedChunks;
-    
-    /* This map contains all data we've received in response to our requests that has not yet been written to disk.
-       When there is no out of order data stored in memory, it will generally be empty except for some transient usage.
-       Keyed by startingBytes in the file, and since this is a map, it will be in order. */
-    class receivedChunk {
-    public:
-        receivedChunk() {}
-
-        receivedChunk(uint64_t startingByte, uint64_t size, void* data, unsigned int friend_id)
-            :startingByte(startingByte), lengthInBytes(size), data(data), friend_received_from(friend_id) {}
-
-        ~receivedChunk() {}
-
-        uint64_t startingByte;
-        uint64_t lengthInBytes;
-        void *data;
-
-        /* The friend that we received this chunk from.
-           We currently use this to drop all receivedChunks when we disconnect from that friend.
-           When multi-source is implemented this doesn't necessarily make sense, as another friend could fill in data.
-           However, for now, this is a good idea, because it prevents a disconnected friend from hogging our memory indefinitely. */
-        unsigned int friend_received_from;
-    };
-    QMap<uint64_t, receivedChunk> mReceivedChunks;
+    /* The parts of the file that have been written to disk so far. */
+    ftRangeSet mSaved;
+
+    /* Because the file is preallocated to its full size, the size on disk says nothing about how much of it has been received.
+       Instead, the ranges that have been saved are recorded in a journal alongside the partial file. */
+    ftResumeJournal mJournal;
+
+    /* When the journal was last synced. */
+    time_t lastProgressSync;
+
+    /* Tracks all of the parts of the file that are yet to be requested, and the requests that are outstanding. */
+    ftChunkMap mChunkMap;
+
+    /* The hashes of each piece of the file, which may be partially received or empty if we have yet to get it from a friend. */
+    ftPieceManifest mManifest;
+
+    /* True if mManifest came from the cache or our own hashing, false if it came from a friend and the file has yet to match its hash. */
+    bool manifestTrusted;
+
+    /* The friend who sent mManifest if it isn't trusted. */
+    unsigned int manifestSource;
+
+    /* Friends whose manifests have been dropped as suspect. */
+    std::set<unsigned int> mSuspectManifestSources;
+
+    /* The friends that sent data for each piece that has been saved but not yet verified.
+       Pieces saved in an earlier run have none, as who sent them isn't persisted. */
+    std::map<uint32_t, std::set<unsigned int> > mPieceSources;
+
+    /* Friends that sent data for pieces that failed verification, waiting to be collected by takeFailedSources. */
+    QList<unsigned int> mFailedSources;
+
+    /* True once the complete file has matched its hash. */
+    bool fileVerified;
+
+    /* Pieces that have been completely saved but not yet checked against the manifest.
+       These are not persisted, so on resuming a download, every saved piece is verified again. */
+    std::set<uint32_t> mUnverifiedPieces;
+
+    /* Set while a ftPieceVerifyJob queued by tick is outstanding, so that only one is queued at a time. */
+    bool verifyQueued;
+
+    /* The number of pieces in a row that have failed verification.
+       If every piece fails, the problem may be the manifest rather than the data. */
+    uint32_t consecutiveVerificationFailures;
 };
 
 #endif // FT_FILE_CREATOR_HEADER
@@ -0,0 +1,314 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <ft/ftfilehandlecache.h>
+#include <ft/ftfilewatcher.h>
+#include <interface/settings.h>
+#include <util/dir.h>
+
+#include <QFile>
+#include <QDir>
+
+#include <string.h>
+
+#ifndef WINDOWS_SYS
+#include <setjmp.h>
+#include <signal.h>
+#endif
+
+ftFileHandleCache *fileHandleCache = NULL;
+
+//The number of files kept open, unless overridden by the "Transfers/MaxOpenUploadFiles" setting
+#define DEFAULT_MAX_OPEN_FILES 64
+
+//The size of each memory mapped window, which is a multiple of the page size on all of our platforms
+#define FT_MAP_WINDOW_SIZE (8 * 1024 * 1024)
+//The most windows each file has mapped at once, enough for a few friends to be reading different parts of the same file
+#define FT_MAP_WINDOWS_PER_FILE 2
+//The most windows mapped across all files, which keeps the address space used within what 32-bit builds can spare
+#define FT_MAP_MAX_WINDOWS 32
+//Only files at least this large are mapped, as smaller files are served in a few reads anyway
+#define FT_MAP_MIN_FILE_SIZE (16 * 1024 * 1024)
+//Only files read at least this many times since they were opened are mapped
+#define FT_MAP_MIN_READS 8
+
+#ifndef WINDOWS_SYS
+/* Where a copy from a mapped window on this thread jumps back to if the file is truncated under it, or NULL if no copy is in progress.
+   volatile as otherwise the compiler sees nothing read it during the copy, and drops setting it as a dead store. */
+static __thread sigjmp_buf *volatile mappedCopyJump = NULL;
+/* How SIGBUS was handled before we installed mappedCopyFault, for faults that aren't in one of our copies. */
+static struct sigaction previousBusAction;
+
+static void mappedCopyFault(int /*signal*/, siginfo_t * /*info*/, void * /*context*/) {
+    if (mappedCopyJump != NULL) siglongjmp(*mappedCopyJump, 1);
+
+    /* Not one of ours, so put back the previous handling, which takes over when the faulting access is retried on return. */
+    sigaction(SIGBUS, &previousBusAction, NULL);
+}
+
+/* Copies size bytes from a mapped window into destination.
+   Returns false rather than crashing if the file was truncated under the mapping during the copy. */
+static bool copyFromMapping(void *destination, const uchar *source, uint32_t size) {
+    sigjmp_buf jump;
+    /* The signal mask isn't saved, as that would cost a system call on every copy,
+       which is why mappedCopyFault is installed with SA_NODEFER so SIGBUS is never left blocked after the jump. */
+    if (sigsetjmp(jump, 0) != 0) {
+        mappedCopyJump = NULL;
+        return false;
+    }
+    mappedCopyJump = &jump;
+    memcpy(destination, source, size);
+    mappedCopyJump = NULL;
+    return true;
+}
+#else
+/* Windows refuses to truncate a file while it is mapped, so a copy from a mapping can't fault. */
+static bool copyFromMapping(void *destination, const uchar *source, uint32_t size) {
+    memcpy(destination, source, size);
+    return true;
+}
+#endif
+
+ftFileHandleCache::ftFileHandleCache() :mUseCounter(0), mMappedWindows(0) {
+    QSettings settings(*mainSettings, QSettings::IniFormat);
+    mMaxOpenFiles = settings.value("Transfers/MaxOpenUploadFiles", DEFAULT_MAX_OPEN_FILES).toInt();
+    if (mMaxOpenFiles < 1) mMaxOpenFiles = 1;
+
+#ifndef WINDOWS_SYS
+    struct sigaction busAction;
+    memset(&busAction, 0, sizeof(busAction));
+    busAction.sa_sigaction = mappedCopyFault;
+    busAction.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&busAction.sa_mask);
+    sigaction(SIGBUS, &busAction, &previousBusAction);
+#endif
+
+    /* These are direct connections so that the handle is dropped before any further reads go to the changed file. */
+    connect(fileWatcher, SIGNAL(oldHashInvalidated(QString,qlonglong,uint)), this, SLOT(oldHashInvalidated(QString,qlonglong,uint)), Qt::DirectConnection);
+    connect(fileWatcher, SIGNAL(fileRemoved(QString)), this, SLOT(invalidate(QString)), Qt::DirectConnection);
+}
+
+ftFileHandleCache::~ftFileHandleCache() {
+    QMutexLocker stack(&cacheMutex);
+    foreach (openFile *handle, mOpenFiles.values()) {
+        locked_closeFile(handle);
+    }
+
+#ifndef WINDOWS_SYS
+    sigaction(SIGBUS, &previousBusAction, NULL);
+#endif
+}
+
+bool ftFileHandleCache::readFile(const QString &path, uint64_t offset, uint32_t size, void *data) {
+    openFile *handle = acquire(path);
+    if (handle == NULL) return false;
+
+    bool success = true;
+    char *position = (char *)data;
+    while (size > 0) {
+        mappedWindow *window = acquireWindow(handle, offset);
+        if (window == NULL) {
+            success = DirUtil::readFileAt(*handle->file, offset, size, position);
+            break;
+        }
+
+        uint32_t available = size;
+        if (offset + available > window->start + window->length) available = window->start + window->length - offset;
+        bool copied = copyFromMapping(position, window->data + (offset - window->start), available);
+        releaseWindow(window);
+
+        /* The file was truncated during the copy, so the rest is read normally, which fails cleanly if it is no longer there. */
+        if (!copied) {
+            success = DirUtil::readFileAt(*handle->file, offset, size, position);
+            break;
+        }
+
+        position += available;
+        offset += available;
+        size -= available;
+    }
+
+    /* A failed read may mean the file has changed out from under us, so open it again next time. */
+    if (!success) invalidate(path);
+    release(handle);
+    return success;
+}
+
+void ftFileHandleCache::adviseWillNeed(const QString &path, uint64_t offset, uint64_t length) {
+    openFile *handle = acquire(path);
+    if (handle == NULL) return;
+    DirUtil::adviseWillNeed(*handle->file, offset, length);
+    release(handle);
+}
+
+void ftFileHandleCache::invalidate(QString path) {
+    QMutexLocker stack(&cacheMutex);
+    QString key = QDir::toNativeSeparators(path);
+    if (!mOpenFiles.contains(key)) return;
+
+    openFile *handle = mOpenFiles.take(key);
+    mLeastRecentlyUsed.remove(handle->lastUsed);
+    if (handle->users > 0) handle->invalidated = true;
+    else locked_closeFile(handle);
+}
+
+void ftFileHandleCache::oldHashInvalidated(QString path, qlonglong /*size*/, unsigned int /*modified*/) {
+    invalidate(path);
+}
+
+ftFileHandleCache::openFile *ftFileHandleCache::acquire(const QString &path) {
+    QMutexLocker stack(&cacheMutex);
+    QString key = QDir::toNativeSeparators(path);
+
+    openFile *handle;
+    if (mOpenFiles.contains(key)) {
+        handle = mOpenFiles[key];
+        mLeastRecentlyUsed.remove(handle->lastUsed);
+    } else {
+        /* Reads are always of whole chunks at a given position, so QFile's buffering would only add a copy. */
+        QFile *file = new QFile(path);
+        if (!file->open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+            delete file;
+            return NULL;
+        }
+        handle = new openFile;
+        handle->file = file;
+        handle->users = 0;
+        handle->reads = 0;
+        handle->unmappable = false;
+        handle->mappedSize = 0;
+        handle->invalidated = false;
+        mOpenFiles[key] = handle;
+    }
+
+    handle->users++;
+    handle->reads++;
+    handle->lastUsed = mUseCounter++;
+    mLeastRecentlyUsed[handle->lastUsed] = key;
+
+    locked_closeExcess();
+    return handle;
+}
+
+void ftFileHandleCache::release(openFile *handle) {
+    QMutexLocker stack(&cacheMutex);
+    handle->users--;
+    if (handle->users == 0 && handle->invalidated) locked_closeFile(handle);
+}
+
+ftFileHandleCache::mappedWindow *ftFileHandleCache::acquireWindow(openFile *handle, uint64_t offset) {
+    QMutexLocker stack(&cacheMutex);
+    if (handle->unmappable || handle->reads < FT_MAP_MIN_READS) return NULL;
+
+    /* If the file has changed size since its windows were mapped, they may extend past its end, so they are all unmapped.
+       Until those being read from are released, reads fall back on readFileAt. */
+    uint64_t fileSize = handle->file->size();
+    if (fileSize != handle->mappedSize && !handle->windows.isEmpty()) {
+        foreach (mappedWindow *existing, handle->windows.values()) {
+            if (existing->users > 0) continue;
+            handle->windows.remove(existing->start);
+            handle->file->unmap(existing->data);
+            delete existing;
+            mMappedWindows--;
+        }
+        if (!handle->windows.isEmpty()) return NULL;
+    }
+
+    uint64_t start = offset - (offset % FT_MAP_WINDOW_SIZE);
+    mappedWindow *window = handle->windows.value(start, NULL);
+
+    if (window == NULL) {
+        if (fileSize < FT_MAP_MIN_FILE_SIZE) {
+            handle->unmappable = true;
+            return NULL;
+        }
+        /* If the file has shrunk since the read was requested, let the read fail normally. */
+        if (start >= fileSize) return NULL;
+        uint64_t length = qMin((uint64_t)FT_MAP_WINDOW_SIZE, fileSize - start);
+
+        /* Make room by unmapping this file's least recently used window, unless they are all in use. */
+        if (handle->windows.count() >= FT_MAP_WINDOWS_PER_FILE) {
+            mappedWindow *oldest = NULL;
+            foreach (mappedWindow *existing, handle->windows.values()) {
+                if (existing->users == 0 && (oldest == NULL || existing->lastUsed < oldest->lastUsed)) oldest = existing;
+            }
+            if (oldest == NULL) return NULL;
+            handle->windows.remove(oldest->start);
+            handle->file->unmap(oldest->data);
+            delete oldest;
+            mMappedWindows--;
+        }
+        if (mMappedWindows >= FT_MAP_MAX_WINDOWS) return NULL;
+
+        uchar *data = handle->file->map(start, length);
+        if (data == NULL) {
+            handle->unmappable = true;
+            return NULL;
+        }
+        DirUtil::adviseSequential(data, length);
+
+        window = new mappedWindow;
+        window->start = start;
+        window->length = length;
+        window->data = data;
+        window->users = 0;
+        handle->windows[start] = window;
+        handle->mappedSize = fileSize;
+        mMappedWindows++;
+    }
+
+    /* A request past the end of the file is left to readFileAt to fail. */
+    if (offset >= window->start + window->length) return NULL;
+
+    window->users++;
+    window->lastUsed = mUseCounter++;
+    return window;
+}
+
+void ftFileHandleCache::releaseWindow(mappedWindow *window) {
+    QMutexLocker stack(&cacheMutex);
+    window->users--;
+}
+
+void ftFileHandleCache::locked_closeFile(openFile *handle) {
+    foreach (mappedWindow *window, handle->windows.values()) {
+        handle->file->unmap(window->data);
+        delete window;
+        mMappedWindows--;
+    }
+    delete handle->file;
+    delete handle;
+}
+
+void ftFileHandleCache::locked_closeExcess() {
+    QMap<uint64_t, QString>::iterator it = mLeastRecentlyUsed.begin();
+    while (mOpenFiles.count() > mMaxOpenFiles && it != mLeastRecentlyUsed.end()) {
+        openFile *handle = mOpenFiles[it.value()];
+        if (handle->users > 0) {
+            it++;
+            continue;
+        }
+        mOpenFiles.remove(it.value());
+        it = mLeastRecentlyUsed.erase(it);
+        locked_closeFile(handle);
+    }
+}
@@ -0,0 +1,149 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef FT_FILE_HANDLE_CACHE_HEADER
+#define FT_FILE_HANDLE_CACHE_HEADER
+
+#include <QObject>
+#include <QMutex>
+#include <QHash>
+#include <QMap>
+#include <QString>
+#include <stdint.h>
+
+class QFile;
+
+/*
+ * Keeps files that are being uploaded open between requests, rather than opening and closing them for every chunk sent.
+ * It is shared by all ftFileProviders, so that any number of friends reading the same file share one open handle.
+ *
+ * Reads are done with DirUtil::readFileAt, which reads from a given offset without moving the file position,
+ * so that the cache's mutex is only held to look up the handle, never during the read itself.
+ *
+ * At most the number of files set by "Transfers/MaxOpenUploadFiles" are kept open, closing the least recently used first.
+ * A file in the middle of being read is never closed, so more than that may briefly be open at once if there are that many reads in progress.
+ * When ftFileWatcher reports that a file has changed or been removed, its handle is dropped, so that the next read opens it afresh.
+ *
+ * Files that are both large and being read often are instead read from read-only memory mappings,
+ * which saves a system call for every read, and lets the OS read ahead into the page cache.
+ * Rather than map whole files, which wouldn't fit in the address space of 32-bit builds, each file maps windows of FT_MAP_WINDOW_SIZE,
+ * with only a few windows per file, and a limit on the total mapped across all files, past which reads fall back on readFileAt.
+ * Like the files themselves, each window counts the reads using it, so that a window shared by uploads to several friends
+ * is never unmapped while one of them is still copying from it.
+ * Before a window is mapped, the file is checked to still be long enough to fill it, as reading past the end of a truncated file's mapping is fatal.
+ * For the same reason, the file's size is checked again before each read from an existing window,
+ * and if it has changed, the file's windows are all unmapped and reads fall back on readFileAt until they have been.
+ * That still leaves the file being truncated during a copy, which on Unix raises SIGBUS.
+ * Each copy from a window is guarded by a SIGBUS handler that jumps back out of it, after which the read falls back on readFileAt.
+ */
+
+class ftFileHandleCache;
+extern ftFileHandleCache *fileHandleCache;
+
+class ftFileHandleCache : public QObject {
+    Q_OBJECT
+
+public:
+    ftFileHandleCache();
+    ~ftFileHandleCache();
+
+    /* Reads size bytes starting at offset from the file at path into data, opening it if it isn't already open.
+       Returns false if the file can't be opened or the full size can't be read. */
+    bool readFile(const QString &path, uint64_t offset, uint32_t size, void *data);
+
+    /* Tells the OS that length bytes starting at offset in the file at path will soon be read, opening it if it isn't already open. */
+    void adviseWillNeed(const QString &path, uint64_t offset, uint64_t length);
+
+public slots:
+    /* Closes the file at path, or if it is being read, closes it as soon as it is finished with.
+       Connected to ftFileWatcher's signals for files changing or being removed. */
+    void invalidate(QString path);
+
+private slots:
+    /* Connected to ftFileWatcher's oldHashInvalidated signal. */
+    void oldHashInvalidated(QString path, qlonglong size, unsigned int modified);
+
+private:
+    struct mappedWindow {
+        /* Where in the file the window starts, and the mapping of it. */
+        uint64_t start;
+        uint64_t length;
+        uchar *data;
+        /* The number of reads currently copying from this window. */
+        int users;
+        uint64_t lastUsed;
+    };
+
+    struct openFile {
+        QFile *file;
+        /* The number of reads currently using this file. */
+        int users;
+        /* The number of reads of this file since it was opened, used to decide whether it is read often enough to be worth mapping. */
+        uint32_t reads;
+        /* The file's mapped windows keyed by their start. */
+        QMap<uint64_t, mappedWindow*> windows;
+        /* The size of the file when its windows were mapped. */
+        uint64_t mappedSize;
+        /* True if mapping this file has failed, so that it isn't tried again. */
+        bool unmappable;
+        /* This file's key in mLeastRecentlyUsed. */
+        uint64_t lastUsed;
+        /* True if the file has been invalidated while in use, and so has already been removed from mOpenFiles,
+           and is to be closed as soon as it isn't in use. */
+        bool invalidated;
+    };
+
+    /* Returns the open file for path, opening it if necessary, and marks it as in use.
+       Returns NULL if the file can't be opened. */
+    openFile *acquire(const QString &path);
+
+    /* Marks the file as no longer in use by the read that acquired it. */
+    void release(openFile *handle);
+
+    /* Returns the mapped window of handle's file containing offset, mapping it if necessary, and marks it as in use.
+       Returns NULL if the file isn't worth mapping, if it can't be mapped now, or if offset is past the end of the file as it was mapped. */
+    mappedWindow *acquireWindow(openFile *handle, uint64_t offset);
+
+    /* Marks the window as no longer in use by the read that acquired it. */
+    void releaseWindow(mappedWindow *window);
+
+    /* Unmaps all of handle's windows and closes and frees it. */
+    void locked_closeFile(openFile *handle);
+
+    /* Closes the least recently used files that aren't in use until we are within the limit on open files. */
+    void locked_closeExcess();
+
+    mutable QMutex cacheMutex;
+
+    /* All currently open files, keyed by their path with native directory separators. */
+    QHash<QString, openFile*> mOpenFiles;
+
+    /* The paths of the open files, ordered from least to most recently used. */
+    QMap<uint64_t, QString> mLeastRecentlyUsed;
+    uint64_t mUseCounter;
+
+    /* The number of windows mapped across all files. */
+    int mMappedWindows;
+    int mMaxOpenFiles;
+};
+
+#endif //FT_FILE_HANDLE_CACHE_HEADER
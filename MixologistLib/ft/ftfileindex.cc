@@ -0,0 +1,105 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <ft/ftfileindex.h>
+
+ftFileIndex *fileIndex = NULL;
+
+ftFileIndex::ftFileIndex() :mGeneration(0), mLoading(0) {}
+
+void ftFileIndex::addFile(ftFileMethod *method, const QString &hash, qlonglong size, const QString &path) {
+    if (hash.isEmpty()) return;
+
+    QWriteLocker stack(&indexLock);
+    QList<indexEntry> &entries = mFiles[hash];
+    foreach (const indexEntry &entry, entries) {
+        if (entry.method == method && entry.size == size && entry.path == path) return;
+    }
+
+    indexEntry entry;
+    entry.method = method;
+    entry.size = size;
+    entry.path = path;
+    entries.append(entry);
+    mGeneration++;
+}
+
+void ftFileIndex::removeFile(ftFileMethod *method, const QString &hash, qlonglong size, const QString &path) {
+    if (hash.isEmpty()) return;
+
+    QWriteLocker stack(&indexLock);
+    QHash<QString, QList<indexEntry> >::iterator it = mFiles.find(hash);
+    if (it == mFiles.end()) return;
+
+    for (int i = 0; i < it.value().count(); i++) {
+        const indexEntry &entry = it.value()[i];
+        if (entry.method == method && entry.size == size && entry.path == path) {
+            it.value().removeAt(i);
+            break;
+        }
+    }
+    if (it.value().isEmpty()) mFiles.erase(it);
+}
+
+QList<ftFileMethod*> ftFileIndex::findMethods(const QString &hash, qlonglong size) const {
+    QList<ftFileMethod*> methods;
+
+    QReadLocker stack(&indexLock);
+    QHash<QString, QList<indexEntry> >::const_iterator it = mFiles.find(hash);
+    if (it == mFiles.end()) return methods;
+
+    foreach (const indexEntry &entry, it.value()) {
+        if (entry.size == size && !methods.contains(entry.method)) methods.append(entry.method);
+    }
+    return methods;
+}
+
+bool ftFileIndex::contains(const QString &hash, qlonglong size) const {
+    QReadLocker stack(&indexLock);
+    QHash<QString, QList<indexEntry> >::const_iterator it = mFiles.find(hash);
+    if (it == mFiles.end()) return false;
+
+    foreach (const indexEntry &entry, it.value()) {
+        if (entry.size == size) return true;
+    }
+    return false;
+}
+
+uint64_t ftFileIndex::generation() const {
+    QReadLocker stack(&indexLock);
+    return mGeneration;
+}
+
+void ftFileIndex::beginLoading() {
+    QWriteLocker stack(&indexLock);
+    mLoading++;
+}
+
+void ftFileIndex::finishLoading() {
+    QWriteLocker stack(&indexLock);
+    if (mLoading > 0) mLoading--;
+}
+
+bool ftFileIndex::populated() const {
+    QReadLocker stack(&indexLock);
+    return mLoading == 0;
+}
@@ -0,0 +1,98 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef FT_FILE_INDEX_HEADER
+#define FT_FILE_INDEX_HEADER
+
+#include <QReadWriteLock>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <stdint.h>
+
+class ftFileMethod;
+
+/*
+ * An index of every file that any of the ftFileMethods may share, so that ftDataDemultiplex can find which of them to ask for a file
+ * without each of them searching through everything they share.
+ *
+ * Each ftFileMethod adds its files as it learns their hashes, and removes them as they are removed or their hashes change.
+ * The index only narrows down which methods to ask, and each method still decides whether and with whom it shares the file,
+ * so an entry left behind for a file that is no longer shared does no harm beyond the method being asked for it.
+ * However, a file missing from the index will never be found, so every file a method may share must be added.
+ *
+ * Because every shared file is in the index, a file that isn't in it is certainly not shared,
+ * and the generation lets those who remember such misses know when a file has since been added.
+ * That only holds once every method has finished loading what it shares at startup, which populated() tells,
+ * so until then a miss only means the file may not have been added yet.
+ *
+ * Lookups only take a read lock, so they never wait on each other.
+ */
+
+class ftFileIndex;
+extern ftFileIndex *fileIndex;
+
+class ftFileIndex {
+public:
+    ftFileIndex();
+
+    /* Records that method may share the file at path with this hash and size. Does nothing if hash is empty. */
+    void addFile(ftFileMethod *method, const QString &hash, qlonglong size, const QString &path);
+
+    /* Removes the record added by addFile for the file at path with this hash and size, if any. */
+    void removeFile(ftFileMethod *method, const QString &hash, qlonglong size, const QString &path);
+
+    /* Returns the methods that may share a file with this hash and size. */
+    QList<ftFileMethod*> findMethods(const QString &hash, qlonglong size) const;
+
+    /* Returns true if any method may share a file with this hash and size. */
+    bool contains(const QString &hash, qlonglong size) const;
+
+    /* Returns a number that is increased every time a file is added. */
+    uint64_t generation() const;
+
+    /* Called by each method before it starts adding the files it shares at startup, and again once it has added them all. */
+    void beginLoading();
+    void finishLoading();
+
+    /* Returns true if no method is still loading its files, so that a file missing from the index is really not shared. */
+    bool populated() const;
+
+private:
+    struct indexEntry {
+        ftFileMethod *method;
+        qlonglong size;
+        QString path;
+    };
+
+    mutable QReadWriteLock indexLock;
+
+    /* Keyed by hash. */
+    QHash<QString, QList<indexEntry> > mFiles;
+
+    uint64_t mGeneration;
+
+    /* The number of methods that have begun loading their files but not yet finished. */
+    int mLoading;
+};
+
+#endif //FT_FILE_INDEX_HEADER
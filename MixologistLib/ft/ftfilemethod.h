@@ -23,7 +23,8 @@
 #ifndef FT_SEARCH_HEADER
 #define FT_SEARCH_HEADER
 
-/* This is the interface implemented by all classes that will be making files available. */
+/* This is the interface implemented by all classes that will be making files available.
+   Each must also add the files it makes available to the fileIndex, as only methods that the index lists for a file are searched for it. */
 
 #include "interface/files.h" // includes interface/types.h too!
 #include "ft/ftfilewatcher.h"
@@ -21,21 +21,33 @@
  ****************************************************************/
 
 #include "ftfileprovider.h"
+#include "ftfilehandlecache.h"
+#include "ftreadahead.h"
+#include "ftblockcache.h"
 
 #include "util/debug.h"
 #include <util/dir.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <interface/peers.h>
 #include <time.h>
 
 #include <QFile>
 
+//The number of consecutive requests from a friend before we start reading ahead of them
+#define READ_AHEAD_MIN_SEQUENTIAL 2
+//How many requests' worth to read ahead of a friend's latest request
+#define READ_AHEAD_REQUESTS 4
+//The most to read ahead of a friend's latest request, however large their requests are
+#define READ_AHEAD_MAX_BYTES (8 * 1024 * 1024)
+
 ftFileProvider::ftFileProvider(QString _path, uint64_t size, QString hash)
-    :fullFileSize(size), hash(hash), path(_path), internalMixologistFile(false) {}
+    :pendingDiskJobs(0), fullFileSize(size), hash(hash), path(_path), internalMixologistFile(false) {}
 
 ftFileProvider::~ftFileProvider() {
-    closeFile();
+    QMutexLocker stack(&ftcMutex);
+    locked_waitForDiskJobs();
 }
 
 bool ftFileProvider::checkFileValid() {
@@ -87,20 +99,29 @@ uint64_t ftFileProvider::getFileSize() const {
 
 bool ftFileProvider::getFileData(uint64_t offset, uint32_t &chunk_size, void *data, unsigned int librarymixer_id) {
 
-    QMutexLocker stack(&ftcMutex);
-
-    QFile fileToRead(path);
-    if (!fileToRead.open(QIODevice::ReadOnly)) return false;
-
     uint32_t requestSize = chunk_size;
     uint64_t baseFileOffset = offset;
-
-    if (baseFileOffset + requestSize > fullFileSize) {
-        requestSize = fullFileSize - baseFileOffset;
-        chunk_size = fullFileSize - baseFileOffset;
-        log(LOG_DEBUG_BASIC, FTFILEPROVIDERZONE,
-            "ftFileProvider::getFileData() Chunk Size greater than total file size, adjusting chunk size " +
-            QString::number(requestSize));
+    QString pathToRead;
+    QString hashToRead;
+    uint64_t fileSize;
+    bool sharedRead;
+
+    {
+        QMutexLocker stack(&ftcMutex);
+        pathToRead = path;
+        hashToRead = hash;
+        fileSize = fullFileSize;
+        sharedRead = blocksCacheable() &&
+                     (requestingFriends.count() > 1 || (requestingFriends.count() == 1 && !requestingFriends.contains(librarymixer_id)));
+
+        if (baseFileOffset >= fullFileSize) requestSize = 0;
+        else if (baseFileOffset + requestSize > fullFileSize) {
+            requestSize = fullFileSize - baseFileOffset;
+            chunk_size = fullFileSize - baseFileOffset;
+            log(LOG_DEBUG_BASIC, FTFILEPROVIDERZONE,
+                "ftFileProvider::getFileData() Chunk Size greater than total file size, adjusting chunk size " +
+                QString::number(requestSize));
+        }
     }
 
     if (requestSize <= 0) {
@@ -108,9 +129,17 @@ bool ftFileProvider::getFileData(uint64_t offset, uint32_t &chunk_size, void *da
         return false;
     }
 
-    fileToRead.seek(baseFileOffset);
+    /* The read is done without holding the mutex, so that friends reading the same file don't wait on each other's disk reads.
+       As much as is cached is taken from memory, and only the rest is read from disk.
+       If other friends are downloading the same file, the rest is read in whole blocks and cached for them. */
+    uint32_t cached = blockCache->read(hashToRead, baseFileOffset, requestSize, data);
+    if (cached < requestSize) {
+        if (sharedRead) {
+            if (!readBlocks(hashToRead, pathToRead, fileSize, baseFileOffset + cached, requestSize - cached, (char *)data + cached)) return false;
+        } else if (!fileHandleCache->readFile(pathToRead, baseFileOffset + cached, requestSize - cached, (char *)data + cached)) return false;
+    }
 
-    if (fileToRead.read((char *)data, requestSize) == -1) return false;
+    QMutexLocker stack(&ftcMutex);
 
     /* Update stats. */
     time_t currentTime = time(NULL);
@@ -130,11 +159,53 @@ bool ftFileProvider::getFileData(uint64_t offset, uint32_t &chunk_size, void *da
         }
     }
 
+    /* Once a friend is seen to be reading the file in order, read ahead of them. */
+    uint64_t prefetchStart = 0;
+    uint64_t prefetchEnd = 0;
+    if (blocksCacheable()) {
+        requestors &requestor = requestingFriends[librarymixer_id];
+        if (baseFileOffset == requestor.lastRequestedEnd) requestor.sequentialRequests++;
+        else {
+            requestor.sequentialRequests = 0;
+            requestor.prefetchedEnd = 0;
+        }
+
+        if (requestor.sequentialRequests >= READ_AHEAD_MIN_SEQUENTIAL) {
+            uint64_t requestEnd = baseFileOffset + requestSize;
+            prefetchStart = qMax(requestor.prefetchedEnd, requestEnd);
+            prefetchEnd = requestEnd + qMin((uint64_t)requestSize * READ_AHEAD_REQUESTS, (uint64_t)READ_AHEAD_MAX_BYTES);
+            if (prefetchEnd > requestor.prefetchedEnd) requestor.prefetchedEnd = prefetchEnd;
+        }
+    }
+
     requestingFriends[librarymixer_id].lastRequestedEnd = baseFileOffset + requestSize;
     requestingFriends[librarymixer_id].lastRequestTime = currentTime;
     requestingFriends[librarymixer_id].transferredSinceLastCalc += requestSize;
     requestingFriends[librarymixer_id].transferred += requestSize;
 
+    stack.unlock();
+    if (prefetchEnd > prefetchStart) readAhead->prefetch(hashToRead, pathToRead, fileSize, prefetchStart, prefetchEnd);
+
+    return true;
+}
+
+bool ftFileProvider::readBlocks(const QString &hashToRead, const QString &pathToRead, uint64_t fileSize,
+                                uint64_t offset, uint32_t size, char *data) {
+    uint64_t generation = blockCache->generation();
+    while (size > 0) {
+        uint64_t blockStart = offset - (offset % FT_BLOCK_SIZE);
+        QByteArray block;
+        block.resize(qMin((uint64_t)FT_BLOCK_SIZE, fileSize - blockStart));
+        if (!fileHandleCache->readFile(pathToRead, blockStart, block.size(), block.data())) return false;
+        blockCache->insertBlock(hashToRead, pathToRead, blockStart, block, generation, false);
+
+        uint32_t available = block.size() - (offset - blockStart);
+        if (available > size) available = size;
+        memcpy(data, block.constData() + (offset - blockStart), available);
+        data += available;
+        offset += available;
+        size -= available;
+    }
     return true;
 }
 
@@ -153,3 +224,24 @@ bool ftFileProvider::isPermittedRequestor(unsigned int librarymixer_id) {
     if (permittedRequestors.isEmpty()) return true;
     return permittedRequestors.contains(librarymixer_id);
 }
+
+void ftFileProvider::beginDiskJob() {
+    QMutexLocker stack(&ftcMutex);
+    pendingDiskJobs++;
+}
+
+void ftFileProvider::endDiskJob() {
+    QMutexLocker stack(&ftcMutex);
+    locked_endDiskJob();
+}
+
+void ftFileProvider::locked_endDiskJob() {
+    pendingDiskJobs--;
+    if (pendingDiskJobs == 0) diskJobsFinished.wakeAll();
+}
+
+void ftFileProvider::locked_waitForDiskJobs() {
+    while (pendingDiskJobs > 0) {
+        diskJobsFinished.wait(&ftcMutex);
+    }
+}
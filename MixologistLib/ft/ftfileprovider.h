@@ -28,6 +28,7 @@
 #include "interface/files.h"
 #include <QFile>
 #include <QMutex>
+#include <QWaitCondition>
 
 /*
  * ftFileProvider represents a single file that is being read from by a single user.
@@ -79,9 +80,25 @@ public:
        If this is not a security limited file, will return true for any ID. */
     bool isPermittedRequestor(unsigned int librarymixer_id);
 
+    /* Called when a job that uses this file is submitted to the ftDiskIO, and by the job when it is finished with it.
+       This won't be deleted until all of its jobs are finished. */
+    void beginDiskJob();
+    void endDiskJob();
+
 protected:
     mutable QMutex ftcMutex;
 
+    /* Waits until all jobs submitted to the ftDiskIO for this file are finished.
+       Must be called from within mutex, which is released while waiting. */
+    void locked_waitForDiskJobs();
+
+    /* Must be called from within mutex. */
+    void locked_endDiskJob();
+
+    /* The number of jobs submitted to the ftDiskIO for this file that have yet to finish, and signalled whenever that reaches 0. */
+    uint32_t pendingDiskJobs;
+    QWaitCondition diskJobsFinished;
+
     /* Total file size of the file. */
     uint64_t fullFileSize;
     /* Hash of the file. */
@@ -112,8 +129,22 @@ protected:
 
         /* The amount that has been sent to this friend. */
         uint64_t transferred;
+
+        /* The number of requests in a row that followed on from the previous, once enough of which are seen, the file is read ahead. */
+        uint32_t sequentialRequests;
+
+        /* How far ahead of the friend's requests we have already asked for the file to be read. */
+        uint64_t prefetchedEnd;
     };
     QHash<unsigned int, struct requestors> requestingFriends;    
+
+    /* True if this file may be read ahead of requests for it, and its blocks added to the ftBlockCache. */
+    virtual bool blocksCacheable() const {return true;}
+
+    /* Reads size bytes starting at offset into data by reading the whole blocks containing them, and adds those blocks to the ftBlockCache.
+       Used for files that several friends are downloading, so that each block only has to be read from disk once.
+       Returns false on any failure to read. */
+    static bool readBlocks(const QString &hashToRead, const QString &pathToRead, uint64_t fileSize, uint64_t offset, uint32_t size, char *data);
 };
 
 #endif // FT_FILE_PROVIDER_HEADER
@@ -23,6 +23,7 @@
 #include <time.h>
 #include <ft/ftfilewatcher.h>
 #include <ft/ftserver.h>
+#include <ft/ftpiecemanifest.h>
 #include <interface/notify.h>
 #include <util/dir.h>
 #include <QFileInfo>
@@ -118,13 +119,19 @@ QString ftFileWatcher::performHash(const QString &path) {
     notifyBase->notifyHashingInfo(path);
 
     QString hash("");
-    bool success = DirUtil::getFileHash(path, hash);
+    QByteArray pieceHashes;
+    bool success = DirUtil::getFileHash(path, hash, FT_PIECE_SIZE, pieceHashes);
 
     notifyBase->notifyHashingInfo("");
 
     /* Send result to receipient*/
     if (success) {
         QFileInfo targetFile(path);
+
+        /* Cache the piece hashes so that friends downloading this file can verify it piece by piece. */
+        ftPieceManifest manifest(targetFile.size());
+        if (manifest.setPieceHashes(pieceHashes)) manifest.save(hash);
+
         emit newFileHash(QDir::toNativeSeparators(path), targetFile.size(), targetFile.lastModified().toTime_t(), hash);
     }
 
@@ -98,6 +98,7 @@ private slots:
 
 private:
     /* Hashes the given path, which may be supplied with either native or QT directory separators.
+       Also caches the file's piece manifest computed in the same pass.
        Updating the GUI as to its progress, and notifies ftserver on successful completion.
        Returns the hash, or an empty string on failure. */
     QString performHash(const QString &path);
@@ -24,6 +24,7 @@
 #include <ft/ftfilewatcher.h>
 #include <ft/ftofflmlist.h>
 #include <ft/fttransfermodule.h>
+#include <ft/ftfileindex.h>
 #include <pqi/friendsConnectivityManager.h>
 #include <services/statusservice.h>
 #include <util/xml.h>
@@ -53,6 +54,7 @@ ftOffLMList::ftOffLMList() {
     connect(friendsConnectivityManager, SIGNAL(friendConnected(uint)), this, SLOT(friendDisconnected(uint)));
 
     /* Load the XML files that store the shares for both self and friends. */
+    fileIndex->beginLoading();
     if (DirUtil::checkCreateDirectory(Init::getUserDirectory(true) + OFF_LM_DIR)) {
         /* Load own XML */
         QDomElement rootNode;
@@ -64,6 +66,7 @@ ftOffLMList::ftOffLMList() {
             connect(rootItem, SIGNAL(itemChanged(OffLMShareItem*)), this, SIGNAL(offLMOwnItemChanged(OffLMShareItem*)));
             connect(rootItem, SIGNAL(itemAboutToBeRemoved(OffLMShareItem*)), this, SIGNAL(offLMOwnItemAboutToBeRemoved(OffLMShareItem*)), Qt::DirectConnection);
             connect(rootItem, SIGNAL(itemRemoved()), this, SIGNAL(offLMOwnItemRemoved()));
+            indexFiles(rootItem);
         }
 
         if (QFileInfo(ownSanitizedXmlFile()).exists()) {
@@ -72,6 +75,7 @@ ftOffLMList::ftOffLMList() {
                status update gets sent out to friends with bad information. */
             DirUtil::getFileHash(ownSanitizedXmlFile(), sanitizedXmlHash);
             sanitizedXmlSize = QFileInfo(ownSanitizedXmlFile()).size();
+            fileIndex->addFile(this, sanitizedXmlHash, sanitizedXmlSize, ownSanitizedXmlFile());
         } else {
             sanitizedXmlHash = "";
             sanitizedXmlSize = 0;
@@ -95,6 +99,8 @@ ftOffLMList::ftOffLMList() {
     offLMHelper = new OffLMHelper(this);
     offLMHelper->moveToThread(offLMHelperThread);
     offLMHelperThread->start();
+
+    fileIndex->finishLoading();
 }
 
 void ftOffLMList::tick() {
@@ -190,11 +196,11 @@ void ftOffLMList::receiveFriendOffLMXmlInfo(unsigned int friend_id, const QStrin
     friendsXmlDownloads[friend_id] = newXmlDownload;
 }
 
-bool ftOffLMList::handleReceiveData(unsigned int friend_id, const QString &hash, uint64_t offset, uint32_t chunksize, void *data) {
+bool ftOffLMList::handleReceiveData(unsigned int friend_id, const QString &hash, uint64_t offset, uint32_t chunksize, const QByteArray &dataBuffer, const void *data) {
     QMutexLocker stack(&offLmMutex);
     if (friendsXmlDownloads.contains(friend_id) &&
         friendsXmlDownloads[friend_id]->mFileCreator->getHash() == hash) {
-        friendsXmlDownloads[friend_id]->recvFileData(friend_id, offset, chunksize, data);
+        friendsXmlDownloads[friend_id]->recvFileData(friend_id, offset, chunksize, dataBuffer, data);
         return true;
     }
     return false;
@@ -306,6 +312,15 @@ ftFileMethod::searchResult ftOffLMList::recursiveSearch(const QString &hash, qlo
     return ftFileMethod::SEARCH_RESULT_NOT_FOUND;
 }
 
+void ftOffLMList::indexFiles(OffLMShareItem *current) {
+    if (current->isFile()) fileIndex->addFile(this, current->hash(), current->size(), current->fullPath());
+    else if (current->isRootItem() || current->isFolder()) {
+        for (int i = 0; i < current->childCount(); i++) {
+            indexFiles(current->child(i));
+        }
+    }
+}
+
 void ftOffLMList::friendConnected(unsigned int friend_id) {
     QMutexLocker stack(&offLmMutex);
 
@@ -329,8 +344,10 @@ void ftOffLMList::newFileHash(QString path, qlonglong size, unsigned int modifie
     if (path == ownSanitizedXmlFile()) {
         QMutexLocker stack(&offLmMutex);
         emit fileNoLongerAvailable(sanitizedXmlHash, sanitizedXmlSize);
+        fileIndex->removeFile(this, sanitizedXmlHash, sanitizedXmlSize, path);
         sanitizedXmlHash = newHash;
         sanitizedXmlSize = size;
+        fileIndex->addFile(this, sanitizedXmlHash, sanitizedXmlSize, path);
         /* If we just updated our sanitizedXml, and we don't have any other files that are pending information,
            send an immediate status update to friends. */
         if (rootItem->allFilesHashed()) statusService->sendStatusUpdateToAll();
@@ -374,11 +391,10 @@ QString ftOffLMList::friendXmlFile(unsigned int friend_id, QString xmlHash) cons
 }
 
 void ftOffLMList::removeFriendDownload(unsigned int friend_id) {
-    QFile partialDownload(friendsXmlDownloads[friend_id]->mFileCreator->getPath());
+    //This will remove the file if it exists, or do nothing if it doesn't
+    friendsXmlDownloads[friend_id]->mFileCreator->deleteFileFromDisk();
     delete friendsXmlDownloads[friend_id];
     friendsXmlDownloads.remove(friend_id);
-    //This will remove the file if it exists, or do nothing if it doesn't
-    partialDownload.remove();
 }
 
 /**********************************************************************************
@@ -481,7 +497,9 @@ void OffLMHelper::updateOwnFileHash(QString path, qlonglong size, unsigned int m
     if (!matches.isEmpty()) {
         foreach(OffLMShareItem* match, matches) {
             if (match->isFile()) {
+                fileIndex->removeFile(list, match->hash(), match->size(), match->fullPath());
                 match->setFileInfo(size, modified, newHash);
+                fileIndex->addFile(list, newHash, size, match->fullPath());
             }
         }
         requestSaveOwnXml();
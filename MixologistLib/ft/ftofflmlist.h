@@ -72,7 +72,7 @@ public:
     void receiveFriendOffLMXmlInfo(unsigned int friend_id, const QString &hash, qlonglong size);
 
     /* Called from ftDataDemultiplex through ftController when we receive new data to pass it to the appropriate transferModule. */
-    bool handleReceiveData(unsigned int friend_id, const QString &hash, uint64_t offset, uint32_t chunksize, void *data);
+    bool handleReceiveData(unsigned int friend_id, const QString &hash, uint64_t offset, uint32_t chunksize, const QByteArray &dataBuffer, const void *data);
 
     /* Sets the given item that is currently set to lend to lent to friend with friend_id
        and deletes all files that it matches. */
@@ -172,6 +172,9 @@ private:
     /* Used by search to recurse down through the tree. */
     ftFileMethod::searchResult recursiveSearch(const QString &hash, qlonglong size, QString &path, OffLMShareItem* current) const;
 
+    /* Adds all of the hashed files in current and below it to the fileIndex. */
+    void indexFiles(OffLMShareItem* current);
+
     /* Convenience method to return the path to user's own Xml file with native directory separators. */
     QString ownXmlFile() const;
 
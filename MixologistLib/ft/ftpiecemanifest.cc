@@ -0,0 +1,154 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <ft/ftpiecemanifest.h>
+#include <util/dir.h>
+#include <interface/init.h>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+
+/* Identifies a cached manifest, followed by the version of its format. */
+#define MANIFEST_MAGIC 0x4d58504d
+#define MANIFEST_VERSION 1
+
+#define MANIFEST_DIR "manifests/"
+
+ftPieceManifest::ftPieceManifest(uint64_t fileSize)
+    :mFileSize(fileSize), mComplete(false) {}
+
+uint32_t ftPieceManifest::pieceCount(uint64_t fileSize) {
+    return (fileSize + FT_PIECE_SIZE - 1) / FT_PIECE_SIZE;
+}
+
+uint64_t ftPieceManifest::pieceStart(uint32_t piece) const {
+    return (uint64_t) piece * FT_PIECE_SIZE;
+}
+
+uint64_t ftPieceManifest::pieceEnd(uint32_t piece) const {
+    uint64_t end = pieceStart(piece) + FT_PIECE_SIZE;
+    if (end > mFileSize) return mFileSize;
+    return end;
+}
+
+void ftPieceManifest::clear() {
+    mRoot.clear();
+    mPieceHashes.clear();
+    mComplete = false;
+}
+
+bool ftPieceManifest::setPieceHashes(const QByteArray &pieceHashes) {
+    if ((uint32_t) pieceHashes.size() != pieceCount() * FT_PIECE_HASH_SIZE) return false;
+
+    mPieceHashes = pieceHashes;
+    mRoot = QCryptographicHash::hash(mPieceHashes, QCryptographicHash::Md5);
+    mComplete = true;
+    return true;
+}
+
+QByteArray ftPieceManifest::pieceHashes(uint32_t firstPiece, uint32_t count) const {
+    return mPieceHashes.mid(firstPiece * FT_PIECE_HASH_SIZE, count * FT_PIECE_HASH_SIZE);
+}
+
+bool ftPieceManifest::addPieceHashes(uint32_t totalPieces, uint32_t firstPiece, const QByteArray &root, const QByteArray &pieceHashes) {
+    if (mComplete) return false;
+    if (totalPieces != pieceCount() || root.size() != FT_PIECE_HASH_SIZE) return false;
+    if (pieceHashes.isEmpty() || pieceHashes.size() % FT_PIECE_HASH_SIZE != 0) return false;
+
+    /* A different root means a different manifest, which can only be taken up from its beginning. */
+    if (mRoot != root) {
+        if (firstPiece != 0) return false;
+        mRoot = root;
+        mPieceHashes.clear();
+    }
+
+    if (firstPiece != receivedPieces()) return false;
+    if (firstPiece + pieceHashes.size() / FT_PIECE_HASH_SIZE > totalPieces) return false;
+
+    mPieceHashes.append(pieceHashes);
+
+    if (receivedPieces() == totalPieces) {
+        if (QCryptographicHash::hash(mPieceHashes, QCryptographicHash::Md5) != mRoot) {
+            clear();
+            return false;
+        }
+        mComplete = true;
+    }
+
+    return true;
+}
+
+bool ftPieceManifest::verifyPiece(uint32_t piece, const QByteArray &data) const {
+    if (!mComplete || piece >= pieceCount()) return false;
+    if ((uint64_t) data.size() != pieceEnd(piece) - pieceStart(piece)) return false;
+
+    return QCryptographicHash::hash(data, QCryptographicHash::Md5) == pieceHashes(piece, 1);
+}
+
+bool ftPieceManifest::save(const QString &hash) const {
+    if (!mComplete) return false;
+    if (!DirUtil::checkCreateDirectory(Init::getUserDirectory(true) + MANIFEST_DIR)) return false;
+
+    /* Write to the side and swap in so a crash never leaves a truncated manifest in the cache. */
+    QString path = cachePath(hash, mFileSize);
+    QFile file(path + ".new");
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+
+    QDataStream out(&file);
+    out << (quint32) MANIFEST_MAGIC << (quint32) MANIFEST_VERSION << (quint64) mFileSize << mRoot << mPieceHashes;
+    bool success = (out.status() == QDataStream::Ok);
+    file.close();
+
+    if (success) success = DirUtil::replaceFile(path + ".new", path);
+    if (!success) QFile::remove(path + ".new");
+    return success;
+}
+
+bool ftPieceManifest::load(const QString &hash, uint64_t fileSize) {
+    mFileSize = fileSize;
+    clear();
+
+    QFile file(cachePath(hash, fileSize));
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream in(&file);
+    quint32 magic, version;
+    quint64 savedSize;
+    QByteArray root, pieceHashes;
+    in >> magic >> version >> savedSize >> root >> pieceHashes;
+    file.close();
+
+    if (in.status() != QDataStream::Ok) return false;
+    if (magic != MANIFEST_MAGIC || version != MANIFEST_VERSION || savedSize != fileSize) return false;
+
+    /* Recomputing the root from the leaves makes sure nothing was corrupted on disk. */
+    if (!setPieceHashes(pieceHashes) || mRoot != root) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+QString ftPieceManifest::cachePath(const QString &hash, uint64_t fileSize) {
+    return Init::getUserDirectory(true) + MANIFEST_DIR + hash + "-" + QString::number(fileSize);
+}
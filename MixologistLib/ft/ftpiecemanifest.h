@@ -0,0 +1,107 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef FT_PIECE_MANIFEST_HEADER
+#define FT_PIECE_MANIFEST_HEADER
+
+#include <stdint.h>
+#include <QByteArray>
+#include <QString>
+
+/* Size of the pieces a file is divided into for verification. The last piece of a file may be shorter. */
+const uint32_t FT_PIECE_SIZE = 1024 * 1024;
+
+/* Each piece hash is an MD5. */
+const int FT_PIECE_HASH_SIZE = 16;
+
+/*
+ * A two level hash tree for a file, the leaves of which are the hashes of each FT_PIECE_SIZE piece of the file,
+ * and the root of which is the hash of all the leaves concatenated.
+ *
+ * The sharer computes this alongside the whole file hash and caches it on disk keyed by that hash.
+ * A downloader fetches it in pages before or while downloading, and can then verify each piece as it arrives,
+ * so a corrupt piece only costs that piece rather than the whole file.
+ * Pages are only accepted as part of the same manifest if they carry the same root,
+ * and the manifest is only complete once the leaves that have arrived actually hash to that root.
+ */
+class ftPieceManifest {
+public:
+    ftPieceManifest(uint64_t fileSize = 0);
+
+    /* Returns the number of pieces a file of that size is divided into. */
+    static uint32_t pieceCount(uint64_t fileSize);
+
+    uint64_t fileSize() const {return mFileSize;}
+    uint32_t pieceCount() const {return pieceCount(mFileSize);}
+
+    /* The range in the file [pieceStart, pieceEnd) covered by the given piece. */
+    uint64_t pieceStart(uint32_t piece) const;
+    uint64_t pieceEnd(uint32_t piece) const;
+
+    /* Returns the piece that contains the given byte of the file. */
+    static uint32_t pieceAt(uint64_t offset) {return offset / FT_PIECE_SIZE;}
+
+    /* Empties the manifest, leaving the file size. */
+    void clear();
+
+    /* Sets the leaves all at once, for when the manifest has been computed locally.
+       Returns false if there isn't exactly one hash per piece. */
+    bool setPieceHashes(const QByteArray &pieceHashes);
+
+    /* True once there is a hash for every piece and they match the root. */
+    bool isComplete() const {return mComplete;}
+
+    /* Returns the root hash. Empty if no part of the manifest is known yet. */
+    QByteArray root() const {return mRoot;}
+
+    /* Returns the concatenated hashes of up to count pieces starting from firstPiece. */
+    QByteArray pieceHashes(uint32_t firstPiece, uint32_t count) const;
+
+    /* The number of leaves that have been received so far, which is also the first piece of the next page to request. */
+    uint32_t receivedPieces() const {return mPieceHashes.size() / FT_PIECE_HASH_SIZE;}
+
+    /* Adds a page of leaves received from a friend.
+       If root differs from the root of the pages received so far, and this is the first page, the earlier pages are discarded in favor of this one.
+       Pages that don't continue on from what has been received so far are ignored.
+       Returns true if the page was added. If this was the last page but the leaves don't match the root, all pages are discarded and false is returned. */
+    bool addPieceHashes(uint32_t totalPieces, uint32_t firstPiece, const QByteArray &root, const QByteArray &pieceHashes);
+
+    /* Returns true if the data, which must be the whole of the given piece, matches its hash. */
+    bool verifyPiece(uint32_t piece, const QByteArray &data) const;
+
+    /* Saves a complete manifest to the cache, keyed by the file's hash and size. */
+    bool save(const QString &hash) const;
+
+    /* Loads a complete manifest from the cache, returning false if there isn't a valid one. */
+    bool load(const QString &hash, uint64_t fileSize);
+
+private:
+    /* Returns the path in the cache for the manifest of the given file. */
+    static QString cachePath(const QString &hash, uint64_t fileSize);
+
+    uint64_t mFileSize;
+    QByteArray mRoot;
+    QByteArray mPieceHashes;
+    bool mComplete;
+};
+
+#endif // FT_PIECE_MANIFEST_HEADER
@@ -0,0 +1,346 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <ft/ftratecontroller.h>
+#include <interface/settings.h>
+#include <util/debug.h>
+
+ftRateController *ftRateController::create() {
+    QSettings settings(*mainSettings, QSettings::IniFormat);
+    if (settings.value("Transfers/RateController", RATE_CONTROLLER_DELIVERY_RATE).toString() == RATE_CONTROLLER_ROUND_TRIP)
+        return new ftRoundTripRateController();
+    return new ftDeliveryRateController();
+}
+
+/**********************************************************************************
+ * ftRoundTripRateController
+ **********************************************************************************/
+
+//Start by requesting chunks of 25k. In practice this works out to a little over 5KB/s
+const double FT_RC_FAST_START_RATE = 25600;
+
+//The amount of time we're targeting to be able to complete one rtt measurement cycle in
+const double FT_RC_STD_RTT = 9; //9 seconds
+//The minimum amount of time that can pass in one rtt measurement cycle that we'll recognize
+const double FT_RC_FAST_RTT = 1; //1 second
+const double FT_RC_MAX_INCREASE = 1.00; //Doubling in speed
+const double FT_RC_MIN_INCREASE = -0.10; //Dropping to 90% speed
+
+ftRoundTripRateController::ftRoundTripRateController()
+    :rtt(0), rttActive(false), rttStart(0), rttOffset(0), mRateChange(1), fastStart(true) {}
+
+void ftRoundTripRateController::reset() {
+    fastStart = true;
+}
+
+uint32_t ftRoundTripRateController::nextRequestSize(uint64_t now, double actualRate) {
+    /* If more time has already passed in this rtt period than FT_RC_STD_RTT (our target time)
+     * then halt any further rate increases for this period, since we were already too aggressive. */
+    if ((rttActive) && ((now - rttStart) / 1000000.0 > FT_RC_STD_RTT)) {
+        if (mRateChange > 0) {
+            log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftRoundTripRateController::nextRequestSize() rate increases halted");
+            mRateChange = 0;
+        }
+    }
+
+    if (fastStart) {
+        fastStart = false;
+        return FT_RC_FAST_START_RATE;
+    }
+    return actualRate * (1.0 + mRateChange);
+}
+
+void ftRoundTripRateController::requestSent(uint64_t now, uint64_t offset, uint32_t size) {
+    /* if it's time to start next rtt measurement period */
+    if (!rttActive) {
+        rttStart = now;
+        rttActive = true;
+        rttOffset = offset + size;
+    }
+}
+
+void ftRoundTripRateController::dataReceived(uint64_t now, uint64_t offset, uint32_t size) {
+    //If we have completed our rtt measurement cycle
+    if ((rttActive) && (rttOffset == offset + size)) {
+
+        rtt = (now - rttStart) / 1000000.0;
+
+        /*
+         * We will change the rate proportionally to the amount we differ from FT_RC_STD_RTT (9 seconds).
+         * FT_RC_FAST_RTT = 1 sec. mRateChange =  1.00
+         * FT_RC_STD_RTT = 9 sec. mRateChange =  0
+         * i.e. 11 sec. mRateChange = -0.25
+         */
+
+        mRateChange = FT_RC_MAX_INCREASE *
+                      (FT_RC_STD_RTT - rtt) /
+                      (FT_RC_STD_RTT - FT_RC_FAST_RTT);
+
+        if (mRateChange > FT_RC_MAX_INCREASE)
+            mRateChange = FT_RC_MAX_INCREASE;
+
+        if (mRateChange < FT_RC_MIN_INCREASE)
+            mRateChange = FT_RC_MIN_INCREASE;
+
+        rttActive = false;
+
+        {
+            QString toLog = "ftRoundTripRateController::dataReceived() rtt calculation complete";
+            toLog += " Updated Rate based on RTT: " + QString::number(rtt);
+            toLog += " Rate: " + QString::number(mRateChange);
+            log(LOG_DEBUG_BASIC, FTTRANSFERMODULEZONE, toLog);
+        }
+    }
+}
+
+void ftRoundTripRateController::requestRefused(uint64_t offset, uint32_t size) {
+    /* The end of the rtt measurement cycle will never arrive if it was in the range that was refused. */
+    if (rttActive && rttOffset > offset && rttOffset <= offset + size) {
+        rttActive = false;
+    }
+}
+
+/**********************************************************************************
+ * ftDeliveryRateController
+ **********************************************************************************/
+
+//Gain while finding the bandwidth in startup, 2/ln(2), the smallest gain that still doubles the delivery rate each round
+const double FT_RC_STARTUP_GAIN = 2.885;
+//Cycle of gains used once the bandwidth has been found
+const double FT_RC_PROBE_GAINS[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+//Multiple of the bandwidth-delay product kept outstanding once the bandwidth has been found,
+//so that delays in the sender reading from disk or in data arriving don't leave the connection idle
+const double FT_RC_WINDOW_GAIN = 2;
+const int FT_RC_PROBE_CYCLE_LENGTH = 8;
+//Startup ends once this many rounds in a row fail to increase the bandwidth by FT_RC_STARTUP_GROWTH
+const int FT_RC_STARTUP_ROUNDS = 3;
+const double FT_RC_STARTUP_GROWTH = 1.25;
+//Number of rounds the bottleneck bandwidth is the maximum over
+const int FT_RC_BANDWIDTH_ROUNDS = 10;
+//Amount of time before the minimum round trip time is measured again
+const uint64_t FT_RC_MIN_RTT_EXPIRY = 10000000; //10 seconds
+//Requests outstanding this long have been given up on by the transfer module
+const uint64_t FT_RC_REQUEST_EXPIRY = 60000000; //60 seconds
+//The window is split into about this many requests, so that it is topped up steadily as data arrives
+const uint64_t FT_RC_WINDOW_REQUESTS = 4;
+//Smallest request made to top up the window, so that it isn't topped up a few bytes at a time
+const uint32_t FT_RC_MIN_REQUEST = 16384;
+//Largest single request, as the sender reads a whole request into memory at once
+const uint32_t FT_RC_MAX_REQUEST = 16 * 1024 * 1024;
+//Window used before anything has been measured
+const uint64_t FT_RC_INITIAL_WINDOW = 4 * FT_RC_MIN_REQUEST;
+
+ftDeliveryRateController::ftDeliveryRateController() {
+    reset();
+}
+
+void ftDeliveryRateController::reset() {
+    mMode = MODE_STARTUP;
+    mRequests.clear();
+    mDelivered = 0;
+    mBandwidthSamples.clear();
+    mNextRoundDelivered = 0;
+    mMinRtt = 0;
+    mMinRttTime = 0;
+    mFullBandwidth = 0;
+    mRoundsWithoutGrowth = 0;
+    mFilledPipe = false;
+    mCycleIndex = 0;
+    mCycleStart = 0;
+}
+
+double ftDeliveryRateController::bottleneckBandwidth() const {
+    double bandwidth = 0;
+    foreach (double sample, mBandwidthSamples) {
+        if (sample > bandwidth) bandwidth = sample;
+    }
+    return bandwidth;
+}
+
+uint32_t ftDeliveryRateController::nextWindowRequest(uint64_t now) {
+    expireRequests(now);
+
+    uint64_t inFlight = bytesInFlight();
+    uint64_t target = window(now);
+    if (inFlight >= target) return 0;
+
+    uint64_t requestSize = target - inFlight;
+    uint64_t largestRequest = target / FT_RC_WINDOW_REQUESTS;
+    if (largestRequest < FT_RC_MIN_REQUEST) largestRequest = FT_RC_MIN_REQUEST;
+    if (largestRequest > FT_RC_MAX_REQUEST) largestRequest = FT_RC_MAX_REQUEST;
+    if (requestSize > largestRequest) requestSize = largestRequest;
+
+    if (inFlight > 0 && requestSize < FT_RC_MIN_REQUEST) return 0;
+
+    return requestSize;
+}
+
+uint64_t ftDeliveryRateController::window(uint64_t now) {
+    double bandwidth = bottleneckBandwidth();
+    if (bandwidth == 0 || mMinRtt == 0) return FT_RC_INITIAL_WINDOW;
+
+    double bandwidthDelay = bandwidth * mMinRtt / 1000000.0;
+
+    if (mMode != MODE_PROBE_RTT && now - mMinRttTime > FT_RC_MIN_RTT_EXPIRY) {
+        log(LOG_DEBUG_BASIC, FTTRANSFERMODULEZONE, "ftDeliveryRateController::window() measuring round trip time again");
+        mMode = MODE_PROBE_RTT;
+    }
+
+    /* Drain ends once what is in flight is no more than the connection holds. */
+    if (mMode == MODE_DRAIN && bytesInFlight() <= bandwidthDelay) {
+        log(LOG_DEBUG_BASIC, FTTRANSFERMODULEZONE,
+            "ftDeliveryRateController::window() drained, bottleneck bandwidth: " + QString::number(bandwidth) +
+            " min rtt: " + QString::number(mMinRtt));
+        mMode = MODE_PROBE;
+        mCycleIndex = 0;
+        mCycleStart = now;
+    }
+
+    double gain = 1;
+    switch (mMode) {
+    case MODE_STARTUP:
+        gain = FT_RC_STARTUP_GAIN;
+        break;
+    case MODE_DRAIN:
+        gain = 1;
+        break;
+    case MODE_PROBE:
+        /* Each gain in the cycle lasts at least one round trip, so its effect can be seen before moving on. */
+        if (now - mCycleStart >= mMinRtt) {
+            mCycleIndex = (mCycleIndex + 1) % FT_RC_PROBE_CYCLE_LENGTH;
+            mCycleStart = now;
+        }
+        gain = FT_RC_WINDOW_GAIN * FT_RC_PROBE_GAINS[mCycleIndex];
+        break;
+    case MODE_PROBE_RTT:
+        /* Once everything has arrived, a single request is sent to measure the round trip time on an empty connection. */
+        return FT_RC_MIN_REQUEST;
+    }
+
+    uint64_t target = bandwidthDelay * gain;
+    if (target < FT_RC_INITIAL_WINDOW) target = FT_RC_INITIAL_WINDOW;
+    return target;
+}
+
+void ftDeliveryRateController::requestSent(uint64_t now, uint64_t offset, uint32_t size) {
+    if (size == 0) return;
+
+    sentRequest request;
+    request.end = offset + size;
+    request.received = 0;
+    request.sentTime = now;
+    request.deliveredAtSend = mDelivered;
+    request.measuresRtt = mRequests.isEmpty();
+    mRequests[offset] = request;
+}
+
+void ftDeliveryRateController::dataReceived(uint64_t now, uint64_t offset, uint32_t size) {
+    mDelivered += size;
+
+    /* Find the request this data belongs to, which is the last one starting at or before it. */
+    QMap<uint64_t, sentRequest>::iterator it = mRequests.upperBound(offset);
+    if (it == mRequests.begin()) return;
+    --it;
+    if (offset >= it.value().end) return;
+
+    sentRequest &request = it.value();
+    if (request.measuresRtt && offset == it.key()) {
+        request.measuresRtt = false;
+        addRttSample(now, now - request.sentTime);
+    }
+
+    request.received += size;
+    if (offset + size >= request.end) {
+        uint64_t elapsed = now - request.sentTime;
+        if (elapsed == 0) elapsed = 1;
+
+        bool newRound = request.deliveredAtSend >= mNextRoundDelivered;
+        if (newRound) mNextRoundDelivered = mDelivered;
+
+        addBandwidthSample((mDelivered - request.deliveredAtSend) * 1000000.0 / elapsed, newRound);
+        mRequests.erase(it);
+    }
+}
+
+void ftDeliveryRateController::requestRefused(uint64_t offset, uint32_t size) {
+    QMap<uint64_t, sentRequest>::iterator it = mRequests.lowerBound(offset);
+    while (it != mRequests.end() && it.key() < offset + size) {
+        it = mRequests.erase(it);
+    }
+}
+
+void ftDeliveryRateController::requestsTimedOut() {
+    mRequests.clear();
+}
+
+void ftDeliveryRateController::addBandwidthSample(double bytesPerSecond, bool newRound) {
+    if (newRound || mBandwidthSamples.isEmpty()) {
+        mBandwidthSamples.append(bytesPerSecond);
+        while (mBandwidthSamples.count() > FT_RC_BANDWIDTH_ROUNDS) mBandwidthSamples.removeFirst();
+    } else if (bytesPerSecond > mBandwidthSamples.last()) {
+        mBandwidthSamples.last() = bytesPerSecond;
+    }
+
+    if (mMode != MODE_STARTUP || !newRound) return;
+
+    double bandwidth = bottleneckBandwidth();
+    if (bandwidth >= mFullBandwidth * FT_RC_STARTUP_GROWTH) {
+        mFullBandwidth = bandwidth;
+        mRoundsWithoutGrowth = 0;
+    } else if (++mRoundsWithoutGrowth >= FT_RC_STARTUP_ROUNDS) {
+        log(LOG_DEBUG_BASIC, FTTRANSFERMODULEZONE,
+            "ftDeliveryRateController::addBandwidthSample() startup found bottleneck bandwidth: " + QString::number(bandwidth));
+        mFilledPipe = true;
+        mMode = MODE_DRAIN;
+    }
+}
+
+void ftDeliveryRateController::addRttSample(uint64_t now, uint64_t rtt) {
+    if (mMinRttTime == 0 || rtt <= mMinRtt || now - mMinRttTime > FT_RC_MIN_RTT_EXPIRY) {
+        mMinRtt = rtt;
+    }
+    /* Any sample taken on an empty connection confirms the minimum is still current. */
+    mMinRttTime = now;
+
+    if (mMode == MODE_PROBE_RTT) {
+        mMode = mFilledPipe ? MODE_PROBE : MODE_STARTUP;
+        mCycleStart = now;
+    }
+}
+
+void ftDeliveryRateController::expireRequests(uint64_t now) {
+    QMap<uint64_t, sentRequest>::iterator it = mRequests.begin();
+    while (it != mRequests.end()) {
+        if (now - it.value().sentTime > FT_RC_REQUEST_EXPIRY) it = mRequests.erase(it);
+        else it++;
+    }
+}
+
+uint64_t ftDeliveryRateController::bytesInFlight() const {
+    uint64_t inFlight = 0;
+    QMap<uint64_t, sentRequest>::const_iterator it;
+    for (it = mRequests.begin(); it != mRequests.end(); it++) {
+        uint64_t requested = it.value().end - it.key();
+        if (it.value().received < requested) inFlight += requested - it.value().received;
+    }
+    return inFlight;
+}
@@ -0,0 +1,208 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef FT_RATE_CONTROLLER_HEADER
+#define FT_RATE_CONTROLLER_HEADER
+
+#include <QMap>
+#include <QList>
+#include <QString>
+#include <stdint.h>
+
+/*
+ * Each source of a download in an ftTransferModule has its own rate controller, which decides how much data to request
+ * from that source, based on what it has observed of the requests it has sent and the data that has come back.
+ *
+ * A controller is either ticked or pipelined.
+ * A ticked controller is asked for one request on each tick of the transfer module.
+ * A pipelined controller instead keeps a window of several requests outstanding, and is asked to top it up
+ * both as data arrives and on each tick, so that there is no gap while waiting for the next tick to request more.
+ *
+ * All times given to a controller are in microseconds from monotonicMicroseconds().
+ *
+ * Which controller is used is chosen by the "Transfers/RateController" setting, and can be either:
+ * RATE_CONTROLLER_DELIVERY_RATE (the default), a pipelined controller that models the connection from its delivery rate and minimum round trip time, or
+ * RATE_CONTROLLER_ROUND_TRIP, the original ticked controller that adjusts its rate towards completing each measurement cycle in 9 seconds.
+ */
+
+#define RATE_CONTROLLER_DELIVERY_RATE "DeliveryRate"
+#define RATE_CONTROLLER_ROUND_TRIP "RoundTrip"
+
+class ftRateController {
+public:
+    virtual ~ftRateController() {}
+
+    /* Creates a new controller of the type selected in the settings. */
+    static ftRateController *create();
+
+    /* Forgets everything learned about the connection, so that the next request starts out small again.
+       Used when the friend disconnects. */
+    virtual void reset() = 0;
+
+    /* True if this controller keeps a window of requests outstanding, and should be asked for nextWindowRequest rather than nextRequestSize. */
+    virtual bool pipelined() const = 0;
+
+    /* For ticked controllers, returns how many bytes to request from this source on this tick.
+       actualRate is the smoothed amount of data received from this source per tick. */
+    virtual uint32_t nextRequestSize(uint64_t /*now*/, double /*actualRate*/) {return 0;}
+
+    /* For pipelined controllers, returns how many bytes to request from this source now to keep its window full,
+       or 0 if enough is already outstanding. May be called repeatedly, as each request is sent, until it returns 0. */
+    virtual uint32_t nextWindowRequest(uint64_t /*now*/) {return 0;}
+
+    /* Called with the request that was actually sent, which may be smaller than was asked for. */
+    virtual void requestSent(uint64_t now, uint64_t offset, uint32_t size) = 0;
+
+    /* Called for each piece of data received from this source. */
+    virtual void dataReceived(uint64_t now, uint64_t offset, uint32_t size) = 0;
+
+    /* Called when the source tells us it can't answer the given range, so nothing more will arrive for it. */
+    virtual void requestRefused(uint64_t offset, uint32_t size) = 0;
+
+    /* Called when the transfer module has given up waiting on what is outstanding and is starting over with new requests. */
+    virtual void requestsTimedOut() {}
+};
+
+/* The original rate controller.
+ * Rate control is based on the amount of time it takes for a complete chunk to be received.
+ * The target time is FT_RC_STD_RTT, at that speed, rates will neither increase nor decrease.
+ * There will be many requests and receipts for a single rtt period. */
+class ftRoundTripRateController : public ftRateController {
+public:
+    ftRoundTripRateController();
+
+    virtual void reset();
+    virtual bool pipelined() const {return false;}
+    virtual uint32_t nextRequestSize(uint64_t now, double actualRate);
+    virtual void requestSent(uint64_t now, uint64_t offset, uint32_t size);
+    virtual void dataReceived(uint64_t now, uint64_t offset, uint32_t size);
+    virtual void requestRefused(uint64_t offset, uint32_t size);
+
+private:
+    double   rtt;       /* amount of time in seconds it took for the last rtt */
+    bool     rttActive; /* indicates we are currently measuring an rtt cycle */
+    uint64_t rttStart;  /* time we began measuring request */
+    uint64_t rttOffset; /* offset in file when rtt cycle is complete */
+    double   mRateChange; /* percentage to change current rate. 0 = steady, .5 = 50% more, 1 = 100% more, -1 = 100% less */
+    /* When true, the next request will be for FT_RC_FAST_START_RATE instead of what would have been requested.
+       Used for starting out transfers as a minimum to start from, so it's true whenever we're starting out. */
+    bool     fastStart;
+};
+
+/* A pipelined rate controller that keeps a model of the connection, made up of the bottleneck bandwidth, which is the highest delivery rate
+ * recently measured, and the minimum round trip time, which is the time between sending a request and the first of its data arriving,
+ * as measured on requests sent when nothing else was outstanding, so that it isn't inflated by waiting behind earlier requests.
+ * Their product is the bandwidth-delay product, the amount of data that needs to be outstanding to keep the connection full.
+ * The window of outstanding requests is the bandwidth-delay product scaled by a gain that depends on the mode:
+ *
+ * Startup:   The gain is high so that the window roughly doubles each round trip, finding the bandwidth of the connection in a few rounds.
+ *            Once several rounds in a row fail to increase the measured bandwidth much, the connection is full.
+ * Drain:     The window is the bandwidth-delay product, and nothing more is requested until the excess requested during startup has arrived.
+ * Probe:     Two bandwidth-delay products are kept outstanding, so that hiccups on either end don't leave the connection idle.
+ *            On top of that, the gain cycles through a round slightly above 1 to discover if more bandwidth has become available,
+ *            a round slightly below 1 to drain anything that built up in doing so, and then several rounds at 1.
+ * Probe RTT: If the minimum round trip time hasn't been confirmed in a while, everything outstanding is allowed to arrive,
+ *            and then a single small request is sent to measure it again.
+ */
+class ftDeliveryRateController : public ftRateController {
+public:
+    ftDeliveryRateController();
+
+    virtual void reset();
+    virtual bool pipelined() const {return true;}
+    virtual uint32_t nextWindowRequest(uint64_t now);
+    virtual void requestSent(uint64_t now, uint64_t offset, uint32_t size);
+    virtual void dataReceived(uint64_t now, uint64_t offset, uint32_t size);
+    virtual void requestRefused(uint64_t offset, uint32_t size);
+    virtual void requestsTimedOut();
+
+    /* The current model of the connection, in bytes per second and microseconds. Both are 0 until first measured. */
+    double bottleneckBandwidth() const;
+    uint64_t minRtt() const {return mMinRtt;}
+
+    /* Returns the total amount requested that hasn't yet arrived. */
+    uint64_t bytesInFlight() const;
+
+private:
+    /* A request that has been sent and is not yet fully received. */
+    struct sentRequest {
+        uint64_t end;
+        uint64_t received;
+        uint64_t sentTime;
+        /* The total amount that had been delivered when this request was sent, for measuring the delivery rate when it completes. */
+        uint64_t deliveredAtSend;
+        /* Whether nothing else was outstanding when this was sent, so that the wait for its first data is a round trip time sample. */
+        bool measuresRtt;
+    };
+
+    /* Returns the number of bytes that should be outstanding. */
+    uint64_t window(uint64_t now);
+
+    /* Records a delivery rate sample from a completed request.
+       If it began a new round, checks whether startup has found the bandwidth of the connection. */
+    void addBandwidthSample(double bytesPerSecond, bool newRound);
+
+    /* Records a round trip time sample. */
+    void addRttSample(uint64_t now, uint64_t rtt);
+
+    /* Drops requests that have been outstanding so long that the transfer module will have given up on them. */
+    void expireRequests(uint64_t now);
+
+    enum Mode {
+        MODE_STARTUP,
+        MODE_DRAIN,
+        MODE_PROBE,
+        MODE_PROBE_RTT
+    };
+    Mode mMode;
+
+    /* Outstanding requests by starting offset. */
+    QMap<uint64_t, sentRequest> mRequests;
+
+    /* Total bytes received from this source. */
+    uint64_t mDelivered;
+
+    /* The highest delivery rate sample in each of the most recent rounds, in bytes per second,
+       the maximum of which is the bottleneck bandwidth.
+       A round is the time it takes for a request to complete, so is roughly a round trip. */
+    QList<double> mBandwidthSamples;
+
+    /* The amount that will have been delivered when the current round ends,
+       because a request sent after it began has completed. */
+    uint64_t mNextRoundDelivered;
+
+    /* The minimum round trip time, and when it was measured, so that it can be allowed to expire and be measured afresh. */
+    uint64_t mMinRtt;
+    uint64_t mMinRttTime;
+
+    /* During startup, the bandwidth we last saw a significant increase to, and the number of rounds since then.
+       Once startup has found the bandwidth, mFilledPipe is set so that probing the round trip time returns to probe rather than startup. */
+    double mFullBandwidth;
+    int mRoundsWithoutGrowth;
+    bool mFilledPipe;
+
+    /* During probe, the position in the cycle of gains, and when we moved to it. */
+    int mCycleIndex;
+    uint64_t mCycleStart;
+};
+
+#endif //FT_RATE_CONTROLLER_HEADER
@@ -0,0 +1,369 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+/*
+ * Replays traces of a connection to a friend against each ftRateController, so that the controllers can be compared.
+ *
+ * A trace is a text file of samples, one per line, each of the form:
+ *   <time in microseconds> <bytes the connection delivered since the previous sample> <round trip time in microseconds>
+ * Lines starting with # are ignored.
+ * Between samples, the friend's connection sends at the rate the sample gives, with half the round trip each way.
+ * Without any trace files, a set of built in traces of common connections is replayed instead.
+ *
+ * The friend's side is simulated as ftServer answers requests, one at a time in the order they arrive,
+ * sending each as MAX_FT_CHUNK pieces through the connection.
+ * Our side drives the controller through the ftRateController interface the way ftTransferModule does for a single source,
+ * ticking once a second, and for pipelined controllers also topping up the window as each piece arrives.
+ *
+ * For each trace and controller, this prints how much of what the connection could carry was used,
+ * how long it took before a second first used 80% of it, how much was used after the first 10 seconds,
+ * and how long requests sat waiting behind others at the friend's end.
+ *
+ * Like the other *_test.cc programs this is not part of the library build, and links against it:
+ *   g++ -I. $(pkg-config --cflags QtCore) ft/ftratecontroller_test.cc lib.linux-g++/libMixologist.a $(pkg-config --libs QtCore QtNetwork QtXml)
+ *   ./ftratecontroller_test [trace files]
+ */
+
+#include <ft/ftratecontroller.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* As in ftServer, the size of each piece of a request as it is sent. */
+#define MAX_FT_CHUNK 8192
+
+/* As in ftTransferModule. */
+#define FT_TM_MINIMUM_CHUNK 128
+#define FT_TM_MAX_WINDOW_REQUESTS 16
+#define FT_TM_REQUEST_TIMEOUT 5000000
+
+/* ftController ticks each transfer once a second. */
+#define TICK_PERIOD 1000000
+
+/* The built in traces are sampled this often. */
+#define BUILT_IN_SAMPLE_PERIOD 100000
+
+/* A second counts as having filled the connection once it uses this much of it. */
+#define FILLED_UTILISATION 0.8
+
+/* Utilisation after this long is reported separately from the ramp up. */
+#define STEADY_STATE_START 10000000
+
+class linkSample {
+public:
+    linkSample(uint64_t time, double bytesPerSecond, uint64_t rtt)
+        :time(time), bytesPerSecond(bytesPerSecond), rtt(rtt) {}
+
+    /* The end of the period this sample covers. */
+    uint64_t time;
+    double bytesPerSecond;
+    uint64_t rtt;
+};
+
+class peerTrace {
+public:
+    std::string name;
+    std::vector<linkSample> samples;
+
+    /* Returns the sample covering time, or the last sample if time is past the end. */
+    const linkSample &at(uint64_t time) const {
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (time < samples[i].time) return samples[i];
+        }
+        return samples.back();
+    }
+
+    uint64_t duration() const {return samples.empty() ? 0 : samples.back().time;}
+
+    /* The total number of bytes the connection could have carried between start and end. */
+    double capacity(uint64_t start, uint64_t end) const {
+        double total = 0;
+        uint64_t previous = 0;
+        for (size_t i = 0; i < samples.size() && previous < end; i++) {
+            uint64_t from = previous > start ? previous : start;
+            uint64_t to = samples[i].time < end ? samples[i].time : end;
+            if (to > from) total += samples[i].bytesPerSecond * (to - from) / 1000000.0;
+            previous = samples[i].time;
+        }
+        return total;
+    }
+};
+
+static bool loadTrace(const char *path, peerTrace &trace) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    trace.name = path;
+    uint64_t previous = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        uint64_t time, bytes, rtt;
+        if (!(fields >> time >> bytes >> rtt)) return false;
+        if (time <= previous) continue;
+        trace.samples.push_back(linkSample(time, bytes * 1000000.0 / (time - previous), rtt));
+        previous = time;
+    }
+    return !trace.samples.empty();
+}
+
+/* A fixed linear congruential generator, so that the built in traces are the same on every platform. */
+static uint32_t traceSeed = 12345;
+static double nextJitter() {
+    traceSeed = traceSeed * 1103515245 + 12345;
+    return ((traceSeed >> 8) & 0xFFFF) / 65536.0;
+}
+
+/* Adds samples to trace for seconds at bytesPerSecond and rtt, varying each sample by up to jitter of both. */
+static void addPeriod(peerTrace &trace, int seconds, double bytesPerSecond, uint64_t rtt, double jitter) {
+    uint64_t time = trace.duration();
+    for (int i = 0; i < seconds * 1000000 / BUILT_IN_SAMPLE_PERIOD; i++) {
+        time += BUILT_IN_SAMPLE_PERIOD;
+        double rateScale = 1 - jitter * nextJitter();
+        double rttScale = 1 + jitter * nextJitter();
+        trace.samples.push_back(linkSample(time, bytesPerSecond * rateScale, rtt * rttScale));
+    }
+}
+
+static std::vector<peerTrace> builtInTraces() {
+    std::vector<peerTrace> traces;
+    peerTrace trace;
+
+    trace.name = "LAN 100Mbit 1ms";
+    addPeriod(trace, 60, 12.5 * 1024 * 1024, 1000, 0.05);
+    traces.push_back(trace);
+
+    trace = peerTrace();
+    trace.name = "Fiber 400Mbit 20ms";
+    addPeriod(trace, 60, 50.0 * 1024 * 1024, 20000, 0.05);
+    traces.push_back(trace);
+
+    trace = peerTrace();
+    trace.name = "DSL 1Mbit 80ms";
+    addPeriod(trace, 120, 128.0 * 1024, 80000, 0.2);
+    traces.push_back(trace);
+
+    trace = peerTrace();
+    trace.name = "Cable 2/8/1MB 40ms";
+    addPeriod(trace, 30, 2.0 * 1024 * 1024, 40000, 0.1);
+    addPeriod(trace, 30, 8.0 * 1024 * 1024, 40000, 0.1);
+    addPeriod(trace, 30, 1.0 * 1024 * 1024, 40000, 0.1);
+    traces.push_back(trace);
+
+    return traces;
+}
+
+class replayResult {
+public:
+    replayResult() :delivered(0), steadyDelivered(0), timeToFill(0), filled(false), queueDelayTotal(0), queueDelayMax(0), requests(0) {}
+
+    uint64_t delivered;
+    uint64_t steadyDelivered;
+    uint64_t timeToFill;
+    bool filled;
+    double queueDelayTotal;
+    uint64_t queueDelayMax;
+    uint64_t requests;
+};
+
+/* Replays trace against controller, simulating both ends of the connection. */
+class connectionReplay {
+public:
+    connectionReplay(const peerTrace &trace, ftRateController *controller)
+        :trace(trace), controller(controller), now(0), nextOffset(0), sourceFreeAt(0),
+         actualRate(0), pastTickTransferred(0), lastRequestTime(0), lastReceiveTime(0), secondDelivered(0) {}
+
+    replayResult run() {
+        events.insert(std::make_pair((uint64_t)0, simEvent(simEvent::TICK, 0, 0)));
+
+        while (!events.empty() && events.begin()->first <= trace.duration()) {
+            now = events.begin()->first;
+            simEvent event = events.begin()->second;
+            events.erase(events.begin());
+
+            if (event.type == simEvent::TICK) tick();
+            else if (event.type == simEvent::REQUEST_ARRIVES) requestArrives(event.offset, event.size);
+            else pieceArrives(event.offset, event.size);
+        }
+        return result;
+    }
+
+private:
+    class simEvent {
+    public:
+        enum eventType {TICK, REQUEST_ARRIVES, PIECE_ARRIVES};
+        simEvent(eventType type, uint64_t offset, uint32_t size) :type(type), offset(offset), size(size) {}
+        eventType type;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    void schedule(uint64_t time, const simEvent &event) {
+        events.insert(std::make_pair(time, event));
+    }
+
+    /* Our side, as in ftTransferModule::locked_tickPeerTransfer. */
+    void tick() {
+        uint64_t second = now / TICK_PERIOD;
+        if (second > 0) finishSecond(second - 1);
+
+        uint64_t ageStalled = now - lastRequestTime;
+        if (controller->pipelined() && now - lastReceiveTime < ageStalled) ageStalled = now - lastReceiveTime;
+        if (ageStalled > FT_TM_REQUEST_TIMEOUT) {
+            controller->requestsTimedOut();
+            lastReceiveTime = now;
+        }
+
+        actualRate = actualRate * 0.5 + pastTickTransferred * 0.5;
+        pastTickTransferred = 0;
+
+        if (controller->pipelined()) fillWindow();
+        else sendRequest(controller->nextRequestSize(now, actualRate));
+
+        schedule(now + TICK_PERIOD, simEvent(simEvent::TICK, 0, 0));
+    }
+
+    void fillWindow() {
+        for (int i = 0; i < FT_TM_MAX_WINDOW_REQUESTS; i++) {
+            uint32_t requestSize = controller->nextWindowRequest(now);
+            if (requestSize == 0) return;
+            sendRequest(requestSize);
+        }
+    }
+
+    void sendRequest(uint32_t requestSize) {
+        if (requestSize < FT_TM_MINIMUM_CHUNK) requestSize = FT_TM_MINIMUM_CHUNK;
+        lastRequestTime = now;
+        controller->requestSent(now, nextOffset, requestSize);
+        schedule(now + trace.at(now).rtt / 2, simEvent(simEvent::REQUEST_ARRIVES, nextOffset, requestSize));
+        nextOffset += requestSize;
+        result.requests++;
+    }
+
+    /* The friend's side, answering requests in the order they arrive as fast as the connection allows. */
+    void requestArrives(uint64_t offset, uint32_t size) {
+        uint64_t queueDelay = sourceFreeAt > now ? sourceFreeAt - now : 0;
+        result.queueDelayTotal += queueDelay;
+        if (queueDelay > result.queueDelayMax) result.queueDelayMax = queueDelay;
+
+        uint64_t sendTime = sourceFreeAt > now ? sourceFreeAt : now;
+        while (size > 0) {
+            uint32_t piece = size < MAX_FT_CHUNK ? size : MAX_FT_CHUNK;
+            const linkSample &link = trace.at(sendTime);
+            sendTime += (uint64_t)(piece * 1000000.0 / link.bytesPerSecond) + 1;
+            schedule(sendTime + link.rtt / 2, simEvent(simEvent::PIECE_ARRIVES, offset, piece));
+            offset += piece;
+            size -= piece;
+        }
+        sourceFreeAt = sendTime;
+    }
+
+    /* Our side, as in ftTransferModule::recvFileData. */
+    void pieceArrives(uint64_t offset, uint32_t size) {
+        lastReceiveTime = now;
+        pastTickTransferred += size;
+        secondDelivered += size;
+        result.delivered += size;
+        if (now >= STEADY_STATE_START) result.steadyDelivered += size;
+
+        controller->dataReceived(now, offset, size);
+        if (controller->pipelined()) fillWindow();
+    }
+
+    void finishSecond(uint64_t second) {
+        double capacity = trace.capacity(second * TICK_PERIOD, (second + 1) * TICK_PERIOD);
+        if (!result.filled && capacity > 0 && secondDelivered >= capacity * FILLED_UTILISATION) {
+            result.filled = true;
+            result.timeToFill = (second + 1) * TICK_PERIOD;
+        }
+        secondDelivered = 0;
+    }
+
+    const peerTrace &trace;
+    ftRateController *controller;
+    std::multimap<uint64_t, simEvent> events;
+    uint64_t now;
+
+    uint64_t nextOffset;
+    uint64_t sourceFreeAt;
+
+    double actualRate;
+    uint64_t pastTickTransferred;
+    uint64_t lastRequestTime;
+    uint64_t lastReceiveTime;
+
+    uint64_t secondDelivered;
+    replayResult result;
+};
+
+static void printResult(const peerTrace &trace, const std::string &controllerName, const replayResult &result) {
+    double capacity = trace.capacity(0, trace.duration());
+    double steadyCapacity = trace.capacity(STEADY_STATE_START, trace.duration());
+
+    std::cout << std::left << std::setw(22) << trace.name
+              << std::setw(15) << controllerName
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << result.delivered / (1024.0 * 1024.0) << "MB"
+              << std::setw(8) << (capacity > 0 ? 100.0 * result.delivered / capacity : 0) << "%";
+    if (result.filled) std::cout << std::setw(9) << result.timeToFill / 1000000.0 << "s";
+    else std::cout << std::setw(10) << "never";
+    std::cout << std::setw(8) << (steadyCapacity > 0 ? 100.0 * result.steadyDelivered / steadyCapacity : 0) << "%"
+              << std::setw(10) << (result.requests ? result.queueDelayTotal / result.requests / 1000.0 : 0) << "ms"
+              << std::setw(10) << result.queueDelayMax / 1000.0 << "ms"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::vector<peerTrace> traces;
+    for (int i = 1; i < argc; i++) {
+        peerTrace trace;
+        if (!loadTrace(argv[i], trace)) {
+            std::cerr << "Unable to load trace " << argv[i] << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [trace files]" << std::endl;
+            return 1;
+        }
+        traces.push_back(trace);
+    }
+    if (traces.empty()) traces = builtInTraces();
+
+    std::cout << std::left << std::setw(22) << "Trace" << std::setw(15) << "Controller"
+              << std::right << std::setw(12) << "Delivered" << std::setw(9) << "Used"
+              << std::setw(10) << "To 80%" << std::setw(9) << "After10s"
+              << std::setw(12) << "Queue avg" << std::setw(12) << "Queue max" << std::endl;
+
+    for (size_t i = 0; i < traces.size(); i++) {
+        ftRoundTripRateController roundTrip;
+        printResult(traces[i], RATE_CONTROLLER_ROUND_TRIP, connectionReplay(traces[i], &roundTrip).run());
+
+        ftDeliveryRateController deliveryRate;
+        printResult(traces[i], RATE_CONTROLLER_DELIVERY_RATE, connectionReplay(traces[i], &deliveryRate).run());
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#include <ft/ftreadahead.h>
+#include <ft/ftblockcache.h>
+#include <ft/ftfilehandlecache.h>
+#include <ft/ftfilewatcher.h>
+
+#include <QDir>
+#include <QByteArray>
+
+ftReadAhead *readAhead = NULL;
+
+//The most blocks waiting to be read at once, past which further read ahead is skipped until the disk catches up
+#define FT_READ_AHEAD_MAX_QUEUED 64
+
+ftReadAhead::ftReadAhead() :mStopping(false) {
+    /* These are direct connections so that nothing more is read from the changed file. */
+    connect(fileWatcher, SIGNAL(oldHashInvalidated(QString,qlonglong,uint)), this, SLOT(oldHashInvalidated(QString,qlonglong,uint)), Qt::DirectConnection);
+    connect(fileWatcher, SIGNAL(fileRemoved(QString)), this, SLOT(invalidate(QString)), Qt::DirectConnection);
+}
+
+ftReadAhead::~ftReadAhead() {
+    stop();
+}
+
+void ftReadAhead::run() {
+    while (true) {
+        readJob job;
+        {
+            QMutexLocker stack(&readAheadMutex);
+            while (mJobs.isEmpty() && !mStopping) {
+                jobsQueued.wait(&readAheadMutex);
+            }
+            if (mStopping) return;
+            job = mJobs.takeFirst();
+        }
+
+        QByteArray data;
+        data.resize(job.length);
+        if (fileHandleCache->readFile(job.path, job.key.second, job.length, data.data())) {
+            blockCache->insertBlock(job.key.first, job.path, job.key.second, data, job.generation, true);
+        }
+
+        QMutexLocker stack(&readAheadMutex);
+        mPendingBlocks.remove(job.key);
+    }
+}
+
+void ftReadAhead::stop() {
+    {
+        QMutexLocker stack(&readAheadMutex);
+        mStopping = true;
+        jobsQueued.wakeAll();
+    }
+    wait();
+}
+
+void ftReadAhead::prefetch(const QString &hash, const QString &path, uint64_t fileSize, uint64_t start, uint64_t end) {
+    if (end > fileSize) end = fileSize;
+    if (start >= end) return;
+
+    uint64_t generation = blockCache->generation();
+    uint64_t firstQueued = 0;
+    uint64_t lastQueued = 0;
+    {
+        QMutexLocker stack(&readAheadMutex);
+        for (uint64_t blockStart = start - (start % FT_BLOCK_SIZE); blockStart < end; blockStart += FT_BLOCK_SIZE) {
+            if (mJobs.count() >= FT_READ_AHEAD_MAX_QUEUED) break;
+
+            blockKey key(hash, blockStart);
+            if (mPendingBlocks.contains(key) || blockCache->contains(hash, blockStart)) continue;
+
+            readJob job;
+            job.key = key;
+            job.path = path;
+            job.length = qMin((uint64_t)FT_BLOCK_SIZE, fileSize - blockStart);
+            job.generation = generation;
+            mJobs.append(job);
+            mPendingBlocks[key] = true;
+
+            if (lastQueued == 0) firstQueued = blockStart;
+            lastQueued = blockStart + job.length;
+        }
+        if (lastQueued == 0) return;
+        jobsQueued.wakeOne();
+    }
+
+    fileHandleCache->adviseWillNeed(path, firstQueued, lastQueued - firstQueued);
+}
+
+void ftReadAhead::invalidate(QString path) {
+    QMutexLocker stack(&readAheadMutex);
+    QString file = QDir::toNativeSeparators(path);
+
+    QList<readJob>::iterator job = mJobs.begin();
+    while (job != mJobs.end()) {
+        if (QDir::toNativeSeparators(job->path) == file) {
+            mPendingBlocks.remove(job->key);
+            job = mJobs.erase(job);
+        } else job++;
+    }
+}
+
+void ftReadAhead::oldHashInvalidated(QString path, qlonglong /*size*/, unsigned int /*modified*/) {
+    invalidate(path);
+}
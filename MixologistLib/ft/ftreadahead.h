@@ -0,0 +1,97 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#ifndef FT_READ_AHEAD_HEADER
+#define FT_READ_AHEAD_HEADER
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <stdint.h>
+
+/*
+ * Friends downloading a file request it in consecutive ranges, so once an upload is seen to be sequential,
+ * its ftFileProvider asks this to read the next few requests' worth of the file ahead of time.
+ *
+ * The reading is done on this thread, so that ftDataDemultiplex never waits on a disk for data it could have predicted,
+ * and the blocks read are added to the shared ftBlockCache, from which the requests are then answered.
+ * Before a range is queued for reading, the OS is also told that it will be needed,
+ * so that the disk can start on it straight away while earlier blocks are still being read.
+ *
+ * Blocks waiting to be read for a file are dropped when ftFileWatcher reports that it has changed or been removed,
+ * and ftBlockCache discards any that were already being read at the time.
+ */
+
+class ftReadAhead;
+extern ftReadAhead *readAhead;
+
+class ftReadAhead : public QThread {
+    Q_OBJECT
+
+public:
+    ftReadAhead();
+    ~ftReadAhead();
+
+    void run();
+
+    /* Asks the thread to finish, and waits for it. */
+    void stop();
+
+    /* Queues any blocks between start and end of the file with hash at path that aren't already cached or being read to be read ahead.
+       fileSize is the size of the file, past which nothing is read. */
+    void prefetch(const QString &hash, const QString &path, uint64_t fileSize, uint64_t start, uint64_t end);
+
+public slots:
+    /* Drops any blocks waiting to be read for the file at path.
+       Connected to ftFileWatcher's signals for files changing or being removed. */
+    void invalidate(QString path);
+
+private slots:
+    /* Connected to ftFileWatcher's oldHashInvalidated signal. */
+    void oldHashInvalidated(QString path, qlonglong size, unsigned int modified);
+
+private:
+    /* A block waiting to be read, identified by its file's hash and its start. */
+    typedef QPair<QString, uint64_t> blockKey;
+
+    struct readJob {
+        blockKey key;
+        QString path;
+        uint32_t length;
+        /* ftBlockCache's generation when the job was queued. */
+        uint64_t generation;
+    };
+
+    mutable QMutex readAheadMutex;
+    QWaitCondition jobsQueued;
+
+    /* Blocks waiting to be read, in the order they were asked for, and the keys of those and the block currently being read. */
+    QList<readJob> mJobs;
+    QHash<blockKey, bool> mPendingBlocks;
+
+    bool mStopping;
+};
+
+#endif //FT_READ_AHEAD_HEADER
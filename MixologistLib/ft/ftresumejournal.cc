@@ -0,0 +1,220 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <ft/ftresumejournal.h>
+#include <util/dir.h>
+#include <util/debug.h>
+
+#include <QByteArray>
+#include <QDataStream>
+
+/* Identifies a resume journal, followed by the version of its format. */
+#define JOURNAL_MAGIC 0x4d58524a
+#define JOURNAL_VERSION 1
+
+/* Magic, version and file size, followed by a checksum of those. */
+#define JOURNAL_HEADER_SIZE 18
+/* Start and end of a range, followed by a checksum of those. */
+#define JOURNAL_RECORD_SIZE 18
+
+/* Once the journal holds this many records, it is compacted down to one record per disjoint range. */
+#define JOURNAL_COMPACT_RECORDS 1024
+
+/* Serializes the given values followed by a checksum of them. */
+static QByteArray checksummed(quint32 first, quint32 second, quint64 third) {
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out << first << second << third;
+    out << qChecksum(bytes.constData(), bytes.size());
+    return bytes;
+}
+
+static QByteArray checksummed(quint64 first, quint64 second) {
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out << first << second;
+    out << qChecksum(bytes.constData(), bytes.size());
+    return bytes;
+}
+
+/* Returns true if the last two bytes of the given record are a valid checksum of the rest of it. */
+static bool checksumValid(const QByteArray &record) {
+    QDataStream in(record.right(2));
+    quint16 checksum;
+    in >> checksum;
+    return checksum == qChecksum(record.constData(), record.size() - 2);
+}
+
+ftResumeJournal::ftResumeJournal(const QString &journalPath, uint64_t fileSize)
+    :mPath(journalPath), mFileSize(fileSize), mRecordCount(0) {}
+
+ftResumeJournal::~ftResumeJournal() {
+    mJournal.close();
+}
+
+bool ftResumeJournal::load(ftRangeSet &completed) {
+    QFile journal(mPath);
+    if (!journal.open(QIODevice::ReadOnly)) return false;
+    QByteArray contents = journal.readAll();
+    journal.close();
+
+    QByteArray header = contents.left(JOURNAL_HEADER_SIZE);
+    if (header.size() != JOURNAL_HEADER_SIZE || !checksumValid(header)) {
+        log(LOG_WARNING, FTFILECREATORZONE, "Resume journal " + mPath + " has a damaged header, ignoring");
+        return false;
+    }
+
+    quint32 magic, version;
+    quint64 fileSize;
+    QDataStream headerStream(header);
+    headerStream >> magic >> version >> fileSize;
+    if (magic != JOURNAL_MAGIC || version != JOURNAL_VERSION || fileSize != mFileSize) {
+        log(LOG_WARNING, FTFILECREATORZONE, "Resume journal " + mPath + " does not match its file, ignoring");
+        return false;
+    }
+
+    completed.clear();
+    mRecordCount = 0;
+    for (int position = JOURNAL_HEADER_SIZE; position + JOURNAL_RECORD_SIZE <= contents.size(); position += JOURNAL_RECORD_SIZE) {
+        QByteArray record = contents.mid(position, JOURNAL_RECORD_SIZE);
+
+        /* A record that fails its checksum was most likely torn by a crash while appending.
+           Since nothing after it can be trusted either, stop here. */
+        if (!checksumValid(record)) {
+            log(LOG_WARNING, FTFILECREATORZONE,
+                "Resume journal " + mPath + " has a damaged record at " + QString::number(position) + ", ignoring the rest of it");
+            break;
+        }
+
+        quint64 start, end;
+        QDataStream recordStream(record);
+        recordStream >> start >> end;
+        if (start >= end || end > mFileSize) break;
+
+        completed.add(start, end);
+        mRecordCount++;
+    }
+
+    return true;
+}
+
+bool ftResumeJournal::rewrite(const ftRangeSet &completed, QFile *dataFile) {
+    if (dataFile != NULL && dataFile->isOpen() && !DirUtil::syncFile(*dataFile)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to sync " + dataFile->fileName() + " to disk");
+        return false;
+    }
+
+    mJournal.close();
+    mPending.clear();
+
+    QString temporaryPath = mPath + ".new";
+    QFile temporary(temporaryPath);
+    if (!temporary.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to write resume journal " + temporaryPath);
+        return false;
+    }
+
+    QByteArray contents = checksummed((quint32)JOURNAL_MAGIC, (quint32)JOURNAL_VERSION, (quint64)mFileSize);
+    std::map<uint64_t, uint64_t>::const_iterator it;
+    for (it = completed.ranges().begin(); it != completed.ranges().end(); it++) {
+        contents.append(checksummed((quint64)it->first, (quint64)it->second));
+    }
+
+    /* The new journal must be fully on disk before it replaces the old one, or a crash could leave neither. */
+    if (temporary.write(contents) != contents.size() || !DirUtil::syncFile(temporary)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to write resume journal " + temporaryPath);
+        temporary.close();
+        temporary.remove();
+        return false;
+    }
+    temporary.close();
+
+    if (!DirUtil::replaceFile(temporaryPath, mPath)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to replace resume journal " + mPath);
+        QFile::remove(temporaryPath);
+        return false;
+    }
+
+    mRecordCount = completed.ranges().size();
+    return true;
+}
+
+void ftResumeJournal::recordCompleted(uint64_t start, uint64_t end) {
+    mPending.add(start, end);
+}
+
+bool ftResumeJournal::sync(QFile *dataFile) {
+    if (mPending.isEmpty()) return true;
+
+    /* Only once the data itself is safely on disk can the journal claim it is complete. */
+    if (dataFile == NULL || !dataFile->isOpen() || !DirUtil::syncFile(*dataFile)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to sync data to disk before updating resume journal " + mPath);
+        return false;
+    }
+
+    if (!openForAppend()) return false;
+
+    QByteArray records;
+    std::map<uint64_t, uint64_t>::const_iterator it;
+    for (it = mPending.ranges().begin(); it != mPending.ranges().end(); it++) {
+        records.append(checksummed((quint64)it->first, (quint64)it->second));
+    }
+
+    if (mJournal.write(records) != records.size() || !DirUtil::syncFile(mJournal)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to append to resume journal " + mPath);
+        return false;
+    }
+
+    mRecordCount += mPending.ranges().size();
+    mPending.clear();
+    return true;
+}
+
+bool ftResumeJournal::needsCompaction() const {
+    return mRecordCount >= JOURNAL_COMPACT_RECORDS;
+}
+
+void ftResumeJournal::remove() {
+    mJournal.close();
+    mPending.clear();
+    mRecordCount = 0;
+    QFile::remove(mPath);
+}
+
+void ftResumeJournal::setPath(const QString &journalPath) {
+    mJournal.close();
+    mPath = journalPath;
+}
+
+bool ftResumeJournal::openForAppend() {
+    if (mJournal.isOpen()) return true;
+
+    /* Appending to a journal that isn't there would produce one without a header, so it must be rewritten instead. */
+    if (!QFile::exists(mPath)) return false;
+
+    mJournal.setFileName(mPath);
+    if (!mJournal.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        log(LOG_ERROR, FTFILECREATORZONE, "Unable to open resume journal " + mPath);
+        return false;
+    }
+    return true;
+}
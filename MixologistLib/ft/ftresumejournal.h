@@ -0,0 +1,94 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef FT_RESUME_JOURNAL_HEADER
+#define FT_RESUME_JOURNAL_HEADER
+
+#include <ft/ftchunkmap.h>
+#include <QFile>
+#include <QString>
+
+/*
+ * A small binary journal kept alongside a partial download that records which ranges of it have been completed,
+ * so that after a restart or crash the download can resume exactly where it left off.
+ *
+ * The journal begins with a header identifying the file it belongs to, followed by fixed size records each
+ * holding a completed range and a checksum. Records are only ever appended, and are buffered in memory until sync(),
+ * which first forces the data file itself to disk, so that the journal never claims data that could still be lost.
+ * A record that was torn by a crash fails its checksum, and it along with everything after it is ignored on load.
+ *
+ * As records accumulate, the journal is compacted by writing out a fresh journal of just the merged ranges
+ * to a temporary file and replacing the old journal with it.
+ */
+class ftResumeJournal {
+public:
+    ftResumeJournal(const QString &journalPath, uint64_t fileSize);
+    ~ftResumeJournal();
+
+    /* Reads the completed ranges recorded on disk into completed.
+       Returns false if there is no journal, or if it does not belong to a file of this size. */
+    bool load(ftRangeSet &completed);
+
+    /* Replaces the journal on disk with one that records exactly completed, discarding any pending records.
+       If dataFile is supplied, it is synced first, as completed may include data not yet on disk.
+       Used on startup to clear out anything torn, and to compact the journal. */
+    bool rewrite(const ftRangeSet &completed, QFile *dataFile = NULL);
+
+    /* Records that [start, end) has been written to the data file.
+       This is only held in memory until the next sync(). */
+    void recordCompleted(uint64_t start, uint64_t end);
+
+    /* True if there are completed ranges that have not yet been synced to the journal. */
+    bool hasPending() const {return !mPending.isEmpty();}
+
+    /* Syncs dataFile to disk, and then appends and syncs all pending records to the journal. */
+    bool sync(QFile *dataFile);
+
+    /* True once enough records have been appended that the journal should be rewritten. */
+    bool needsCompaction() const;
+
+    /* Closes and deletes the journal from disk, for when the download is complete or cancelled. */
+    void remove();
+
+    /* Changes where the journal is kept. The journal at the old location is left alone. */
+    void setPath(const QString &journalPath);
+
+    QString path() const {return mPath;}
+
+private:
+    /* Opens mJournal for appending if it is not already open. */
+    bool openForAppend();
+
+    QString mPath;
+    uint64_t mFileSize;
+
+    /* Held open for appending between syncs. */
+    QFile mJournal;
+
+    /* Completed ranges that have not yet been written to the journal. */
+    ftRangeSet mPending;
+
+    /* Number of records in the journal on disk. */
+    unsigned int mRecordCount;
+};
+
+#endif // FT_RESUME_JOURNAL_HEADER
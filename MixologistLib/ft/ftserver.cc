@@ -29,6 +29,10 @@ const int ftserverzone = 29539;
 #include "ft/ftfilewatcher.h"
 #include "ft/ftcontroller.h"
 #include "ft/ftfileprovider.h"
+#include "ft/ftfilehandlecache.h"
+#include "ft/ftblockcache.h"
+#include "ft/ftreadahead.h"
+#include "ft/ftdiskio.h"
 #include "ft/ftdatademultiplex.h"
 #include "ft/ftborrower.h"
 
@@ -59,6 +63,10 @@ void ftServer::setupMixologyService() {
 
 /* Final Setup (once everything is assigned) */
 void ftServer::SetupFtServer() {
+    fileHandleCache = new ftFileHandleCache();
+    blockCache = new ftBlockCache();
+    readAhead = new ftReadAhead();
+    diskIO = new ftDiskIO();
     fileDownloadController = new ftController();
     mFtDataplex = new ftDataDemultiplex(fileDownloadController);
 
@@ -94,13 +102,17 @@ void ftServer::SetupFtServer() {
 }
 
 void ftServer::StartupThreads() {
+    readAhead->start();
     fileDownloadController->start();
     mFtDataplex->start();
 }
 
 void ftServer::StopThreads() {
     fileDownloadController->exit();
-    mFtDataplex->exit();
+    mFtDataplex->stop();
+    /* Finishes any writes and uploads already queued. */
+    diskIO->stop();
+    readAhead->stop();
 }
 
 /***************************************************************/
@@ -142,8 +154,8 @@ void ftServer::cancelFile(int groupId, const QString &hash) {
     fileDownloadController->cancelFile(groupId, hash);
 }
 
-bool ftServer::controlFile(int orig_item_id, QString hash, uint32_t flags) {
-    return fileDownloadController->controlFile(orig_item_id, hash, flags);
+bool ftServer::controlFile(int groupId, QString hash, uint32_t flags) {
+    return fileDownloadController->controlFile(groupId, hash, flags);
 }
 
 void ftServer::clearCompletedFiles() {
@@ -190,6 +202,10 @@ void ftServer::FileUploads(QList<uploadFileInfo> &uploads) {
     mFtDataplex->FileUploads(uploads);
 }
 
+void ftServer::getUploadCacheStats(uint64_t &hits, uint64_t &misses, uint64_t &cachedBytes) {
+    blockCache->getStats(hits, misses, cachedBytes);
+}
+
 /**********************************************************************************
  * LibraryMixer Item Control
  **********************************************************************************/
@@ -333,7 +349,8 @@ bool ftServer::sendDataRequest(unsigned int librarymixer_id, QString hash, uint6
 const uint32_t MAX_FT_CHUNK  = 8 * 1024; /* 8K */
 
 /* Server Send */
-bool ftServer::sendData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t baseOffset, uint32_t chunkSize, void *data) {
+bool ftServer::sendData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t baseOffset, const QByteArray &data) {
+    uint32_t chunkSize = data.size();
     uint32_t remainingToSend = chunkSize;
     uint64_t offset = 0;
     uint32_t chunk;
@@ -366,8 +383,8 @@ bool ftServer::sendData(unsigned int librarymixer_id, QString hash, uint64_t siz
 
         rfd->fd.file_offset = baseOffset + offset;
 
-        /* file data */
-        rfd->fd.binData.setBinData(&(((uint8_t *) data)[offset]), chunk);
+        /* file data, which each packet points into rather than copying, so that it is only copied again when encrypted */
+        rfd->fd.binData.setBinDataView(data, offset, chunk);
 
         persongrp->SendFileData(rfd);
 
@@ -375,12 +392,72 @@ bool ftServer::sendData(unsigned int librarymixer_id, QString hash, uint64_t siz
         remainingToSend -= chunk;
     }
 
-    /* clean up data */
-    free(data);
+    return true;
+}
+
+bool ftServer::sendDataUnavailable(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, uint32_t reason) {
+    FileUnavailable *rfu = new FileUnavailable();
+
+    /* id */
+    rfu->LibraryMixerId(librarymixer_id);
+
+    /* file info */
+    rfu->file.filesize = size;
+    rfu->file.hash = hash;
+
+    /* offsets */
+    rfu->fileoffset = offset;
+    rfu->chunksize = chunksize;
+
+    rfu->reason = reason;
+
+    persongrp->SendFileUnavailable(rfu);
+
+    return true;
+}
+
+bool ftServer::sendManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece) {
+    FileManifestRequest *rfmr = new FileManifestRequest();
+
+    /* id */
+    rfmr->LibraryMixerId(librarymixer_id);
+
+    /* file info */
+    rfmr->file.filesize = size;
+    rfmr->file.hash = hash;
+
+    rfmr->firstPiece = firstPiece;
+
+    persongrp->SendFileManifestRequest(rfmr);
+
+    return true;
+}
+
+bool ftServer::sendManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t totalPieces, uint32_t firstPiece,
+                            const QByteArray &root, const QByteArray &pieceHashes) {
+    FileManifest *rfm = new FileManifest();
+
+    /* id */
+    rfm->LibraryMixerId(librarymixer_id);
+
+    /* file info */
+    rfm->file.filesize = size;
+    rfm->file.hash = hash;
+
+    rfm->totalPieces = totalPieces;
+    rfm->firstPiece = firstPiece;
+    rfm->root.setBinData((void *) root.constData(), root.size());
+    rfm->pieceHashes.setBinData((void *) pieceHashes.constData(), pieceHashes.size());
+
+    persongrp->SendFileManifest(rfm);
 
     return true;
 }
 
+float ftServer::getSentRate(unsigned int librarymixer_id) {
+    return persongrp->getSentRate(librarymixer_id);
+}
+
 /* NB: The core lock must be activated before calling this.
  * This Lock should be moved lower into the system...
  * most likely destination is in ftServer.
@@ -404,6 +481,9 @@ bool ftServer::handleFileData() {
     // now File Input.
     FileRequest *fr;
     FileData *fd;
+    FileUnavailable *fu;
+    FileManifestRequest *fmr;
+    FileManifest *fm;
 
     int i_init = 0;
     int i = 0;
@@ -424,19 +504,48 @@ bool ftServer::handleFileData() {
     while ((fd = persongrp->GetFileData()) != NULL ) {
         i++; /* count */
 
-        /* incoming data */
+        /* incoming data is a view of the buffer it was received into, or of the sender's buffer if it came over the loopback,
+           which the demultiplexer keeps a reference to rather than copying the data out */
+        fd->fd.binData.makeView();
         mFtDataplex->recvData(fd->LibraryMixerId(),
                               fd->fd.file.hash,  fd->fd.file.filesize,
                               fd->fd.file_offset,
                               fd->fd.binData.bin_len,
+                              fd->fd.binData.viewBuffer(),
                               fd->fd.binData.bin_data);
 
-        /* we've stolen the data part -> so blank before delete
-         */
-        fd->fd.binData.TlvShallowClear();
         delete fd;
     }
 
+    // and requests of ours that couldn't be answered.
+    while ((fu = persongrp->GetFileUnavailable()) != NULL ) {
+        i++; /* count */
+        mFtDataplex->recvDataUnavailable(fu->LibraryMixerId(),
+                                         fu->file.hash, fu->file.filesize,
+                                         fu->fileoffset, fu->chunksize,
+                                         fu->reason);
+        delete fu;
+    }
+
+    // and piece manifests, both requests for our own and pages of those we requested.
+    while ((fmr = persongrp->GetFileManifestRequest()) != NULL ) {
+        i++; /* count */
+        mFtDataplex->recvManifestRequest(fmr->LibraryMixerId(),
+                                         fmr->file.hash, fmr->file.filesize,
+                                         fmr->firstPiece);
+        delete fmr;
+    }
+
+    while ((fm = persongrp->GetFileManifest()) != NULL ) {
+        i++; /* count */
+        mFtDataplex->recvManifest(fm->LibraryMixerId(),
+                                  fm->file.hash, fm->file.filesize,
+                                  fm->totalPieces, fm->firstPiece,
+                                  QByteArray((const char *) fm->root.bin_data, fm->root.bin_len),
+                                  QByteArray((const char *) fm->pieceHashes.bin_data, fm->pieceHashes.bin_len));
+        delete fm;
+    }
+
     if (i > 0) {
         return 1;
     }
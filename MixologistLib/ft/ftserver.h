@@ -117,8 +117,8 @@ public:
     /* Cancels an existing file transfer */
     virtual void cancelFile(int groupId, const QString &hash);
 
-    /* Pauses or resumes a transfer. */
-    virtual bool controlFile(int orig_item_id, QString hash, uint32_t flags);
+    /* Pauses, resumes or moves to the top of the download queue a downloadGroup. */
+    virtual bool controlFile(int groupId, QString hash, uint32_t flags);
 
     /* Removes all completed transfers and all errored pending requests. */
     virtual void clearCompletedFiles();
@@ -133,6 +133,7 @@ public:
     virtual void getPendingRequests(std::list<pendingRequest> &requests);
     virtual void FileDownloads(QList<downloadGroupInfo> &downloads);
     virtual void FileUploads(QList<uploadFileInfo> &uploads);
+    virtual void getUploadCacheStats(uint64_t &hits, uint64_t &misses, uint64_t &cachedBytes);
 
     /**********************************************************************************
      * Directory Handling
@@ -255,7 +256,16 @@ public:
     virtual bool sendDataRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize);
 
     /* Server Send */
-    virtual bool sendData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t baseOffset, uint32_t chunkSize, void *data);
+    virtual bool sendData(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t baseOffset, const QByteArray &data);
+    virtual bool sendDataUnavailable(unsigned int librarymixer_id, QString hash, uint64_t size, uint64_t offset, uint32_t chunksize, uint32_t reason);
+
+    /* Manifest Send */
+    virtual bool sendManifestRequest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t firstPiece);
+    virtual bool sendManifest(unsigned int librarymixer_id, QString hash, uint64_t size, uint32_t totalPieces, uint32_t firstPiece,
+                              const QByteArray &root, const QByteArray &pieceHashes);
+
+    /* Connection Stats */
+    virtual float getSentRate(unsigned int librarymixer_id);
 
     /* This tick is called from the main server */
     virtual int tick();
@@ -24,6 +24,7 @@
 #include <ft/ftfilewatcher.h>
 #include <ft/ftserver.h>
 #include <ft/ftborrower.h>
+#include <ft/ftfileindex.h>
 #include <interface/peers.h>
 #include <services/mixologyservice.h>
 #include <pqi/pqinotify.h>
@@ -39,6 +40,8 @@ ftTempList::ftTempList() {
     connect(fileWatcher, SIGNAL(oldHashInvalidated(QString,qlonglong,uint)), this, SLOT(oldHashInvalidated(QString,qlonglong,uint)), Qt::QueuedConnection);
     connect(fileWatcher, SIGNAL(fileRemoved(QString)), this, SLOT(fileRemoved(QString)));
 
+    fileIndex->beginLoading();
+
     QDomElement rootNode;
     if (XmlUtil::openXml(TEMPITEMFILE, xml, rootNode, "tempitems", QIODevice::ReadWrite)){
         QDomNode currentNode = rootNode.firstChildElement("item");
@@ -52,6 +55,7 @@ ftTempList::ftTempList() {
                 tempList.append(currentItem);
                 //Check if any items are missing their hashes, continue hashing
                 for (int i = 0; i < currentItem->fileCount(); i++) {
+                    fileIndex->addFile(this, currentItem->hashes()[i], currentItem->filesizes()[i], currentItem->paths()[i]);
                     if (currentItem->hashes()[i].isEmpty()) fileWatcher->addFile(currentItem->paths()[i]);
                     else fileWatcher->addFile(currentItem->paths()[i], currentItem->filesizes()[i], currentItem->modified()[i]);
                 }
@@ -59,6 +63,8 @@ ftTempList::ftTempList() {
             currentNode = currentNode.nextSiblingElement("item");
         }
     }
+
+    fileIndex->finishLoading();
 }
 
 void ftTempList::addTempItem(const QString &title, const QStringList &paths, unsigned int friend_id, const QString &itemKey) {
@@ -157,7 +163,9 @@ void ftTempList::newFileHash(QString path, qlonglong size, unsigned int modified
         } else {
             for (int i = 0; i < item->fileCount(); i++) {
                 if (path == item->paths()[i]) {
+                    fileIndex->removeFile(this, item->hashes()[i], item->filesizes()[i], path);
                     item->setFileInfo(path, size, modified, newHash);
+                    fileIndex->addFile(this, newHash, size, path);
                     XmlUtil::writeXml(TEMPITEMFILE, xml);
                     sendTempItemIfReady(item);
                 }
@@ -198,6 +206,7 @@ void ftTempList::fileRemoved(QString path) {
 }
 
 void ftTempList::removeFile(TempShareItem *item, int index) {
+    fileIndex->removeFile(this, item->hashes()[index], item->filesizes()[index], item->paths()[index]);
     item->removeFile(index);
     if (item->fileCount() > 0) XmlUtil::writeXml(TEMPITEMFILE, xml);
     else removeTempItem(item);
@@ -205,6 +214,9 @@ void ftTempList::removeFile(TempShareItem *item, int index) {
 
 void ftTempList::removeTempItem(TempShareItem *item) {
     tempList.removeOne(item);
+    for (int i = 0; i < item->fileCount(); i++) {
+        fileIndex->removeFile(this, item->hashes()[i], item->filesizes()[i], item->paths()[i]);
+    }
     for (int i = 0; i < item->fileCount(); i++) item->removeFile(i);
     delete item;
     XmlUtil::writeXml(TEMPITEMFILE, xml);
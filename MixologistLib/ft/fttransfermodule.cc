@@ -27,20 +27,16 @@
 #include <interface/peers.h>
 #include <interface/files.h>
 #include <util/debug.h>
-
-//The amount of time we're targeting to be able to complete one rtt measurement cycle in
-const int32_t FT_TM_STD_RTT = 9; //9 seconds
-//The minimum amount of time that can pass in one rtt measurement cycle that we'll recognize
-const int32_t FT_TM_FAST_RTT = 1; //1 second
+#include <util/clock.h>
 
 ftTransferModule::ftTransferModule(unsigned int initial_friend_id, uint64_t size, const QString &hash)
-    :actualRate(0) {
+    :actualRate(0), lastManifestRequest(0), lastManifestSource(0) {
     QMutexLocker stack(&tfMtx);
 
     QString temporaryLocation =  files->getPartialsDirectory() + QDir::separator() + hash;
     mFileCreator = new ftFileCreator(temporaryLocation, size, hash);
 
-    peerInfo initialPeer(initial_friend_id);
+    peerInfo initialPeer(initial_friend_id, ftRateController::create());
     if (friendsConnectivityManager->isOnline(initial_friend_id)) {
         initialPeer.state = peerInfo::PQIPEER_ONLINE_IDLE;
     } else {
@@ -57,6 +53,9 @@ ftTransferModule::ftTransferModule(unsigned int initial_friend_id, uint64_t size
 }
 
 ftTransferModule::~ftTransferModule() {
+    foreach (peerInfo source, mFileSources.values()) {
+        delete source.rateController;
+    }
     delete mFileCreator;
 }
 
@@ -72,13 +71,26 @@ int ftTransferModule::tick() {
     case FILE_DOWNLOADING:
         {
             QMutexLocker stack(&tfMtx);
+            foreach (unsigned int librarymixer_id, mFileCreator->takeFailedSources()) {
+                locked_sourceFailedPiece(librarymixer_id);
+            }
+
             actualRate = 0;
             foreach (unsigned int librarymixer_id, mFileSources.keys()) {
                 locked_tickPeerTransfer(mFileSources[librarymixer_id]);
                 actualRate += mFileSources[librarymixer_id].actualRate;
             }
 
+            locked_requestManifest();
+
             mFileCreator->tick();
+
+            /* The last data may have been written since the sources last asked for more,
+               and the sources may all be idle or offline, so the file is checked for completion here rather than left to them. */
+            if (mFileCreator->finished()) {
+                mTransferStatus = FILE_COMPLETE;
+                return 1;
+            }
         }
         break;
     case FILE_COMPLETE:
@@ -90,12 +102,31 @@ int ftTransferModule::tick() {
     return 0;
 }
 
-void ftTransferModule::friendConnected(unsigned int friend_id) {
+void ftTransferModule::addFileSource(unsigned int friend_id) {
     QMutexLocker stack(&tfMtx);
 
-    if (!mFileSources.contains(friend_id)) return;
+    if (mFileSources.contains(friend_id)) return;
+
+    log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE,
+        "ftTransferModule::addFileSource() adding " + QString::number(friend_id) + " as a source for " + mFileCreator->getHash());
+
+    peerInfo newPeer(friend_id, ftRateController::create());
+    if (friendsConnectivityManager->isOnline(friend_id)) {
+        newPeer.state = peerInfo::PQIPEER_ONLINE_IDLE;
+    } else {
+        newPeer.state = peerInfo::PQIPEER_NOT_ONLINE;
+    }
+
+    mFileSources.insert(newPeer.librarymixer_id, newPeer);
+}
+
+bool ftTransferModule::friendConnected(unsigned int friend_id) {
+    QMutexLocker stack(&tfMtx);
+
+    if (!mFileSources.contains(friend_id)) return false;
 
     mFileSources[friend_id].state = peerInfo::PQIPEER_ONLINE_IDLE;
+    return true;
 }
 
 void ftTransferModule::friendDisconnected(unsigned int friend_id) {
@@ -109,7 +140,22 @@ void ftTransferModule::friendDisconnected(unsigned int friend_id) {
     mFileCreator->invalidateChunksRequestedFrom(friend_id);
 
     /* If we've been disconnected, set the module to restart the transfer rate next time. */
-    mFileSources[friend_id].fastStart = true;
+    mFileSources[friend_id].rateController->reset();
+}
+
+time_t ftTransferModule::nextTickDue(time_t now) const {
+    QMutexLocker stack(&tfMtx);
+
+    time_t nextDue = 0;
+    QMap<unsigned int, peerInfo>::const_iterator it;
+    for (it = mFileSources.begin(); it != mFileSources.end(); it++) {
+        if (it.value().state == peerInfo::PQIPEER_NOT_ONLINE) continue;
+
+        /* A source we're backing off from needs nothing until the back off is over, any other online source needs ticking right away. */
+        time_t due = (it.value().retryAfter > now) ? it.value().retryAfter : now;
+        if (nextDue == 0 || due < nextDue) nextDue = due;
+    }
+    return nextDue;
 }
 
 ftTransferModule::fileTransferStatus ftTransferModule::transferStatus() const {
@@ -122,6 +168,11 @@ void ftTransferModule::transferStatus(fileTransferStatus newStatus) {
     mTransferStatus = newStatus;
 }
 
+double ftTransferModule::currentRate() const {
+    QMutexLocker stack(&tfMtx);
+    return actualRate;
+}
+
 bool ftTransferModule::getFileSources(QList<unsigned int> &sourceIds) {
     QMutexLocker stack(&tfMtx);
     foreach (unsigned int friend_id, mFileSources.keys()) {
@@ -141,33 +192,98 @@ bool ftTransferModule::getPeerState(unsigned int librarymixer_id, uint32_t &stat
     return true;
 }
 
-bool ftTransferModule::recvFileData(unsigned int librarymixer_id, uint64_t offset, uint32_t chunk_size, void *data) {
+bool ftTransferModule::recvFileData(unsigned int librarymixer_id, uint64_t offset, uint32_t chunk_size, const QByteArray &dataBuffer, const void *data) {
     {
         QMutexLocker stack(&tfMtx);
 
-        if (!mFileSources.contains(librarymixer_id)) {
-            free(data);
-            return false;
-        }
+        if (!mFileSources.contains(librarymixer_id)) return false;
+
+        peerInfo &currentPeer = mFileSources[librarymixer_id];
+        locked_recvDataUpdateStats(currentPeer, offset, chunk_size);
 
-        locked_recvDataUpdateStats(mFileSources[librarymixer_id], offset, chunk_size);
+        /* Top up the window as soon as there is room rather than waiting for the next tick. */
+        if (currentPeer.rateController->pipelined() && mTransferStatus == FILE_DOWNLOADING && time(NULL) >= currentPeer.retryAfter) {
+            locked_fillWindow(currentPeer);
+        }
     }
 
-    mFileCreator->addFileData(librarymixer_id, offset, chunk_size, data);
+    mFileCreator->addFileData(librarymixer_id, offset, chunk_size, dataBuffer, data);
+
+    return true;
+}
+
+bool ftTransferModule::recvFileManifest(unsigned int librarymixer_id, uint32_t totalPieces, uint32_t firstPiece, const QByteArray &root, const QByteArray &pieceHashes) {
+    QMutexLocker stack(&tfMtx);
+
+    if (!mFileSources.contains(librarymixer_id)) return false;
+
+    if (!mFileCreator->addManifestPage(librarymixer_id, totalPieces, firstPiece, root, pieceHashes)) return false;
+
+    if (mFileCreator->needsManifest()) {
+        lastManifestRequest = time(NULL);
+        lastManifestSource = librarymixer_id;
+        ftserver->sendManifestRequest(librarymixer_id, mFileCreator->getHash(), mFileCreator->getFileSize(), mFileCreator->nextManifestPiece());
+    }
 
     return true;
 }
 
-//Start by requesting chunks of 25k. In practice this works out to a little over 5KB/s
-const double FT_TM_FAST_START_RATE = 25600;
-//Max number of times to try a source before marking it unavailable
-const uint32_t FT_TM_MAX_RESETS = 5;
 //Minimum mchunk size. In practice this works out to about 1/8KB/s
 const uint32_t FT_TM_MINIMUM_CHUNK = 128;
+//Maximum chunk size, the most a friend will read for a single request (FT_MAX_UPLOAD_READ), so that every request is answered in full
+const uint32_t FT_TM_MAXIMUM_CHUNK = 16 * 1024 * 1024;
+//Amount of time to wait before asking again a friend that told us they don't have the part we requested
+const uint32_t FT_TM_UNAVAILABLE_BACKOFF = 5; //5 seconds
+//Amount of time to wait before asking again a friend that told us they don't have the file at all, in case they get it back
+const uint32_t FT_TM_FILE_MISSING_BACKOFF = 300; //5 minutes
 //Amount of time to wait on a request before considering it dead and attempting a new one
 const uint32_t FT_TM_REQUEST_TIMEOUT = 5; //5 seconds
 //Amount of time between receiving before marking source as idle
 const uint32_t FT_TM_DOWNLOAD_TIMEOUT = 10; //10 seconds
+//Amount of time to wait on a request for the piece manifest before asking again
+const uint32_t FT_TM_MANIFEST_RETRY = 10; //10 seconds
+//Amount of time to wait before asking again a friend that sent data for a piece that failed verification, doubled for each further failure
+const uint32_t FT_TM_FAILED_PIECE_BACKOFF = 30; //30 seconds
+//Most times the failed piece back off is doubled, so a friend that keeps sending bad data is only asked about every 16 minutes
+const uint32_t FT_TM_FAILED_PIECE_MAX_DOUBLINGS = 5;
+//Most requests sent at once to top up the window of a pipelined source
+const int FT_TM_MAX_WINDOW_REQUESTS = 16;
+
+bool ftTransferModule::recvFileUnavailable(unsigned int librarymixer_id, uint64_t offset, uint32_t chunk_size, uint32_t reason) {
+    QMutexLocker stack(&tfMtx);
+
+    if (!mFileSources.contains(librarymixer_id)) return false;
+
+    time_t currentTime = time(NULL);
+    peerInfo &currentPeer = mFileSources[librarymixer_id];
+
+    /* They did answer us, so once the back off is over they should be asked again right away rather than treated as timed out. */
+    currentPeer.lastRequestTime = currentTime;
+    currentPeer.lastReceiveTime = currentTime;
+    currentPeer.numResets = 0;
+    currentPeer.state = peerInfo::PQIPEER_ONLINE_IDLE;
+
+    if (reason == FileUnavailable::FILE_NOT_FOUND || reason == FileUnavailable::FILE_CHANGED) {
+        log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE,
+            "ftTransferModule::recvFileUnavailable() " + QString::number(librarymixer_id) + " doesn't have " + mFileCreator->getHash());
+
+        /* None of our other outstanding requests to them will be answered either, so hand them all back to the other sources now
+           rather than waiting for them to time out. */
+        mFileCreator->invalidateChunksRequestedFrom(librarymixer_id);
+        currentPeer.retryAfter = currentTime + FT_TM_FILE_MISSING_BACKOFF;
+        currentPeer.rateController->reset();
+        return true;
+    }
+
+    log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE,
+        "ftTransferModule::recvFileUnavailable() " + QString::number(librarymixer_id) + " can't yet send part of " + mFileCreator->getHash());
+
+    mFileCreator->invalidateChunkRequestedFrom(librarymixer_id, offset, chunk_size);
+    currentPeer.retryAfter = currentTime + FT_TM_UNAVAILABLE_BACKOFF;
+    currentPeer.rateController->requestRefused(offset, chunk_size);
+
+    return true;
+}
 
 bool ftTransferModule::locked_tickPeerTransfer(peerInfo &currentPeer) {
 
@@ -178,48 +294,45 @@ bool ftTransferModule::locked_tickPeerTransfer(peerInfo &currentPeer) {
     /* if offline - ignore */
     if (currentPeer.state == peerInfo::PQIPEER_NOT_ONLINE) return false;
 
+    /* if they recently told us they don't have what we need - give them time to get it */
+    if (currentTime < currentPeer.retryAfter) return false;
+
+    /* A pipelined source can go a while without new requests while it waits for its window to drain,
+       so it has only stalled if nothing has arrived from it in that time either. */
+    int ageStalled = ageRequestTime;
+    if (currentPeer.rateController->pipelined() && ageReceiveTime < ageStalled) ageStalled = ageReceiveTime;
+
     /* If we haven't made a new request in a long time.
        This can be either because of connection failure or because we were too aggressive in the amount we requested
        and it couldn't be completed in FT_TM_REQUEST_TIMEOUT */
-    if (ageRequestTime > (int) (FT_TM_REQUEST_TIMEOUT * (currentPeer.numResets + 1))) {
+    if (ageStalled > (int) (FT_TM_REQUEST_TIMEOUT * (currentPeer.numResets + 1))) {
         log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_tickPeerTransfer() request timeout");
 
-#ifdef false
-        //Multi-source stuff
-        /* 2) Some of the peers might not have the file...care must be taken avoid deadlock.
-        *
-        * A edge case which used to fail badly.
-        *  Small 1K file (one chunk), with 3 sources (A,B,C). A doesn't have file.
-        *  (a) request data from A. B & C pause because no more data needed.
-        *  (b) all timeout, chunk is back in the needed pool...then back to request again (a) and repeat.
-        *  (c) all timeout x 5 and are disabled...no transfer, while B&C had it the whole time.
-        *
-        * To solve this we introduced an element of randomness to resets on timeout. */
-        if (info.numResets > 1) { /* 3rd timeout */
+        /* Some of the sources might not have the file, so care must be taken to avoid deadlock.
+         *
+         * A edge case which used to fail badly.
+         *  Small 1K file (one chunk), with 3 sources (A,B,C). A doesn't have file.
+         *  (a) request data from A. B & C pause because no more data needed.
+         *  (b) all timeout, chunk is back in the needed pool...then back to request again (a) and repeat.
+         *  (c) all timeout x 5 and are disabled...no transfer, while B&C had it the whole time.
+         *
+         * To solve this we introduced an element of randomness to resets on timeout. */
+        if (mFileSources.count() > 1 && currentPeer.numResets > 1) { /* 3rd timeout */
             /* 90% chance of return false...
              * will mean variations in which peer
              * starts first. hopefully stop deadlocks.
              */
             if (qrand() % 10 != 0) return false;
         }
-#endif
         /* reset, treat as if we received the last request so we can send a new request */
+        currentPeer.rateController->requestsTimedOut();
         currentPeer.numResets++;
         currentPeer.state = peerInfo::PQIPEER_DOWNLOADING;
         currentPeer.lastReceiveTime = currentTime;
         ageReceiveTime = 0;
 
-#ifdef false
-        /* We could potentially reach here because our friend doesn't have the requested file anymore.
-           This will disable the file.
-           For now, this has been turned off, we need transfer reliability more than bandwidth efficiency.
-           We should have a no such file packet response to bad requests instead of this. */
-        if (info.numResets >= FT_TM_MAX_RESETS) {
-            log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_tickPeerTransfer() max resets reached");
-            info.state = PQIPEER_NOT_ONLINE;
-            return false;
-        }
-#endif
+        /* A friend that no longer has the file tells us so with a FileUnavailable, so timeouts alone never give up on a source,
+           as we need transfer reliability more than bandwidth efficiency. */
     }
 
     /* if we haven't received any data in a long time */
@@ -233,27 +346,15 @@ bool ftTransferModule::locked_tickPeerTransfer(peerInfo &currentPeer) {
     currentPeer.actualRate = currentPeer.actualRate * 0.5 + currentPeer.pastTickTransferred * 0.5;
     currentPeer.pastTickTransferred = 0;
 
-    /* If more time has already passed in this rtt period than FT_TM_STD_RTT (our target time)
-     * then halt any further rate increases for this period, since we were already too aggressive. */
-    if ((currentPeer.rttActive) && ((currentTime - currentPeer.rttStart) > FT_TM_STD_RTT)) {
-        if (currentPeer.mRateChange > 0) {
-            log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_tickPeerTransfer() rate increases halted");
-            currentPeer.mRateChange = 0;
-        }
+    /* Pipelined sources are mostly topped up as their data arrives, but are also topped up here in case nothing is arriving. */
+    if (currentPeer.rateController->pipelined()) {
+        locked_fillWindow(currentPeer);
+        return true;
     }
 
     /* Calculate amount of data to request */
-    uint32_t requestSize;
-    if (currentPeer.fastStart) {
-        requestSize = FT_TM_FAST_START_RATE;
-        currentPeer.fastStart = false;
-    } else {
-        requestSize = currentPeer.actualRate * (1.0 + currentPeer.mRateChange);
-    }
-    if (requestSize < FT_TM_MINIMUM_CHUNK) {
-        requestSize = FT_TM_MINIMUM_CHUNK;
-        log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_tickPeerTransfer() minimum speed hit");
-    }
+    uint32_t requestSize = locked_limitRequestSize(currentPeer,
+                                                   currentPeer.rateController->nextRequestSize(monotonicMicroseconds(), currentPeer.actualRate));
 
     {
         QString toLog = "ftTransferModule::locked_tickPeerTransfer()";
@@ -262,79 +363,131 @@ bool ftTransferModule::locked_tickPeerTransfer(peerInfo &currentPeer) {
         log(LOG_DEBUG_BASIC, FTTRANSFERMODULEZONE, toLog);
     }
 
-    /* do request */
-    currentPeer.lastRequestTime = currentTime;
-    uint64_t requestOffset = 0;
-    if (mFileCreator->allocateRemainingChunk(currentPeer.librarymixer_id, requestOffset, requestSize) == false) {
-        mTransferStatus = FILE_COMPLETE;
-    } else {
-        if (requestSize > 0) {
-            currentPeer.state = peerInfo::PQIPEER_DOWNLOADING;
-            {
-                QString toLog = "ftTransferModule::locked_tickPeerTransfer() requesting data";
-                toLog += (" hash: " + mFileCreator->getHash());
-                toLog.append(" requestOffset: " + QString::number(requestOffset));
-                toLog.append(" requestSize: " + QString::number(requestSize));
-                log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, toLog);
-            }
-            ftserver->sendDataRequest(currentPeer.librarymixer_id, mFileCreator->getHash(), mFileCreator->getFileSize(), requestOffset, requestSize);
+    locked_sendRequest(currentPeer, requestSize);
 
-            /* if it's time to start next rtt measurement period */
-            if (!currentPeer.rttActive) {
-                currentPeer.rttStart = currentTime;
-                currentPeer.rttActive = true;
-                currentPeer.rttOffset = requestOffset + requestSize;
-            }
-        } else {
-            log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_tickPeerTransfer() waiting for a chunk to become available for a new request");
+    return true;
+}
+
+void ftTransferModule::locked_fillWindow(peerInfo &currentPeer) {
+    uint64_t now = monotonicMicroseconds();
+    for (int i = 0; i < FT_TM_MAX_WINDOW_REQUESTS; i++) {
+        uint32_t requestSize = currentPeer.rateController->nextWindowRequest(now);
+        if (requestSize == 0) return;
+
+        if (!locked_sendRequest(currentPeer, locked_limitRequestSize(currentPeer, requestSize))) return;
+    }
+}
+
+uint32_t ftTransferModule::locked_limitRequestSize(const peerInfo &currentPeer, uint32_t requestSize) const {
+    /* With multiple sources, near the end of the file we split what is left between them in proportion to their rates,
+       so that a slow source isn't handed a large chunk that faster sources then sit idle waiting on. */
+    if (mFileSources.count() > 1 && currentPeer.actualRate > 0) {
+        double totalRate = locked_totalSourceRate();
+        if (totalRate > 0) {
+            double share = mFileCreator->amountUnrequested() * (currentPeer.actualRate / totalRate);
+            if (share < requestSize) requestSize = share;
         }
     }
 
-    return true;
+    if (requestSize < FT_TM_MINIMUM_CHUNK) {
+        requestSize = FT_TM_MINIMUM_CHUNK;
+        log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_limitRequestSize() minimum speed hit");
+    }
+
+    /* The round trip rate controller asks for whatever its rate works out to, which on a fast connection can be more than will be sent. */
+    if (requestSize > FT_TM_MAXIMUM_CHUNK) requestSize = FT_TM_MAXIMUM_CHUNK;
+
+    return requestSize;
 }
 
-const double FT_TM_MAX_INCREASE = 1.00; //Doubling in speed
-const double FT_TM_MIN_INCREASE = -0.10; //Dropping to 90% speed
+bool ftTransferModule::locked_sendRequest(peerInfo &currentPeer, uint32_t requestSize) {
+    currentPeer.lastRequestTime = time(NULL);
+    uint64_t requestOffset = 0;
+    unsigned int previousOwner = 0;
+    if (mFileCreator->allocateRemainingChunk(currentPeer.librarymixer_id, requestOffset, requestSize, previousOwner) == false) {
+        mTransferStatus = FILE_COMPLETE;
+        return false;
+    }
+
+    /* The chunk was taken over from a source we had given up waiting on, or is being raced against a slow one.
+       Either way that source's rate controller stops counting it as outstanding, so it isn't left holding back their window. */
+    if (previousOwner != 0 && previousOwner != currentPeer.librarymixer_id && mFileSources.contains(previousOwner)) {
+        mFileSources[previousOwner].rateController->requestRefused(requestOffset, requestSize);
+    }
 
-void ftTransferModule::locked_recvDataUpdateStats(peerInfo &currentPeer, uint64_t startingByte, uint32_t chunk_size) {
-    time_t currentTime = time(NULL);
-    currentPeer.lastReceiveTime = currentTime;
-    currentPeer.numResets = 0;
-    currentPeer.state = peerInfo::PQIPEER_DOWNLOADING;
-    currentPeer.pastTickTransferred += chunk_size;
+    if (requestSize == 0) {
+        log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, "ftTransferModule::locked_sendRequest() waiting for a chunk to become available for a new request");
+        return false;
+    }
 
-    //If we have completed our rtt measurement cycle
-    if ((currentPeer.rttActive) && (currentPeer.rttOffset == startingByte + chunk_size)) {
+    currentPeer.state = peerInfo::PQIPEER_DOWNLOADING;
+    {
+        QString toLog = "ftTransferModule::locked_sendRequest() requesting data";
+        toLog += (" hash: " + mFileCreator->getHash());
+        toLog.append(" requestOffset: " + QString::number(requestOffset));
+        toLog.append(" requestSize: " + QString::number(requestSize));
+        log(LOG_DEBUG_ALERT, FTTRANSFERMODULEZONE, toLog);
+    }
+    ftserver->sendDataRequest(currentPeer.librarymixer_id, mFileCreator->getHash(), mFileCreator->getFileSize(), requestOffset, requestSize);
+    currentPeer.rateController->requestSent(monotonicMicroseconds(), requestOffset, requestSize);
 
-        int32_t rtt = time(NULL) - currentPeer.rttStart;
+    return true;
+}
 
-        /*
-         * We will change the rate proportionally to the amount we differ from FT_TM_STD_RTT (9 seconds).
-         * FT_TM_FAST_RTT = 1 sec. mRateChange =  1.00
-         * FT_TM_STD_RTT = 9 sec. mRateChange =  0
-         * i.e. 11 sec. mRateChange = -0.25
-         */
+void ftTransferModule::locked_requestManifest() {
+    time_t currentTime = time(NULL);
+    if (currentTime - lastManifestRequest < (int) FT_TM_MANIFEST_RETRY) return;
+    if (!mFileCreator->needsManifest()) return;
+
+    /* Find the first online source after the one we last asked, wrapping around to the start. */
+    QMap<unsigned int, peerInfo>::const_iterator it = mFileSources.upperBound(lastManifestSource);
+    for (int checked = 0; checked < mFileSources.count(); checked++, it++) {
+        if (it == mFileSources.end()) it = mFileSources.begin();
+        if (it.value().state == peerInfo::PQIPEER_NOT_ONLINE) continue;
+        if (mFileCreator->manifestSuspectFrom(it.key())) continue;
+
+        lastManifestRequest = currentTime;
+        lastManifestSource = it.key();
+        ftserver->sendManifestRequest(it.key(), mFileCreator->getHash(), mFileCreator->getFileSize(), mFileCreator->nextManifestPiece());
+        return;
+    }
+}
 
-        currentPeer.mRateChange = FT_TM_MAX_INCREASE *
-                           (FT_TM_STD_RTT - rtt) /
-                           (FT_TM_STD_RTT - FT_TM_FAST_RTT);
+void ftTransferModule::locked_sourceFailedPiece(unsigned int librarymixer_id) {
+    if (!mFileSources.contains(librarymixer_id)) return;
 
-        if (currentPeer.mRateChange > FT_TM_MAX_INCREASE)
-            currentPeer.mRateChange = FT_TM_MAX_INCREASE;
+    peerInfo &currentPeer = mFileSources[librarymixer_id];
+    currentPeer.failedPieces++;
 
-        if (currentPeer.mRateChange < FT_TM_MIN_INCREASE)
-            currentPeer.mRateChange = FT_TM_MIN_INCREASE;
+    uint32_t doublings = currentPeer.failedPieces - 1;
+    if (doublings > FT_TM_FAILED_PIECE_MAX_DOUBLINGS) doublings = FT_TM_FAILED_PIECE_MAX_DOUBLINGS;
+    time_t retryAfter = time(NULL) + (FT_TM_FAILED_PIECE_BACKOFF << doublings);
+    if (retryAfter > currentPeer.retryAfter) currentPeer.retryAfter = retryAfter;
 
-        currentPeer.rtt = rtt;
-        currentPeer.rttActive = false;
+    log(LOG_WARNING, FTTRANSFERMODULEZONE,
+        "ftTransferModule::locked_sourceFailedPiece() " + QString::number(librarymixer_id) +
+        " sent data that failed verification for " + mFileCreator->getHash() +
+        ", backing off until " + QString::number(currentPeer.retryAfter));
 
-        {
-            QString toLog = "ftTransferModule::locked_recvDataUpdateStats() rtt calculation complete";
-            toLog += " Updated Rate based on RTT: " + QString::number(rtt);
-            toLog += " Rate: " + QString::number(currentPeer.mRateChange);
-            log(LOG_DEBUG_BASIC, FTTRANSFERMODULEZONE, toLog);
-        }
+    mFileCreator->invalidateChunksRequestedFrom(librarymixer_id);
+    currentPeer.rateController->reset();
+}
 
+double ftTransferModule::locked_totalSourceRate() const {
+    double totalRate = 0;
+    QMap<unsigned int, peerInfo>::const_iterator it;
+    for (it = mFileSources.begin(); it != mFileSources.end(); it++) {
+        if (it.value().state == peerInfo::PQIPEER_DOWNLOADING) totalRate += it.value().actualRate;
     }
+    return totalRate;
 }
 
+void ftTransferModule::locked_recvDataUpdateStats(peerInfo &currentPeer, uint64_t startingByte, uint32_t chunk_size) {
+    time_t currentTime = time(NULL);
+    currentPeer.lastReceiveTime = currentTime;
+    currentPeer.numResets = 0;
+    currentPeer.state = peerInfo::PQIPEER_DOWNLOADING;
+    currentPeer.pastTickTransferred += chunk_size;
+
+    currentPeer.rateController->dataReceived(monotonicMicroseconds(), startingByte, chunk_size);
+}
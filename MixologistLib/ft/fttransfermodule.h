@@ -26,6 +26,7 @@
 #include "ft/ftfilecreator.h"
 #include "ft/ftdatademultiplex.h"
 #include "ft/ftcontroller.h"
+#include "ft/ftratecontroller.h"
 
 #include <QMutex>
 
@@ -40,12 +41,19 @@
  *
  * In practice, the way this works for file transfers is that the ftController thread's loop will have the transferModule send requests for more data.
  * Meanwhile, the incoming data is handled by the ftDataDemultiplex thread.
+ * With a pipelined rate controller, each source keeps a window of several requests outstanding, which is also topped up from the
+ * ftDataDemultiplex thread as data arrives, so that on high latency connections there is no gap between one request completing and the next being sent.
  * Stats are collected on the incoming data, to try to keep the requests in sync with the speed of the connection to that friend.
- * Reasons to avoid requesting a huge chunk all at once are (1) to avoid allocating too much of a file to one friend (for multi-source when enabled)
+ * Reasons to avoid requesting a huge chunk all at once are (1) to avoid allocating too much of a file to one friend when there are multiple sources
  * and (2) to avoid the overhead on the sender side of reading a huge chunk into memory all at once.
- * We do this by setting a target time to complete our requests of 9 seconds.
- * If we have completed our requested amount of data, and the time is less than 9 seconds, we increase the rate.
- * Conversely if we took more time to complete our request we decrease the rate.
+ * How much to request from each friend is decided by that friend's ftRateController.
+ *
+ * When more than one friend has the file, each is a separate source with its own rate control, and all are requested from in parallel.
+ * Chunks are handed out by the shared ftFileCreator, so sources never overlap except at the very end of the download,
+ * where a source that has run out of anything else to request races a slower source for its outstanding chunk.
+ *
+ * Alongside the data, the file's piece manifest is fetched from the sources a page at a time,
+ * so that the ftFileCreator can verify each piece as it completes and re-request only the pieces that fail.
  */
 
 class peerInfo;
@@ -69,20 +77,39 @@ public:
     /* Called from ftController, returns 0 normally, returns 1 when file is complete. */
     int tick();
 
+    /* Called from ftController after tick, returns the time at which this needs to be ticked again,
+       which is now if it is actively downloading, or 0 if it has no online sources and needn't be ticked until one comes online. */
+    time_t nextTickDue(time_t now) const;
+
     /* Returns the current status. */
     ftTransferModule::fileTransferStatus transferStatus() const;
 
     /* Sets the current status. */
     void transferStatus(fileTransferStatus newStatus);
 
+    /* Returns the combined rate in bytes per second that data is being received from all sources. */
+    double currentRate() const;
+
+    /* Adds the friend as a source to download this file from, if they aren't one already. */
+    void addFileSource(unsigned int friend_id);
+
     /* Called from ftController, returns a list of librarymixer ids of file sources that are known. */
     bool getFileSources(QList<unsigned int> &sourceIds);
 
     /* Called from ftController, gets the online state and target transfer rate for a friend. */
     bool getPeerState(unsigned int librarmixer_id, uint32_t &state, uint32_t &tfRate);
 
-    /* Called from ftDataDemultiplex when data is received, frees the data whether successful or not. */
-    bool recvFileData(unsigned int librarymixer_id, uint64_t offset, uint32_t chunk_size, void *data);
+    /* Called from ftDataDemultiplex when data is received, where data points into dataBuffer, which keeps it alive. */
+    bool recvFileData(unsigned int librarymixer_id, uint64_t offset, uint32_t chunk_size, const QByteArray &dataBuffer, const void *data);
+
+    /* Called from ftDataDemultiplex when a friend tells us they can't answer a request we made of them, for one of the FileUnavailable reasons.
+       Hands the range back to be requested from another source, and backs off from asking that friend for a while.
+       If the friend doesn't have the file at all, every range requested from them is handed back, and they are left alone for much longer. */
+    bool recvFileUnavailable(unsigned int librarymixer_id, uint64_t offset, uint32_t chunk_size, uint32_t reason);
+
+    /* Called from ftDataDemultiplex when a page of the file's piece manifest is received.
+       If there is more of the manifest to get, immediately requests the next page from the same friend. */
+    bool recvFileManifest(unsigned int librarymixer_id, uint32_t totalPieces, uint32_t firstPiece, const QByteArray &root, const QByteArray &pieceHashes);
 
     /* Has an independent Mutex, can be accessed directly */
     ftFileCreator* mFileCreator;
@@ -90,8 +117,9 @@ public:
     /* Originally I wanted to make these slots and make them directly connect to the friendConnected signal from friendsConnectivityManager.
        However, they never received the signals even though I checked everything a thousand times.
        Therefore, I have put the actual signal reception in ftcontroller and ftofflmlist, where they signals are received fine.
-       If anyone can figure out a way to make these directly receive the signals, that'd be a lot cleaner. */
-    void friendConnected(unsigned int friend_id);
+       If anyone can figure out a way to make these directly receive the signals, that'd be a lot cleaner.
+       friendConnected returns true if the friend is one of our sources. */
+    bool friendConnected(unsigned int friend_id);
     void friendDisconnected(unsigned int friend_id);
 
 private:
@@ -99,8 +127,30 @@ private:
        Handles calculating target rates and then requesting an appropriate amount of data. */
     bool locked_tickPeerTransfer(peerInfo &currentPeer);
 
-    /* Called by recvFileData, updates info about our transfer so that locked_tickPeerTransfer can know how much to request.
-       If we are rttActive and calculating a new rate, and we have finished receiving the full chunk, calculates the new rate change. */
+    /* Called for pipelined sources, both by tick and whenever data is received, sends as many requests as their window has room for. */
+    void locked_fillWindow(peerInfo &currentPeer);
+
+    /* Limits requestSize to this source's share of what remains unrequested when there are multiple sources,
+       and raises it to the minimum request size. */
+    uint32_t locked_limitRequestSize(const peerInfo &currentPeer, uint32_t requestSize) const;
+
+    /* Allocates a chunk of up to requestSize and sends the request for it.
+       Returns false if there was no chunk available to request, marking the transfer complete if nothing at all remains. */
+    bool locked_sendRequest(peerInfo &currentPeer, uint32_t requestSize);
+
+    /* Called by tick, requests the next page of the piece manifest if we still need it and haven't asked recently.
+       Each attempt goes to the next online source in turn, so one source that can't provide it doesn't hold us up.
+       Sources whose manifest was dropped as suspect are skipped. */
+    void locked_requestManifest();
+
+    /* Called by tick for each piece with data from librarymixer_id that failed verification.
+       Hands back their outstanding requests and backs off from them, for longer with each failure. */
+    void locked_sourceFailedPiece(unsigned int librarymixer_id);
+
+    /* Returns the combined rate of all sources that are currently downloading. */
+    double locked_totalSourceRate() const;
+
+    /* Called by recvFileData, updates info about our transfer so that locked_tickPeerTransfer can know how much to request. */
     void locked_recvDataUpdateStats(peerInfo &currentPeer, uint64_t startingByte, uint32_t chunk_size);
 
     mutable QMutex tfMtx;
@@ -113,18 +163,23 @@ private:
 
     /* Total transfer speed on this file. */
     double actualRate;
+
+    /* When we last requested a page of the piece manifest, and who from. */
+    time_t lastManifestRequest;
+    unsigned int lastManifestSource;
 };
 
 /* Used internally to hold information about each friend we have as a file source. */
 class peerInfo {
 public:
     /* Unused default constructor just so we can use QMap. */
-    peerInfo(){}
+    peerInfo():rateController(NULL){}
 
-    peerInfo(unsigned int _librarymixer_id)
+    /* The peerInfo does not take ownership of the rateController, which the ftTransferModule deletes. */
+    peerInfo(unsigned int _librarymixer_id, ftRateController *_rateController)
         :librarymixer_id(_librarymixer_id), actualRate(0), state(PQIPEER_NOT_ONLINE),
-        offset(0), chunkSize(0), receivedSize(0), lastRequestTime(0), lastReceiveTime(0), pastTickTransferred(0), numResets(0),
-        rtt(0), rttActive(false), rttStart(0), rttOffset(0),mRateChange(1), fastStart(true) {return;}
+        offset(0), chunkSize(0), receivedSize(0), lastRequestTime(0), lastReceiveTime(0), pastTickTransferred(0), numResets(0), retryAfter(0), failedPieces(0),
+        rateController(_rateController) {return;}
 
     unsigned int librarymixer_id;
     double actualRate;
@@ -148,22 +203,18 @@ public:
     uint32_t pastTickTransferred;
 
     /* Number of times that we have reset trying for this file from this peer.
-       Used to disable non-existant files. */
+       Reset whenever they answer us. */
     uint32_t numResets;
 
-    /* rtt rate control
-     * Rate control is based on the amount of time it takes for a complete chunk to be received.
-     * The target time is FT_TM_STD_RTT, at that speed, rates will neither increase nor decrease.
-     * There will be many requests and receipts for a single rtt period.
-     */
-    uint32_t rtt;       /* amount of time it took for the last rtt */
-    bool     rttActive; /* indicates we are currently measuring an rtt cycle */
-    time_t   rttStart;  /* time we began measuring request */
-    uint64_t rttOffset; /* offset in file when rtt cycle is complete */
-    float    mRateChange; /* percentage to change current rate. 0 = steady, .5 = 50% more, 1 = 100% more, -1 = 100% less */
-    /* When true, the next request will be for FT_TM_FAST_START_RATE instead of what would have been requested.
-       Used for starting out transfers as a minimum to start from, so it's true whenever we're starting out. */
-    bool    fastStart;
+    /* When a friend tells us they don't have what we asked for, such as when they are still downloading it themselves,
+       we don't make further requests of them until this time. */
+    time_t retryAfter;
+
+    /* Number of pieces containing data from this friend that have failed verification. */
+    uint32_t failedPieces;
+
+    /* Decides how much to request from this friend. */
+    ftRateController *rateController;
 };
 
 #endif  //FT_TRANSFER_MODULE_HEADER
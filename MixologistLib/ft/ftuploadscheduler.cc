@@ -0,0 +1,110 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#include <ft/ftuploadscheduler.h>
+#include <ft/ftserver.h>
+#include <interface/settings.h>
+
+//The number of friends served at once, unless overridden by the "Transfers/UploadSlots" setting
+const int FT_US_DEFAULT_SLOTS = 8;
+
+//The number of turns a friend may keep their slot for while others are waiting
+const int FT_US_SLOT_TURNS = 16;
+
+//Each friend's quantum is how much their connection would be sent in this long at its measured rate, within the limits below
+const double FT_US_QUANTUM_SECONDS = 0.25;
+const uint64_t FT_US_MIN_QUANTUM = 64 * 1024;
+const uint64_t FT_US_MAX_QUANTUM = 4 * 1024 * 1024;
+
+ftUploadScheduler::ftUploadScheduler()
+    :mCurrent(0), mTurnStarted(false) {
+    QSettings settings(*mainSettings, QSettings::IniFormat);
+    mSlots = settings.value("Transfers/UploadSlots", FT_US_DEFAULT_SLOTS).toInt();
+    if (mSlots < 1) mSlots = 1;
+}
+
+void ftUploadScheduler::addRequest(const ftRequest &request) {
+    friendQueue &queue = mFriends[request.mLibraryMixerId];
+    bool wasIdle = queue.requests.empty();
+    queue.requests.push_back(request);
+
+    if (wasIdle) {
+        if (mActive.count() < mSlots) mActive.append(request.mLibraryMixerId);
+        else mWaiting.append(request.mLibraryMixerId);
+    }
+}
+
+bool ftUploadScheduler::nextRequest(ftRequest &request) {
+    while (!mActive.isEmpty()) {
+        if (mCurrent >= mActive.count()) mCurrent = 0;
+        friendQueue &queue = mFriends[mActive[mCurrent]];
+
+        if (!mTurnStarted) {
+            if (queue.turns >= FT_US_SLOT_TURNS && !mWaiting.isEmpty()) {
+                releaseSlot(true);
+                continue;
+            }
+            queue.deficit += quantum(mActive[mCurrent]);
+            queue.turns++;
+            mTurnStarted = true;
+        }
+
+        if (queue.requests.front().mChunk <= queue.deficit) {
+            request = queue.requests.front();
+            queue.requests.pop_front();
+            queue.deficit -= request.mChunk;
+
+            if (queue.requests.empty()) releaseSlot(false);
+            return true;
+        }
+
+        /* The friend's next request is larger than what they have left this turn, so it's the next friend's turn. */
+        mCurrent++;
+        mTurnStarted = false;
+    }
+
+    return false;
+}
+
+uint64_t ftUploadScheduler::quantum(unsigned int librarymixer_id) const {
+    /* The connection's rate is in kB/s. */
+    uint64_t bytes = (uint64_t)(ftserver->getSentRate(librarymixer_id) * 1000 * FT_US_QUANTUM_SECONDS);
+    if (bytes < FT_US_MIN_QUANTUM) return FT_US_MIN_QUANTUM;
+    if (bytes > FT_US_MAX_QUANTUM) return FT_US_MAX_QUANTUM;
+    return bytes;
+}
+
+void ftUploadScheduler::releaseSlot(bool stillWaiting) {
+    unsigned int friend_id = mActive.takeAt(mCurrent);
+    friendQueue &queue = mFriends[friend_id];
+    queue.deficit = 0;
+    queue.turns = 0;
+    mTurnStarted = false;
+    if (stillWaiting) mWaiting.append(friend_id);
+
+    fillSlots();
+}
+
+void ftUploadScheduler::fillSlots() {
+    while (mActive.count() < mSlots && !mWaiting.isEmpty()) {
+        mActive.append(mWaiting.takeFirst());
+    }
+}
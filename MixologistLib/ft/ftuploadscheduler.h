@@ -0,0 +1,102 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+#ifndef FT_UPLOAD_SCHEDULER_HEADER
+#define FT_UPLOAD_SCHEDULER_HEADER
+
+#include "ft/ftdatademultiplex.h"
+
+#include <QMap>
+#include <QList>
+#include <list>
+#include <stdint.h>
+
+/*
+ * The ftUploadScheduler decides the order in which friends' requests for file data are answered,
+ * so that a friend who floods us with requests can't hold up everyone else's uploads.
+ * It is owned by the ftDataDemultiplex, and only called under its mutex.
+ *
+ * Each friend has their own queue of requests, and the queues are served by deficit round robin:
+ * on each friend's turn, their quantum of bytes is added to their deficit, and their requests are answered until the next is larger than their deficit.
+ * A friend's quantum is proportional to the rate at which data is actually being written to their connection, as measured by its pqistreamer,
+ * between FT_US_MIN_QUANTUM and FT_US_MAX_QUANTUM, so that a fast friend gets their fair share of bandwidth,
+ * while a slow friend only gets as much disk time as they can actually take.
+ * This is measured below the scheduler, so a friend can't earn a larger share by flooding us with requests,
+ * only by their link taking data faster.
+ *
+ * Only the number of friends set by "Transfers/UploadSlots" are served at once, the rest waiting in line for a slot.
+ * A friend keeps their slot while they have requests queued, but if others are waiting,
+ * gives it up after FT_US_SLOT_TURNS turns and goes to the back of the line.
+ */
+
+class ftUploadScheduler {
+public:
+    ftUploadScheduler();
+
+    /* Adds a request for file data to the back of its friend's queue. */
+    void addRequest(const ftRequest &request);
+
+    /* Takes the next request to answer into request, returning false if there are none. */
+    bool nextRequest(ftRequest &request);
+
+    /* True if there are any requests queued. */
+    bool hasRequests() const {return !mActive.isEmpty() || !mWaiting.isEmpty();}
+
+    /* The number of friends currently being served. */
+    int activeFriends() const {return mActive.count();}
+
+private:
+    struct friendQueue {
+        friendQueue():deficit(0), turns(0) {}
+
+        std::list<ftRequest> requests;
+        /* The number of bytes the friend may still be sent this turn. */
+        uint64_t deficit;
+        /* The number of turns the friend has had since getting a slot. */
+        int turns;
+    };
+
+    /* Returns the number of bytes added to the friend's deficit on each of their turns. */
+    uint64_t quantum(unsigned int librarymixer_id) const;
+
+    /* Moves the friend whose turn it is out of their slot, to the back of the line if they still have requests,
+       and fills any free slots from the front of the line. */
+    void releaseSlot(bool stillWaiting);
+
+    /* Fills free slots from the front of the line. */
+    void fillSlots();
+
+    /* All friends who have made requests, keyed by librarymixer_id. */
+    QMap<unsigned int, friendQueue> mFriends;
+
+    /* The friends being served in their round robin order, and the position in it of the friend whose turn it is. */
+    QList<unsigned int> mActive;
+    int mCurrent;
+    /* True if the friend at mCurrent has already been given their quantum for this turn. */
+    bool mTurnStarted;
+
+    /* Friends waiting for a slot, in the order they will get one. */
+    QList<unsigned int> mWaiting;
+
+    int mSlots;
+};
+
+#endif //FT_UPLOAD_SCHEDULER_HEADER
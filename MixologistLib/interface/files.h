@@ -37,6 +37,7 @@ extern Files *files;
 
 const uint32_t FILE_CTRL_PAUSE = 0x00000100;
 const uint32_t FILE_CTRL_START = 0x00000200;
+const uint32_t FILE_CTRL_MOVE_TO_TOP = 0x00000400;
 
 const uint32_t FILE_RATE_TRICKLE = 0x00000001;
 const uint32_t FILE_RATE_SLOW = 0x00000002;
@@ -81,6 +82,10 @@ public:
     virtual void FileDownloads(QList<downloadGroupInfo> &downloads) = 0;
     virtual void FileUploads(QList<uploadFileInfo> &uploads) = 0;
 
+    /* Fills in the number of blocks of uploads that were served from memory and that had to be read from disk,
+       and the bytes of file data currently held in memory. */
+    virtual void getUploadCacheStats(uint64_t &hits, uint64_t &misses, uint64_t &cachedBytes) = 0;
+
     /**********************************************************************************
      * Directory Control
      **********************************************************************************/
@@ -114,8 +119,9 @@ public:
     /* Cancels an existing file transfer from a single downloadGroup. */
     virtual void cancelFile(int groupId, const QString &hash) = 0;
 
-    /* Pauses or resumes a transfer. */
-    virtual bool controlFile(int orig_item_id, QString hash, uint32_t flags) = 0;
+    /* Pauses, resumes or moves to the top of the download queue the downloadGroup groupId,
+       according to the FILE_CTRL flags defined above. */
+    virtual bool controlFile(int groupId, QString hash, uint32_t flags) = 0;
 
     /* Removes all completed transfers and all errored pending requests. */
     virtual void clearCompletedFiles() = 0;
@@ -205,6 +205,11 @@ float ConnectionToFriend::getRate(bool in) {
     return activeConnectionMethod->getRate(in);
 }
 
+float ConnectionToFriend::getSentRate() {
+    if ((!active) || (activeConnectionMethod == NULL)) return 0;
+    return activeConnectionMethod->getSentRate();
+}
+
 void ConnectionToFriend::setMaxRate(bool in, float val) {
     // set to all of them. (and us)
     PQInterface::setMaxRate(in, val);
@@ -72,6 +72,7 @@ public:
 
     // PQInterface for rate control overloaded....
     virtual float getRate(bool in);
+    virtual float getSentRate();
     virtual void setMaxRate(bool in, float val);
 
 private:
@@ -57,6 +57,15 @@ public:
     virtual FileData *GetFileData() = 0;
     virtual int SendFileData(FileData *) = 0;
 
+    virtual FileUnavailable *GetFileUnavailable() = 0;
+    virtual int SendFileUnavailable(FileUnavailable *) = 0;
+
+    virtual FileManifestRequest *GetFileManifestRequest() = 0;
+    virtual int SendFileManifestRequest(FileManifestRequest *) = 0;
+
+    virtual FileManifest *GetFileManifest() = 0;
+    virtual int SendFileManifest(FileManifest *) = 0;
+
 };
 
 class P3Interface: public SearchInterface {
@@ -75,6 +84,11 @@ public:
     virtual int SendRawItem(RawItem *) = 0;
     virtual RawItem *GetRawItem() = 0;
 
+    /* The rate in kB/s at which data has recently been written to the connection to the friend, or 0 if there is none. */
+    virtual float getSentRate(unsigned int /*librarymixer_id*/) {
+        return 0;
+    }
+
 };
 
 #endif // PQI_TOP_HEADER
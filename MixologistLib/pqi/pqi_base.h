@@ -85,6 +85,10 @@ public:
         return bw_out;
     }
 
+    //The rate in kB/s at which data has recently been written to the connection,
+    //measured whether or not it is bandwidth limited, unlike getRate(false).
+    virtual float getSentRate() {return 0;}
+
     virtual float getMaxRate(bool in) {
         if (in) return bwMax_in;
         return bwMax_out;
@@ -194,7 +198,8 @@ public:
        Returns the amount of data sent, or -1 on error. */
     virtual int senddata(void *data, int length) = 0;
 
-    /* Returns -1 on errors, otherwise returns the size in bytes of the packet this is read. */
+    /* Reads as much as is available without blocking, up to len, which needn't end on a packet boundary.
+       Returns the number of bytes read, which is 0 if there is nothing to read yet, or -1 on errors. */
     virtual int readdata(void *data, int len) = 0;
 
     /* Returns true when connected. */
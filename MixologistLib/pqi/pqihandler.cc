@@ -99,6 +99,18 @@ int pqihandler::SendFileData(FileData *ns) {
     return HandleNetItem(ns);
 }
 
+int pqihandler::SendFileUnavailable(FileUnavailable *ns) {
+    return HandleNetItem(ns);
+}
+
+int pqihandler::SendFileManifestRequest(FileManifestRequest *ns) {
+    return HandleNetItem(ns);
+}
+
+int pqihandler::SendFileManifest(FileManifest *ns) {
+    return HandleNetItem(ns);
+}
+
 int pqihandler::SendRawItem(RawItem *ns) {
     return HandleNetItem(ns);
 }
@@ -168,6 +180,24 @@ void pqihandler::locked_SortnStoreItem(NetItem *item) {
                             item = NULL;
                             break;
 
+                        case PKT_SUBTYPE_FI_UNAVAILABLE:
+                            log(LOG_DEBUG_BASIC, PQIHANDLERZONE, "SortnStore->File Unavailable");
+                            in_unavailable.push_back(item);
+                            item = NULL;
+                            break;
+
+                        case PKT_SUBTYPE_FI_MANIFEST_REQUEST:
+                            log(LOG_DEBUG_BASIC, PQIHANDLERZONE, "SortnStore->File Manifest Request");
+                            in_manifest_request.push_back(item);
+                            item = NULL;
+                            break;
+
+                        case PKT_SUBTYPE_FI_MANIFEST:
+                            log(LOG_DEBUG_BASIC, PQIHANDLERZONE, "SortnStore->File Manifest");
+                            in_manifest.push_back(item);
+                            item = NULL;
+                            break;
+
                         default:
                             break; /* no match! */
                     }
@@ -220,6 +250,48 @@ FileData *pqihandler::GetFileData() {
     return NULL;
 }
 
+FileUnavailable *pqihandler::GetFileUnavailable() {
+    QMutexLocker stack(&coreMtx);
+
+    if (in_unavailable.size() != 0) {
+        FileUnavailable *fi = dynamic_cast<FileUnavailable *>(in_unavailable.front());
+        if (!fi) {
+            delete in_unavailable.front();
+        }
+        in_unavailable.pop_front();
+        return fi;
+    }
+    return NULL;
+}
+
+FileManifestRequest *pqihandler::GetFileManifestRequest() {
+    QMutexLocker stack(&coreMtx);
+
+    if (in_manifest_request.size() != 0) {
+        FileManifestRequest *fi = dynamic_cast<FileManifestRequest *>(in_manifest_request.front());
+        if (!fi) {
+            delete in_manifest_request.front();
+        }
+        in_manifest_request.pop_front();
+        return fi;
+    }
+    return NULL;
+}
+
+FileManifest *pqihandler::GetFileManifest() {
+    QMutexLocker stack(&coreMtx);
+
+    if (in_manifest.size() != 0) {
+        FileManifest *fi = dynamic_cast<FileManifest *>(in_manifest.front());
+        if (!fi) {
+            delete in_manifest.front();
+        }
+        in_manifest.pop_front();
+        return fi;
+    }
+    return NULL;
+}
+
 RawItem *pqihandler::GetRawItem() {
     QMutexLocker stack(&coreMtx);
 
@@ -234,6 +306,12 @@ RawItem *pqihandler::GetRawItem() {
     return NULL;
 }
 
+float pqihandler::getSentRate(unsigned int librarymixer_id) {
+    QMutexLocker stack(&coreMtx);
+    if (!connectionsToFriends.contains(librarymixer_id)) return 0;
+    return connectionsToFriends[librarymixer_id]->getSentRate();
+}
+
 static const float MIN_RATE = 0.01; // 10 B/s
 
 // internal fn to send updates
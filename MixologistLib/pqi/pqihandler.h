@@ -53,6 +53,12 @@ public:
     virtual int SendFileData(FileData *ns);
     virtual FileRequest *GetFileRequest();
     virtual FileData *GetFileData();
+    virtual int SendFileUnavailable(FileUnavailable *ns);
+    virtual FileUnavailable *GetFileUnavailable();
+    virtual int SendFileManifestRequest(FileManifestRequest *ns);
+    virtual FileManifestRequest *GetFileManifestRequest();
+    virtual int SendFileManifest(FileManifest *ns);
+    virtual FileManifest *GetFileManifest();
 
     // Rest of P3Interface
     /* In practice, this tick is called from AggregatedConnectionsToFriends, which implemented pqihandler */
@@ -67,6 +73,7 @@ public:
     float getMaxIndivRate(bool in);
     void setMaxRate(bool in, float val);
     float getMaxRate(bool in);
+    virtual float getSentRate(unsigned int librarymixer_id);
 
 protected:
     /* check to be overloaded by those that can
@@ -78,7 +85,7 @@ protected:
 
     //Called from tick, steps through the pqis and takes all the incoming items off of them, and then calling SortnStoreItem on the items
     int locked_GetItems();
-    //Called from locked_GetItems, takes an incoming item and puts it on the appropriate incoming queue (i.e. service, file request, file data)
+    //Called from locked_GetItems, takes an incoming item and puts it on the appropriate incoming queue (i.e. service, file request, file data, file unavailable, file manifest)
     void locked_SortnStoreItem(NetItem *item);
 
     mutable QMutex coreMtx;
@@ -89,7 +96,7 @@ protected:
     QMap<unsigned int, PQInterface *> connectionsToFriends;
 
     //Incoming queues
-    QList<NetItem *> in_request, in_data, in_service;
+    QList<NetItem *> in_request, in_data, in_unavailable, in_manifest_request, in_manifest, in_service;
 
 private:
 
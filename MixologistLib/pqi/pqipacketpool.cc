@@ -0,0 +1,102 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include "pqi/pqipacketpool.h"
+
+#include <stdlib.h>
+
+/* How many bytes each size class may hold for reuse, though every class may hold at least one buffer.
+   Small buffers are capped by count instead, as even many of them take little memory. */
+const uint32_t PQI_POOL_MAX_CACHED_BYTES_PER_CLASS = 262144;
+const uint32_t PQI_POOL_MAX_CACHED_BUFFERS_PER_CLASS = 32;
+
+pqiPacketPool::pqiPacketPool() {}
+
+pqiPacketPool::~pqiPacketPool() {
+    for (int i = 0; i < num_size_classes; i++) {
+        for (unsigned int j = 0; j < freeBuffers[i].size(); j++) {
+            free(freeBuffers[i][j]);
+        }
+    }
+}
+
+void *pqiPacketPool::allocate(uint32_t size, uint32_t &capacity) {
+    poolStats.allocations++;
+
+    int index = sizeClass(size);
+    if (index < 0) {
+        capacity = size;
+        return malloc(size);
+    }
+
+    capacity = classSize(index);
+    if (!freeBuffers[index].empty()) {
+        void *buffer = freeBuffers[index].back();
+        freeBuffers[index].pop_back();
+        poolStats.reused++;
+        poolStats.cachedBuffers--;
+        poolStats.cachedBytes -= capacity;
+        return buffer;
+    }
+
+    return malloc(capacity);
+}
+
+void pqiPacketPool::release(void *buffer, uint32_t capacity) {
+    if (!buffer) return;
+
+    int index = sizeClass(capacity);
+    /* Only buffers that were allocated as a size class are exactly the size of one. */
+    if (index < 0 || classSize(index) != capacity) {
+        free(buffer);
+        return;
+    }
+
+    uint32_t maxCached = PQI_POOL_MAX_CACHED_BYTES_PER_CLASS / capacity;
+    if (maxCached < 1) maxCached = 1;
+    if (maxCached > PQI_POOL_MAX_CACHED_BUFFERS_PER_CLASS) maxCached = PQI_POOL_MAX_CACHED_BUFFERS_PER_CLASS;
+
+    if (freeBuffers[index].size() >= maxCached) {
+        poolStats.discarded++;
+        free(buffer);
+        return;
+    }
+
+    freeBuffers[index].push_back(buffer);
+    poolStats.cachedBuffers++;
+    poolStats.cachedBytes += capacity;
+}
+
+pqiPacketPoolStats pqiPacketPool::stats() const {
+    return poolStats;
+}
+
+int pqiPacketPool::sizeClass(uint32_t size) {
+    for (int i = 0; i < num_size_classes; i++) {
+        if (size <= classSize(i)) return i;
+    }
+    return -1;
+}
+
+uint32_t pqiPacketPool::classSize(int sizeClass) {
+    return 1u << (smallest_class_bits + sizeClass * class_step_bits);
+}
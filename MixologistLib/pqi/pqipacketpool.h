@@ -0,0 +1,85 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef MRK_PQI_PACKET_POOL_HEADER
+#define MRK_PQI_PACKET_POOL_HEADER
+
+#include <stdint.h>
+#include <vector>
+
+/*
+A pool of buffers for serialising packets into, so that the many packets a pqistreamer sends each second
+reuse the same handful of buffers rather than each being malloced and freed.
+Buffers are handed out in a small number of size classes, each a power of two, and a released buffer is kept
+for reuse by its class until that class is holding as many as it is allowed.
+Requests larger than the largest class are simply malloced and freed.
+
+Each pqistreamer has its own pool, and like the rest of the pqistreamer, it is protected by the streamer's mutex,
+so the pool itself does no locking.
+*/
+
+struct pqiPacketPoolStats {
+    pqiPacketPoolStats():allocations(0), reused(0), discarded(0), cachedBuffers(0), cachedBytes(0) {}
+
+    /* Number of buffers handed out, and how many of those were reused rather than newly malloced. */
+    uint64_t allocations;
+    uint64_t reused;
+    /* Number of buffers freed when released because their class was already holding as many as it is allowed. */
+    uint64_t discarded;
+    /* The buffers currently held for reuse. */
+    uint32_t cachedBuffers;
+    uint64_t cachedBytes;
+};
+
+class pqiPacketPool {
+public:
+    pqiPacketPool();
+    ~pqiPacketPool();
+
+    /* Returns a buffer of at least size bytes, setting capacity to its actual size, or NULL if it couldn't be allocated. */
+    void *allocate(uint32_t size, uint32_t &capacity);
+
+    /* Returns a buffer from allocate to the pool, where capacity is the capacity it was allocated with. */
+    void release(void *buffer, uint32_t capacity);
+
+    pqiPacketPoolStats stats() const;
+
+private:
+    /* The size classes run from 256 bytes up to 256 KB, the largest packet size, each four times the one before. */
+    enum {
+        smallest_class_bits = 8,
+        class_step_bits = 2,
+        num_size_classes = 6
+    };
+
+    /* Returns the index of the smallest size class that holds size bytes, or -1 if it is larger than all of them. */
+    static int sizeClass(uint32_t size);
+
+    static uint32_t classSize(int sizeClass);
+
+    /* Buffers held for reuse in each size class. */
+    std::vector<void *> freeBuffers[num_size_classes];
+
+    pqiPacketPoolStats poolStats;
+};
+
+#endif //MRK_PQI_PACKET_POOL_HEADER
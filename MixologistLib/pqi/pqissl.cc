@@ -128,7 +128,6 @@ void pqissl::reset() {
     ssl_connection = NULL;
     sameLAN = false;
     errorZeroReturnCount = 0;
-    readSoFar = 0;
 
     /* We only notify of this event if we actually shut something down. */
     if (neededReset && parent()) {
@@ -201,12 +200,11 @@ int pqissl::senddata(void *data, int length) {
 }
 
 int pqissl::readdata(void *data, int length) {
-    /* Read in the packet. However, packets can be split into multiple ssl buffers when they are larger than 16384 bytes.
-       Therefore, we use a do while loop to read it in multiple slices. */
-    do {
-        int bytesRead = SSL_read(ssl_connection,
-                                 (void *)((unsigned long int)data + (unsigned long int)readSoFar),
-                                 length - readSoFar);
+    /* SSL_read returns at most one SSL record at a time, so we keep reading records until either length is reached,
+       or there are no more complete records available right now. */
+    int readSoFar = 0;
+    while (readSoFar < length) {
+        int bytesRead = SSL_read(ssl_connection, (char *) data + readSoFar, length - readSoFar);
 
         /* bytesRead = 0 means unsuccessful read by SSL_read, < 0 means error */
         if (bytesRead <= 0) {
@@ -236,23 +234,23 @@ int pqissl::readdata(void *data, int length) {
                 }
 
                 log(LOG_DEBUG_ALERT, PQISSLZONE, out.str().c_str());
-                return -1;
+                break;
             }
 
             /* The only real error we expect */
             if (sslErrorCode == SSL_ERROR_SYSCALL) {
                 log(LOG_WARNING, PQISSLZONE, "Connection to " + addressToString(&remote_addr) + " lost");
                 reset();
-                return -1;
+                break;
             } else if (sslErrorCode == SSL_ERROR_WANT_WRITE) {
                 log(LOG_DEBUG_ALERT, PQISSLZONE, "SSL_read() SSL_ERROR_WANT_WRITE");
-                return -1;
+                break;
             } else if (sslErrorCode == SSL_ERROR_WANT_READ) {
                 /* SSL_WANT_READ is not a critical error. It's just a sign that
-                   the internal SSL buffer is not ready to accept more data. So -1
-                   is returned, and the connection will be retried as is on next call of readdata().*/
+                   there is no complete SSL record available to read yet. So we return what
+                   we have so far, and the rest will be read on a later call of readdata().*/
                 log(LOG_DEBUG_ALL, PQISSLZONE, "SSL_read() SSL_ERROR_WANT_READ");
-                return -1;
+                return readSoFar;
             } else {
                 std::ostringstream out;
                 out << "SSL_read() UNKNOWN ERROR: " << sslErrorCode;
@@ -261,21 +259,17 @@ int pqissl::readdata(void *data, int length) {
                 printSSLError(ssl_connection, bytesRead, sslErrorCode, extraErrorInfo, out);
                 log(LOG_DEBUG_ALERT, PQISSLZONE, out.str().c_str());
                 reset();
-                return -1;
+                break;
             }
-        } else readSoFar += bytesRead;
-    } while (readSoFar < length);
+        }
 
-    if (length != readSoFar) {
-        QString toLog = QString("pqissl::readdata() finished but expected length was ") +
-                        QString::number(length) + ", but actually read " +
-                        QString::number(readSoFar) + "\n";
-        log(LOG_DEBUG_ALERT, PQISSLZONE, toLog);
+        readSoFar += bytesRead;
+        errorZeroReturnCount = 0;
     }
 
-    readSoFar = 0;
-    errorZeroReturnCount = 0;
-    return length;
+    /* Anything read before an error is still returned, and the error will be seen again on the next call if it persists. */
+    if (readSoFar == 0 && length > 0) return -1;
+    return readSoFar;
 }
 
 bool pqissl::isactive() {return currentlyConnected;}
@@ -95,7 +95,8 @@ public:
        Returns the amount of data sent, or -1 on error. */
     virtual int senddata(void *data, int length);
 
-    /* Returns -1 on errors, otherwise returns the size in bytes of the packet this is read. */
+    /* Reads as much as is available without blocking, up to length, which needn't end on a packet boundary.
+       Returns the number of bytes read, which is 0 if there is nothing to read yet, or -1 on errors. */
     virtual int readdata(void *data, int length);
 
     /* Returns true when connected. */
@@ -186,10 +187,6 @@ protected:
     int mOpenSocket;
     struct sockaddr_in remote_addr;
 
-    /* Reading in packets may require multiple calls to readdata().
-       This stores how far in we've made it into our read so far. */
-    int readSoFar;
-
     /* Whether we are on the same subnet as this friend. Used to exempt from bandwidth balancing. */
     bool sameLAN;
 
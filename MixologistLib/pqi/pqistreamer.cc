@@ -35,6 +35,9 @@
 
 const int PQISTREAM_ABS_MAX = 900000000; /* ~900 MB/sec (actually per loop) */
 
+/* The most plaintext one TLS record can carry, so each write of the send buffer is a single full record. */
+const int PQISTREAM_SEND_BUFFER_SIZE = 16384;
+
 /* This removes the print statements (which hammer pqidebug) */
 /***
 #define NeTITEM_DEBUG 1
@@ -43,19 +46,17 @@ const int PQISTREAM_ABS_MAX = 900000000; /* ~900 MB/sec (actually per loop) */
 
 pqistreamer::pqistreamer(Serialiser *rss, std::string id, unsigned int librarymixer_id, BinInterface *bio_in, int bio_flags_in)
     :PQInterface(id, librarymixer_id), serialiser(rss), bio(bio_in), bio_flags(bio_flags_in),
-     pkt_wpending(NULL),
+     send_buffer_len(0), pkt_wpending(NULL), wpending_offset(0),
      totalRead(0), totalSent(0),
      currRead(0), currSent(0),
-     avgReadCount(0), avgSentCount(0) {
+     avgReadCount(0), avgSentCount(0), sentRate(0) {
     avgLastUpdate = currReadTS = currSentTS = time(NULL);
 
-    /* allocated once */
-    pkt_rpend_size = getPktMaxSize();
-    pkt_rpending = malloc(pkt_rpend_size);
-    reading_state = reading_state_initial;
+    /* Twice the largest packet, so that a partial packet only needs moving once most of the buffer has been used. */
+    recv_buffer.resize(2 * getPktMaxSize());
+    recv_start = recv_end = 0;
 
-    // avoid uninitialized (and random) memory read.
-    memset(pkt_rpending,0,pkt_rpend_size);
+    send_buffer = malloc(PQISTREAM_SEND_BUFFER_SIZE);
 
     // 100 B/s (minimal)
     setMaxRate(true, 0.1);
@@ -80,8 +81,6 @@ pqistreamer::pqistreamer(Serialiser *rss, std::string id, unsigned int librarymi
         exit(1);
     }
 
-    failed_read_attempts = 0;                      // reset failed read, as no packet is still read.
-
     return;
 }
 
@@ -115,24 +114,24 @@ pqistreamer::~pqistreamer() {
 
     // clean up outgoing. (cntrl packets)
     while (out_pkt.size() > 0) {
-        void *pkt = out_pkt.front();
+        outPacket *pkt = out_pkt.front();
         out_pkt.pop_front();
-        free(pkt);
+        freePacket(pkt);
     }
 
     // clean up outgoing (data packets)
     while (out_data.size() > 0) {
-        void *pkt = out_data.front();
+        outPacket *pkt = out_data.front();
         out_data.pop_front();
-        free(pkt);
+        freePacket(pkt);
     }
 
     if (pkt_wpending) {
-        free(pkt_wpending);
+        freePacket(pkt_wpending);
         pkt_wpending = NULL;
     }
 
-    free(pkt_rpending);
+    free(send_buffer);
 
     // clean up outgoing.
     while (incoming.size() > 0) {
@@ -166,19 +165,15 @@ int pqistreamer::SendItem(NetItem *si) {
     FileData *data = dynamic_cast<FileData *>(si);
     bool isControl = (data == NULL);
 
-    uint32_t pktsize = serialiser->size(si);
-    void *ptr = malloc(pktsize);
+    outPacket *pkt = serialisePacket(si);
 
-    if (serialiser->serialise(si, ptr, &pktsize)) {
+    if (pkt) {
         if (isControl) {
-            out_pkt.push_back(ptr);
+            out_pkt.push_back(pkt);
         } else {
-            out_data.push_back(ptr);
+            out_data.push_back(pkt);
         }
     } else {
-        /* cleanup serialiser */
-        free(ptr);
-
         std::ostringstream out;
         out << "pqistreamer::SendItem() Null Pkt generated!";
         out << std::endl;
@@ -194,6 +189,45 @@ int pqistreamer::SendItem(NetItem *si) {
     return 1;
 }
 
+outPacket *pqistreamer::serialisePacket(NetItem *si) {
+    outPacket *pkt = new outPacket();
+    uint32_t pktsize = serialiser->size(si);
+
+    /* File data that is a view of a shared buffer is left where it is, and only the rest of the packet is serialised. */
+    FileData *data = dynamic_cast<FileData *>(si);
+    if (data && data->fd.binData.isView()) {
+        uint32_t headersize = pktsize - data->fd.binData.bin_len;
+        pkt->header = packetPool.allocate(headersize, pkt->headerCapacity);
+        if (pkt->header && serialiser->serialiseHeader(si, pkt->header, &headersize)) {
+            pkt->headerSize = headersize;
+            pkt->payloadBuffer = data->fd.binData.viewBuffer();
+            pkt->payload = data->fd.binData.bin_data;
+            pkt->payloadSize = data->fd.binData.bin_len;
+            return pkt;
+        }
+        freePacket(pkt);
+        return NULL;
+    }
+
+    pkt->header = packetPool.allocate(pktsize, pkt->headerCapacity);
+    if (pkt->header && serialiser->serialise(si, pkt->header, &pktsize)) {
+        pkt->headerSize = pktsize;
+        return pkt;
+    }
+    freePacket(pkt);
+    return NULL;
+}
+
+void pqistreamer::freePacket(outPacket *pkt) {
+    packetPool.release(pkt->header, pkt->headerCapacity);
+    delete pkt;
+}
+
+pqiPacketPoolStats pqistreamer::getPacketPoolStats() const {
+    QMutexLocker stack(&streamerMtx);
+    return packetPool.stats();
+}
+
 NetItem *pqistreamer::GetItem() {
     {
         std::ostringstream out;
@@ -238,7 +272,7 @@ int pqistreamer::tick() {
 
     /* give details of the packets */
     {
-        std::list<void *>::iterator it;
+        std::list<outPacket *>::iterator it;
 
         std::ostringstream out;
         out << "pqistreamer::tick() Queued Data:";
@@ -256,7 +290,7 @@ int pqistreamer::tick() {
             int total = 0;
 
             for (it = out_pkt.begin(); it != out_pkt.end(); it++) {
-                total += getNetItemSize(*it);
+                total += getNetItemSize((*it)->header);
             }
 
             out << "\t Out Packets [" << out_pkt.size() << "] => " << total;
@@ -264,7 +298,7 @@ int pqistreamer::tick() {
 
             total = 0;
             for (it = out_data.begin(); it != out_data.end(); it++) {
-                total += getNetItemSize(*it);
+                total += getNetItemSize((*it)->header);
             }
 
             out << "\t Out Data    [" << out_data.size() << "] => " << total;
@@ -272,6 +306,12 @@ int pqistreamer::tick() {
 
             out << "\t Incoming    [" << incoming.size() << "]";
             out << std::endl;
+
+            pqiPacketPoolStats poolStats = packetPool.stats();
+            out << "\t Packet Pool [" << poolStats.cachedBuffers << "] => " << poolStats.cachedBytes << " bytes";
+            out << ", reused " << poolStats.reused << "/" << poolStats.allocations;
+            out << ", discarded " << poolStats.discarded;
+            out << std::endl;
         }
 
         pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, out.str().c_str());
@@ -297,12 +337,12 @@ int pqistreamer::handleoutgoing() {
 
     int sentbytes = 0;
 
-    std::list<void *>::iterator it;
+    std::list<outPacket *>::iterator it;
 
     if (!(bio->isactive())) {
         /* if we are not active - clear anything in the queues. */
         for (it = out_pkt.begin(); it != out_pkt.end(); ) {
-            free(*it);
+            freePacket(*it);
             it = out_pkt.erase(it);
 
             std::ostringstream out;
@@ -310,7 +350,7 @@ int pqistreamer::handleoutgoing() {
             pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, out.str().c_str());
         }
         for (it = out_data.begin(); it != out_data.end(); ) {
-            free(*it);
+            freePacket(*it);
             it = out_data.erase(it);
 
             std::ostringstream out;
@@ -320,9 +360,11 @@ int pqistreamer::handleoutgoing() {
 
         /* also remove the pending packets */
         if (pkt_wpending) {
-            free(pkt_wpending);
+            freePacket(pkt_wpending);
             pkt_wpending = NULL;
+            wpending_offset = 0;
         }
+        send_buffer_len = 0;
 
         outSentBytes(sentbytes);
         return 0;
@@ -345,38 +387,25 @@ int pqistreamer::handleoutgoing() {
             return 0;
         }
 
-        // send a out_pkt, else send out_data. unless
-        // there is a pending packet.
-        if (!pkt_wpending) {
-            if (out_pkt.size() > 0) {
-                pkt_wpending = *(out_pkt.begin());
-                out_pkt.pop_front();
-            } else if (out_data.size() > 0) {
-                pkt_wpending = *(out_data.begin());
-                out_data.pop_front();
-            }
-        }
+        // unless a previous write failed and must be retried, pack the queued packets into the send buffer.
+        if (send_buffer_len == 0) fillSendBuffer();
 
-        if (pkt_wpending) {
-            // write packet.
-            int bytes_to_send = getNetItemSize(pkt_wpending);
+        if (send_buffer_len > 0) {
             int bytes_sent;
-
-            if (bytes_to_send != (bytes_sent = bio->senddata(pkt_wpending, bytes_to_send))) {
+            if (send_buffer_len != (bytes_sent = bio->senddata(send_buffer, send_buffer_len))) {
                 std::ostringstream out;
-                out << "Problems with Send Data! (only " << bytes_sent << " bytes sent" << ", total pkt size=" << bytes_to_send;
+                out << "Problems with Send Data! (only " << bytes_sent << " bytes sent" << ", total buffer size=" << send_buffer_len;
                 pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, out.str().c_str());
 
                 outSentBytes(sentbytes);
-                // pkt_wpending will kept til next time.
+                // send_buffer will be kept til next time.
                 // ensuring exactly the same data is written (openSSL requirement).
                 return -1;
             }
 
-            free(pkt_wpending);
-            pkt_wpending = NULL;
+            sentbytes += send_buffer_len;
+            send_buffer_len = 0;
 
-            sentbytes += bytes_to_send;
             allSent = true;
         }
     }
@@ -384,118 +413,165 @@ int pqistreamer::handleoutgoing() {
     return 1;
 }
 
+void pqistreamer::fillSendBuffer() {
+    while (send_buffer_len < PQISTREAM_SEND_BUFFER_SIZE) {
+        // send a out_pkt, else send out_data. unless
+        // there is a partially copied packet.
+        if (!pkt_wpending) {
+            if (out_pkt.size() > 0) {
+                pkt_wpending = *(out_pkt.begin());
+                out_pkt.pop_front();
+            } else if (out_data.size() > 0) {
+                pkt_wpending = *(out_data.begin());
+                out_data.pop_front();
+            } else {
+                break;
+            }
+            wpending_offset = 0;
+        }
+
+        // copy the packet, header first and then any payload, for as much as fits.
+        uint32_t packetSize = pkt_wpending->headerSize + pkt_wpending->payloadSize;
+        while (wpending_offset < packetSize && send_buffer_len < PQISTREAM_SEND_BUFFER_SIZE) {
+            const char *segment;
+            uint32_t remaining;
+            if (wpending_offset < pkt_wpending->headerSize) {
+                segment = (const char *) pkt_wpending->header + wpending_offset;
+                remaining = pkt_wpending->headerSize - wpending_offset;
+            } else {
+                segment = (const char *) pkt_wpending->payload + (wpending_offset - pkt_wpending->headerSize);
+                remaining = packetSize - wpending_offset;
+            }
+
+            uint32_t toCopy = PQISTREAM_SEND_BUFFER_SIZE - send_buffer_len;
+            if (remaining < toCopy) toCopy = remaining;
+
+            memcpy((char *) send_buffer + send_buffer_len, segment, toCopy);
+            send_buffer_len += toCopy;
+            wpending_offset += toCopy;
+        }
+
+        if (wpending_offset < packetSize) break;
+
+        freePacket(pkt_wpending);
+        pkt_wpending = NULL;
+        wpending_offset = 0;
+    }
+}
+
 
 /*
-This long and complicated function is basically broken into two parts.
-In the first, labeled start_packet_read, we attempt to read the basic block, which is the minimum packet size.
-Once we have that we mark reading_state to started, and can read the full size in the header from the basic block.
-Once we have the full size, we proceed to read in and deserialize the packet.
-If when we finish deserializing, we still have more available to read and haven't hit our transfer cap yet, we loop back to start_packet_read.
+Reads as much as is available into recv_buffer, and deserialises every complete packet in it,
+leaving any partial packet at the end for the next read to complete.
+If we still have more available to read and haven't hit our transfer cap yet, we read again.
 */
 int pqistreamer::handleincoming() {
     int readbytes = 0;
-    static const int max_failed_read_attempts = 2000;
 
     pqioutput(PQL_DEBUG_ALL, PQISTREAMERZONE, "pqistreamer::handleincoming()");
 
     if (!(bio->isactive())) {
-        reading_state = reading_state_initial;
+        recv_start = recv_end = 0;
         inReadBytes(readbytes);
         return 0;
     }
 
-    // enough space to read any packet.
-    int maxlen = pkt_rpend_size;
-    void *block = pkt_rpending;
-
-    // initial read size: basic packet.
-    int baseLength = getPktBaseSize();
-
     int maxin = inAllowedBytes();
 
-start_packet_read:
-    {
-        // read the basic block (minimum packet size)
-        int amountRead;
-        // reset the block, to avoid uninitialized memory reads.
-        memset(block,0,baseLength);
+    while (true) {
+        makeRecvSpace();
+
+        /* Written through constData, as recv_buffer may be shared with views of packets already deserialised,
+           and writing through data() would copy it. No view covers anything after recv_end. */
+        char *readPoint = const_cast<char *>(recv_buffer.constData()) + recv_end;
+        int amountRead = bio->readdata(readPoint, recv_buffer.size() - recv_end);
+
+        if (amountRead == 0) {
+            pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, "pqistreamer::handleincoming() read blocked");
+            break;
+        } else if (amountRead < 0) {
+            // Most likely it is either nothing to read or a packet is pending but could not be read by pqissl because of stream flow.
+            // So we return without an error, and any partial packet is completed by a later read.
+            pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, "pqistreamer::handleincoming() Error in bio read");
+            break;
+        }
 
-        if (baseLength != (amountRead = bio->readdata(block, baseLength))) {
-            pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, "pqistreamer::handleincoming() Didn't read BasePkt!");
+        recv_end += amountRead;
+        readbytes += amountRead;
 
+        if (!deserialiseReceived()) {
             inReadBytes(readbytes);
+            return -1;
+        }
 
-            if (amountRead == 0) {
-                pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, "pqistreamer::handleincoming() read blocked");
-                return 0;
-            } else if (amountRead < 0) {
-                // TMost likely it is either nothing to read or a packet is pending but could not be read by pqissl because of stream flow.
-                // So we return without an error, and leave the machine state in 'start_read'.
-                pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, "pqistreamer::handleincoming() Error in bio read");
-                return 0;
-            } else {
-                // This should never happen as partial reads are handled at a lower layer in the bio.
-                std::ostringstream out;
-                out << "pqistreamer::handleincoming() Incomplete ";
-                out << "(Strange) read of " << amountRead << " bytes";
-                pqioutput(PQL_ALERT, PQISTREAMERZONE, out.str().c_str());
-                return -1;
-            }
+        if (maxin < readbytes) {
+            pqioutput(PQL_DEBUG_ALERT, PQISTREAMERZONE, "pqistreamer::handleincoming() Max bytes read");
+            break;
         }
 
-        readbytes += baseLength;
-        reading_state = reading_state_packet_started;
-        failed_read_attempts = 0; // base packet totally read, reset failed read count
+        if (!bio->moretoread()) break;
     }
 
-    {
-        // How much more to read.
-        int extraLength = getNetItemSize(block) - baseLength;
+    inReadBytes(readbytes);
+    return 0;
+}
+
+void pqistreamer::makeRecvSpace() {
+    int pending = recv_end - recv_start;
+
+    /* Nothing is left to deserialise and nothing else is using the buffer, so it can simply be started again. */
+    if (pending == 0 && recv_buffer.isDetached()) {
+        recv_start = recv_end = 0;
+        return;
+    }
+
+    if (recv_buffer.size() - recv_start >= (int) getPktMaxSize()) return;
+
+    if (recv_buffer.isDetached()) {
+        memmove(recv_buffer.data(), recv_buffer.constData() + recv_start, pending);
+    } else {
+        /* The old buffer is freed once the last view of it is. */
+        QByteArray newBuffer;
+        newBuffer.resize(recv_buffer.size());
+        memcpy(newBuffer.data(), recv_buffer.constData() + recv_start, pending);
+        recv_buffer = newBuffer;
+    }
+    recv_start = 0;
+    recv_end = pending;
+}
+
+bool pqistreamer::deserialiseReceived() {
+    uint32_t baseLength = getPktBaseSize();
 
-        if (extraLength > maxlen - baseLength) {
+    while ((uint32_t)(recv_end - recv_start) >= baseLength) {
+        uint32_t packetSize = getNetItemSize((void *)(recv_buffer.constData() + recv_start));
+
+        if (packetSize > getPktMaxSize()) {
             pqioutput(PQL_ALERT, PQISTREAMERZONE, "Received a packet larger than the maximum limit allowed!");
             bio->close();
-            reading_state = reading_state_initial;
-            failed_read_attempts = 0;
-            return -1;
+            recv_start = recv_end = 0;
+            return false;
+        } else if (packetSize < baseLength) {
+            pqioutput(PQL_ALERT, PQISTREAMERZONE, "Received a packet smaller than its own header!");
+            bio->close();
+            recv_start = recv_end = 0;
+            return false;
         }
 
-        if (extraLength > 0) {
-            void *extradata = (void *) (((char *) block) + baseLength);
-            int amountRead;
-            // reset the block, to avoid uninitialized memory reads.
-            memset((void *)( &(((unsigned char *)block)[baseLength])), 0 ,extraLength);
-            // for checking later
-            memset(extradata, 0, extraLength);
-
-            // we assume readdata() returned either -1 or the complete read size.
-            if (extraLength != (amountRead = bio->readdata(extradata, extraLength))) {
-                if (++failed_read_attempts > max_failed_read_attempts) {
-                    pqioutput(PQL_ALERT, PQISTREAMERZONE, "Unexpected failure to read packet");
-                    bio->close();
-                    reading_state = reading_state_initial;
-                    failed_read_attempts = 0;
-                    return -1;
-                } else {
-                    // this is just a SSL_WANT_READ error. Don't panic, we'll re-try the read soon.
-                    return 0;
-                }
-            }
-            failed_read_attempts = 0;
-            readbytes += extraLength;
-        }
+        // wait for the rest of the packet.
+        if ((uint32_t)(recv_end - recv_start) < packetSize) break;
 
         // create packet, based on header.
         {
             std::ostringstream out;
             out << "Read Data Block->Incoming Pkt(";
-            out << baseLength + extraLength << ")" << std::endl;
+            out << packetSize << ")" << std::endl;
             pqioutput(PQL_DEBUG_BASIC, PQISTREAMERZONE, out.str().c_str());
         }
 
-        uint32_t pktlen = baseLength+extraLength;
+        uint32_t pktlen = packetSize;
 
-        NetItem *pkt = serialiser->deserialise(block, &pktlen);
+        NetItem *pkt = serialiser->deserialiseView(recv_buffer, recv_start, &pktlen);
 
         if (pkt != NULL){
             // Use overloaded Contact function
@@ -509,18 +585,10 @@ start_packet_read:
         }
         else pqioutput(PQL_ALERT, PQISTREAMERZONE, "Failed to deserialize a packet!");
 
-        reading_state = reading_state_initial;
-        failed_read_attempts = 0;
+        recv_start += packetSize;
     }
 
-    if (maxin < readbytes){
-        pqioutput(PQL_DEBUG_ALERT, PQISTREAMERZONE, "pqistreamer::handleincoming() Max bytes read");
-    } else {
-        if (bio->moretoread()) goto start_packet_read;
-    }
-
-    inReadBytes(readbytes);
-    return 0;
+    return true;
 }
 
 
@@ -624,6 +692,10 @@ void    pqistreamer::outSentBytes(int outb) {
         avgSentpSec += (1.0 - AVG_PAST_WEIGHT) * avgSentCount /
                        (1000.0 * (currentTime - avgLastUpdate));
 
+        sentRate *= AVG_PAST_WEIGHT;
+        sentRate += (1.0 - AVG_PAST_WEIGHT) * avgSentCount /
+                    (1000.0 * (currentTime - avgLastUpdate));
+
 
         /* pretend our rate is zero if we are
          * not bandwidthLimited().
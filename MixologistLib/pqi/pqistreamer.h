@@ -25,7 +25,9 @@
 
 // Only dependent on the base stuff.
 #include "pqi/pqi_base.h"
+#include "pqi/pqipacketpool.h"
 #include <QMutex>
+#include <QByteArray>
 
 #include <list>
 
@@ -36,6 +38,21 @@ and converts it into binary data for the BinInterface.
 While doing so, it also manages the bandwidth based on limits passed down to it from above.
 */
 
+/* A serialised packet waiting to be written.
+   Most packets are serialised whole into header, but file data is sent from the buffer it was read into,
+   so that header holds only everything before the file data, and payload points into payloadBuffer, which keeps it alive.
+   header comes from the pqistreamer's packetPool, and headerCapacity is the size it was allocated with. */
+struct outPacket {
+    outPacket():header(NULL), headerSize(0), headerCapacity(0), payload(NULL), payloadSize(0) {}
+
+    void *header;
+    uint32_t headerSize;
+    uint32_t headerCapacity;
+    QByteArray payloadBuffer;
+    const void *payload;
+    uint32_t payloadSize;
+};
+
 class pqistreamer: public PQInterface {
 public:
     pqistreamer(Serialiser *rss, std::string peerid, unsigned int librarymixer_id, BinInterface *bio_in, int bio_flagsin);
@@ -49,6 +66,11 @@ public:
 
     virtual int tick();
 
+    virtual float getSentRate() {return sentRate;}
+
+    // Returns the statistics of the pool the outgoing packets are serialised into.
+    pqiPacketPoolStats getPacketPoolStats() const;
+
 private:
     /* Implementation */
     //Called by tick to handle the outbound and inbound queues. Heavyweight functions that do almost all of the work.
@@ -67,30 +89,54 @@ private:
     // Updates totalRead, currRead, and avgReadCount based on amount read
     void inReadBytes(int inb);
 
+    // Copies as much of the queued packets into send_buffer as will fit.
+    void fillSendBuffer();
+
+    // Makes sure that recv_buffer has room after recv_start for the largest possible packet,
+    // moving any partial packet to the start of recv_buffer, or of a new recv_buffer if views of the old one remain.
+    void makeRecvSpace();
+    // Deserialises every complete packet in recv_buffer onto incoming.
+    // Returns false, closing the connection, if the data isn't a valid packet.
+    bool deserialiseReceived();
+
+    // Serialises the item into a new outPacket, returning NULL on failure.
+    outPacket *serialisePacket(NetItem *si);
+    // Frees an outPacket and returns its header to packetPool, releasing its reference to any payload buffer.
+    void freePacket(outPacket *pkt);
+
     // Serialiser - determines which packets can be serialised.
     Serialiser *serialiser;
     // Binary Interface for IO, initialized at startup.
     BinInterface *bio;
     unsigned int bio_flags; // possible are BIN_FLAGS_NO_CLOSE | BIN_FLAGS_NO_DELETE
 
-    void *pkt_wpending; // storage for pending packet to write.
-    int pkt_rpend_size; // size of pkt_rpending.
-    void *pkt_rpending; // storage for read in pending packets.
-
-    enum {
-        reading_state_packet_started = 1,
-        reading_state_initial = 0
-    };
-
-    int reading_state;
-    int failed_read_attempts;
+    // Queued packets are packed back to back into send_buffer, so that each write fills a whole TLS record
+    // rather than every packet, however small, being a record and a write of its own.
+    // A packet that doesn't fit is split, and the rest of it starts the next send_buffer.
+    // This means the data of a FileData view is copied once here, as SSL_write can only take one contiguous buffer.
+    // A failed write is retried with exactly the same send_buffer (openSSL requirement).
+    void *send_buffer;
+    int send_buffer_len; // bytes in send_buffer waiting to be written.
+    outPacket *pkt_wpending; // packet being copied into send_buffer.
+    uint32_t wpending_offset; // bytes of pkt_wpending already copied into send_buffer.
+
+    // Incoming data is read into recv_buffer in bulk, as much as is available each time, and complete packets are deserialised
+    // from where they are in it, with any file data left there as a view rather than copied out.
+    // Views only ever cover packets before recv_start, and recv_buffer is only written to after recv_end,
+    // so while views of it remain it is still filled, but is replaced rather than reused once full.
+    QByteArray recv_buffer;
+    int recv_start; // start of the first packet not yet deserialised.
+    int recv_end; // end of the data read so far.
 
     // Temp Storage for transient data.....
-    std::list<void *> out_pkt; // Control / Search / Results queue
-    std::list<void *> out_data; // FileData - secondary queue.
+    std::list<outPacket *> out_pkt; // Control / Search / Results queue
+    std::list<outPacket *> out_data; // FileData - secondary queue.
     //A queue of incoming items of all types, waiting for GetItem to be called to take them off
     std::list<NetItem *> incoming;
 
+    // Buffers for serialising outgoing packets into, recycled as each packet is written.
+    pqiPacketPool packetPool;
+
     // data for network stats.
     int totalRead;
     int totalSent;
@@ -104,6 +150,8 @@ private:
     int avgLastUpdate; // TS from which these are measured.
     float avgReadCount;
     float avgSentCount;
+    // The rate in kB/s data has been written to bio, kept whether or not it is bandwidthLimited().
+    float sentRate;
 
     mutable QMutex streamerMtx;
 };
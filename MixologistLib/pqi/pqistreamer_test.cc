@@ -0,0 +1,155 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+/*
+ * Benchmark of the upload path from the buffer a chunk is read into, through pqistreamer, to the connection.
+ *
+ * Each chunk is split into MAX_FT_CHUNK FileData packets as ftServer::sendData does,
+ * queued on a pqistreamer with SendItem, and written by tick to a BinInterface that only counts what it is given,
+ * so what is measured is everything up to where SSL would encrypt it.
+ *
+ * This is run two ways:
+ * Copied:  each FileData is given its own copy of its data with setBinData, and serialised whole along with it,
+ *          as uploads were before FileData could be a view.
+ * View:    each FileData is a view into the chunk with setBinDataView, so only its headers are serialised,
+ *          and its data is copied once, as it is packed into the send buffer.
+ *
+ * Prints the payload bytes handled per CPU cycle where the cycle counter is available, and per nanosecond otherwise.
+ *
+ * Like the other *_test.cc programs this is not part of the library build, and links against it:
+ *   g++ -I. $(pkg-config --cflags QtCore) pqi/pqistreamer_test.cc lib.linux-g++/libMixologist.a $(pkg-config --libs QtCore QtNetwork QtXml) -lssl -lcrypto
+ *   ./pqistreamer_test [chunk size in KB] [chunks]
+ */
+
+#include "pqi/pqistreamer.h"
+#include "serialiser/baseitems.h"
+#include "serialiser/serial.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <time.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+/* As in ftServer. */
+#define MAX_FT_CHUNK 8192
+
+/* A connection that accepts everything it is given straight away. */
+class countingBinInterface: public BinInterface {
+public:
+    countingBinInterface() :bytesSent(0) {}
+
+    virtual int tick() {return 0;}
+    virtual int senddata(void *, int length) {
+        bytesSent += length;
+        return length;
+    }
+    virtual int readdata(void *, int) {return 0;}
+    virtual bool isactive() {return true;}
+    virtual bool moretoread() {return false;}
+    virtual bool cansend() {return true;}
+    virtual void close() {}
+    virtual bool bandwidthLimited() {return false;}
+
+    uint64_t bytesSent;
+};
+
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t cycles() {
+#ifdef HAVE_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Sends chunks of chunkSize through a new pqistreamer, either as views or as copies, and prints the rate. */
+static void runBenchmark(const char *name, bool views, uint32_t chunkSize, int chunks) {
+    Serialiser *serialiser = new Serialiser();
+    serialiser->addSerialType(new FileItemSerialiser());
+    countingBinInterface *bio = new countingBinInterface();
+    /* The streamer owns both the serialiser and the bio, and deletes each item once it is queued. */
+    pqistreamer streamer(serialiser, "benchmark", 1, bio, 0);
+
+    uint64_t payloadBytes = 0;
+    uint64_t startCycles = cycles();
+    uint64_t startTime = nanoseconds();
+
+    for (int i = 0; i < chunks; i++) {
+        /* As ftUploadReadJob reads each chunk into a buffer of its own, which the packets then point into. */
+        QByteArray data;
+        data.resize(chunkSize);
+        memset(data.data(), i, chunkSize);
+
+        for (uint32_t offset = 0; offset < chunkSize; offset += MAX_FT_CHUNK) {
+            uint32_t chunk = chunkSize - offset < MAX_FT_CHUNK ? chunkSize - offset : MAX_FT_CHUNK;
+
+            FileData *rfd = new FileData();
+            rfd->LibraryMixerId(1);
+            rfd->fd.file.filesize = (uint64_t)chunkSize * chunks;
+            rfd->fd.file.hash = "0123456789abcdef0123456789abcdef";
+            rfd->fd.file_offset = (uint64_t)i * chunkSize + offset;
+            if (views) rfd->fd.binData.setBinDataView(data, offset, chunk);
+            else rfd->fd.binData.setBinData(data.data() + offset, chunk);
+
+            streamer.SendItem(rfd);
+            payloadBytes += chunk;
+        }
+
+        streamer.tick();
+    }
+
+    uint64_t elapsedCycles = cycles() - startCycles;
+    uint64_t elapsedTime = nanoseconds() - startTime;
+
+    std::cout << name << ": " << payloadBytes / (1024 * 1024) << "MB of file data, " << bio->bytesSent / (1024 * 1024) << "MB written, "
+              << elapsedTime / 1000000.0 << "ms";
+    if (elapsedCycles > 0) std::cout << ", " << (double)payloadBytes / elapsedCycles << " bytes/cycle";
+    else if (elapsedTime > 0) std::cout << ", " << (double)payloadBytes / elapsedTime << " bytes/ns";
+    std::cout << std::endl;
+}
+
+int main(int argc, char **argv) {
+    uint32_t chunkSize = (argc > 1 ? atoi(argv[1]) : 1024) * 1024;
+    int chunks = argc > 2 ? atoi(argv[2]) : 2048;
+
+    if (chunkSize == 0 || chunks <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [chunk size in KB] [chunks]" << std::endl;
+        return 1;
+    }
+
+    /* Once first to warm up the caches and the packet pool's allocations, and then once each for real. */
+    runBenchmark("Warm up", true, chunkSize, chunks / 8 + 1);
+    runBenchmark("Copied", false, chunkSize, chunks);
+    runBenchmark("View  ", true, chunkSize, chunks);
+
+    return 0;
+}
@@ -34,11 +34,20 @@
 uint32_t    FileItemSerialiser::size(NetItem *i) {
     FileRequest *rfr;
     FileData    *rfd;
+    FileUnavailable *rfu;
+    FileManifestRequest *rfmr;
+    FileManifest *rfm;
 
     if (NULL != (rfr = dynamic_cast<FileRequest *>(i))) {
         return sizeReq(rfr);
     } else if (NULL != (rfd = dynamic_cast<FileData *>(i))) {
         return sizeData(rfd);
+    } else if (NULL != (rfu = dynamic_cast<FileUnavailable *>(i))) {
+        return sizeUnavailable(rfu);
+    } else if (NULL != (rfmr = dynamic_cast<FileManifestRequest *>(i))) {
+        return sizeManifestReq(rfmr);
+    } else if (NULL != (rfm = dynamic_cast<FileManifest *>(i))) {
+        return sizeManifest(rfm);
     }
 
     return 0;
@@ -48,11 +57,30 @@ uint32_t    FileItemSerialiser::size(NetItem *i) {
 bool    FileItemSerialiser::serialise(NetItem *i, void *data, uint32_t *pktsize) {
     FileRequest *rfr;
     FileData    *rfd;
+    FileUnavailable *rfu;
+    FileManifestRequest *rfmr;
+    FileManifest *rfm;
 
     if (NULL != (rfr = dynamic_cast<FileRequest *>(i))) {
         return serialiseReq(rfr, data, pktsize);
     } else if (NULL != (rfd = dynamic_cast<FileData *>(i))) {
         return serialiseData(rfd, data, pktsize);
+    } else if (NULL != (rfu = dynamic_cast<FileUnavailable *>(i))) {
+        return serialiseUnavailable(rfu, data, pktsize);
+    } else if (NULL != (rfmr = dynamic_cast<FileManifestRequest *>(i))) {
+        return serialiseManifestReq(rfmr, data, pktsize);
+    } else if (NULL != (rfm = dynamic_cast<FileManifest *>(i))) {
+        return serialiseManifest(rfm, data, pktsize);
+    }
+
+    return false;
+}
+
+bool    FileItemSerialiser::serialiseHeader(NetItem *i, void *data, uint32_t *pktsize) {
+    FileData    *rfd;
+
+    if (NULL != (rfd = dynamic_cast<FileData *>(i))) {
+        return serialiseDataHeader(rfd, data, pktsize);
     }
 
     return false;
@@ -73,7 +101,16 @@ NetItem *FileItemSerialiser::deserialise(void *data, uint32_t *pktsize) {
             return deserialiseReq(data, pktsize);
             break;
         case PKT_SUBTYPE_FI_DATA:
-            return deserialiseData(data, pktsize);
+            return deserialiseData(data, pktsize, NULL, 0);
+            break;
+        case PKT_SUBTYPE_FI_UNAVAILABLE:
+            return deserialiseUnavailable(data, pktsize);
+            break;
+        case PKT_SUBTYPE_FI_MANIFEST_REQUEST:
+            return deserialiseManifestReq(data, pktsize);
+            break;
+        case PKT_SUBTYPE_FI_MANIFEST:
+            return deserialiseManifest(data, pktsize);
             break;
         default:
             return NULL;
@@ -82,6 +119,16 @@ NetItem *FileItemSerialiser::deserialise(void *data, uint32_t *pktsize) {
     return NULL;
 }
 
+NetItem *FileItemSerialiser::deserialiseView(const QByteArray &buffer, uint32_t base, uint32_t *pktsize) {
+    void *data = (void *)(buffer.constData() + base);
+
+    if (PKT_SUBTYPE_FI_DATA == getNetItemSubType(getNetItemId(data))) {
+        return deserialiseData(data, pktsize, &buffer, base);
+    }
+
+    return deserialise(data, pktsize);
+}
+
 /*************************************************************************/
 
 FileRequest::~FileRequest() {
@@ -263,7 +310,38 @@ bool     FileItemSerialiser::serialiseData(FileData *item, void *data, uint32_t
     return ok;
 }
 
-FileData *FileItemSerialiser::deserialiseData(void *data, uint32_t *pktsize) {
+/* serialise all but the file data to the buffer, setting pktsize to the size of the header only */
+bool     FileItemSerialiser::serialiseDataHeader(FileData *item, void *data, uint32_t *pktsize) {
+    uint32_t tlvsize = sizeData(item);
+    uint32_t headersize = tlvsize - item->fd.binData.bin_len;
+    uint32_t offset = 0;
+
+    if (*pktsize < headersize)
+        return false; /* not enough space */
+
+    *pktsize = headersize;
+
+    bool ok = true;
+
+    /* The packet header has the full size, including the file data that will follow. */
+    ok &= setNetItemHeader(data, headersize, item->PacketId(), tlvsize);
+
+    /* skip the header */
+    offset += 8;
+
+    ok &= item->fd.SetTlvHeader(data, headersize, &offset);
+
+    if (offset != headersize) {
+        ok = false;
+#ifdef SERIAL_DEBUG
+        std::cerr << "FileItemSerialiser::serialiseDataHeader() Size Error! " << std::endl;
+#endif
+    }
+
+    return ok;
+}
+
+FileData *FileItemSerialiser::deserialiseData(void *data, uint32_t *pktsize, const QByteArray *viewBuffer, uint32_t viewBase) {
     /* get the type and size */
     uint32_t rstype = getNetItemId(data);
     uint32_t rssize = getNetItemSize(data);
@@ -293,7 +371,374 @@ FileData *FileItemSerialiser::deserialiseData(void *data, uint32_t *pktsize) {
     offset += 8;
 
     /* get mandatory parts first */
-    ok &= item->fd.GetTlv(data, rssize, &offset);
+    if (viewBuffer) ok &= item->fd.GetTlvView(*viewBuffer, viewBase, rssize, &offset);
+    else ok &= item->fd.GetTlv(data, rssize, &offset);
+
+    if (offset != rssize) {
+        /* error */
+        delete item;
+        return NULL;
+    }
+
+    if (!ok) {
+        delete item;
+        return NULL;
+    }
+
+    return item;
+}
+
+
+/*************************************************************************/
+
+FileUnavailable::~FileUnavailable() {
+    return;
+}
+
+void    FileUnavailable::clear() {
+    file.TlvClear();
+    fileoffset = 0;
+    chunksize  = 0;
+    reason     = 0;
+}
+
+std::ostream &FileUnavailable::print(std::ostream &out, uint16_t indent) {
+    printNetItemBase(out, "FileUnavailable", indent);
+    uint16_t int_Indent = indent + 2;
+    printIndent(out, int_Indent);
+    out << "FileOffset: " << fileoffset << std::endl;
+    out << "ChunkSize:  " << chunksize  << std::endl;
+    out << "Reason:     " << reason     << std::endl;
+    file.print(out, int_Indent);
+    printNetItemEnd(out, "FileUnavailable", indent);
+    return out;
+}
+
+
+uint32_t    FileItemSerialiser::sizeUnavailable(FileUnavailable *item) {
+    uint32_t s = 8; /* header */
+    s += 8; /* offset */
+    s += 4; /* chunksize */
+    s += 4; /* reason */
+    s += item->file.TlvSize();
+
+    return s;
+}
+
+/* serialise the data to the buffer */
+bool     FileItemSerialiser::serialiseUnavailable(FileUnavailable *item, void *data, uint32_t *pktsize) {
+    uint32_t tlvsize = sizeUnavailable(item);
+    uint32_t offset = 0;
+
+    if (*pktsize < tlvsize)
+        return false; /* not enough space */
+
+    *pktsize = tlvsize;
+
+    bool ok = true;
+
+    ok &= setNetItemHeader(data, tlvsize, item->PacketId(), tlvsize);
+
+#ifdef SERIAL_DEBUG
+    std::cerr << "FileItemSerialiser::serialiseUnavailable() Header: " << ok << std::endl;
+    std::cerr << "FileItemSerialiser::serialiseUnavailable() Size: " << tlvsize << std::endl;
+#endif
+
+    /* skip the header */
+    offset += 8;
+
+    /* add mandatory parts first */
+    ok &= setRawUInt64(data, tlvsize, &offset, item->fileoffset);
+    ok &= setRawUInt32(data, tlvsize, &offset, item->chunksize);
+    ok &= setRawUInt32(data, tlvsize, &offset, item->reason);
+    ok &= item->file.SetTlv(data, tlvsize, &offset);
+
+    if (offset != tlvsize) {
+        ok = false;
+#ifdef SERIAL_DEBUG
+        std::cerr << "FileItemSerialiser::serialiseUnavailable() Size Error! " << std::endl;
+#endif
+    }
+
+    return ok;
+}
+
+FileUnavailable *FileItemSerialiser::deserialiseUnavailable(void *data, uint32_t *pktsize) {
+    /* get the type and size */
+    uint32_t rstype = getNetItemId(data);
+    uint32_t rssize = getNetItemSize(data);
+
+    uint32_t offset = 0;
+
+    if ((PKT_VERSION1 != getNetItemVersion(rstype)) ||
+            (PKT_CLASS_BASE != getNetItemClass(rstype)) ||
+            (PKT_TYPE_FILE  != getNetItemType(rstype)) ||
+            (PKT_SUBTYPE_FI_UNAVAILABLE != getNetItemSubType(rstype))) {
+        return NULL; /* wrong type */
+    }
+
+    if (*pktsize < rssize)    /* check size */
+        return NULL; /* not enough data */
+
+    /* set the packet length */
+    *pktsize = rssize;
+
+    bool ok = true;
+
+    /* ready to load */
+    FileUnavailable *item = new FileUnavailable();
+    item->clear();
+
+    /* skip the header */
+    offset += 8;
+
+    /* get mandatory parts first */
+    ok &= getRawUInt64(data, rssize, &offset, &(item->fileoffset));
+    ok &= getRawUInt32(data, rssize, &offset, &(item->chunksize));
+    ok &= getRawUInt32(data, rssize, &offset, &(item->reason));
+    ok &= item->file.GetTlv(data, rssize, &offset);
+
+    if (offset != rssize) {
+        /* error */
+        delete item;
+        return NULL;
+    }
+
+    if (!ok) {
+        delete item;
+        return NULL;
+    }
+
+    return item;
+}
+
+
+/*************************************************************************/
+
+FileManifestRequest::~FileManifestRequest() {
+    return;
+}
+
+void    FileManifestRequest::clear() {
+    file.TlvClear();
+    firstPiece = 0;
+}
+
+std::ostream &FileManifestRequest::print(std::ostream &out, uint16_t indent) {
+    printNetItemBase(out, "FileManifestRequest", indent);
+    uint16_t int_Indent = indent + 2;
+    printIndent(out, int_Indent);
+    out << "FirstPiece: " << firstPiece << std::endl;
+    file.print(out, int_Indent);
+    printNetItemEnd(out, "FileManifestRequest", indent);
+    return out;
+}
+
+
+uint32_t    FileItemSerialiser::sizeManifestReq(FileManifestRequest *item) {
+    uint32_t s = 8; /* header */
+    s += 4; /* firstPiece */
+    s += item->file.TlvSize();
+
+    return s;
+}
+
+/* serialise the data to the buffer */
+bool     FileItemSerialiser::serialiseManifestReq(FileManifestRequest *item, void *data, uint32_t *pktsize) {
+    uint32_t tlvsize = sizeManifestReq(item);
+    uint32_t offset = 0;
+
+    if (*pktsize < tlvsize)
+        return false; /* not enough space */
+
+    *pktsize = tlvsize;
+
+    bool ok = true;
+
+    ok &= setNetItemHeader(data, tlvsize, item->PacketId(), tlvsize);
+
+#ifdef SERIAL_DEBUG
+    std::cerr << "FileItemSerialiser::serialiseManifestReq() Header: " << ok << std::endl;
+    std::cerr << "FileItemSerialiser::serialiseManifestReq() Size: " << tlvsize << std::endl;
+#endif
+
+    /* skip the header */
+    offset += 8;
+
+    /* add mandatory parts first */
+    ok &= setRawUInt32(data, tlvsize, &offset, item->firstPiece);
+    ok &= item->file.SetTlv(data, tlvsize, &offset);
+
+    if (offset != tlvsize) {
+        ok = false;
+#ifdef SERIAL_DEBUG
+        std::cerr << "FileItemSerialiser::serialiseManifestReq() Size Error! " << std::endl;
+#endif
+    }
+
+    return ok;
+}
+
+FileManifestRequest *FileItemSerialiser::deserialiseManifestReq(void *data, uint32_t *pktsize) {
+    /* get the type and size */
+    uint32_t rstype = getNetItemId(data);
+    uint32_t rssize = getNetItemSize(data);
+
+    uint32_t offset = 0;
+
+    if ((PKT_VERSION1 != getNetItemVersion(rstype)) ||
+            (PKT_CLASS_BASE != getNetItemClass(rstype)) ||
+            (PKT_TYPE_FILE  != getNetItemType(rstype)) ||
+            (PKT_SUBTYPE_FI_MANIFEST_REQUEST != getNetItemSubType(rstype))) {
+        return NULL; /* wrong type */
+    }
+
+    if (*pktsize < rssize)    /* check size */
+        return NULL; /* not enough data */
+
+    /* set the packet length */
+    *pktsize = rssize;
+
+    bool ok = true;
+
+    /* ready to load */
+    FileManifestRequest *item = new FileManifestRequest();
+    item->clear();
+
+    /* skip the header */
+    offset += 8;
+
+    /* get mandatory parts first */
+    ok &= getRawUInt32(data, rssize, &offset, &(item->firstPiece));
+    ok &= item->file.GetTlv(data, rssize, &offset);
+
+    if (offset != rssize) {
+        /* error */
+        delete item;
+        return NULL;
+    }
+
+    if (!ok) {
+        delete item;
+        return NULL;
+    }
+
+    return item;
+}
+
+/*************************************************************************/
+
+FileManifest::~FileManifest() {
+    return;
+}
+
+void    FileManifest::clear() {
+    file.TlvClear();
+    root.TlvClear();
+    pieceHashes.TlvClear();
+    totalPieces = 0;
+    firstPiece = 0;
+}
+
+std::ostream &FileManifest::print(std::ostream &out, uint16_t indent) {
+    printNetItemBase(out, "FileManifest", indent);
+    uint16_t int_Indent = indent + 2;
+    printIndent(out, int_Indent);
+    out << "TotalPieces: " << totalPieces << std::endl;
+    out << "FirstPiece:  " << firstPiece << std::endl;
+    root.print(out, int_Indent);
+    pieceHashes.print(out, int_Indent);
+    file.print(out, int_Indent);
+    printNetItemEnd(out, "FileManifest", indent);
+    return out;
+}
+
+
+uint32_t    FileItemSerialiser::sizeManifest(FileManifest *item) {
+    uint32_t s = 8; /* header */
+    s += 4; /* totalPieces */
+    s += 4; /* firstPiece */
+    s += item->root.TlvSize();
+    s += item->pieceHashes.TlvSize();
+    s += item->file.TlvSize();
+
+    return s;
+}
+
+/* serialise the data to the buffer */
+bool     FileItemSerialiser::serialiseManifest(FileManifest *item, void *data, uint32_t *pktsize) {
+    uint32_t tlvsize = sizeManifest(item);
+    uint32_t offset = 0;
+
+    if (*pktsize < tlvsize)
+        return false; /* not enough space */
+
+    *pktsize = tlvsize;
+
+    bool ok = true;
+
+    ok &= setNetItemHeader(data, tlvsize, item->PacketId(), tlvsize);
+
+#ifdef SERIAL_DEBUG
+    std::cerr << "FileItemSerialiser::serialiseManifest() Header: " << ok << std::endl;
+    std::cerr << "FileItemSerialiser::serialiseManifest() Size: " << tlvsize << std::endl;
+#endif
+
+    /* skip the header */
+    offset += 8;
+
+    /* add mandatory parts first */
+    ok &= setRawUInt32(data, tlvsize, &offset, item->totalPieces);
+    ok &= setRawUInt32(data, tlvsize, &offset, item->firstPiece);
+    ok &= item->root.SetTlv(data, tlvsize, &offset);
+    ok &= item->pieceHashes.SetTlv(data, tlvsize, &offset);
+    ok &= item->file.SetTlv(data, tlvsize, &offset);
+
+    if (offset != tlvsize) {
+        ok = false;
+#ifdef SERIAL_DEBUG
+        std::cerr << "FileItemSerialiser::serialiseManifest() Size Error! " << std::endl;
+#endif
+    }
+
+    return ok;
+}
+
+FileManifest *FileItemSerialiser::deserialiseManifest(void *data, uint32_t *pktsize) {
+    /* get the type and size */
+    uint32_t rstype = getNetItemId(data);
+    uint32_t rssize = getNetItemSize(data);
+
+    uint32_t offset = 0;
+
+    if ((PKT_VERSION1 != getNetItemVersion(rstype)) ||
+            (PKT_CLASS_BASE != getNetItemClass(rstype)) ||
+            (PKT_TYPE_FILE  != getNetItemType(rstype)) ||
+            (PKT_SUBTYPE_FI_MANIFEST != getNetItemSubType(rstype))) {
+        return NULL; /* wrong type */
+    }
+
+    if (*pktsize < rssize)    /* check size */
+        return NULL; /* not enough data */
+
+    /* set the packet length */
+    *pktsize = rssize;
+
+    bool ok = true;
+
+    /* ready to load */
+    FileManifest *item = new FileManifest();
+    item->clear();
+
+    /* skip the header */
+    offset += 8;
+
+    /* get mandatory parts first */
+    ok &= getRawUInt32(data, rssize, &offset, &(item->totalPieces));
+    ok &= getRawUInt32(data, rssize, &offset, &(item->firstPiece));
+    ok &= item->root.GetTlv(data, rssize, &offset);
+    ok &= item->pieceHashes.GetTlv(data, rssize, &offset);
+    ok &= item->file.GetTlv(data, rssize, &offset);
 
     if (offset != rssize) {
         /* error */
@@ -26,12 +26,16 @@
 #include <map>
 
 #include "serialiser/serial.h"
+#include "serialiser/tlvbase.h"
 #include "serialiser/tlvtypes.h"
 
 const uint8_t PKT_TYPE_FILE          = 0x01;
 
 const uint8_t PKT_SUBTYPE_FI_REQUEST  = 0x01;
 const uint8_t PKT_SUBTYPE_FI_DATA     = 0x02;
+const uint8_t PKT_SUBTYPE_FI_UNAVAILABLE = 0x03;
+const uint8_t PKT_SUBTYPE_FI_MANIFEST_REQUEST = 0x04;
+const uint8_t PKT_SUBTYPE_FI_MANIFEST = 0x05;
 
 /**************************************************************************/
 
@@ -71,6 +75,77 @@ public:
 
 /**************************************************************************/
 
+/* Sent in response to a FileRequest that can't be answered, so the requester can look elsewhere rather than wait for a timeout. */
+class FileUnavailable: public NetItem {
+public:
+    FileUnavailable()
+        :NetItem(PKT_VERSION1, PKT_CLASS_BASE,
+                 PKT_TYPE_FILE,
+                 PKT_SUBTYPE_FI_UNAVAILABLE) {
+        return;
+    }
+    virtual ~FileUnavailable();
+    virtual void clear();
+    std::ostream &print(std::ostream &out, uint16_t indent = 0);
+
+    /* The friend can't send the requested range right now, usually because they are still downloading it,
+       but it is worth asking them for it again later. */
+    static const uint32_t RANGE_NOT_YET_AVAILABLE = 1;
+    /* The friend isn't sharing the file with us, or no longer has it. */
+    static const uint32_t FILE_NOT_FOUND = 2;
+    /* The friend was sharing the file, but it has changed or been removed on disk since. */
+    static const uint32_t FILE_CHANGED = 3;
+
+    uint64_t fileoffset;  /* start of data requested */
+    uint32_t chunksize;   /* size of data requested */
+    uint32_t reason;      /* why the request couldn't be answered */
+    TlvFileItem file;   /* file information */
+};
+
+/**************************************************************************/
+
+/* Requests a page of a file's piece manifest, starting from the hash of firstPiece. */
+class FileManifestRequest: public NetItem {
+public:
+    FileManifestRequest()
+        :NetItem(PKT_VERSION1, PKT_CLASS_BASE,
+                 PKT_TYPE_FILE,
+                 PKT_SUBTYPE_FI_MANIFEST_REQUEST) {
+        return;
+    }
+    virtual ~FileManifestRequest();
+    virtual void clear();
+    std::ostream &print(std::ostream &out, uint16_t indent = 0);
+
+    uint32_t firstPiece;  /* first piece hash requested */
+    TlvFileItem file;   /* file information */
+};
+
+/**************************************************************************/
+
+/* A page of a file's piece manifest. */
+class FileManifest: public NetItem {
+public:
+    FileManifest()
+        :NetItem(PKT_VERSION1, PKT_CLASS_BASE,
+                 PKT_TYPE_FILE,
+                 PKT_SUBTYPE_FI_MANIFEST),
+        root(TLV_TYPE_BIN_PIECEROOT), pieceHashes(TLV_TYPE_BIN_PIECEHASHES) {
+        return;
+    }
+    virtual ~FileManifest();
+    virtual void clear();
+    std::ostream &print(std::ostream &out, uint16_t indent = 0);
+
+    uint32_t totalPieces; /* number of pieces in the whole file */
+    uint32_t firstPiece;  /* piece the first hash in pieceHashes is for */
+    TlvBinaryData root;   /* root hash of the whole manifest */
+    TlvBinaryData pieceHashes; /* concatenated piece hashes */
+    TlvFileItem file;   /* file information */
+};
+
+/**************************************************************************/
+
 class FileItemSerialiser: public SerialType {
 public:
     FileItemSerialiser()
@@ -86,6 +161,12 @@ public:
     virtual bool        serialise  (NetItem *item, void *data, uint32_t *size);
     virtual NetItem     *deserialise(void *data, uint32_t *size);
 
+    /* Only FileData can be serialised in two parts, with its file data sent from the buffer it was read into. */
+    virtual bool        serialiseHeader(NetItem *item, void *data, uint32_t *size);
+
+    /* Likewise only FileData is deserialised with its file data left in the buffer it was received into. */
+    virtual NetItem     *deserialiseView(const QByteArray &buffer, uint32_t base, uint32_t *size);
+
 private:
 
     /* sub types */
@@ -95,7 +176,21 @@ private:
 
     virtual uint32_t    sizeData(FileData *);
     virtual bool        serialiseData (FileData *item, void *data, uint32_t *size);
-    virtual FileData   *deserialiseData(void *data, uint32_t *size);
+    virtual bool        serialiseDataHeader (FileData *item, void *data, uint32_t *size);
+    /* When viewBuffer is set, data is viewBase bytes into it, and the file data is left there as a view. */
+    virtual FileData   *deserialiseData(void *data, uint32_t *size, const QByteArray *viewBuffer, uint32_t viewBase);
+
+    virtual uint32_t    sizeUnavailable(FileUnavailable *);
+    virtual bool        serialiseUnavailable (FileUnavailable *item, void *data, uint32_t *size);
+    virtual FileUnavailable   *deserialiseUnavailable(void *data, uint32_t *size);
+
+    virtual uint32_t    sizeManifestReq(FileManifestRequest *);
+    virtual bool        serialiseManifestReq (FileManifestRequest *item, void *data, uint32_t *size);
+    virtual FileManifestRequest   *deserialiseManifestReq(void *data, uint32_t *size);
+
+    virtual uint32_t    sizeManifest(FileManifest *);
+    virtual bool        serialiseManifest (FileManifest *item, void *data, uint32_t *size);
+    virtual FileManifest   *deserialiseManifest(void *data, uint32_t *size);
 
 };
 
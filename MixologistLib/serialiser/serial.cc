@@ -23,6 +23,7 @@
 #include "serialiser/baseserial.h"
 #include "serialiser/serial.h"
 
+#include <QByteArray>
 #include <map>
 #include <iostream>
 
@@ -129,6 +130,14 @@ NetItem *SerialType::deserialise(void *, uint32_t *) {
     return NULL;
 }
 
+bool SerialType::serialiseHeader(NetItem *, void *, uint32_t *) {
+    return false;
+}
+
+NetItem *SerialType::deserialiseView(const QByteArray &buffer, uint32_t base, uint32_t *size) {
+    return deserialise((void *)(buffer.constData() + base), size);
+}
+
 uint32_t SerialType::PacketId() {
     return type;
 }
@@ -247,7 +256,31 @@ bool Serialiser::serialise  (NetItem *item, void *data, uint32_t *size) {
 
 
 
+bool Serialiser::serialiseHeader(NetItem *item, void *data, uint32_t *size) {
+    SerialType *serialType = findSerialType(item->PacketId());
+    if (serialType == NULL) return false;
+    return serialType->serialiseHeader(item, data, size);
+}
+
+SerialType *Serialiser::findSerialType(uint32_t packetId) {
+    /* Try the most specific match first, then one less byte of the packet id at a time. */
+    uint32_t masks[3] = {0xFFFFFF00, 0xFFFF0000, 0xFF000000};
+    for (int i = 0; i < 3; i++) {
+        std::map<uint32_t, SerialType *>::iterator it = serialisers.find(packetId & masks[i]);
+        if (it != serialisers.end()) return it->second;
+    }
+    return NULL;
+}
+
 NetItem *Serialiser::deserialise(void *data, uint32_t *size) {
+    return deserialise(data, size, NULL, 0);
+}
+
+NetItem *Serialiser::deserialiseView(const QByteArray &buffer, uint32_t base, uint32_t *size) {
+    return deserialise((void *)(buffer.constData() + base), size, &buffer, base);
+}
+
+NetItem *Serialiser::deserialise(void *data, uint32_t *size, const QByteArray *viewBuffer, uint32_t viewBase) {
     /* find the type */
     if (*size < 8) {
 #ifdef  SERIAL_DEBUG
@@ -294,7 +327,9 @@ NetItem *Serialiser::deserialise(void *data, uint32_t *size) {
         }
     }
 
-    NetItem *item = (it->second)->deserialise(data, &pkt_size);
+    NetItem *item;
+    if (viewBuffer) item = (it->second)->deserialiseView(*viewBuffer, viewBase, &pkt_size);
+    else item = (it->second)->deserialise(data, &pkt_size);
     if (!item) {
 #ifdef  SERIAL_DEBUG
         std::cerr << "Serialiser::deserialise() Failed!";
@@ -31,6 +31,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+class QByteArray;
+
 /*******************************************************************
  * This is the Top-Level serialiser/deserialise,
  *
@@ -111,6 +113,15 @@ public:
     virtual bool        serialise  (NetItem *item, void *data, uint32_t *size);
     virtual NetItem     *deserialise(void *data, uint32_t *size);
 
+    /* For items whose packet ends in a bulk payload that can be sent from where it already is,
+       serialises everything before the payload, with sizes that include the payload that will follow.
+       Returns false for items that can't be serialised this way. */
+    virtual bool        serialiseHeader(NetItem *item, void *data, uint32_t *size);
+
+    /* Deserialises the packet base bytes into buffer, for items whose bulk payload can be left where it is in buffer as a view.
+       Items that can't be deserialised this way are deserialised as normal. */
+    virtual NetItem     *deserialiseView(const QByteArray &buffer, uint32_t base, uint32_t *size);
+
     uint32_t    PacketId();
 protected:
     uint32_t type;
@@ -126,9 +137,17 @@ public:
     uint32_t    size(NetItem *);
     bool        serialise  (NetItem *item, void *data, uint32_t *size);
     NetItem     *deserialise(void *data, uint32_t *size);
+    bool        serialiseHeader(NetItem *item, void *data, uint32_t *size);
+    NetItem     *deserialiseView(const QByteArray &buffer, uint32_t base, uint32_t *size);
 
 
 private:
+    /* Returns the SerialType for the packet id, or NULL if there is none. */
+    SerialType *findSerialType(uint32_t packetId);
+
+    /* Implements deserialise, and deserialiseView when viewBuffer is set, in which case data is viewBase bytes into viewBuffer. */
+    NetItem     *deserialise(void *data, uint32_t *size, const QByteArray *viewBuffer, uint32_t viewBase);
+
     std::map<uint32_t, SerialType *> serialisers;
 };
 
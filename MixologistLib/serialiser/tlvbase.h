@@ -181,6 +181,8 @@ const uint16_t TLV_TYPE_SIGN_RSA_SHA1 = 0x0120; /* Used (Distrib/Forums) */
 const uint16_t TLV_TYPE_BIN_IMAGE     = 0x0130; /* Used (Generic - Forums) */
 
 const uint16_t TLV_TYPE_BIN_FILEDATA  = 0x0140; /* Used - ACTIVE! */
+const uint16_t TLV_TYPE_BIN_PIECEROOT = 0x0141; /* Used - ACTIVE! */
+const uint16_t TLV_TYPE_BIN_PIECEHASHES = 0x0142; /* Used - ACTIVE! */
 
 const uint16_t TLV_TYPE_BIN_SERIALISE = 0x0150; /* Used (Generic - Distrib) */
 
@@ -490,7 +490,35 @@ bool TlvFileData::SetTlv(void *data, uint32_t size, uint32_t *offset) { /* seria
 
 }
 
+bool TlvFileData::SetTlvHeader(void *data, uint32_t size, uint32_t *offset) {
+    uint16_t tlvsize = TlvSize();
+    uint32_t headerend = *offset + tlvsize - binData.bin_len;
+
+    if (size < headerend)
+        return false; /* not enough space */
+
+    bool ok = true;
+
+    /* The TLV sizes written are the full sizes including binData's bytes, which will follow directly after. */
+    ok &= SetTlvBase(data, *offset + tlvsize, offset, TLV_TYPE_FILEDATA , tlvsize);
+
+    ok &= file.SetTlv(data, size, offset);
+    ok &= SetTlvUInt64(data,size,offset,
+                       TLV_TYPE_UINT64_OFFSET,file_offset);
+    ok &= binData.SetTlvHeader(data, size, offset);
+
+    return ok;
+}
+
 bool TlvFileData::GetTlv(void *data, uint32_t size, uint32_t *offset) { /* serialise   */
+    return getTlv(data, size, offset, NULL, 0);
+}
+
+bool TlvFileData::GetTlvView(const QByteArray &buffer, uint32_t base, uint32_t size, uint32_t *offset) {
+    return getTlv((void *)(buffer.constData() + base), size, offset, &buffer, base);
+}
+
+bool TlvFileData::getTlv(void *data, uint32_t size, uint32_t *offset, const QByteArray *viewBuffer, uint32_t viewBase) {
     if (size < *offset + 4) {
         return false;
     }
@@ -516,7 +544,8 @@ bool TlvFileData::GetTlv(void *data, uint32_t size, uint32_t *offset) { /* seria
     ok &= file.GetTlv(data, size, offset);
     ok &= GetTlvUInt64(data,size,offset,
                        TLV_TYPE_UINT64_OFFSET,&file_offset);
-    ok &= binData.GetTlv(data, size, offset);
+    if (viewBuffer) ok &= binData.GetTlvView(*viewBuffer, viewBase, size, offset);
+    else ok &= binData.GetTlv(data, size, offset);
 
     return ok;
 
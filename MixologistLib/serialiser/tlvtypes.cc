@@ -87,8 +87,27 @@ bool     TlvBinaryData::setBinData(void *data, uint16_t size) {
     return true;
 }
 
+bool     TlvBinaryData::setBinDataView(const QByteArray &buffer, uint32_t offset, uint16_t size) {
+    TlvClear();
+
+    if (offset + size > (uint32_t)buffer.size()) return false;
+    bin_len = size;
+    if (bin_len == 0) return true;
+
+    sharedBuffer = buffer;
+    bin_data = (void *)(sharedBuffer.constData() + offset);
+    return true;
+}
+
+void TlvBinaryData::makeView() {
+    if (isView() || bin_data == NULL) return;
+
+    QByteArray buffer((const char *) bin_data, bin_len);
+    setBinDataView(buffer, 0, buffer.size());
+}
+
 void TlvBinaryData::TlvClear() {
-    if (bin_data) {
+    if (bin_data && !isView()) {
         free(bin_data);
     }
     TlvShallowClear();
@@ -97,6 +116,7 @@ void TlvBinaryData::TlvClear() {
 void    TlvBinaryData::TlvShallowClear() {
     bin_data = NULL;
     bin_len = 0;
+    sharedBuffer = QByteArray();
 }
 
 uint16_t TlvBinaryData::TlvSize() {
@@ -132,7 +152,26 @@ bool     TlvBinaryData::SetTlv(void *data, uint32_t size, uint32_t *offset) { /*
 
 
 
+bool     TlvBinaryData::SetTlvHeader(void *data, uint32_t size, uint32_t *offset) {
+    uint16_t tlvsize = TlvSize();
+    uint32_t tlvend  = *offset + tlvsize;
+
+    if (size < *offset + 4)
+        return false; /* not enough space */
+
+    /* The full size is checked against tlvend, as the data that follows the header is included in it. */
+    return SetTlvBase(data, tlvend, offset, tlvtype, tlvsize);
+}
+
 bool     TlvBinaryData::GetTlv(void *data, uint32_t size, uint32_t *offset) { /* serialise   */
+    return getTlv(data, size, offset, NULL, 0);
+}
+
+bool     TlvBinaryData::GetTlvView(const QByteArray &buffer, uint32_t base, uint32_t size, uint32_t *offset) {
+    return getTlv((void *)(buffer.constData() + base), size, offset, &buffer, base);
+}
+
+bool     TlvBinaryData::getTlv(void *data, uint32_t size, uint32_t *offset, const QByteArray *viewBuffer, uint32_t viewBase) {
     if (size < *offset + 4) {
         return false; /* not enough space to get the header */
     }
@@ -154,7 +193,9 @@ bool     TlvBinaryData::GetTlv(void *data, uint32_t size, uint32_t *offset) { /*
     /* skip the header */
     (*offset) += 4;
 
-    bool ok = setBinData(&(((uint8_t *) data)[*offset]), tlvsize - 4);
+    bool ok;
+    if (viewBuffer) ok = setBinDataView(*viewBuffer, viewBase + *offset, tlvsize - 4);
+    else ok = setBinData(&(((uint8_t *) data)[*offset]), tlvsize - 4);
     (*offset) += bin_len;
 
     return ok;
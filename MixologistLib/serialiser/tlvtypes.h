@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <QString>
+#include <QByteArray>
 
 //#define TLV_TYPE_FILE_ITEM   0x0000
 
@@ -79,11 +80,36 @@ public:
     virtual bool     GetTlv(void *data, uint32_t size, uint32_t *offset);
     virtual std::ostream &print(std::ostream &out, uint16_t indent); /*! Error/Debug util function */
 
+    /// Deserialise from the packet at base in buffer like GetTlv, but leaving the binary data in buffer as a view rather than copying it.
+    bool     GetTlvView(const QByteArray &buffer, uint32_t base, uint32_t size, uint32_t *offset);
+
     bool    setBinData(void *data, uint16_t size);
 
+    /*! Points bin_data at size bytes from offset in buffer, rather than copying them.
+        buffer is implicitly shared, so this keeps it alive until cleared, and it must not be modified while any view of it exists. */
+    bool    setBinDataView(const QByteArray &buffer, uint32_t offset, uint16_t size);
+
+    /*! True if bin_data points into a shared buffer rather than being malloc'ed. */
+    bool    isView() const {return !sharedBuffer.isNull();}
+
+    /*! The buffer a view points into. */
+    const QByteArray &viewBuffer() const {return sharedBuffer;}
+
+    /*! If this isn't a view, moves bin_data into a shared buffer and makes this a view of it, so it can be passed on as one. */
+    void    makeView();
+
+    /// Serialise only the TLV header, for when the binary data itself is sent from where it is, straight after the header.
+    bool     SetTlvHeader(void *data, uint32_t size, uint32_t *offset);
+
     uint16_t tlvtype;   /// set/checked against TLV input
     uint16_t bin_len;   /// size of malloc'ed data (not serialised)
     void    *bin_data;  /// mandatory
+
+private:
+    /// Implements GetTlv, and GetTlvView when viewBuffer is set, in which case data is viewBase bytes into viewBuffer.
+    bool     getTlv(void *data, uint32_t size, uint32_t *offset, const QByteArray *viewBuffer, uint32_t viewBase);
+
+    QByteArray sharedBuffer; /// the buffer bin_data points into if this is a view, otherwise null
 };
 
 class TlvFileItem: public TlvItem {
@@ -138,9 +164,19 @@ public:
     virtual bool     GetTlv(void *data, uint32_t size, uint32_t *offset); /* deserialise */
     virtual std::ostream &print(std::ostream &out, uint16_t indent);
 
+    /// Serialise everything except the bytes of binData, which come last, for when they are sent from where they are.
+    bool     SetTlvHeader(void *data, uint32_t size, uint32_t *offset);
+
+    /// Deserialise from the packet at base in buffer like GetTlv, but leaving binData as a view into buffer rather than copying it.
+    bool     GetTlvView(const QByteArray &buffer, uint32_t base, uint32_t size, uint32_t *offset);
+
     TlvFileItem   file;         /// Mandatory: file information
     uint64_t        file_offset;  /// Mandatory: where to start in bin data
     TlvBinaryData binData;      /// Mandatory: serialised file info
+
+private:
+    /// Implements GetTlv, and GetTlvView when viewBuffer is set, in which case data is viewBase bytes into viewBuffer.
+    bool     getTlv(void *data, uint32_t size, uint32_t *offset, const QByteArray *viewBuffer, uint32_t viewBase);
 };
 
 
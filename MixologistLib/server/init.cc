@@ -4,6 +4,7 @@
 #include "ft/fttemplist.h"
 #include "ft/ftfilewatcher.h"
 #include "ft/ftborrower.h"
+#include "ft/ftfileindex.h"
 
 #include "pqi/authmgr.h"
 #include "pqi/friendsConnectivityManager.h"
@@ -265,6 +266,9 @@ Control *Init::createControl(QString ownName) {
     fileWatcher->moveToThread(fileWatcherThread);
     fileWatcherThread->start();
 
+    /* Create this before any of the classes that share files, so they can add their files to it as they load them. */
+    fileIndex = new ftFileIndex();
+
     /* This must take place before the ftserver so it can use it in its own setup. */
     librarymixermanager = new LibraryMixerLibraryManager();
     libraryMixerFriendLibrary = new LibraryMixerFriendLibrary();
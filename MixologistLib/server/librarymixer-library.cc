@@ -27,6 +27,7 @@
 #include <interface/init.h>
 #include <interface/peers.h> //For the peers variable
 #include <ft/ftserver.h>
+#include <ft/ftfileindex.h>
 #include <util/dir.h>
 #include <util/xml.h>
 #include <pqi/pqinotify.h>
@@ -35,7 +36,10 @@
 
 #define LIBRARYFILE "library.xml"
 
-LibraryMixerLibraryManager::LibraryMixerLibraryManager() {
+LibraryMixerLibraryManager::LibraryMixerLibraryManager() :mLoading(true) {
+    /* Until the library downloaded from LibraryMixer at startup has been merged, we don't know which items we still share. */
+    fileIndex->beginLoading();
+
     connect(fileWatcher, SIGNAL(newFileHash(QString,qlonglong,uint,QString)), this, SLOT(newFileHash(QString,qlonglong,uint,QString)), Qt::QueuedConnection);
     connect(fileWatcher, SIGNAL(oldHashInvalidated(QString,qlonglong,uint)), this, SLOT(oldHashInvalidated(QString,qlonglong,uint)), Qt::QueuedConnection);
     connect(fileWatcher, SIGNAL(fileRemoved(QString)), this, SLOT(fileRemoved(QString)));
@@ -48,6 +52,7 @@ LibraryMixerLibraryManager::LibraryMixerLibraryManager() {
             connect(currentItem, SIGNAL(fileNoLongerAvailable(QString,qulonglong)), this, SIGNAL(fileNoLongerAvailable(QString,qulonglong)));
 
             libraryList.insert(currentItem->id(), currentItem);
+            indexFiles(currentItem);
             emit libraryItemInserted(currentItem->id());
 
             currentNode = currentNode.nextSiblingElement("item");
@@ -90,6 +95,7 @@ void LibraryMixerLibraryManager::mergeLibrary(const QDomElement &libraryElement)
     while (!preexistingItems.isEmpty()) {
         unsigned int itemId = preexistingItems.first();
         preexistingItems.removeFirst();
+        unindexFiles(libraryList[itemId]);
         delete libraryList[itemId];
         libraryList.remove(itemId);
         emit libraryItemRemoved(itemId);
@@ -97,6 +103,11 @@ void LibraryMixerLibraryManager::mergeLibrary(const QDomElement &libraryElement)
 
     XmlUtil::writeXml(LIBRARYFILE, xml);
 
+    if (mLoading) {
+        mLoading = false;
+        fileIndex->finishLoading();
+    }
+
     /* Check if any items are missing their hashes, continue hashing if so.
        fileCount() returns 0 if there are no files because the item state has no associated files. */
     foreach (LibraryMixerLibraryItem* currentItem, libraryList.values()) {
@@ -312,7 +323,9 @@ void LibraryMixerLibraryManager::newFileHash(QString path, qlonglong size, unsig
 
             for (int i = 0; i < libraryList[item_id]->fileCount(); i++) {
                 if (path == libraryList[item_id]->paths()[i]) {
+                    fileIndex->removeFile(this, libraryList[item_id]->hashes()[i], libraryList[item_id]->filesizes()[i], path);
                     libraryList[item_id]->setFileInfo(path, size, modified, newHash);
+                    fileIndex->addFile(this, newHash, size, path);
                     toSave = true;
                 }
             }
@@ -358,6 +371,7 @@ void LibraryMixerLibraryManager::fileRemoved(QString path) {
                        This is because for better or worse QFileSystemWatcher doesn't detect drive removals or network share disconnections.
                        Therefore, while it may be ideal to keep around old hash information so we can send it with the hash job when the file returns,
                        this works well enough for now and is a lot easier than otherwise individually tracking which files are missing. */
+                    fileIndex->removeFile(this, libraryList[item_id]->hashes()[i], libraryList[item_id]->filesizes()[i], path);
                     libraryList[item_id]->setFileInfo(path, -1, 0, "");
                     libraryList[item_id]->itemState(LibraryMixerItem::MATCH_NOT_FOUND);
                     emit libraryStateChanged(item_id);
@@ -392,6 +406,18 @@ LibraryMixerItem LibraryMixerLibraryManager::internalConvertItem(LibraryMixerLib
     return returnItem;
 }
 
+void LibraryMixerLibraryManager::indexFiles(LibraryMixerLibraryItem *item) {
+    for (int i = 0; i < item->fileCount(); i++) {
+        fileIndex->addFile(this, item->hashes()[i], item->filesizes()[i], item->paths()[i]);
+    }
+}
+
+void LibraryMixerLibraryManager::unindexFiles(LibraryMixerLibraryItem *item) {
+    for (int i = 0; i < item->fileCount(); i++) {
+        fileIndex->removeFile(this, item->hashes()[i], item->filesizes()[i], item->paths()[i]);
+    }
+}
+
 bool LibraryMixerLibraryManager::equalNode(const QDomNode a, const QDomNode b) const {
     return !a.firstChildElement("id").isNull() && !b.firstChildElement("id").isNull() &&
            a.firstChildElement("id").text() == b.firstChildElement("id").text();
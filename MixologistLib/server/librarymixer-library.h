@@ -150,10 +150,16 @@ private:
     void oldFilesNoLongerAvailable(const LibraryMixerLibraryItem& item);
     void oldFilesNoLongerAvailable(const QStringList &hashes, const QList<qlonglong> &filesizes);
 
+    /* Adds or removes all of the item's hashed files in the fileIndex. */
+    void indexFiles(LibraryMixerLibraryItem* item);
+    void unindexFiles(LibraryMixerLibraryItem* item);
+
     /* Returns true if both a and b have the same non-null item_id. */
     bool equalNode(const QDomNode a, const QDomNode b) const;
 
     mutable QMutex libMutex;
+    /* True until the library has been merged with the one downloaded from LibraryMixer, which is when the fileIndex is told it has loaded. */
+    bool mLoading;
     QDomDocument xml; //The master XML for a user's library
     /* These are how we store the LibraryMixerLibraryItems that wrap the xml.
        The key is the item's id on LibraryMixer. */
@@ -0,0 +1,67 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#include <util/clock.h>
+
+/********************************** WINDOWS/UNIX SPECIFIC PART ******************/
+#ifndef WINDOWS_SYS
+#ifdef __APPLE__
+
+#include <mach/mach_time.h>
+
+uint64_t monotonicMicroseconds() {
+    static mach_timebase_info_data_t timebase = {0, 0};
+    if (timebase.denom == 0) mach_timebase_info(&timebase);
+
+    return (mach_absolute_time() * timebase.numer / timebase.denom) / 1000;
+}
+
+#else
+
+#include <time.h>
+
+uint64_t monotonicMicroseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+#endif
+
+#else
+
+#include <windows.h>
+
+uint64_t monotonicMicroseconds() {
+    static LARGE_INTEGER frequency = {{0, 0}};
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    /* Split the division to avoid overflowing on counters that run at high frequencies. */
+    uint64_t seconds = now.QuadPart / frequency.QuadPart;
+    uint64_t remainder = now.QuadPart % frequency.QuadPart;
+    return seconds * 1000000 + (remainder * 1000000) / frequency.QuadPart;
+}
+
+#endif
+/********************************** WINDOWS/UNIX SPECIFIC PART ******************/
@@ -0,0 +1,32 @@
+/****************************************************************
+ *  Copyright 2010, Fair Use, Inc.
+ *
+ *  This file is part of the Mixologist.
+ *
+ *  The Mixologist is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  The Mixologist is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with the Mixologist; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ ****************************************************************/
+
+
+#ifndef UTIL_CLOCK_HEADER
+#define UTIL_CLOCK_HEADER
+
+#include <stdint.h>
+
+/* Returns the number of microseconds since an arbitrary fixed point, from a clock that never goes backwards,
+   even if the system time is changed. Only meaningful for measuring the time between two calls. */
+uint64_t monotonicMicroseconds();
+
+#endif //UTIL_CLOCK_HEADER
@@ -42,8 +42,12 @@
 #if defined(WIN32) || defined(__CYGWIN__)
 #include "wtypes.h"
 #include <winioctl.h>
+#include <io.h>
 #else
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #endif
 
 #include <QFile>
@@ -161,6 +165,109 @@ bool DirUtil::renameFile(const QString &from, const QString &to) {
     return true ;
 }
 
+bool DirUtil::replaceFile(const QString &from, const QString &to) {
+#ifdef WIN32
+    return MoveFileExW((LPCWSTR)QDir::toNativeSeparators(from).utf16(), (LPCWSTR)QDir::toNativeSeparators(to).utf16(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0;
+#endif
+}
+
+bool DirUtil::syncFile(QFile &file) {
+    if (!file.flush()) return false;
+#ifdef WIN32
+    return FlushFileBuffers((HANDLE)_get_osfhandle(file.handle())) != 0;
+#else
+    return fsync(file.handle()) == 0;
+#endif
+}
+
+bool DirUtil::readFileAt(QFile &file, uint64_t offset, uint32_t size, void *data) {
+    char *position = (char *)data;
+    while (size > 0) {
+#ifdef WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD bytesRead = 0;
+        if (!ReadFile((HANDLE)_get_osfhandle(file.handle()), position, size, &bytesRead, &overlapped)) return false;
+#else
+        ssize_t bytesRead = pread(file.handle(), position, size, offset);
+        if (bytesRead < 0 && errno == EINTR) continue;
+        if (bytesRead < 0) return false;
+#endif
+        /* Reaching the end of the file before reading everything. */
+        if (bytesRead == 0) return false;
+        position += bytesRead;
+        offset += bytesRead;
+        size -= bytesRead;
+    }
+    return true;
+}
+
+bool DirUtil::writeFileAt(QFile &file, uint64_t offset, uint32_t size, const void *data) {
+    const char *position = (const char *)data;
+    while (size > 0) {
+#ifdef WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD bytesWritten = 0;
+        if (!WriteFile((HANDLE)_get_osfhandle(file.handle()), position, size, &bytesWritten, &overlapped)) return false;
+#else
+        ssize_t bytesWritten = pwrite(file.handle(), position, size, offset);
+        if (bytesWritten < 0 && errno == EINTR) continue;
+        if (bytesWritten < 0) return false;
+#endif
+        if (bytesWritten == 0) return false;
+        position += bytesWritten;
+        offset += bytesWritten;
+        size -= bytesWritten;
+    }
+    return true;
+}
+
+QString DirUtil::deviceOf(const QString &path) {
+#if defined(WIN32) || defined(__CYGWIN__)
+    /* Each drive letter or network share is treated as its own device. */
+    QString root = QDir::toNativeSeparators(QFileInfo(path).absoluteFilePath());
+    if (root.startsWith("\\\\")) return root.section('\\', 0, 3).toLower();
+    return root.left(2).toLower();
+#else
+    struct stat info;
+    if (stat(path.toLocal8Bit().constData(), &info) != 0 &&
+        stat(QFileInfo(path).absolutePath().toLocal8Bit().constData(), &info) != 0) return QString();
+    return QString::number((qulonglong)info.st_dev);
+#endif
+}
+
+void DirUtil::adviseSequential(void *address, uint64_t length) {
+#if defined(WIN32) || defined(__CYGWIN__)
+    (void) address;
+    (void) length;
+#else
+    madvise(address, length, MADV_SEQUENTIAL);
+#endif
+}
+
+void DirUtil::adviseWillNeed(QFile &file, uint64_t offset, uint64_t length) {
+#if defined(WIN32) || defined(__CYGWIN__)
+    (void) file;
+    (void) offset;
+    (void) length;
+#elif defined(__APPLE__)
+    struct radvisory advice;
+    advice.ra_offset = offset;
+    advice.ra_count = (int) qMin(length, (uint64_t) INT_MAX);
+    fcntl(file.handle(), F_RDADVISE, &advice);
+#else
+    posix_fadvise(file.handle(), offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
 bool DirUtil::moveFile(const QString &source, const QString &dest) {
     QString destination = dest;
 
@@ -297,3 +404,61 @@ bool DirUtil::getFileHash(const QString &filepath, QString &hash) {
 
     return true;
 }
+
+bool DirUtil::getFileHash(const QString &filepath, QString &hash, uint32_t pieceSize, QByteArray &pieceHashes) {
+    QFile file(filepath);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    MD5_CTX *md5_ctx = new MD5_CTX;
+    MD5_Init(md5_ctx);
+    MD5_CTX *piece_ctx = new MD5_CTX;
+    MD5_Init(piece_ctx);
+
+    char data[READ_BUFFER_SIZE];
+    int amount_read;
+    unsigned char md5_buf[MD5_DIGEST_LENGTH];
+    uint32_t pieceRemaining = pieceSize;
+    bool pieceStarted = false;
+
+    pieceHashes.clear();
+
+    while ((amount_read = file.read(data, READ_BUFFER_SIZE)) > 0) {
+        MD5_Update(md5_ctx, data, amount_read);
+
+        /* A read may straddle the boundary between two pieces, so feed each piece only its own part. */
+        int consumed = 0;
+        while (consumed < amount_read) {
+            int toPiece = amount_read - consumed;
+            if ((uint32_t) toPiece > pieceRemaining) toPiece = pieceRemaining;
+            MD5_Update(piece_ctx, &data[consumed], toPiece);
+            pieceStarted = true;
+            consumed += toPiece;
+            pieceRemaining -= toPiece;
+
+            if (pieceRemaining == 0) {
+                MD5_Final(&md5_buf[0], piece_ctx);
+                pieceHashes.append((char *)md5_buf, MD5_DIGEST_LENGTH);
+                MD5_Init(piece_ctx);
+                pieceRemaining = pieceSize;
+                pieceStarted = false;
+            }
+        }
+    }
+
+    /* The last piece of the file may be short. */
+    if (pieceStarted) {
+        MD5_Final(&md5_buf[0], piece_ctx);
+        pieceHashes.append((char *)md5_buf, MD5_DIGEST_LENGTH);
+    }
+
+    MD5_Final(&md5_buf[0], md5_ctx);
+
+    delete md5_ctx;
+    delete piece_ctx;
+    file.close();
+
+    QByteArray result((char *)md5_buf, MD5_DIGEST_LENGTH);
+    hash = QString(result.toHex());
+
+    return true;
+}
@@ -26,8 +26,12 @@
 
 #include <string>
 #include <list>
+#include <stdint.h>
 #include <QString>
 
+class QFile;
+class QByteArray;
+
 namespace DirUtil {
 
 /* Non-destructively removes the last part of a path and returns the result.
@@ -50,6 +54,43 @@ bool allPathsMatch(const QStringList sourcePaths, const QStringList comparisonPa
    Returns true on success, false on failure */
 bool renameFile(const QString &from, const QString &to);
 
+/* Renames from to to, replacing to if it already exists.
+   Where the platform supports it, this is atomic, so to is always either the old or the new file even across a crash.
+   Returns true on success, false on failure */
+bool replaceFile(const QString &from, const QString &to);
+
+/* Flushes the file's buffers and asks the OS to commit its contents to the disk itself before returning.
+   file must already be open.
+   Returns true on success, false on failure */
+bool syncFile(QFile &file);
+
+/* Reads size bytes starting at offset from file into data, without using the file's current position,
+   so that more than one thread may read from the same open file at once.
+   On Windows the read still moves the handle's position, so anything else using the file must seek before each read or write
+   rather than relying on QFile::pos().
+   file must already be open, and should be unbuffered.
+   Returns true only if all size bytes were read. */
+bool readFileAt(QFile &file, uint64_t offset, uint32_t size, void *data);
+
+/* Writes size bytes from data to file starting at offset, without using the file's current position,
+   so that the file may be read from or written to by other threads at the same time.
+   As with readFileAt, on Windows the write still moves the handle's position.
+   file must already be open for writing, and should be unbuffered.
+   Returns true only if all size bytes were written. */
+bool writeFileAt(QFile &file, uint64_t offset, uint32_t size, const void *data);
+
+/* Returns a string identifying the physical device the file or directory at path is stored on,
+   so that files on the same device compare equal. If the device can't be determined, returns an empty string. */
+QString deviceOf(const QString &path);
+
+/* Hints to the OS that the memory mapped file data at address will be read sequentially, so it can read ahead more aggressively.
+   address must be page aligned. Does nothing on platforms without such hints. */
+void adviseSequential(void *address, uint64_t length);
+
+/* Hints to the OS that length bytes starting at offset in file will soon be read, so it can start reading them into its cache.
+   Returns immediately without waiting for the data. Does nothing on platforms without such hints. */
+void adviseWillNeed(QFile &file, uint64_t offset, uint64_t length);
+
 /* Moves a file, first trying to rename, and if that fails, manually moving.
    If dest contains '\', appropriate directories are created.
    Any "~" or ".." are ignored in dest.
@@ -88,5 +129,8 @@ QString createUniqueDirectory(const QString &path);
 /* Hashes the file and fills in hash. */
 bool getFileHash(const QString &filepath, QString &hash);
 
+/* As getFileHash, but in the same pass over the file also fills pieceHashes with the concatenated MD5s of each pieceSize piece of the file. */
+bool getFileHash(const QString &filepath, QString &hash, uint32_t pieceSize, QByteArray &pieceHashes);
+
 }
 #endif